@@ -0,0 +1,19 @@
+#!/bin/bash
+#
+# The C backend (-C, compiled with CC at -O2) against native code from the
+# same optimization level: a loop of 3e7 iterations plus fib(27), and
+# fibonacci_recursive of ass4 for 35.
+#
+. `dirname $0`/timing.sh
+HERE=`dirname $0`
+
+compare () {
+    native $1 -O2 && $VSLC -O2 -C -f $1 -o $WORK/c.c && $CC -O2 -w -o $WORK/c $WORK/c.c || exit 1
+    echo "$2, s:"
+    echo "  native 32-bit   `fastest $WORK/native32 $3`"
+    echo "  native 64-bit   `fastest $WORK/native64 $3`"
+    echo "  C at -O2        `fastest $WORK/c $3`"
+}
+
+compare $HERE/loop.vsl "loop + fib(27), n=3e7" 30000000
+compare ../ass4/vsl_programs/fibonacci_recursive.vsl "fibonacci_recursive 35" 35
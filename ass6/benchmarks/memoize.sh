@@ -0,0 +1,16 @@
+#!/bin/bash
+#
+# Memoization of pure recursive functions, -O2 against -O2 -e memoize, on
+# fibonacci_recursive of ass4, natively for a few n and on the bytecode VM.
+#
+. `dirname $0`/timing.sh
+PROGRAM=../ass4/vsl_programs/fibonacci_recursive.vsl
+
+for setting in "" "-e memoize"; do
+    native $PROGRAM "-O2 $setting" && $VSLC -O2 $setting -b -f $PROGRAM -o $WORK/fibonacci.vslb || exit 1
+    echo "fibonacci_recursive, -O2${setting:+ $setting}, s:"
+    for n in 32 38 42; do
+        echo "  n=$n native 32-bit   `fastest $WORK/native32 $n`"
+    done
+    echo "  n=32 bytecode VM     `fastest $VSLC -x $WORK/fibonacci.vslb -- 32`"
+done
@@ -0,0 +1,47 @@
+#
+# Helpers for the benchmark scripts, which source this file. They run from
+# the ass6 directory after make, like test_runner.sh. CC links the
+# programs, and has to be able to build 32 bit executables with -m32.
+# RUNS is how many times each measurement is made, the fastest counts.
+#
+CC=${CC:-cc}
+VSLC=./bin/vslc
+RUNS=${RUNS:-5}
+WORK=`mktemp -d`
+trap "rm -rf $WORK" EXIT
+
+# Build a program as a 32 bit (native32) and a 64 bit (native64) executable
+native () {
+    $VSLC $2 -f $1 -o $WORK/native32.s && $CC -m32 -o $WORK/native32 $WORK/native32.s \
+        && $VSLC $2 -m64 -f $1 -o $WORK/native64.s && $CC -o $WORK/native64 $WORK/native64.s
+}
+
+# Seconds the fastest of RUNS runs of a command takes, what it prints dropped
+fastest () {
+    local best=
+    for run in `seq $RUNS`; do
+        local start=`date +%s%N`
+        "$@" > /dev/null 2>&1
+        local time=$(( `date +%s%N` - start ))
+        if [ -z "$best" ] || [ $time -lt $best ]; then
+            best=$time
+        fi
+    done
+    awk "BEGIN { printf \"%.3f\", $best / 1e9 }"
+}
+
+# The same in milliseconds for one run, of a command which is run n times
+fastest_of () {
+    local n=$1
+    shift
+    local seconds=`fastest repeat $n "$@"`
+    awk "BEGIN { printf \"%.2f\", $seconds * 1000 / $n }"
+}
+
+repeat () {
+    local n=$1
+    shift
+    for i in `seq $n`; do
+        "$@"
+    done
+}
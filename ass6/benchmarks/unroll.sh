@@ -0,0 +1,17 @@
+#!/bin/bash
+#
+# Loop unrolling at -O2, switched off with -d unroll and on by default, for
+# native code and the bytecode VM, on benchmarks/unroll.vsl with 200000
+# repetitions.
+#
+. `dirname $0`/timing.sh
+HERE=`dirname $0`
+
+echo "200000 repetitions of a 1000 and an 8 iteration FOR, s:"
+for setting in "-d unroll" ""; do
+    native $HERE/unroll.vsl "-O2 $setting" && $VSLC -O2 $setting -b -f $HERE/unroll.vsl -o $WORK/unroll.vslb || exit 1
+    echo "  -O2 ${setting:-(unroll on)}"
+    echo "    native 32-bit   `fastest $WORK/native32 200000`"
+    echo "    native 64-bit   `fastest $WORK/native64 200000`"
+    echo "    bytecode VM     `fastest $VSLC -x $WORK/unroll.vslb -- 200000`"
+done
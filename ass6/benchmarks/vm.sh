@@ -0,0 +1,27 @@
+#!/bin/bash
+#
+# Startup and throughput of the bytecode VM (-b and -x) against native code
+# and running in memory (-r). Startup runs a program which prints one
+# string, throughput a loop of 3e7 iterations and fib(27).
+#
+. `dirname $0`/timing.sh
+HERE=`dirname $0`
+
+native $HERE/hello.vsl -O2 && $VSLC -O2 -b -f $HERE/hello.vsl -o $WORK/hello.vslb || exit 1
+echo "startup, PRINT \"hi\", ms:"
+echo "  native 32-bit   `fastest_of 100 $WORK/native32`"
+echo "  native 64-bit   `fastest_of 100 $WORK/native64`"
+echo "  -x              `fastest_of 100 $VSLC -x $WORK/hello.vslb`"
+echo "  -r              `fastest_of 100 $VSLC -O2 -r -f $HERE/hello.vsl`"
+compile_and_run () {
+    $VSLC -O2 -f $HERE/hello.vsl -o $WORK/compiled.s && $CC -m32 -o $WORK/compiled $WORK/compiled.s \
+        && $WORK/compiled
+}
+echo "  vslc + cc + run `fastest_of 20 compile_and_run`"
+
+native $HERE/loop.vsl -O2 && $VSLC -O2 -b -f $HERE/loop.vsl -o $WORK/loop.vslb || exit 1
+echo "loop + fib(27), n=3e7, s:"
+echo "  native 32-bit   `fastest $WORK/native32 30000000`"
+echo "  native 64-bit   `fastest $WORK/native64 30000000`"
+echo "  -r              `fastest $VSLC -O2 -r -f $HERE/loop.vsl -- 30000000`"
+echo "  -x              `fastest $VSLC -x $WORK/loop.vslb -- 30000000`"
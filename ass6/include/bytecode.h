@@ -0,0 +1,95 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "tree.h"
+
+/*
+ * Register bytecode for VSL. Every function has a window of registers: the
+ * parameters first, then the locals of its blocks, then temporaries. A
+ * call passes its arguments in consecutive registers of the caller, which
+ * become the first registers of the callee's window.
+ */
+
+/* Operands: a, b and c are registers unless noted */
+typedef enum {
+    BC_LOADK,       /* a := constants[b]                                */
+    BC_MOVE,        /* a := b                                           */
+    BC_CLEAR,       /* a .. a+b-1 := 0                                  */
+    BC_ADD,         /* a := b + c                                       */
+    BC_SUB,         /* a := b - c                                       */
+    BC_MUL,         /* a := b * c                                       */
+    BC_DIV,         /* a := b / c                                       */
+    BC_ADDI,        /* a := b + c, c is a signed 16 bit immediate       */
+    BC_NEG,         /* a := -b                                          */
+    BC_LT, BC_GT, BC_LE, BC_GE, BC_EQ, BC_NE,
+                    /* a := b relation c, 1 or 0                        */
+    BC_JUMP,        /* jump by c, a signed offset from the next one     */
+    BC_JUMPZERO,    /* jump by c if a is 0                              */
+    BC_JUMPLT, BC_JUMPGT, BC_JUMPLE, BC_JUMPGE, BC_JUMPEQ, BC_JUMPNE,
+                    /* jump by c if a relation b                        */
+    BC_CALL,        /* a := function b, arguments from register c on    */
+    BC_TAILCALL,    /* return function b, arguments from register c on  */
+    BC_RETURN,      /* return a                                         */
+    BC_PRINTS,      /* print string a                                   */
+    BC_PRINTI,      /* print a as an integer                            */
+    BC_NEWLINE,     /* end a print statement                            */
+    BC_MEMOLOOKUP,  /* return what the cache has for function b and the
+                       parameters, if anything, else copy them to a on  */
+    BC_MEMORETURN,  /* cache a for function b and the parameters copied
+                       to register c on, and return it                  */
+    N_BYTECODES
+} bytecode_opcode_t;
+
+typedef struct {
+    uint16_t opcode, a, b, c;
+} bytecode_instruction_t;
+
+typedef struct {
+    uint32_t name;              /* Offset of the name in the string pool */
+    uint32_t entry;             /* First instruction */
+    uint32_t n_instructions;
+    uint16_t n_parameters, n_registers;
+} bytecode_function_t;
+
+/*
+ * A .vslb file is the header followed by the function table, constants,
+ * string offsets, instructions and string pool, each aligned to 8 bytes,
+ * in the byte order of the machine. It is used where it is mapped, after
+ * checking that every operand is in range.
+ */
+#define BYTECODE_MAGIC "VSLB"
+#define BYTECODE_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_functions, n_constants, n_strings, n_instructions, pool_size;
+    uint32_t entry;             /* Function called with the command line */
+} bytecode_header_t;
+
+typedef struct {
+    bytecode_header_t *header;
+    bytecode_function_t *functions;
+    int32_t *constants;
+    uint32_t *strings;          /* Offsets in the string pool */
+    bytecode_instruction_t *code;
+    char *pool;
+    void *image;
+    size_t size;
+    bool mapped;
+} bytecode_t;
+
+
+bytecode_t *bytecode_compile ( node_t *root );
+void bytecode_write ( FILE *stream, bytecode_t *program );
+bytecode_t *bytecode_load ( char *path );
+void bytecode_finalize ( bytecode_t *program );
+
+int32_t bytecode_run ( bytecode_t *program, int32_t argc, char **argv );
+
+
+#endif
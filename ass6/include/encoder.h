@@ -0,0 +1,51 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "generator.h"
+
+/* Sections of an object, undefined symbols are resolved by the linker */
+typedef enum { SECTION_UNDEFINED, SECTION_TEXT, SECTION_DATA } section_t;
+
+/*
+ * Relocated 32 bit fields in the text: absolute addresses, PC relative
+ * addresses, and PC relative calls (through the PLT on x86-64)
+ */
+typedef enum { RELOCATION_ABSOLUTE, RELOCATION_PC, RELOCATION_CALL } relocation_kind_t;
+
+/* Labels in the text and data, and the external functions that are called */
+typedef struct {
+    char *name;
+    section_t section;
+    uint32_t offset, size;
+    bool function;
+} object_symbol_t;
+
+typedef struct {
+    uint32_t offset;            /* Position of the field in the text */
+    uint32_t symbol;            /* Index in the symbol list */
+    relocation_kind_t kind;
+    int32_t addend;
+} relocation_t;
+
+/* Machine code and data for a program, before linking */
+typedef struct {
+    target_t target;
+    uint8_t *text, *data;
+    uint32_t text_size, data_size;
+    object_symbol_t *symbols;
+    uint32_t n_symbols;
+    relocation_t *relocations;
+    uint32_t n_relocations;
+} object_t;
+
+
+object_t *object_encode ( instruction_t *start );
+void object_write_elf ( FILE *stream, object_t *object );
+void object_finalize ( object_t *object );
+
+
+#endif
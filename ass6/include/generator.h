@@ -0,0 +1,55 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "tree.h"
+
+/* Instruction sets the generator can emit code for */
+typedef enum { TARGET_X86, TARGET_X86_64 } target_t;
+
+/*
+ * Assembly text, a relocatable ELF object from the built-in encoder,
+ * running the encoded program in memory, a .vslb bytecode image, C, or
+ * the mid-level IR as text
+ */
+typedef enum { OUTPUT_ASSEMBLY, OUTPUT_OBJECT, OUTPUT_RUN, OUTPUT_BYTECODE, OUTPUT_C, OUTPUT_IR } output_t;
+
+
+/* Elements of the low-level intermediate representation */
+
+/* Instructions */
+typedef enum {
+    STRING, LABEL, PUSH, POP, MOVE, CALL, SYSCALL, LEAVE, RET,
+    ADD, SUB, MUL, DIV, JUMP, JUMPZERO, JUMPNONZ, DECL, CLTD, NEG, CMPZERO, NIL,
+    CMP, SETL, SETG, SETLE, SETGE, SETE, SETNE, CBW, CWDE,JUMPEQ,
+    JUMPNE, JUMPL, JUMPG, JUMPLE, JUMPGE, SHL, SAR, SHR, LEA, MULI, INC, DEC, MOVZBL,
+    CMOVL, CMOVG, CMOVLE, CMOVGE, CMOVE, CMOVNE, JUMPA, JUMPINDIRECT, JUMPTABLE, MEMOTABLE
+} opcode_t;
+
+/*
+ * JUMPTABLE puts a table of 32 bit words in the data. Its operand is the
+ * name of the table, the label the entries are relative to, and the labels
+ * of the entries, separated by spaces. Every word is the distance of its
+ * entry from that label. MEMOTABLE puts a table of zeros in the data, its
+ * operand is the name and the size in bytes, separated by a space.
+ */
+
+/* A struct to make linked lists from instructions */
+typedef struct instr {
+    opcode_t opcode;
+    char *operands[2];
+    int32_t offsets[2];
+    struct instr *next;
+} instruction_t;
+
+
+extern target_t target;
+extern output_t output;
+
+void generate ( FILE *stream, node_t *root );
+int32_t peephole_optimize ( instruction_t **list );
+
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef IR_H
+#define IR_H
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "tree.h"
+
+/*
+ * Mid-level intermediate representation: the control flow graph of every
+ * function, in SSA form. It is built from the tree after bind_names.
+ * Instructions are values, and their operands point straight at the
+ * instructions that compute them. Variables are numbered by slot, the
+ * way the bytecode compiler numbers registers: the parameters first, then
+ * the locals of each block on top of those of the blocks around it.
+ * Every instruction remembers the tree node it was made from, so passes
+ * can analyse the IR and then rewrite the tree that all the backends
+ * generate code from.
+ */
+
+typedef enum {
+    IR_CONSTANT,    /* value                                            */
+    IR_PARAMETER,   /* the parameter with index value                   */
+    IR_UNDEFINED,   /* a variable read where nothing defines it         */
+    IR_PHI,         /* one operand for each predecessor, in order       */
+    IR_COPY,        /* an assignment of operand 0                       */
+    IR_NEGATE,      /* -operand 0                                       */
+    IR_BINARY,      /* operand 0 op operand 1                           */
+    IR_CALL,        /* label ( operands )                               */
+    IR_PRINT,       /* print the operands, the node is the PRINT_LIST   */
+    IR_JUMP,        /* to successor 0                                   */
+    IR_BRANCH,      /* to successor 0 if operand 0 is not 0, else 1     */
+    IR_RETURN,      /* operand 0, none when the body ends without one   */
+    N_IR_OPCODES
+} ir_opcode_t;
+
+typedef struct ir_instruction {
+    ir_opcode_t opcode;
+    int32_t id;                     /* Value number, printed as v<id> */
+    char *op;                       /* Binary operator */
+    char *label;                    /* Called function */
+    int32_t value;                  /* Constant, or index of a parameter */
+    int32_t variable;               /* Slot defined by a phi, copy, parameter or
+                                     * loop increment, -1 for temporaries */
+    node_t *node;                   /* Where in the tree it comes from */
+    uint32_t n_operands;
+    struct ir_instruction **operands;
+    struct ir_block *block;
+    struct ir_instruction *previous, *next;
+    struct ir_instruction *replacement; /* Set on phis removed while building */
+} ir_instruction_t;
+
+typedef struct ir_block {
+    int32_t id;
+    ir_instruction_t *first, *last;  /* Phis first, the terminator last */
+    uint32_t n_predecessors, n_successors;
+    struct ir_block **predecessors, *successors[2];
+    struct ir_block *dominator;     /* Immediate, NULL for the entry */
+    int32_t order;                  /* Reverse postorder, -1 if unreachable */
+
+    /* Only used while building the SSA form */
+    bool sealed;
+    ir_instruction_t **definitions;
+} ir_block_t;
+
+/* The value a VARIABLE node in the tree reads */
+typedef struct {
+    node_t *node;
+    ir_instruction_t *value;
+    int32_t variable;
+} ir_use_t;
+
+typedef struct {
+    node_t *node;                   /* The FUNCTION */
+    char *name;
+    int32_t n_parameters, n_variables, n_values;
+    uint32_t n_blocks;
+    ir_block_t **blocks;            /* Reverse postorder, then the unreachable ones */
+    uint32_t n_uses;
+    ir_use_t *uses;
+    ir_instruction_t *removed;      /* Phis which turned out not to be needed */
+} ir_function_t;
+
+typedef struct {
+    uint32_t n_functions;
+    ir_function_t *functions;
+} ir_program_t;
+
+
+ir_program_t *ir_build ( node_t *root );
+bool ir_verify ( FILE *stream, ir_program_t *program );
+void ir_print ( FILE *stream, ir_program_t *program );
+void ir_finalize ( ir_program_t *program );
+
+bool ir_dominates ( ir_block_t *dominator, ir_block_t *block );
+bool ir_is_terminator ( ir_instruction_t *instruction );
+
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef JIT_H
+#define JIT_H
+
+
+#include <stdint.h>
+#include "encoder.h"
+
+/* Command line of the program run by the JIT, argv[0] is its name */
+extern int32_t jit_argc;
+extern char **jit_argv;
+
+
+void jit_run ( object_t *object );
+
+
+#endif
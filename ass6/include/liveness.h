@@ -0,0 +1,36 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ir.h"
+
+/*
+ * Liveness of the SSA values of a function: which values are live when
+ * each block is entered and left. A value is live when an instruction
+ * which counts may still use it. An operand of a phi is used at the end
+ * of the predecessor it comes from, not in the block of the phi. Only
+ * reachable blocks are analysed. The sets are bit vectors indexed by
+ * value number, ready for a register allocator to build interference
+ * from.
+ */
+typedef struct {
+    ir_function_t *function;
+    uint32_t n_words;               /* Words in each set */
+    uint32_t **live_in, **live_out; /* Indexed by block id */
+} liveness_t;
+
+
+/*
+ * Analyse a function. If 'counted' is not NULL, only the operands of the
+ * instructions it marks (by value number) are uses.
+ */
+liveness_t *liveness_analyse ( ir_function_t *function, bool *counted );
+void liveness_finalize ( liveness_t *liveness );
+
+bool liveness_live_in ( liveness_t *liveness, ir_block_t *block, ir_instruction_t *value );
+bool liveness_live_out ( liveness_t *liveness, ir_block_t *block, ir_instruction_t *value );
+
+
+#endif
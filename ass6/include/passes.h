@@ -0,0 +1,145 @@
+#ifndef PASSES_H
+#define PASSES_H
+
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "tree.h"
+#include "generator.h"
+
+/*
+ * Optimization passes. Tree passes rewrite the syntax tree after
+ * bind_names, so every backend sees their result. Instruction passes
+ * rewrite the generator's instruction list before it is printed or
+ * encoded. Code generation passes are choices the backends make while
+ * generating code: they can be switched off, and count what they did,
+ * but are not timed on their own.
+ */
+typedef enum { PASS_TREE, PASS_INSTRUCTIONS, PASS_CODEGEN } pass_kind_t;
+
+/* Every pass, in the order they run */
+typedef enum {
+    PASS_UNUSED,
+    PASS_INLINE,
+    PASS_FOLD,
+    PASS_SCCP,
+    PASS_EVALUATE,
+    PASS_SPECIALIZE,
+    PASS_UNREACHABLE,
+    PASS_UNROLL,
+    PASS_CSE,
+    PASS_LICM,
+    PASS_INDUCTION,
+    PASS_DEAD_STORES,
+    PASS_TAIL_CALLS,
+    PASS_STRENGTH_REDUCTION,
+    PASS_LOOP_ROTATION,
+    PASS_IF_CONVERSION,
+    PASS_SWITCH,
+    PASS_MEMOIZE,
+    PASS_PEEPHOLE,
+    N_PASSES
+} pass_id_t;
+
+typedef struct {
+    char *name;                 /* Used with -e and -d */
+    char *description;
+    pass_kind_t kind;
+    int32_t level;              /* Lowest -O level which runs the pass */
+
+    /* Run the pass, returning the number of changes it made */
+    int32_t (*run_tree) ( node_t *root );
+    int32_t (*run_instructions) ( instruction_t **start );
+
+    /* Set by -e (1) and -d (-1), overrides the level */
+    int32_t selected;
+
+    /* Statistics for the report */
+    int32_t changes;
+    double seconds;
+} pass_t;
+
+
+extern int32_t optimization_level;
+extern bool pass_report;
+
+void pass_select ( char *name, bool enabled );
+bool pass_enabled ( pass_id_t pass );
+void pass_count ( pass_id_t pass, int32_t changes );
+
+void passes_run_tree ( node_t *root );
+void passes_run_instructions ( instruction_t **start );
+void passes_report ( FILE *stream );
+
+/* Set a size limit of unroll from a name=value setting, or list them */
+bool unroll_set ( char *setting );
+void unroll_limits ( FILE *stream );
+
+/* Passes, implemented in their own files */
+int32_t fold_constants ( node_t *root );
+int32_t inline_functions ( node_t *root );
+int32_t propagate_constants ( node_t *root );
+int32_t evaluate_calls ( node_t *root );
+int32_t specialize_functions ( node_t *root );
+int32_t remove_unreachable ( node_t *root );
+int32_t unroll_loops ( node_t *root );
+int32_t eliminate_common_subexpressions ( node_t *root );
+int32_t move_loop_invariants ( node_t *root );
+int32_t reduce_induction_variables ( node_t *root );
+int32_t remove_dead_stores ( node_t *root );
+int32_t warn_unused ( node_t *root );
+
+/*
+ * dead-stores gives a DECLARATION this as data when its variables are
+ * always assigned before they are read, and the backends then only make
+ * room for them. The parser leaves the data NULL.
+ */
+#define DECLARATION_UNCLEARED "uncleared"
+#define DECLARATION_CLEARED(declaration) ((declaration)->data == NULL)
+
+/* Locals made by tree passes, in temporaries.c */
+bool temporaries_open ( node_t *function );
+symbol_t *temporary_new ( char *prefix );
+node_t *temporary_read ( symbol_t *temporary );
+node_t *temporary_assign ( symbol_t *temporary, node_t *value );
+int32_t temporaries_close ( void );
+
+/* Functions which print nothing and only call such functions, in purity.c */
+void purity_analyse ( node_t *root );
+bool purity_is_pure ( symbol_t *function );
+bool purity_expression_is_pure ( node_t *root );
+bool purity_is_recursive ( symbol_t *function );
+bool purity_evaluate ( node_t *call, int32_t *value );
+void purity_finalize ( void );
+
+/*
+ * Functions whose results are cached, and the size of the cache: at most
+ * MEMO_KEYS parameters, 1 << MEMO_BITS entries, in memoize.c
+ */
+#define MEMO_KEYS 6
+#define MEMO_BITS 12
+void memoize_analyse ( node_t *root );
+bool memoize_function ( node_t *function );
+uint32_t memoize_hash ( uint32_t seed, int32_t *arguments, uint32_t n_arguments );
+void memoize_finalize ( void );
+
+/* Heap and tree helpers shared by the passes and the backends, in helpers.c */
+void *array_grow ( void *array, uint32_t used, uint32_t *capacity, size_t element );
+void *allocate_zeroed ( size_t size );
+int node_compare ( const void *a, const void *b );
+bool expression_is_call ( node_t *root );
+bool expression_has_call ( node_t *root );
+bool expression_has_division ( node_t *root );
+bool subtree_assigns ( node_t *root, symbol_t *entry );
+uint32_t subtree_size ( node_t *root );
+uint32_t function_parameter_count ( node_t *function );
+node_t *statement_list_new ( uint32_t n );
+node_t *node_list_new ( nodetype_t type, uint32_t n );
+node_t *node_make_integer ( node_t *root, int32_t value );
+node_t *subtree_copy ( node_t *root );
+
+/* Arithmetic on constants the way the machine does it, in fold.c */
+bool fold_binary ( char *op, int32_t left, int32_t right, int32_t *result );
+
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef TRANSPILER_H
+#define TRANSPILER_H
+
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "tree.h"
+
+
+void transpile ( FILE *stream, node_t *root );
+
+
+#endif
@@ -0,0 +1,712 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bytecode.h"
+#include "passes.h"
+
+/*
+ * Bytecode compiler: translates the syntax tree decorated by bind_names
+ * into register bytecode, and the .vslb image that holds it. Variables
+ * are registers: parameters in the order they are declared, then the
+ * locals of each block on top of the blocks enclosing it, the same layout
+ * as the generator gives the activation record. Temporaries are allocated
+ * above the variables in scope, like a stack.
+ */
+
+
+/* The program being compiled */
+static bytecode_instruction_t *code;
+static uint32_t n_code, code_capacity;
+static int32_t *constants;
+static uint32_t n_constants, constants_capacity;
+static bytecode_function_t *functions;
+static char *pool;
+static uint32_t pool_size, pool_capacity;
+static uint32_t *strings;
+static node_t *function_list;
+
+/* The function being compiled, depth is the same scope depth as in symtab */
+static int32_t n_parameters, n_locals, top, n_registers, depth;
+
+/* Index of the function if its calls are memoized, -1 if not */
+static int32_t memoized;
+static int32_t *block_base = NULL, block_base_size = 0;
+
+/* Relational operators, as values and as jumps taken when they are false */
+static const struct {
+    char *op;
+    bytecode_opcode_t value, jump_false;
+} relations[] = {
+    { "<",  BC_LT, BC_JUMPGE },
+    { ">",  BC_GT, BC_JUMPLE },
+    { "<=", BC_LE, BC_JUMPGT },
+    { ">=", BC_GE, BC_JUMPLT },
+    { "==", BC_EQ, BC_JUMPNE },
+    { "!=", BC_NE, BC_JUMPEQ }
+};
+
+static void compile_statement ( node_t *root );
+static void compile_expression ( node_t *root, int32_t destination );
+
+
+    static void
+compile_error ( char *message )
+{
+    fprintf(stderr, "Bytecode: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+
+    static uint16_t
+operand ( int32_t value )
+{
+    if (value < 0 || value > UINT16_MAX) {
+        compile_error("too many registers in a function");
+    }
+    return value;
+}
+
+
+    static uint32_t
+emit ( bytecode_opcode_t opcode, int32_t a, int32_t b, int32_t c )
+{
+    code = array_grow(code, n_code, &code_capacity, sizeof(*code));
+    code[n_code] = (bytecode_instruction_t) { opcode, operand(a), operand(b), c };
+    return n_code++;
+}
+
+
+/* Point the jump at index 'jump' to the instruction at 'target' */
+    static void
+patch ( uint32_t jump, uint32_t target )
+{
+    int32_t offset = (int32_t) target - (int32_t) (jump + 1);
+    if (offset < INT16_MIN || offset > INT16_MAX) {
+        compile_error("jump out of range, the function is too large");
+    }
+    code[jump].c = (uint16_t) (int16_t) offset;
+}
+
+
+    static int32_t
+constant ( int32_t value )
+{
+    for (uint32_t k = 0; k < n_constants; k++) {
+        if (constants[k] == value) {
+            return k;
+        }
+    }
+    constants = array_grow(constants, n_constants, &constants_capacity, sizeof(*constants));
+    constants[n_constants] = value;
+    return n_constants++;
+}
+
+
+    static uint32_t
+pool_add ( char *bytes, uint32_t length )
+{
+    uint32_t offset = pool_size;
+    for (uint32_t i = 0; i <= length; i++) {
+        pool = array_grow(pool, pool_size, &pool_capacity, 1);
+        pool[pool_size++] = (i < length) ? bytes[i] : '\0';
+    }
+    return offset;
+}
+
+
+/* Registers */
+
+
+    static int32_t
+temporary ( void )
+{
+    top++;
+    if (top > n_registers) {
+        n_registers = top;
+    }
+    return top - 1;
+}
+
+
+/* The register of a variable, numbered like variable_offset in the generator */
+    static int32_t
+variable_register ( symbol_t *entry )
+{
+    if (entry->stack_offset > 0) {
+        return n_parameters - entry->stack_offset / 4 + 1;
+    }
+    return n_parameters + block_base[entry->depth] - entry->stack_offset / 4 - 1;
+}
+
+
+/* A register holding the value of an expression: variables are used directly */
+    static int32_t
+value_register ( node_t *root )
+{
+    if (root->type.index == VARIABLE) {
+        return variable_register(root->entry);
+    }
+    int32_t destination = temporary();
+    compile_expression(root, destination);
+    return destination;
+}
+
+
+    static int32_t
+function_index ( char *label )
+{
+    for (uint32_t i = 0; i < function_list->n_children; i++) {
+        if (strcmp(function_list->children[i]->children[0]->entry->label, label) == 0) {
+            return i;
+        }
+    }
+    compile_error("call to undefined function");
+    return -1;
+}
+
+
+/* Expressions */
+
+
+/* Compute the arguments of a call into registers from the top, returns the first */
+    static int32_t
+compile_arguments ( node_t *root )
+{
+    node_t *arguments = root->children[1];
+    int32_t base = top;
+    int32_t n_arguments = (arguments == NULL) ? 0 : arguments->n_children;
+    node_t *function = function_list->children[function_index(root->children[0]->entry->label)];
+
+    if (n_arguments != ((function->children[1] == NULL) ? 0 : (int32_t) function->children[1]->n_children)) {
+        compile_error("wrong number of arguments in a call");
+    }
+    for (int32_t i = 0; i < n_arguments; i++) {
+        compile_expression(arguments->children[i], temporary());
+    }
+    return base;
+}
+
+
+/* Small constants as the immediate of an addition, INT16_MIN if it is not one */
+    static int32_t
+small_constant ( node_t *root, bool negate )
+{
+    if (root->type.index != INTEGER) {
+        return INT16_MIN;
+    }
+    int64_t value = *(int32_t *) root->data;
+    if (negate) {
+        value = -value;
+    }
+    return (value > INT16_MIN && value <= INT16_MAX) ? value : INT16_MIN;
+}
+
+
+    static void
+compile_expression ( node_t *root, int32_t destination )
+{
+    int32_t saved_top = top, immediate;
+    char *op = (char *) root->data;
+
+    if (root->type.index == INTEGER) {
+        emit(BC_LOADK, destination, constant(*(int32_t *) root->data), 0);
+    } else if (root->type.index == VARIABLE) {
+        emit(BC_MOVE, destination, variable_register(root->entry), 0);
+    } else if (root->type.index != EXPRESSION || op == NULL) {
+        compile_expression(root->children[0], destination);
+    } else if (root->n_children == 1) {
+        emit(BC_NEG, destination, value_register(root->children[0]), 0);
+    } else if (expression_is_call(root)) {
+        int32_t base = compile_arguments(root);
+        emit(BC_CALL, destination, function_index(root->children[0]->entry->label), operand(base));
+    } else if ((*op == '+' || strcmp(op, "-") == 0)
+        && (immediate = small_constant(root->children[1], *op == '-')) != INT16_MIN) {
+        emit(BC_ADDI, destination, value_register(root->children[0]), (uint16_t) (int16_t) immediate);
+    } else if (*op == '+' && (immediate = small_constant(root->children[0], false)) != INT16_MIN) {
+        emit(BC_ADDI, destination, value_register(root->children[1]), (uint16_t) (int16_t) immediate);
+    } else {
+        bytecode_opcode_t opcode;
+        switch (*op) {
+            case '+': opcode = BC_ADD; break;
+            case '-': opcode = BC_SUB; break;
+            case '*': opcode = BC_MUL; break;
+            case '/': opcode = BC_DIV; break;
+            default:
+                opcode = N_BYTECODES;
+                for (uint32_t i = 0; i < sizeof(relations) / sizeof(relations[0]); i++) {
+                    if (strcmp(relations[i].op, op) == 0) {
+                        opcode = relations[i].value;
+                    }
+                }
+                if (opcode == N_BYTECODES) {
+                    compile_error("unknown operator");
+                }
+                break;
+        }
+        int32_t left = value_register(root->children[0]);
+        int32_t right = value_register(root->children[1]);
+        emit(opcode, destination, left, operand(right));
+    }
+
+    top = saved_top;
+}
+
+
+/* Jump taken when a condition is false, returns it for patching */
+    static uint32_t
+compile_condition ( node_t *root )
+{
+    int32_t saved_top = top;
+    uint32_t jump;
+
+    for (uint32_t i = 0; i < sizeof(relations) / sizeof(relations[0]); i++) {
+        if (root->type.index == EXPRESSION && root->n_children == 2 && root->data != NULL
+            && strcmp(relations[i].op, root->data) == 0) {
+            int32_t left = value_register(root->children[0]);
+            int32_t right = value_register(root->children[1]);
+            jump = emit(relations[i].jump_false, left, right, 0);
+            top = saved_top;
+            return jump;
+        }
+    }
+
+    jump = emit(BC_JUMPZERO, value_register(root), 0, 0);
+    top = saved_top;
+    return jump;
+}
+
+
+/* Statements */
+
+
+    static void
+compile_block ( node_t *root )
+{
+    int32_t saved_locals = n_locals, saved_top = top, declared = 0;
+
+    depth++;
+    if (depth >= block_base_size) {
+        block_base_size = 2 * depth + 8;
+        block_base = realloc(block_base, sizeof(*block_base) * block_base_size);
+        if (block_base == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for block frames.\n");
+            abort();
+        }
+    }
+    block_base[depth] = n_locals;
+
+    /*
+     * Locals are cleared when the block is entered, like the pushed zeros,
+     * except those which are always assigned before they are read
+     */
+    if (root->children[0] != NULL) {
+        int32_t first = n_parameters + n_locals, cleared = 0;
+        for (uint32_t i = 0; i < root->children[0]->n_children; i++) {
+            node_t *declaration = root->children[0]->children[i];
+            int32_t n = declaration->children[0]->n_children;
+            if (DECLARATION_CLEARED(declaration)) {
+                cleared += n;
+            } else {
+                if (cleared > 0) {
+                    emit(BC_CLEAR, first, cleared, 0);
+                }
+                first += cleared + n;
+                cleared = 0;
+            }
+            declared += n;
+        }
+        if (cleared > 0) {
+            emit(BC_CLEAR, first, cleared, 0);
+        }
+    }
+    n_locals += declared;
+    top = n_parameters + n_locals;
+    if (top > n_registers) {
+        n_registers = top;
+    }
+
+    compile_statement(root->children[1]);
+
+    n_locals = saved_locals;
+    top = saved_top;
+    depth--;
+}
+
+
+    static void
+compile_statement ( node_t *root )
+{
+    uint32_t start, jump, skip;
+    int32_t saved_top = top;
+
+    if (root == NULL) {
+        return;
+    }
+
+    switch (root->type.index) {
+        case BLOCK:
+            compile_block(root);
+            break;
+
+        case ASSIGNMENT_STATEMENT:
+            compile_expression(root->children[1], variable_register(root->children[0]->entry));
+            break;
+
+        case RETURN_STATEMENT:
+            /* Calls in tail position reuse the frame */
+            if (pass_enabled(PASS_TAIL_CALLS) && memoized < 0 && expression_is_call(root->children[0])) {
+                int32_t base = compile_arguments(root->children[0]);
+                pass_count(PASS_TAIL_CALLS, 1);
+                emit(BC_TAILCALL, 0, function_index(root->children[0]->children[0]->entry->label), base);
+            } else if (memoized >= 0) {
+                emit(BC_MEMORETURN, value_register(root->children[0]), memoized, n_parameters);
+            } else {
+                emit(BC_RETURN, value_register(root->children[0]), 0, 0);
+            }
+            top = saved_top;
+            break;
+
+        case PRINT_LIST:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                node_t *item = root->children[i]->children[0];
+                if (item->type.index == TEXT) {
+                    emit(BC_PRINTS, *(int32_t *) item->data, 0, 0);
+                } else {
+                    emit(BC_PRINTI, value_register(item), 0, 0);
+                    top = saved_top;
+                }
+            }
+            emit(BC_NEWLINE, 0, 0, 0);
+            break;
+
+        case WHILE_STATEMENT:
+            start = n_code;
+            jump = compile_condition(root->children[0]);
+            compile_statement(root->children[1]);
+            patch(emit(BC_JUMP, 0, 0, 0), start);
+            patch(jump, n_code);
+            break;
+
+        case FOR_STATEMENT: {
+            /* The end value is evaluated every time, as in the generator */
+            int32_t counter = variable_register(root->children[0]->children[0]->entry);
+            compile_statement(root->children[0]);
+            start = n_code;
+            jump = emit(BC_JUMPEQ, counter, value_register(root->children[1]), 0);
+            top = saved_top;
+            compile_statement(root->children[2]);
+            emit(BC_ADDI, counter, counter, 1);
+            patch(emit(BC_JUMP, 0, 0, 0), start);
+            patch(jump, n_code);
+            break;
+        }
+
+        case IF_STATEMENT:
+            jump = compile_condition(root->children[0]);
+            compile_statement(root->children[1]);
+            if (root->n_children == 3) {
+                skip = emit(BC_JUMP, 0, 0, 0);
+                patch(jump, n_code);
+                compile_statement(root->children[2]);
+                patch(skip, n_code);
+            } else {
+                patch(jump, n_code);
+            }
+            break;
+
+        default:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                compile_statement(root->children[i]);
+            }
+            break;
+    }
+}
+
+
+    static void
+compile_function ( node_t *root, bytecode_function_t *function )
+{
+    char *name = root->children[0]->entry->label;
+
+    depth++;
+    n_parameters = (root->children[1] == NULL) ? 0 : root->children[1]->n_children;
+    n_locals = 0;
+    top = n_registers = n_parameters;
+
+    function->name = pool_add(name, strlen(name));
+    function->entry = n_code;
+    function->n_parameters = operand(n_parameters);
+
+    /* A memoized call keeps a copy of its arguments below the locals */
+    memoized = memoize_function(root) ? function_index(name) : -1;
+    if (memoized >= 0) {
+        emit(BC_MEMOLOOKUP, n_parameters, memoized, 0);
+        n_locals = n_parameters;
+        top = n_registers = 2 * n_parameters;
+        pass_count(PASS_MEMOIZE, 1);
+    }
+
+    compile_statement(root->children[root->n_children - 1]);
+
+    /* Falling off the end returns 0 */
+    int32_t zero = temporary();
+    emit(BC_CLEAR, zero, 1, 0);
+    emit(BC_RETURN, zero, 0, 0);
+
+    function->n_instructions = n_code - function->entry;
+    function->n_registers = operand(n_registers);
+    depth--;
+}
+
+
+/* The .vslb image */
+
+
+#define ALIGN8(size) (((size) + 7) & ~(size_t) 7)
+
+/* Sizes of the sections of an image after the header */
+    static void
+section_sizes ( bytecode_header_t *header, size_t sizes[5] )
+{
+    sizes[0] = ALIGN8((size_t) header->n_functions * sizeof(bytecode_function_t));
+    sizes[1] = ALIGN8((size_t) header->n_constants * sizeof(int32_t));
+    sizes[2] = ALIGN8((size_t) header->n_strings * sizeof(uint32_t));
+    sizes[3] = ALIGN8((size_t) header->n_instructions * sizeof(bytecode_instruction_t));
+    sizes[4] = ALIGN8((size_t) header->pool_size);
+}
+
+
+/* Point into the sections of an image, false if it is too small for them */
+    static bool
+bytecode_layout ( bytecode_t *program )
+{
+    size_t sizes[5], position = ALIGN8(sizeof(bytecode_header_t));
+    uint8_t *image = program->image;
+
+    if (program->size < position) {
+        return false;
+    }
+    program->header = (bytecode_header_t *) image;
+    section_sizes(program->header, sizes);
+    for (int i = 0; i < 5; i++) {
+        if (sizes[i] > program->size - position) {
+            return false;
+        }
+        position += sizes[i];
+    }
+
+    position = ALIGN8(sizeof(bytecode_header_t));
+    program->functions = (bytecode_function_t *) (image + position);
+    position += sizes[0];
+    program->constants = (int32_t *) (image + position);
+    position += sizes[1];
+    program->strings = (uint32_t *) (image + position);
+    position += sizes[2];
+    program->code = (bytecode_instruction_t *) (image + position);
+    position += sizes[3];
+    program->pool = (char *) (image + position);
+    return true;
+}
+
+
+    bytecode_t *
+bytecode_compile ( node_t *root )
+{
+    uint32_t n_functions, n_strings = strings_count();
+    bytecode_t *program = calloc(1, sizeof(*program));
+
+    code = NULL;
+    constants = NULL;
+    pool = NULL;
+    n_code = code_capacity = n_constants = constants_capacity = pool_size = pool_capacity = 0;
+    depth = 1;      /* The function list has a scope, as in the generator */
+
+    function_list = root->children[0];
+    n_functions = function_list->n_children;
+    functions = calloc(n_functions + 1, sizeof(*functions));
+    strings = calloc(n_strings + 1, sizeof(*strings));
+
+    for (uint32_t i = 0; i < n_strings; i++) {
+        uint32_t length;
+        char *value = strings_value(i, &length);
+        strings[i] = pool_add(value, length);
+        free(value);
+    }
+    memoize_analyse(root);
+    for (uint32_t i = 0; i < n_functions; i++) {
+        compile_function(function_list->children[i], &functions[i]);
+    }
+    memoize_finalize();
+
+    /* Copy everything into one image, laid out as in the file */
+    bytecode_header_t header = {
+        BYTECODE_MAGIC, BYTECODE_VERSION,
+        n_functions, n_constants, n_strings, n_code, pool_size, 0
+    };
+    size_t sizes[5];
+    section_sizes(&header, sizes);
+    program->size = ALIGN8(sizeof(header)) + sizes[0] + sizes[1] + sizes[2] + sizes[3] + sizes[4];
+    program->image = calloc(1, program->size);
+    memcpy(program->image, &header, sizeof(header));
+    bytecode_layout(program);
+
+    memcpy(program->functions, functions, n_functions * sizeof(*functions));
+    memcpy(program->constants, constants, n_constants * sizeof(*constants));
+    memcpy(program->strings, strings, n_strings * sizeof(*strings));
+    memcpy(program->code, code, n_code * sizeof(*code));
+    memcpy(program->pool, pool, pool_size);
+
+    free(functions);
+    free(constants);
+    free(strings);
+    free(code);
+    free(pool);
+    free(block_base);
+    block_base = NULL;
+    block_base_size = 0;
+    return program;
+}
+
+
+    void
+bytecode_write ( FILE *stream, bytecode_t *program )
+{
+    fwrite(program->image, 1, program->size, stream);
+}
+
+
+/* Operand kinds of the instructions, for checking images before running them */
+static const char *formats[N_BYTECODES] = {
+    [BC_LOADK] = "rk-", [BC_MOVE] = "rr-", [BC_CLEAR] = "rn-",
+    [BC_ADD] = "rrr", [BC_SUB] = "rrr", [BC_MUL] = "rrr", [BC_DIV] = "rrr",
+    [BC_ADDI] = "rr-", [BC_NEG] = "rr-",
+    [BC_LT] = "rrr", [BC_GT] = "rrr", [BC_LE] = "rrr", [BC_GE] = "rrr", [BC_EQ] = "rrr", [BC_NE] = "rrr",
+    [BC_JUMP] = "--j", [BC_JUMPZERO] = "r-j",
+    [BC_JUMPLT] = "rrj", [BC_JUMPGT] = "rrj", [BC_JUMPLE] = "rrj",
+    [BC_JUMPGE] = "rrj", [BC_JUMPEQ] = "rrj", [BC_JUMPNE] = "rrj",
+    [BC_CALL] = "rfw", [BC_TAILCALL] = "-fw", [BC_RETURN] = "r--",
+    [BC_PRINTS] = "s--", [BC_PRINTI] = "r--", [BC_NEWLINE] = "---",
+    [BC_MEMOLOOKUP] = "wf-", [BC_MEMORETURN] = "rfw"
+};
+
+
+/*
+ * Check that every operand of every instruction is in range, so the VM can
+ * run the image without checking: registers inside the frame, jumps inside
+ * the function, and each function ending with a jump or return.
+ */
+    static bool
+bytecode_verify ( bytecode_t *program )
+{
+    bytecode_header_t *header = program->header;
+
+    if (memcmp(header->magic, BYTECODE_MAGIC, 4) != 0 || header->version != BYTECODE_VERSION
+        || header->entry >= header->n_functions
+        || (header->pool_size > 0 && program->pool[header->pool_size - 1] != '\0')) {
+        return false;
+    }
+    for (uint32_t s = 0; s < header->n_strings; s++) {
+        if (program->strings[s] >= header->pool_size) {
+            return false;
+        }
+    }
+
+    for (uint32_t f = 0; f < header->n_functions; f++) {
+        bytecode_function_t *function = &program->functions[f];
+        if (function->name >= header->pool_size || function->n_instructions == 0
+            || function->entry > header->n_instructions
+            || function->n_instructions > header->n_instructions - function->entry
+            || function->n_parameters > function->n_registers) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < function->n_instructions; i++) {
+            bytecode_instruction_t *instruction = &program->code[function->entry + i];
+            if (instruction->opcode >= N_BYTECODES) {
+                return false;
+            }
+            uint16_t operands[3] = { instruction->a, instruction->b, instruction->c };
+            for (int o = 0; o < 3; o++) {
+                int64_t target = (int64_t) i + 1 + (int16_t) operands[o];
+                switch (formats[instruction->opcode][o]) {
+                    case 'r':
+                        if (operands[o] >= function->n_registers) return false;
+                        break;
+                    case 'n':
+                        if (operands[0] + operands[o] > function->n_registers) return false;
+                        break;
+                    case 'k':
+                        if (operands[o] >= header->n_constants) return false;
+                        break;
+                    case 's':
+                        if (operands[o] >= header->n_strings) return false;
+                        break;
+                    case 'f':
+                        if (operands[o] >= header->n_functions) return false;
+                        if ((instruction->opcode == BC_MEMOLOOKUP || instruction->opcode == BC_MEMORETURN)
+                            && program->functions[operands[o]].n_parameters > MEMO_KEYS) return false;
+                        break;
+                    case 'w':
+                        if (operands[1] >= header->n_functions
+                            || operands[o] + program->functions[operands[1]].n_parameters
+                            > function->n_registers) return false;
+                        break;
+                    case 'j':
+                        if (target < 0 || target >= function->n_instructions) return false;
+                        break;
+                }
+            }
+        }
+
+        uint16_t last = program->code[function->entry + function->n_instructions - 1].opcode;
+        if (last != BC_JUMP && last != BC_RETURN && last != BC_TAILCALL && last != BC_MEMORETURN) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Map a .vslb file, it is checked but never copied */
+    bytecode_t *
+bytecode_load ( char *path )
+{
+    bytecode_t *program = calloc(1, sizeof(*program));
+    struct stat status;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        fprintf(stderr, "Could not open bytecode file '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    program->size = status.st_size;
+    program->image = mmap(NULL, program->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (program->size == 0 || program->image == MAP_FAILED) {
+        fprintf(stderr, "Could not map bytecode file '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    program->mapped = true;
+
+    if (!bytecode_layout(program) || !bytecode_verify(program)) {
+        fprintf(stderr, "Invalid bytecode file '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return program;
+}
+
+
+    void
+bytecode_finalize ( bytecode_t *program )
+{
+    if (program->mapped) {
+        munmap(program->image, program->size);
+    } else {
+        free(program->image);
+    }
+    free(program);
+}
@@ -0,0 +1,565 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+#include "ir.h"
+
+/*
+ * Common subexpression elimination by value numbering on the SSA form of
+ * every function. The dominator tree is walked with a scoped table of the
+ * expressions computed so far, so an expression is found again in its own
+ * block and in every block it dominates. An assignment makes a new SSA
+ * value, which kills the expressions that read the variable before it.
+ * Calls are barriers: every call is a value of its own, so nothing that
+ * contains one is ever the same as anything else. A VSL function cannot
+ * reach the locals of its caller, so a call kills no other values.
+ *
+ * The tree is then rewritten. The first computation of an expression is
+ * assigned to a new local just before the statement it is in, and the
+ * computations it makes redundant read that local instead. Expressions are
+ * only moved in front of statements which evaluate them once, and a
+ * division, which can trap, only in front of statements which have
+ * nothing to show before it.
+ */
+
+/* A computation in the scoped table */
+typedef struct {
+    ir_opcode_t opcode;
+    char *op;
+    int32_t left, right;            /* Value numbers, or the constant in left */
+    ir_instruction_t *instruction;
+    int32_t next;                   /* Entry before it in the same bucket, or -1 */
+} entry_t;
+
+/* What happens to an expression node */
+typedef struct record {
+    node_t *node;
+    node_t *representative;         /* First computation, NULL for that one itself */
+    int32_t uses, size;
+    bool profitable;
+    symbol_t *temporary;
+} record_t;
+
+/* The function being analysed */
+static ir_function_t *function;
+static int32_t *numbers;
+static ir_block_t ***children;
+static uint32_t *n_children;
+
+/* The scoped table, entries are removed in the reverse order of insertion */
+static entry_t *entries;
+static uint32_t n_entries, entries_capacity;
+static int32_t *buckets;
+static uint32_t n_buckets;
+
+/* Expressions which can be moved in front of their statement, sorted */
+static node_t **hoistable;
+static uint32_t n_hoistable, hoistable_capacity;
+
+/* Redundancies for the whole program, sorted by node when rewriting */
+static record_t *records;
+static uint32_t n_records, records_capacity;
+
+/* Assignments to go in front of the statement being rewritten */
+static node_t **prefix;
+static uint32_t n_prefix, prefix_capacity;
+
+
+    static bool
+is_hoistable ( node_t *node )
+{
+    return bsearch(&node, hoistable, n_hoistable, sizeof(*hoistable), node_compare) != NULL;
+}
+
+
+/* Records start with their node, so they sort and search like nodes */
+    static record_t *
+record_find ( node_t *node )
+{
+    return bsearch(&node, records, n_records, sizeof(*records), node_compare);
+}
+
+
+    static void
+record_add ( node_t *node, node_t *representative )
+{
+    records = array_grow(records, n_records, &records_capacity, sizeof(*records));
+    records[n_records++] = (record_t) { node, representative, 0, 0, false, NULL };
+}
+
+
+/* Finding the expressions which can be moved */
+
+
+/*
+ * Mark the expressions in a part of a statement which is evaluated once,
+ * before anything else in the statement happens. 'ordered' is false when
+ * something else in the statement can be seen before the part traps.
+ */
+    static void
+mark_part ( node_t *root, bool ordered )
+{
+    if (root == NULL) {
+        return;
+    }
+    if (root->type.index == EXPRESSION && (ordered || !expression_has_division(root))) {
+        hoistable = array_grow(hoistable, n_hoistable, &hoistable_capacity, sizeof(*hoistable));
+        hoistable[n_hoistable++] = root;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        mark_part(root->children[i], ordered);
+    }
+}
+
+
+    static void
+mark_statements ( node_t *root )
+{
+    if (root == NULL) {
+        return;
+    }
+    switch (root->type.index) {
+        case ASSIGNMENT_STATEMENT:
+            mark_part(root->children[1], !expression_has_call(root->children[1]));
+            return;
+        case RETURN_STATEMENT:
+            mark_part(root->children[0], !expression_has_call(root->children[0]));
+            return;
+        case PRINT_LIST:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                mark_part(root->children[i], false);
+            }
+            return;
+        case IF_STATEMENT:
+            mark_part(root->children[0], !expression_has_call(root->children[0]));
+            for (uint32_t i = 1; i < root->n_children; i++) {
+                mark_statements(root->children[i]);
+            }
+            return;
+        case WHILE_STATEMENT:
+            /* The condition is evaluated again every time around */
+            mark_statements(root->children[1]);
+            return;
+        case FOR_STATEMENT:
+            /* Only the start value is evaluated once */
+            mark_statements(root->children[0]);
+            mark_statements(root->children[2]);
+            return;
+        case EXPRESSION:
+            return;
+        default:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                mark_statements(root->children[i]);
+            }
+            return;
+    }
+}
+
+
+/* Value numbering */
+
+
+    static bool
+is_commutative ( char *op )
+{
+    return strcmp(op, "+") == 0 || strcmp(op, "*") == 0 || strcmp(op, "==") == 0 || strcmp(op, "!=") == 0;
+}
+
+
+    static uint32_t
+hash ( entry_t *key )
+{
+    uint32_t h = 2166136261u;
+
+    h = (h ^ (uint32_t) key->opcode) * 16777619u;
+    for (char *c = key->op; c != NULL && *c != '\0'; c++) {
+        h = (h ^ (uint8_t) *c) * 16777619u;
+    }
+    h = (h ^ (uint32_t) key->left) * 16777619u;
+    h = (h ^ (uint32_t) key->right) * 16777619u;
+    return h & (n_buckets - 1);
+}
+
+
+    static ir_instruction_t *
+lookup ( entry_t *key )
+{
+    for (int32_t e = buckets[hash(key)]; e >= 0; e = entries[e].next) {
+        entry_t *entry = &entries[e];
+        if (entry->opcode == key->opcode && entry->left == key->left && entry->right == key->right
+            && (entry->op == key->op || (entry->op != NULL && key->op != NULL && strcmp(entry->op, key->op) == 0))) {
+            return entry->instruction;
+        }
+    }
+    return NULL;
+}
+
+
+    static void
+insert ( entry_t *key, ir_instruction_t *instruction )
+{
+    uint32_t h = hash(key);
+
+    entries = array_grow(entries, n_entries, &entries_capacity, sizeof(*entries));
+    entries[n_entries] = *key;
+    entries[n_entries].instruction = instruction;
+    entries[n_entries].next = buckets[h];
+    buckets[h] = n_entries++;
+}
+
+
+/* Forget everything inserted since the table had 'mark' entries */
+    static void
+forget ( uint32_t mark )
+{
+    while (n_entries > mark) {
+        entry_t *entry = &entries[--n_entries];
+        buckets[hash(entry)] = entry->next;
+    }
+}
+
+
+    static void
+number_instruction ( ir_instruction_t *i )
+{
+    entry_t key = { i->opcode, NULL, 0, 0, NULL, -1 };
+    ir_instruction_t *found;
+
+    switch (i->opcode) {
+        case IR_CONSTANT:
+            key.left = i->value;
+            numbers[i->id] = lookup(&key)->id;
+            break;
+
+        case IR_COPY:
+            numbers[i->id] = numbers[i->operands[0]->id];
+            break;
+
+        case IR_PHI:
+            /* The same value along every edge, operands from back edges are not numbered yet */
+            for (uint32_t k = 1; k < i->n_operands; k++) {
+                if (numbers[i->operands[k]->id] != numbers[i->operands[0]->id]) {
+                    return;
+                }
+            }
+            if (i->n_operands > 0 && i->operands[0] != i) {
+                numbers[i->id] = numbers[i->operands[0]->id];
+            }
+            break;
+
+        case IR_NEGATE: case IR_BINARY:
+            key.op = i->op;
+            key.left = numbers[i->operands[0]->id];
+            if (i->opcode == IR_BINARY) {
+                key.right = numbers[i->operands[1]->id];
+                if (is_commutative(i->op) && key.right < key.left) {
+                    key.right = key.left;
+                    key.left = numbers[i->operands[1]->id];
+                }
+            }
+            found = lookup(&key);
+            if (found != NULL) {
+                numbers[i->id] = numbers[found->id];
+                if (i->node->type.index == EXPRESSION) {
+                    record_add(i->node, found->node);
+                }
+            } else if (i->node->type.index == EXPRESSION && is_hoistable(i->node)) {
+                insert(&key, i);
+                record_add(i->node, NULL);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+/* Number a block, then the blocks it dominates with what it computes */
+    static void
+number_block ( ir_block_t *block )
+{
+    uint32_t mark = n_entries;
+
+    for (ir_instruction_t *i = block->first; i != NULL; i = i->next) {
+        number_instruction(i);
+    }
+    for (uint32_t c = 0; c < n_children[block->id]; c++) {
+        number_block(children[block->id][c]);
+    }
+    forget(mark);
+}
+
+
+    static void
+analyse ( ir_function_t *analysed )
+{
+    uint32_t *capacity;
+
+    function = analysed;
+    numbers = allocate_zeroed(sizeof(*numbers) * (function->n_values + 1));
+    for (int32_t v = 0; v < function->n_values; v++) {
+        numbers[v] = v;
+    }
+    children = allocate_zeroed(sizeof(*children) * (function->n_blocks + 1));
+    n_children = allocate_zeroed(sizeof(*n_children) * (function->n_blocks + 1));
+    capacity = allocate_zeroed(sizeof(*capacity) * (function->n_blocks + 1));
+
+    for (n_buckets = 16; n_buckets < 2 * (uint32_t) function->n_values; n_buckets *= 2)
+        ;
+    buckets = allocate_zeroed(sizeof(*buckets) * n_buckets);
+    memset(buckets, -1, sizeof(*buckets) * n_buckets);
+    n_entries = 0;
+
+    /* The dominator tree, children in reverse postorder */
+    for (uint32_t b = 1; b < function->n_blocks && function->blocks[b]->order >= 0; b++) {
+        int32_t parent = function->blocks[b]->dominator->id;
+        children[parent] = array_grow(children[parent], n_children[parent], &capacity[parent], sizeof(**children));
+        children[parent][n_children[parent]++] = function->blocks[b];
+    }
+
+    /* Constants are the same wherever they are, they are never forgotten */
+    for (uint32_t b = 0; b < function->n_blocks && function->blocks[b]->order >= 0; b++) {
+        for (ir_instruction_t *i = function->blocks[b]->first; i != NULL; i = i->next) {
+            entry_t key = { IR_CONSTANT, NULL, i->value, 0, NULL, -1 };
+            if (i->opcode == IR_CONSTANT && lookup(&key) == NULL) {
+                insert(&key, i);
+            }
+        }
+    }
+
+    number_block(function->blocks[0]);
+
+    for (uint32_t b = 0; b < function->n_blocks; b++) {
+        free(children[b]);
+    }
+    free(children);
+    free(n_children);
+    free(capacity);
+    free(numbers);
+    free(buckets);
+}
+
+
+/* Rewriting */
+
+
+/* Count the computations which would read a local, outside those that do */
+    static void
+count_uses ( node_t *root )
+{
+    record_t *record;
+
+    if (root == NULL) {
+        return;
+    }
+    record = (root->type.index == EXPRESSION) ? record_find(root) : NULL;
+    if (record != NULL && record->representative != NULL) {
+        record_find(record->representative)->uses++;
+        return;
+    }
+    if (record != NULL) {
+        record->size = subtree_size(root);
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        count_uses(root->children[i]);
+    }
+}
+
+
+/* A read of the local which holds a representative */
+    static node_t *
+local_read ( record_t *record )
+{
+    if (record->temporary == NULL) {
+        record->temporary = temporary_new("cse");
+    }
+    return temporary_read(record->temporary);
+}
+
+
+/*
+ * Rewrite an expression: computations made before read the local, and in
+ * a part which can be moved, first computations are assigned to a local
+ * before the statement, inner ones first.
+ */
+    static node_t *
+rewrite_expression ( node_t *root, bool hoist )
+{
+    record_t *record;
+
+    if (root == NULL) {
+        return NULL;
+    }
+    record = (root->type.index == EXPRESSION) ? record_find(root) : NULL;
+    if (record != NULL && record->representative != NULL) {
+        record_t *representative = record_find(record->representative);
+        if (representative->profitable) {
+            node_t *read = local_read(representative);
+            destroy_subtree(root);
+            return read;
+        }
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = rewrite_expression(root->children[i], hoist);
+    }
+    if (hoist && record != NULL && record->representative == NULL && record->profitable) {
+        node_t *read = local_read(record);
+        prefix = array_grow(prefix, n_prefix, &prefix_capacity, sizeof(*prefix));
+        prefix[n_prefix++] = temporary_assign(record->temporary, root);
+        return read;
+    }
+    return root;
+}
+
+
+/* Put the assignments made for a statement in front of it */
+    static node_t *
+prepend ( node_t *root, uint32_t mark )
+{
+    node_t *list;
+
+    if (n_prefix == mark) {
+        return root;
+    }
+    list = node_list_new(statement_list_n, n_prefix - mark + 1);
+    for (uint32_t i = mark; i < n_prefix; i++) {
+        list->children[i - mark] = prefix[i];
+    }
+    list->children[n_prefix - mark] = root;
+    n_prefix = mark;
+    return list;
+}
+
+
+    static node_t *
+rewrite_statement ( node_t *root )
+{
+    uint32_t mark = n_prefix;
+
+    if (root == NULL) {
+        return NULL;
+    }
+    switch (root->type.index) {
+        case ASSIGNMENT_STATEMENT:
+            root->children[1] = rewrite_expression(root->children[1], true);
+            return prepend(root, mark);
+
+        case RETURN_STATEMENT:
+            root->children[0] = rewrite_expression(root->children[0], true);
+            return prepend(root, mark);
+
+        case PRINT_LIST:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                root->children[i] = rewrite_expression(root->children[i], true);
+            }
+            return prepend(root, mark);
+
+        case IF_STATEMENT:
+            root->children[0] = rewrite_expression(root->children[0], true);
+            for (uint32_t i = 1; i < root->n_children; i++) {
+                root->children[i] = rewrite_statement(root->children[i]);
+            }
+            return prepend(root, mark);
+
+        case WHILE_STATEMENT:
+            root->children[0] = rewrite_expression(root->children[0], false);
+            root->children[1] = rewrite_statement(root->children[1]);
+            return root;
+
+        case FOR_STATEMENT:
+            /* The start value goes in front of the loop, not inside it */
+            root->children[0]->children[1] = rewrite_expression(root->children[0]->children[1], true);
+            root->children[1] = rewrite_expression(root->children[1], false);
+            root->children[2] = rewrite_statement(root->children[2]);
+            return prepend(root, mark);
+
+        case STATEMENT_LIST: {
+            uint32_t n = 0;
+            node_t **statements = NULL;
+            uint32_t capacity = 0;
+
+            /* Lists made for the assignments are spliced into this one */
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                node_t *statement = rewrite_statement(root->children[i]);
+                if (statement != NULL && statement->type.index == STATEMENT_LIST) {
+                    for (uint32_t k = 0; k < statement->n_children; k++) {
+                        statements = array_grow(statements, n, &capacity, sizeof(*statements));
+                        statements[n++] = statement->children[k];
+                    }
+                    statement->n_children = 0;
+                    node_finalize(statement);
+                } else {
+                    statements = array_grow(statements, n, &capacity, sizeof(*statements));
+                    statements[n++] = statement;
+                }
+            }
+            free(root->children);
+            root->children = statements;
+            root->n_children = n;
+            return root;
+        }
+
+        default:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                root->children[i] = rewrite_statement(root->children[i]);
+            }
+            return root;
+    }
+}
+
+
+    static void
+rewrite_function ( node_t *function_node, int32_t *changes )
+{
+    node_t *body = function_node->children[function_node->n_children - 1];
+
+    /* Without a block of its own, the function has nowhere to keep locals */
+    if (!temporaries_open(function_node)) {
+        return;
+    }
+    body->children[1] = rewrite_statement(body->children[1]);
+    *changes += temporaries_close();
+}
+
+
+    int32_t
+eliminate_common_subexpressions ( node_t *root )
+{
+    ir_program_t *program;
+    node_t *functions = root->children[0];
+    int32_t changes = 0;
+
+    n_hoistable = n_records = 0;
+    mark_statements(root);
+    qsort(hoistable, n_hoistable, sizeof(*hoistable), node_compare);
+
+    program = ir_build(root);
+    for (uint32_t f = 0; f < program->n_functions; f++) {
+        analyse(&program->functions[f]);
+    }
+    ir_finalize(program);
+    qsort(records, n_records, sizeof(*records), node_compare);
+
+    /* Worth a local if it saves more than the assignment costs */
+    count_uses(root);
+    for (uint32_t r = 0; r < n_records; r++) {
+        records[r].profitable = records[r].representative == NULL
+            && records[r].uses * (records[r].size - 1) >= 2;
+    }
+
+    for (uint32_t f = 0; f < functions->n_children; f++) {
+        rewrite_function(functions->children[f], &changes);
+    }
+
+    free(records);
+    free(hoistable);
+    free(entries);
+    free(prefix);
+    records = NULL;
+    hoistable = NULL;
+    entries = NULL;
+    prefix = NULL;
+    records_capacity = hoistable_capacity = entries_capacity = prefix_capacity = 0;
+    return changes;
+}
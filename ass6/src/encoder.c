@@ -0,0 +1,1073 @@
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+
+#include "encoder.h"
+
+/*
+ * Built-in assembler for the instruction list of the generator: the same
+ * instructions that instructions_print writes as text are encoded as x86
+ * or x86-64 machine code, together with the data that strings_output
+ * writes, and can be saved as a relocatable ELF object without running
+ * 'as'. Operands are the strings of the instruction list, so they are
+ * parsed the way the assembler would.
+ */
+
+
+/* Growable byte arrays for the sections and tables */
+typedef struct {
+    uint8_t *bytes;
+    uint32_t size, capacity;
+} buffer_t;
+
+/* Registers by name, with their number in encodings and size in bytes */
+typedef struct {
+    char *name;
+    int32_t number, width;
+} machine_register_t;
+
+static const machine_register_t registers[] = {
+    { "%eax", 0, 4 }, { "%ecx", 1, 4 }, { "%edx", 2, 4 }, { "%ebx", 3, 4 },
+    { "%esp", 4, 4 }, { "%ebp", 5, 4 }, { "%esi", 6, 4 }, { "%edi", 7, 4 },
+    { "%r8d", 8, 4 }, { "%r9d", 9, 4 }, { "%r10d", 10, 4 }, { "%r11d", 11, 4 },
+    { "%r12d", 12, 4 }, { "%r13d", 13, 4 }, { "%r14d", 14, 4 }, { "%r15d", 15, 4 },
+    { "%rax", 0, 8 }, { "%rcx", 1, 8 }, { "%rdx", 2, 8 }, { "%rbx", 3, 8 },
+    { "%rsp", 4, 8 }, { "%rbp", 5, 8 }, { "%rsi", 6, 8 }, { "%rdi", 7, 8 },
+    { "%r8", 8, 8 }, { "%r9", 9, 8 }, { "%r10", 10, 8 }, { "%r11", 11, 8 },
+    { "%r12", 12, 8 }, { "%r13", 13, 8 }, { "%r14", 14, 8 }, { "%r15", 15, 8 },
+    { "%al", 0, 1 }, { "%cl", 1, 1 }, { "%dl", 2, 1 }, { "%bl", 3, 1 }
+};
+
+/* Register number of missing base and index registers, and of RIP */
+#define NO_REGISTER (-1)
+#define RIP (-2)
+
+typedef enum {
+    OPERAND_NONE, OPERAND_REGISTER, OPERAND_IMMEDIATE, OPERAND_MEMORY
+} operand_kind_t;
+
+typedef struct {
+    operand_kind_t kind;
+    int32_t reg, width;             /* Register operands */
+    int32_t base, index, scale;     /* Memory operands */
+    int32_t value;                  /* Immediate or displacement */
+    char *symbol;                   /* Label in an immediate or displacement */
+} operand_t;
+
+
+/* The object being encoded, and its sections */
+static object_t *object;
+static buffer_t text, data;
+static uint32_t symbols_capacity, relocations_capacity;
+
+/* Label name to symbol index + 1 */
+static ght_hash_table_t *labels;
+
+/*
+ * Jumps are encoded with 8 bit displacements when their target is near
+ * enough. Every pass over the instructions records where each jump ends,
+ * jumps that turn out not to reach become 32 bit ones, until nothing
+ * changes.
+ */
+static bool *long_jumps;
+static uint32_t *jump_ends, *jump_targets;
+static uint32_t n_jumps, jump_index;
+
+
+    static void
+buffer_append ( buffer_t *buffer, const void *bytes, uint32_t size )
+{
+    if (buffer->size + size > buffer->capacity) {
+        buffer->capacity = 2 * (buffer->size + size) + 64;
+        buffer->bytes = realloc(buffer->bytes, buffer->capacity);
+        if (buffer->bytes == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for object code.\n");
+            abort();
+        }
+    }
+    memcpy(buffer->bytes + buffer->size, bytes, size);
+    buffer->size += size;
+}
+
+
+    static void
+emit_byte ( uint8_t byte )
+{
+    buffer_append(&text, &byte, 1);
+}
+
+
+/* Little endian, like everything else on x86 */
+    static void
+emit_int32 ( int32_t value )
+{
+    uint8_t bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+    buffer_append(&text, bytes, 4);
+}
+
+
+    static bool
+fits_int8 ( int32_t value )
+{
+    return value >= -128 && value <= 127;
+}
+
+
+/* Symbols */
+
+
+    static uint32_t
+symbol_add ( char *name, section_t section, uint32_t offset, bool function )
+{
+    if (object->n_symbols == symbols_capacity) {
+        symbols_capacity = 2 * symbols_capacity + 16;
+        object->symbols = realloc(object->symbols, sizeof(*object->symbols) * symbols_capacity);
+        if (object->symbols == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for symbols.\n");
+            abort();
+        }
+    }
+    object->symbols[object->n_symbols] = (object_symbol_t) { name, section, offset, 0, function };
+    ght_insert(labels, (void *) (uintptr_t) (object->n_symbols + 1), strlen(name), name);
+    return object->n_symbols++;
+}
+
+
+/* Index of a symbol, -1 if there is none by that name */
+    static int32_t
+symbol_find ( char *name )
+{
+    uintptr_t index = (uintptr_t) ght_get(labels, strlen(name), name);
+    return (int32_t) index - 1;
+}
+
+
+/*
+ * A 32 bit field referring to a symbol, which the linker fills in. The
+ * addend is kept with the relocation, not in the field.
+ */
+    static void
+emit_relocated ( char *name, relocation_kind_t kind, int32_t addend )
+{
+    int32_t symbol = symbol_find(name);
+
+    if (symbol < 0) {
+        symbol = symbol_add(STRDUP(name), SECTION_UNDEFINED, 0, false);
+    }
+
+    if (object->n_relocations == relocations_capacity) {
+        relocations_capacity = 2 * relocations_capacity + 16;
+        object->relocations = realloc(object->relocations,
+            sizeof(*object->relocations) * relocations_capacity);
+        if (object->relocations == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for relocations.\n");
+            abort();
+        }
+    }
+    object->relocations[object->n_relocations++] = (relocation_t) { text.size, symbol, kind, addend };
+    emit_int32(0);
+}
+
+
+/* The data section: the format for integers, and the string literals */
+
+
+/* Add a string, with its terminator */
+    static void
+data_add ( char *name, char *bytes, uint32_t length )
+{
+    symbol_add(name, SECTION_DATA, data.size, false);
+    buffer_append(&data, bytes, length + 1);
+}
+
+
+    static void
+data_assemble ( void )
+{
+    data_add(STRDUP(".INTEGER"), "%d ", 3);
+    for (int32_t i = 0; i < strings_count(); i++) {
+        char *name = malloc(sizeof(*name) * 20);
+        uint32_t length;
+        char *value = strings_value(i, &length);
+        sprintf(name, ".STRING%d", i);
+        data_add(name, value, length);
+        free(value);
+    }
+}
+
+
+/*
+ * Jump tables: room for the words of every table in the data, and once the
+ * text is laid out, the distances of the entries from the label they are
+ * relative to. Tables of zeros only need the room.
+ */
+    static void
+tables_assemble ( instruction_t *start, bool fill )
+{
+    for (instruction_t *this = start; this != NULL; this = this->next) {
+        char *labels, *name, *base;
+        uint32_t offset;
+
+        if (this->opcode == MEMOTABLE && !fill) {
+            uint32_t size;
+            uint8_t *zeros;
+            labels = STRDUP(this->operands[0]);
+            name = strtok(labels, " ");
+            size = strtoul(strtok(NULL, " "), NULL, 10);
+            zeros = calloc(size, 1);
+            if (zeros == NULL) {
+                fprintf(stderr, "Failed to allocate heap for a table.\n");
+                abort();
+            }
+            while (data.size % 4 != 0) {
+                buffer_append(&data, "", 1);
+            }
+            symbol_add(STRDUP(name), SECTION_DATA, data.size, false);
+            buffer_append(&data, zeros, size);
+            free(zeros);
+            free(labels);
+        }
+        if (this->opcode != JUMPTABLE) {
+            continue;
+        }
+        labels = STRDUP(this->operands[0]);
+        name = strtok(labels, " ");
+        base = strtok(NULL, " ");
+        if (!fill) {
+            while (data.size % 4 != 0) {
+                buffer_append(&data, "", 1);
+            }
+            symbol_add(STRDUP(name), SECTION_DATA, data.size, false);
+        }
+        offset = object->symbols[symbol_find(name)].offset;
+
+        for (char *entry = strtok(NULL, " "); entry != NULL; entry = strtok(NULL, " "), offset += 4) {
+            int32_t distance = 0;
+            if (fill) {
+                distance = object->symbols[symbol_find(entry)].offset - object->symbols[symbol_find(base)].offset;
+            }
+            uint8_t bytes[4] = { distance, distance >> 8, distance >> 16, distance >> 24 };
+            if (fill) {
+                memcpy(data.bytes + offset, bytes, 4);
+            } else {
+                buffer_append(&data, bytes, 4);
+            }
+        }
+        free(labels);
+    }
+}
+
+
+/* Operands */
+
+
+    static bool
+register_lookup ( char *name, size_t length, int32_t *number, int32_t *width )
+{
+    for (uint32_t r = 0; r < sizeof(registers) / sizeof(registers[0]); r++) {
+        if (strlen(registers[r].name) == length && strncmp(registers[r].name, name, length) == 0) {
+            *number = registers[r].number;
+            *width = registers[r].width;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+    static void
+operand_error ( char *text )
+{
+    fprintf(stderr, "Cannot encode operand '%s'\n", text);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Parse an operand of the instruction list. A non-zero offset makes the
+ * operand the base register of a memory operand, otherwise it is an
+ * immediate ($), a register (%), or a memory operand in AT&T syntax:
+ * displacement or label followed by (base) or (base,index,scale).
+ */
+    static void
+operand_parse ( char *text, int32_t offset, operand_t *operand )
+{
+    int32_t width;
+
+    *operand = (operand_t) { OPERAND_NONE, 0, 0, NO_REGISTER, NO_REGISTER, 1, 0, NULL };
+
+    if (text == NULL) {
+        return;
+    }
+
+    if (offset != 0) {
+        operand->kind = OPERAND_MEMORY;
+        operand->value = offset;
+        if (!register_lookup(text, strlen(text), &operand->base, &width)) {
+            operand_error(text);
+        }
+        return;
+    }
+
+    if (*text == '$') {
+        operand->kind = OPERAND_IMMEDIATE;
+        if (text[1] == '-' || (text[1] >= '0' && text[1] <= '9')) {
+            operand->value = strtol(text + 1, NULL, 0);
+        } else {
+            operand->symbol = text + 1;
+        }
+        return;
+    }
+
+    if (*text == '%') {
+        operand->kind = OPERAND_REGISTER;
+        if (!register_lookup(text, strlen(text), &operand->reg, &operand->width)) {
+            operand_error(text);
+        }
+        return;
+    }
+
+    /* Memory operand */
+    operand->kind = OPERAND_MEMORY;
+    char *open = strchr(text, '('), *end;
+    if (open == NULL) {
+        operand_error(text);
+    }
+    if (open != text) {
+        if (*text == '-' || (*text >= '0' && *text <= '9')) {
+            operand->value = strtol(text, NULL, 0);
+        } else {
+            operand->symbol = STRDUP(text);
+            operand->symbol[open - text] = '\0';
+        }
+    }
+
+    end = open + 1 + strcspn(open + 1, ",)");
+    if (end - open - 1 == 4 && strncmp(open + 1, "%rip", 4) == 0) {
+        operand->base = RIP;
+    } else if (!register_lookup(open + 1, end - open - 1, &operand->base, &width)) {
+        operand_error(text);
+    }
+    if (*end == ',') {
+        char *index = end + 1;
+        end = index + strcspn(index, ",)");
+        if (!register_lookup(index, end - index, &operand->index, &width)) {
+            operand_error(text);
+        }
+        if (*end == ',') {
+            operand->scale = strtol(end + 1, NULL, 10);
+        }
+    }
+}
+
+
+/* Instructions */
+
+
+/*
+ * REX prefix on x86-64: W for 64 bit operands, R, X and B extend the reg
+ * field, index and base (or r/m register) to r8-r15
+ */
+    static void
+emit_rex ( bool wide, int32_t reg, operand_t *rm )
+{
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0);
+
+    if (object->target != TARGET_X86_64) {
+        return;
+    }
+    if (rm->kind == OPERAND_REGISTER && (rm->reg & 8)) {
+        rex |= 1;
+    }
+    if (rm->kind == OPERAND_MEMORY && rm->base >= 0 && (rm->base & 8)) {
+        rex |= 1;
+    }
+    if (rm->kind == OPERAND_MEMORY && rm->index >= 0 && (rm->index & 8)) {
+        rex |= 2;
+    }
+    if (rex != 0x40) {
+        emit_byte(rex);
+    }
+}
+
+
+/*
+ * ModRM byte, and the SIB byte and displacement of memory operands. RIP
+ * relative displacements count from the end of the instruction, trailing is
+ * the size of an immediate after them.
+ */
+    static void
+emit_modrm ( int32_t reg, operand_t *rm, int32_t trailing )
+{
+    if (rm->kind == OPERAND_REGISTER) {
+        emit_byte(0xC0 | (reg & 7) << 3 | (rm->reg & 7));
+        return;
+    }
+
+    if (rm->base == RIP) {
+        emit_byte(0x05 | (reg & 7) << 3);
+        emit_relocated(rm->symbol, RELOCATION_PC, rm->value - 4 - trailing);
+        return;
+    }
+
+    if (rm->kind != OPERAND_MEMORY || rm->base == NO_REGISTER || rm->symbol != NULL) {
+        fprintf(stderr, "Cannot encode memory operand\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bool sib = rm->index != NO_REGISTER || (rm->base & 7) == 4;
+    int32_t mod = (rm->value == 0 && (rm->base & 7) != 5) ? 0 : (fits_int8(rm->value) ? 1 : 2);
+    int32_t scale = (rm->scale == 8) ? 3 : (rm->scale == 4) ? 2 : (rm->scale == 2) ? 1 : 0;
+
+    emit_byte(mod << 6 | (reg & 7) << 3 | (sib ? 4 : (rm->base & 7)));
+    if (sib) {
+        int32_t index = (rm->index == NO_REGISTER) ? 4 : rm->index;
+        emit_byte(scale << 6 | (index & 7) << 3 | (rm->base & 7));
+    }
+    if (mod == 1) {
+        emit_byte(rm->value);
+    } else if (mod == 2) {
+        emit_int32(rm->value);
+    }
+}
+
+
+/* Opcode (two bytes if it is above 0xFF) with a ModRM operand */
+    static void
+encode_rm ( int32_t opcode, int32_t reg, operand_t *rm, bool wide, int32_t trailing )
+{
+    emit_rex(wide, reg, rm);
+    if (opcode > 0xFF) {
+        emit_byte(opcode >> 8);
+    }
+    emit_byte(opcode);
+    emit_modrm(reg, rm, trailing);
+}
+
+
+    static void
+emit_immediate ( operand_t *immediate, bool byte )
+{
+    if (immediate->symbol != NULL) {
+        emit_relocated(immediate->symbol, RELOCATION_ABSOLUTE, immediate->value);
+    } else if (byte) {
+        emit_byte(immediate->value);
+    } else {
+        emit_int32(immediate->value);
+    }
+}
+
+
+    static bool
+short_immediate ( operand_t *immediate )
+{
+    return immediate->symbol == NULL && fits_int8(immediate->value);
+}
+
+
+/*
+ * Arithmetic with the usual three forms: immediate (opcode 0x83 or 0x81 with
+ * an extension in the reg field), register to r/m (store), and r/m to
+ * register (load)
+ */
+    static void
+encode_alu ( int32_t extension, int32_t store, int32_t load, operand_t *src, operand_t *dst, bool wide )
+{
+    if (src->kind == OPERAND_IMMEDIATE && !short_immediate(src)
+        && dst->kind == OPERAND_REGISTER && dst->reg == 0) {
+        /* The accumulator has its own form, with the opcode after the store */
+        emit_rex(wide, 0, dst);
+        emit_byte(store + 4);
+        emit_immediate(src, false);
+    } else if (src->kind == OPERAND_IMMEDIATE) {
+        bool byte = short_immediate(src);
+        encode_rm(byte ? 0x83 : 0x81, extension, dst, wide, byte ? 1 : 4);
+        emit_immediate(src, byte);
+    } else if (src->kind == OPERAND_REGISTER) {
+        encode_rm(store, src->reg, dst, wide, 0);
+    } else {
+        encode_rm(load, dst->reg, src, wide, 0);
+    }
+}
+
+
+    static void
+encode_move ( operand_t *src, operand_t *dst, bool wide )
+{
+    if (src->kind == OPERAND_IMMEDIATE && dst->kind == OPERAND_REGISTER && !wide) {
+        if (dst->reg & 8) {
+            emit_byte(0x41);
+        }
+        emit_byte(0xB8 + (dst->reg & 7));
+        emit_immediate(src, false);
+    } else if (src->kind == OPERAND_IMMEDIATE) {
+        encode_rm(0xC7, 0, dst, wide, 4);
+        emit_immediate(src, false);
+    } else if (src->kind == OPERAND_REGISTER) {
+        encode_rm(0x89, src->reg, dst, wide, 0);
+    } else {
+        encode_rm(0x8B, dst->reg, src, wide, 0);
+    }
+}
+
+
+/* Push and pop have the size of a stack word without any prefix */
+    static void
+encode_stack ( opcode_t opcode, operand_t *operand )
+{
+    if (operand->kind == OPERAND_REGISTER) {
+        if (operand->reg & 8) {
+            emit_byte(0x41);
+        }
+        emit_byte(((opcode == PUSH) ? 0x50 : 0x58) + (operand->reg & 7));
+    } else if (operand->kind == OPERAND_IMMEDIATE) {
+        bool byte = short_immediate(operand);
+        emit_byte(byte ? 0x6A : 0x68);
+        emit_immediate(operand, byte);
+    } else if (opcode == PUSH) {
+        encode_rm(0xFF, 6, operand, false, 0);
+    } else {
+        encode_rm(0x8F, 0, operand, false, 0);
+    }
+}
+
+
+/* Jumps to labels in the text, long_opcode is 0x0F8x for conditions */
+    static void
+encode_jump ( uint8_t short_opcode, int32_t long_opcode, char *label )
+{
+    int32_t target = symbol_find(label);
+    uint32_t jump = jump_index++;
+
+    if (target < 0 || object->symbols[target].section != SECTION_TEXT) {
+        fprintf(stderr, "Jump to undefined label '%s'\n", label);
+        exit(EXIT_FAILURE);
+    }
+
+    if (long_jumps[jump]) {
+        if (long_opcode > 0xFF) {
+            emit_byte(long_opcode >> 8);
+        }
+        emit_byte(long_opcode);
+        emit_int32(object->symbols[target].offset - (text.size + 4));
+    } else {
+        emit_byte(short_opcode);
+        emit_byte(object->symbols[target].offset - (text.size + 1));
+    }
+    jump_ends[jump] = text.size;
+    jump_targets[jump] = target;
+}
+
+
+/* Calls to functions of the program, labelled with a leading underscore */
+    static void
+encode_call ( char *function )
+{
+    char *label = malloc(sizeof(*label) * (strlen(function) + 2));
+    sprintf(label, "_%s", function);
+    int32_t target = symbol_find(label);
+
+    if (target < 0) {
+        fprintf(stderr, "Call to undefined function '%s'\n", function);
+        exit(EXIT_FAILURE);
+    }
+    emit_byte(0xE8);
+    emit_int32(object->symbols[target].offset - (text.size + 4));
+    free(label);
+}
+
+
+/* A label defined by a STRING instruction, NULL for other text */
+    static char *
+label_name ( instruction_t *this )
+{
+    size_t length;
+
+    if (this->opcode == LABEL) {
+        char *name = malloc(sizeof(*name) * (strlen(this->operands[0]) + 2));
+        sprintf(name, "_%s", this->operands[0]);
+        return name;
+    }
+    if (this->opcode != STRING || (length = strlen(this->operands[0])) == 0
+        || this->operands[0][length - 1] != ':') {
+        return NULL;
+    }
+    char *name = STRDUP(this->operands[0]);
+    name[length - 1] = '\0';
+    return name;
+}
+
+
+    static bool
+is_jump ( opcode_t opcode )
+{
+    switch (opcode) {
+        case JUMP: case JUMPZERO: case JUMPNONZ: case JUMPEQ: case JUMPNE:
+        case JUMPL: case JUMPG: case JUMPLE: case JUMPGE: case JUMPA:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+    static void
+encode_instruction ( instruction_t *this )
+{
+    operand_t a, b;
+    bool wide;
+    char *name;
+
+    switch (this->opcode) {
+        case STRING: case LABEL:
+            name = label_name(this);
+            if (name != NULL) {
+                object->symbols[symbol_find(name)].offset = text.size;
+                free(name);
+            } else if (strcmp(this->operands[0], ".text") != 0) {
+                fprintf(stderr, "Cannot encode directive '%s'\n", this->operands[0]);
+                exit(EXIT_FAILURE);
+            }
+            return;
+
+        case JUMP:     encode_jump(0xEB, 0xE9, this->operands[0]); return;
+        case JUMPZERO: case JUMPEQ:
+                       encode_jump(0x74, 0x0F84, this->operands[0]); return;
+        case JUMPNONZ: case JUMPNE:
+                       encode_jump(0x75, 0x0F85, this->operands[0]); return;
+        case JUMPL:    encode_jump(0x7C, 0x0F8C, this->operands[0]); return;
+        case JUMPGE:   encode_jump(0x7D, 0x0F8D, this->operands[0]); return;
+        case JUMPLE:   encode_jump(0x7E, 0x0F8E, this->operands[0]); return;
+        case JUMPG:    encode_jump(0x7F, 0x0F8F, this->operands[0]); return;
+        case JUMPA:    encode_jump(0x77, 0x0F87, this->operands[0]); return;
+        case JUMPTABLE: case MEMOTABLE:
+            return;
+
+        case CALL:
+            encode_call(this->operands[0]);
+            return;
+        case SYSCALL:
+            emit_byte(0xE8);
+            emit_relocated(this->operands[0], RELOCATION_CALL, -4);
+            return;
+
+        default:
+            break;
+    }
+
+    operand_parse(this->operands[0], this->offsets[0], &a);
+    operand_parse(this->operands[1], this->offsets[1], &b);
+    wide = (a.kind == OPERAND_REGISTER && a.width == 8) || (b.kind == OPERAND_REGISTER && b.width == 8);
+
+    switch (this->opcode) {
+        case PUSH: case POP:
+            encode_stack(this->opcode, &a);
+            break;
+        case MOVE:
+            encode_move(&a, &b, wide);
+            break;
+        case ADD:
+            encode_alu(0, 0x01, 0x03, &a, &b, wide);
+            break;
+        case SUB:
+            encode_alu(5, 0x29, 0x2B, &a, &b, wide);
+            break;
+        case CMP:
+            encode_alu(7, 0x39, 0x3B, &a, &b, wide);
+            break;
+        case CMPZERO:
+            encode_rm(0x83, 7, &a, wide, 1);
+            emit_byte(0);
+            break;
+
+        case MUL: encode_rm(0xF7, 5, &a, wide, 0); break;
+        case DIV: encode_rm(0xF7, 7, &a, wide, 0); break;
+        case NEG: encode_rm(0xF7, 3, &a, wide, 0); break;
+        case INC: case DEC: case DECL:
+            /* x86-64 took the one byte forms for REX prefixes */
+            if (a.kind == OPERAND_REGISTER && object->target == TARGET_X86) {
+                emit_byte(((this->opcode == INC) ? 0x40 : 0x48) + a.reg);
+            } else {
+                encode_rm(0xFF, (this->opcode == INC) ? 0 : 1, &a, wide, 0);
+            }
+            break;
+
+        case SHL: case SAR: case SHR:
+            if (a.value == 1) {
+                encode_rm(0xD1, (this->opcode == SHL) ? 4 : (this->opcode == SAR) ? 7 : 5, &b, wide, 0);
+            } else {
+                encode_rm(0xC1, (this->opcode == SHL) ? 4 : (this->opcode == SAR) ? 7 : 5, &b, wide, 1);
+                emit_byte(a.value);
+            }
+            break;
+        case LEA:
+            encode_rm(0x8D, b.reg, &a, wide, 0);
+            break;
+        case MULI:
+            if (a.kind == OPERAND_IMMEDIATE) {
+                bool byte = short_immediate(&a);
+                encode_rm(byte ? 0x6B : 0x69, b.reg, &b, wide, byte ? 1 : 4);
+                emit_immediate(&a, byte);
+            } else {
+                encode_rm(0x0FAF, b.reg, &a, wide, 0);
+            }
+            break;
+        case MOVZBL:
+            encode_rm(0x0FB6, b.reg, &a, false, 0);
+            break;
+
+        case CMOVL:  encode_rm(0x0F4C, b.reg, &a, false, 0); break;
+        case CMOVGE: encode_rm(0x0F4D, b.reg, &a, false, 0); break;
+        case CMOVLE: encode_rm(0x0F4E, b.reg, &a, false, 0); break;
+        case CMOVG:  encode_rm(0x0F4F, b.reg, &a, false, 0); break;
+        case CMOVE:  encode_rm(0x0F44, b.reg, &a, false, 0); break;
+        case CMOVNE: encode_rm(0x0F45, b.reg, &a, false, 0); break;
+
+        case SETL:  encode_rm(0x0F9C, 0, &a, false, 0); break;
+        case SETGE: encode_rm(0x0F9D, 0, &a, false, 0); break;
+        case SETLE: encode_rm(0x0F9E, 0, &a, false, 0); break;
+        case SETG:  encode_rm(0x0F9F, 0, &a, false, 0); break;
+        case SETE:  encode_rm(0x0F94, 0, &a, false, 0); break;
+        case SETNE: encode_rm(0x0F95, 0, &a, false, 0); break;
+
+        case JUMPINDIRECT:
+            encode_rm(0xFF, 4, &a, false, 0);
+            break;
+
+        case CLTD:  emit_byte(0x99); break;
+        case CBW:   emit_byte(0x66); emit_byte(0x98); break;
+        case CWDE:  emit_byte(0x98); break;
+        case LEAVE: emit_byte(0xC9); break;
+        case RET:   emit_byte(0xC3); break;
+        case NIL:   break;
+
+        default:
+            fprintf(stderr, "Error in instruction stream\n");
+            exit(EXIT_FAILURE);
+    }
+}
+
+
+/* Encode all the instructions, with the jump sizes decided so far */
+    static void
+encode_pass ( instruction_t *start )
+{
+    text.size = 0;
+    object->n_relocations = 0;
+    jump_index = 0;
+
+    for (instruction_t *this = start; this != NULL; this = this->next) {
+        encode_instruction(this);
+    }
+}
+
+
+    object_t *
+object_encode ( instruction_t *start )
+{
+    bool changed;
+
+    object = calloc(1, sizeof(*object));
+    object->target = target;
+    text = data = (buffer_t) { NULL, 0, 0 };
+    symbols_capacity = relocations_capacity = 0;
+    labels = ght_create(256);
+
+    data_assemble();
+    tables_assemble(start, false);
+
+    /* Define the labels, and count the jumps */
+    n_jumps = 0;
+    for (instruction_t *this = start; this != NULL; this = this->next) {
+        char *name = label_name(this);
+        if (name != NULL) {
+            symbol_add(name, SECTION_TEXT, 0, *name == '_' || strcmp(name, "main") == 0);
+        }
+        if (is_jump(this->opcode)) {
+            n_jumps++;
+        }
+    }
+    long_jumps = calloc(n_jumps + 1, sizeof(*long_jumps));
+    jump_ends = malloc(sizeof(*jump_ends) * (n_jumps + 1));
+    jump_targets = malloc(sizeof(*jump_targets) * (n_jumps + 1));
+
+    /*
+     * Jumps only ever grow, so this terminates. The last pass lays out the
+     * code exactly as the one before, so all displacements are right.
+     */
+    do {
+        encode_pass(start);
+        changed = false;
+        for (uint32_t j = 0; j < n_jumps; j++) {
+            int32_t displacement = object->symbols[jump_targets[j]].offset - jump_ends[j];
+            if (!long_jumps[j] && !fits_int8(displacement)) {
+                long_jumps[j] = true;
+                changed = true;
+            }
+        }
+    } while (changed);
+    encode_pass(start);
+    tables_assemble(start, true);
+
+    /* Functions extend to the next one */
+    for (uint32_t s = 0, last = 0; s < object->n_symbols; s++) {
+        if (object->symbols[s].function) {
+            if (last != 0) {
+                object->symbols[last - 1].size = object->symbols[s].offset - object->symbols[last - 1].offset;
+            }
+            last = s + 1;
+            object->symbols[s].size = text.size - object->symbols[s].offset;
+        }
+    }
+
+    object->text = text.bytes;
+    object->text_size = text.size;
+    object->data = data.bytes;
+    object->data_size = data.size;
+
+    free(long_jumps);
+    free(jump_ends);
+    free(jump_targets);
+    ght_finalize(labels);
+    return object;
+}
+
+
+    void
+object_finalize ( object_t *object )
+{
+    for (uint32_t s = 0; s < object->n_symbols; s++) {
+        free(object->symbols[s].name);
+    }
+    free(object->symbols);
+    free(object->relocations);
+    free(object->text);
+    free(object->data);
+    free(object);
+}
+
+
+/*
+ * Relocatable ELF objects, ELF32 for x86 and ELF64 for x86-64. The
+ * sections are the text, the data, relocations for the text, a symbol
+ * table with the functions (main is global) and the called library
+ * functions, and an empty .note.GNU-stack to mark the stack non-executable.
+ */
+
+enum {
+    SH_NULL, SH_TEXT, SH_DATA, SH_RELOCATIONS, SH_SYMTAB, SH_STRTAB, SH_SHSTRTAB, SH_NOTE,
+    N_SECTIONS
+};
+
+
+    static uint32_t
+string_table_add ( buffer_t *table, char *name )
+{
+    uint32_t offset = table->size;
+    buffer_append(table, name, strlen(name) + 1);
+    return offset;
+}
+
+
+    static void
+elf_symbol ( buffer_t *table, bool elf64, uint32_t name, uint8_t info, uint16_t section,
+    uint32_t value, uint32_t size )
+{
+    if (elf64) {
+        Elf64_Sym symbol = { name, info, STV_DEFAULT, section, value, size };
+        buffer_append(table, &symbol, sizeof(symbol));
+    } else {
+        Elf32_Sym symbol = { name, value, size, info, STV_DEFAULT, section };
+        buffer_append(table, &symbol, sizeof(symbol));
+    }
+}
+
+
+    static void
+elf_relocation ( buffer_t *table, bool elf64, uint32_t offset, uint32_t symbol, uint32_t type,
+    int32_t addend )
+{
+    if (elf64) {
+        Elf64_Rela relocation = { offset, ELF64_R_INFO(symbol, type), addend };
+        buffer_append(table, &relocation, sizeof(relocation));
+    } else {
+        Elf32_Rel relocation = { offset, ELF32_R_INFO(symbol, type) };
+        buffer_append(table, &relocation, sizeof(relocation));
+    }
+}
+
+
+    static void
+write_padding ( FILE *stream, uint32_t *position, uint32_t alignment )
+{
+    while (*position % alignment != 0) {
+        fputc(0, stream);
+        (*position)++;
+    }
+}
+
+
+    void
+object_write_elf ( FILE *stream, object_t *object )
+{
+    bool elf64 = (object->target == TARGET_X86_64);
+    buffer_t symtab = { NULL, 0, 0 }, strtab = { NULL, 0, 0 }, shstrtab = { NULL, 0, 0 };
+    buffer_t relocations = { NULL, 0, 0 };
+    uint32_t *elf_index = malloc(sizeof(*elf_index) * (object->n_symbols + 1));
+    uint32_t n_locals, n_elf_symbols = 3;
+    uint8_t *text = malloc(object->text_size + 1);
+
+    memcpy(text, object->text, object->text_size);
+
+    /* The null symbol, and the sections which labels are relative to */
+    string_table_add(&strtab, "");
+    elf_symbol(&symtab, elf64, 0, 0, SHN_UNDEF, 0, 0);
+    elf_symbol(&symtab, elf64, 0, ELF32_ST_INFO(STB_LOCAL, STT_SECTION), SH_TEXT, 0, 0);
+    elf_symbol(&symtab, elf64, 0, ELF32_ST_INFO(STB_LOCAL, STT_SECTION), SH_DATA, 0, 0);
+
+    /* Local symbols come first: the functions other than main */
+    for (uint32_t s = 0; s < object->n_symbols; s++) {
+        object_symbol_t *symbol = &object->symbols[s];
+        elf_index[s] = (symbol->section == SECTION_DATA) ? SH_DATA : SH_TEXT;
+        if (symbol->function && strcmp(symbol->name, "main") != 0) {
+            elf_symbol(&symtab, elf64, string_table_add(&strtab, symbol->name),
+                ELF32_ST_INFO(STB_LOCAL, STT_FUNC), SH_TEXT, symbol->offset, symbol->size);
+            elf_index[s] = n_elf_symbols++;
+        }
+    }
+    n_locals = n_elf_symbols;
+    for (uint32_t s = 0; s < object->n_symbols; s++) {
+        object_symbol_t *symbol = &object->symbols[s];
+        if (symbol->section == SECTION_UNDEFINED) {
+            elf_symbol(&symtab, elf64, string_table_add(&strtab, symbol->name),
+                ELF32_ST_INFO(STB_GLOBAL, STT_NOTYPE), SHN_UNDEF, 0, 0);
+            elf_index[s] = n_elf_symbols++;
+        } else if (strcmp(symbol->name, "main") == 0) {
+            elf_symbol(&symtab, elf64, string_table_add(&strtab, symbol->name),
+                ELF32_ST_INFO(STB_GLOBAL, STT_FUNC), SH_TEXT, symbol->offset, symbol->size);
+            elf_index[s] = n_elf_symbols++;
+        }
+    }
+
+    /*
+     * Labels without a symbol of their own are relative to their section.
+     * x86 uses REL relocations, with the addend in the relocated field.
+     */
+    for (uint32_t r = 0; r < object->n_relocations; r++) {
+        relocation_t *relocation = &object->relocations[r];
+        object_symbol_t *symbol = &object->symbols[relocation->symbol];
+        uint32_t index = elf_index[relocation->symbol], type;
+        int32_t addend = relocation->addend;
+
+        if (index == SH_TEXT || index == SH_DATA) {
+            addend += symbol->offset;
+        }
+        if (elf64) {
+            type = (relocation->kind == RELOCATION_ABSOLUTE) ? R_X86_64_32
+                : (relocation->kind == RELOCATION_PC) ? R_X86_64_PC32 : R_X86_64_PLT32;
+        } else {
+            type = (relocation->kind == RELOCATION_ABSOLUTE) ? R_386_32 : R_386_PC32;
+            for (int i = 0; i < 4; i++) {
+                text[relocation->offset + i] = (uint32_t) addend >> (8 * i);
+            }
+        }
+        elf_relocation(&relocations, elf64, relocation->offset, index, type, addend);
+    }
+
+    /* Section names */
+    uint32_t names[N_SECTIONS];
+    names[SH_NULL] = string_table_add(&shstrtab, "");
+    names[SH_TEXT] = string_table_add(&shstrtab, ".text");
+    names[SH_DATA] = string_table_add(&shstrtab, ".data");
+    names[SH_RELOCATIONS] = string_table_add(&shstrtab, elf64 ? ".rela.text" : ".rel.text");
+    names[SH_SYMTAB] = string_table_add(&shstrtab, ".symtab");
+    names[SH_STRTAB] = string_table_add(&shstrtab, ".strtab");
+    names[SH_SHSTRTAB] = string_table_add(&shstrtab, ".shstrtab");
+    names[SH_NOTE] = string_table_add(&shstrtab, ".note.GNU-stack");
+
+    /* Section contents follow the header, section headers come last */
+    struct {
+        uint8_t *bytes;
+        uint32_t size, type, flags, alignment, link, info, entry_size;
+    } sections[N_SECTIONS] = {
+        [SH_NULL] = { NULL, 0, SHT_NULL, 0, 0, 0, 0, 0 },
+        [SH_TEXT] = { text, object->text_size, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16, 0, 0, 0 },
+        [SH_DATA] = { object->data, object->data_size, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 4, 0, 0, 0 },
+        [SH_RELOCATIONS] = { relocations.bytes, relocations.size, elf64 ? SHT_RELA : SHT_REL,
+            SHF_INFO_LINK, elf64 ? 8 : 4, SH_SYMTAB, SH_TEXT,
+            elf64 ? sizeof(Elf64_Rela) : sizeof(Elf32_Rel) },
+        [SH_SYMTAB] = { symtab.bytes, symtab.size, SHT_SYMTAB, 0, elf64 ? 8 : 4, SH_STRTAB, n_locals,
+            elf64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym) },
+        [SH_STRTAB] = { strtab.bytes, strtab.size, SHT_STRTAB, 0, 1, 0, 0, 0 },
+        [SH_SHSTRTAB] = { shstrtab.bytes, shstrtab.size, SHT_STRTAB, 0, 1, 0, 0, 0 },
+        [SH_NOTE] = { NULL, 0, SHT_PROGBITS, 0, 1, 0, 0, 0 }
+    };
+    uint32_t offsets[N_SECTIONS] = { 0 };
+    uint32_t position = elf64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+    uint32_t header_offset;
+
+    for (int i = 1; i < N_SECTIONS; i++) {
+        position = (position + sections[i].alignment - 1) / sections[i].alignment * sections[i].alignment;
+        offsets[i] = position;
+        position += sections[i].size;
+    }
+    header_offset = (position + 7) / 8 * 8;
+
+    /* ELF header */
+    unsigned char ident[EI_NIDENT] = {
+        ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, elf64 ? ELFCLASS64 : ELFCLASS32,
+        ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV
+    };
+    if (elf64) {
+        Elf64_Ehdr header = {
+            .e_type = ET_REL, .e_machine = EM_X86_64, .e_version = EV_CURRENT,
+            .e_shoff = header_offset, .e_ehsize = sizeof(Elf64_Ehdr),
+            .e_shentsize = sizeof(Elf64_Shdr), .e_shnum = N_SECTIONS, .e_shstrndx = SH_SHSTRTAB
+        };
+        memcpy(header.e_ident, ident, EI_NIDENT);
+        fwrite(&header, sizeof(header), 1, stream);
+    } else {
+        Elf32_Ehdr header = {
+            .e_type = ET_REL, .e_machine = EM_386, .e_version = EV_CURRENT,
+            .e_shoff = header_offset, .e_ehsize = sizeof(Elf32_Ehdr),
+            .e_shentsize = sizeof(Elf32_Shdr), .e_shnum = N_SECTIONS, .e_shstrndx = SH_SHSTRTAB
+        };
+        memcpy(header.e_ident, ident, EI_NIDENT);
+        fwrite(&header, sizeof(header), 1, stream);
+    }
+
+    /* Contents */
+    position = elf64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr);
+    for (int i = 1; i < N_SECTIONS; i++) {
+        write_padding(stream, &position, sections[i].alignment);
+        if (sections[i].size > 0) {
+            fwrite(sections[i].bytes, 1, sections[i].size, stream);
+        }
+        position += sections[i].size;
+    }
+    write_padding(stream, &position, 8);
+
+    /* Section headers */
+    for (int i = 0; i < N_SECTIONS; i++) {
+        if (elf64) {
+            Elf64_Shdr header = {
+                names[i], sections[i].type, sections[i].flags, 0, offsets[i], sections[i].size,
+                sections[i].link, sections[i].info, sections[i].alignment, sections[i].entry_size
+            };
+            fwrite(&header, sizeof(header), 1, stream);
+        } else {
+            Elf32_Shdr header = {
+                names[i], sections[i].type, sections[i].flags, 0, offsets[i], sections[i].size,
+                sections[i].link, sections[i].info, sections[i].alignment, sections[i].entry_size
+            };
+            fwrite(&header, sizeof(header), 1, stream);
+        }
+    }
+
+    free(symtab.bytes);
+    free(strtab.bytes);
+    free(shstrtab.bytes);
+    free(relocations.bytes);
+    free(elf_index);
+    free(text);
+}
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+/*
+ * Compile-time evaluation of calls to pure functions whose arguments are
+ * constants, like fibonacci_number(20). The call is run by the evaluator
+ * in purity.c, and replaced by the value it returns. Calls in the
+ * arguments are evaluated first, so constant calls nested in constant
+ * calls go too. It runs after sccp, which makes arguments computed from
+ * constants in variables into literals, and folds what the values leave
+ * behind. A call which traps, runs too long or recurses too deep is left
+ * to do that at run time.
+ */
+
+
+    static bool
+has_constant_arguments ( node_t *call )
+{
+    node_t *arguments = call->children[1];
+
+    for (uint32_t a = 0; arguments != NULL && a < arguments->n_children; a++) {
+        if (arguments->children[a]->type.index != INTEGER) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+    static void
+evaluate_tree ( node_t *root, int32_t *changes )
+{
+    int32_t value;
+
+    if (root == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        evaluate_tree(root->children[i], changes);
+    }
+
+    if (expression_is_call(root) && purity_is_pure(root->children[0]->entry) && has_constant_arguments(root)
+        && purity_evaluate(root, &value)) {
+        node_make_integer(root, value);
+        (*changes)++;
+    }
+}
+
+
+    int32_t
+evaluate_calls ( node_t *root )
+{
+    int32_t changes = 0;
+
+    purity_analyse(root);
+    evaluate_tree(root, &changes);
+    purity_finalize();
+    if (changes > 0) {
+        fold_constants(root);
+    }
+    return changes;
+}
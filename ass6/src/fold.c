@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+/*
+ * Constant folding on the bound syntax tree. simplify_tree already folds
+ * operators whose operands are both integers; this also removes the
+ * identities x+0, x-0, x*1 and x/1, folds x*0 and x-x when x has no calls
+ * in it, compares a variable with itself, and folds again what these
+ * leave behind, bottom up. Arithmetic wraps around like the machine's.
+ */
+
+static node_t *fold ( node_t *root, int32_t *changes );
+
+
+    static bool
+is_constant ( node_t *root, int32_t value )
+{
+    return root != NULL && root->type.index == INTEGER && *(int32_t *) root->data == value;
+}
+
+
+/* Replace an expression node with one of its children */
+    static node_t *
+keep_child ( node_t *root, uint32_t index )
+{
+    node_t *child = root->children[index];
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (i != index) {
+            destroy_subtree(root->children[i]);
+        }
+    }
+    node_finalize(root);
+    return child;
+}
+
+
+/*
+ * Evaluate a binary operator on constants. Returns false for division
+ * by zero and the division that overflows, which are left for run time.
+ */
+    bool
+fold_binary ( char *op, int32_t left, int32_t right, int32_t *result )
+{
+    if (strcmp(op, "+") == 0) { *result = (int32_t) ((uint32_t) left + (uint32_t) right); }
+    else if (strcmp(op, "-") == 0) { *result = (int32_t) ((uint32_t) left - (uint32_t) right); }
+    else if (strcmp(op, "*") == 0) { *result = (int32_t) ((uint32_t) left * (uint32_t) right); }
+    else if (strcmp(op, "/") == 0) {
+        if (right == 0 || (left == INT32_MIN && right == -1)) {
+            return false;
+        }
+        *result = left / right;
+    }
+    else if (strcmp(op, "<") == 0) { *result = left < right; }
+    else if (strcmp(op, ">") == 0) { *result = left > right; }
+    else if (strcmp(op, "<=") == 0) { *result = left <= right; }
+    else if (strcmp(op, ">=") == 0) { *result = left >= right; }
+    else if (strcmp(op, "==") == 0) { *result = left == right; }
+    else if (strcmp(op, "!=") == 0) { *result = left != right; }
+    else { return false; }
+    return true;
+}
+
+
+    static node_t *
+fold_expression ( node_t *root, int32_t *changes )
+{
+    char *op = root->data;
+    node_t *left = root->children[0], *right = NULL;
+    int32_t value;
+
+    /* Unary minus */
+    if (root->n_children == 1) {
+        if (left->type.index == INTEGER) {
+            (*changes)++;
+            return node_make_integer(root, (int32_t) -(uint32_t) *(int32_t *) left->data);
+        }
+        if (left->type.index == EXPRESSION && left->n_children == 1) {
+            (*changes)++;
+            node_t *inner = keep_child(left, 0);
+            root->children[0] = NULL;
+            node_finalize(root);
+            return inner;
+        }
+        return root;
+    }
+
+    if (*op == 'F') {
+        return root;
+    }
+    right = root->children[1];
+
+    if (left->type.index == INTEGER && right->type.index == INTEGER
+        && fold_binary(op, *(int32_t *) left->data, *(int32_t *) right->data, &value)) {
+        (*changes)++;
+        return node_make_integer(root, value);
+    }
+
+    /* Identities */
+    if (((strcmp(op, "+") == 0 || strcmp(op, "-") == 0) && is_constant(right, 0))
+        || ((strcmp(op, "*") == 0 || strcmp(op, "/") == 0) && is_constant(right, 1))) {
+        (*changes)++;
+        return keep_child(root, 0);
+    }
+    if ((strcmp(op, "+") == 0 && is_constant(left, 0)) || (strcmp(op, "*") == 0 && is_constant(left, 1))) {
+        (*changes)++;
+        return keep_child(root, 1);
+    }
+    if (strcmp(op, "*") == 0 && ((is_constant(right, 0) && !expression_has_call(left))
+        || (is_constant(left, 0) && !expression_has_call(right)))) {
+        (*changes)++;
+        return node_make_integer(root, 0);
+    }
+
+    /* The same variable on both sides */
+    if (left->type.index == VARIABLE && right->type.index == VARIABLE && left->entry == right->entry) {
+        if (strcmp(op, "-") == 0) { value = 0; }
+        else if (strcmp(op, "==") == 0 || strcmp(op, "<=") == 0 || strcmp(op, ">=") == 0) { value = 1; }
+        else if (strcmp(op, "!=") == 0 || strcmp(op, "<") == 0 || strcmp(op, ">") == 0) { value = 0; }
+        else { return root; }
+        (*changes)++;
+        return node_make_integer(root, value);
+    }
+
+    return root;
+}
+
+
+    static node_t *
+fold ( node_t *root, int32_t *changes )
+{
+    if (root == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = fold(root->children[i], changes);
+    }
+    if (root->type.index == EXPRESSION && root->data != NULL) {
+        return fold_expression(root, changes);
+    }
+    return root;
+}
+
+
+    int32_t
+fold_constants ( node_t *root )
+{
+    int32_t changes = 0;
+    fold(root, &changes);
+    return changes;
+}
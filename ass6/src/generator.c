@@ -1,31 +1,25 @@
 #include <tree.h>
 #include <generator.h>
+#include <encoder.h>
+#include <jit.h>
+#include <passes.h>
 
-bool peephole = false;
+target_t target = TARGET_X86;
+output_t output = OUTPUT_ASSEMBLY;
 
 
-/* Elements of the low-level intermediate representation */
-
-/* Instructions */
-typedef enum {
-    STRING, LABEL, PUSH, POP, MOVE, CALL, SYSCALL, LEAVE, RET,
-    ADD, SUB, MUL, DIV, JUMP, JUMPZERO, JUMPNONZ, DECL, CLTD, NEG, CMPZERO, NIL,
-    CMP, SETL, SETG, SETLE, SETGE, SETE, SETNE, CBW, CWDE,JUMPEQ
-} opcode_t;
-
 /* Registers */
 static char
 *eax = "%eax", *ebx = "%ebx", *ecx = "%ecx", *edx = "%edx",
     *ebp = "%ebp", *esp = "%esp", *esi = "%esi", *edi = "%edi",
     *al = "%al", *bl = "%bl";
 
-/* A struct to make linked lists from instructions */
-typedef struct instr {
-    opcode_t opcode;
-    char *operands[2];
-    int32_t offsets[2];
-    struct instr *next;
-} instruction_t;
+/* Additional registers on x86-64, and the full width names of the ones above */
+static char
+*r8d = "%r8d", *r9d = "%r9d", *r10d = "%r10d", *r11d = "%r11d",
+    *rax = "%rax", *rbx = "%rbx", *rcx = "%rcx", *rdx = "%rdx",
+    *rbp = "%rbp", *rsp = "%rsp", *rsi = "%rsi", *rdi = "%rdi",
+    *r8 = "%r8", *r9 = "%r9", *r12 = "%r12", *r13 = "%r13";
 
 /* Start and last element for emitting/appending instructions */
 static instruction_t *start = NULL, *last = NULL;
@@ -35,13 +29,89 @@ static instruction_t *start = NULL, *last = NULL;
  * how the symtab was built
  */ 
 static int32_t depth = 1;
-//Used to find variables in other frames
-int32_t depth_difference;
+
+/*
+ * The parts of the stack convention that depend on the target: the size of
+ * a stack word, the frame and stack pointers, and the scratch register which
+ * holds the right operand of binary operations (ebx is callee saved on
+ * x86-64, so it uses r11 instead)
+ */
+static int32_t word = 4;
+static char *fp, *sp, *scratch;
+
+/*
+ * Register which counts down the iterations of a FOR loop in rotated form.
+ * Nothing else uses it in code the generator emits for a function, and
+ * the C library keeps it, so it is only taken by innermost loops without
+ * calls to VSL functions.
+ */
+static char *counter;
+
+/*
+ * Blocks do not get activation records of their own, their locals are
+ * allocated in the function's record on top of those of the enclosing
+ * blocks. frame_size is the number of words allocated below ebp at the
+ * current point, block_base holds the value it had when the block at each
+ * depth was entered, so every variable is at a fixed offset from ebp.
+ */
+static int32_t frame_size = 0;
+static int32_t *block_base = NULL, block_base_size = 0;
+
+/*
+ * Words pushed on top of the locals by the statement being generated. With
+ * frame_size, this tells statically how to align the stack at calls, which
+ * x86-64 requires to be on a 16 byte boundary.
+ */
+static int32_t temporaries = 0;
+
+/*
+ * The list of function definitions, and the function currently being
+ * generated along with the label index of its body (the target of
+ * self-recursive tail calls)
+ */
+static node_t *functions = NULL, *current_function = NULL;
+static int32_t current_body_label;
+
+/*
+ * Label index of the cache of the function being generated if its calls
+ * are memoized, -1 if not. Return statements then jump to the code which
+ * stores their value in it.
+ */
+static int32_t current_memo = -1;
 
 /* Prototypes for auxiliaries (implemented at the end of this file) */
 static void instruction_add ( opcode_t op, char *arg1, char *arg2, int32_t off1, int32_t off2 );
 static void instructions_print ( FILE *stream );
 static void instructions_finalize ( void );
+static void generate_condition ( FILE *stream, node_t *root, char *false_label );
+static void generate_branch ( FILE *stream, node_t *root, char *destination, bool when );
+static void generate_rotated_while ( FILE *stream, node_t *root, int32_t index );
+static void generate_rotated_for ( FILE *stream, node_t *root, int32_t index );
+static bool generate_conditional_move ( FILE *stream, node_t *root );
+static bool generate_switch ( FILE *stream, node_t *root, int32_t index );
+static bool generate_tail_call ( FILE *stream, node_t *call );
+static void generate_memo_lookup ( node_t *function );
+static void generate_memo_store ( node_t *function );
+static void generate_expression ( FILE *stream, node_t *root );
+static void generate_value ( FILE *stream, node_t *root );
+static void generate_store ( FILE *stream, node_t *variable, node_t *value );
+static int32_t variable_offset ( symbol_t *entry );
+static char *immediate ( int32_t value );
+static char *word_register ( char *reg );
+static char *argument_register ( int32_t index );
+static int32_t register_parameter_count ( int32_t n_parameters );
+static void push_word ( char *operand, int32_t offset );
+static void pop_word ( char *operand, int32_t offset );
+static int32_t alignment_padding ( int32_t words );
+static void reserve_stack ( int32_t words );
+static void release_stack ( int32_t words );
+static void library_call ( char *function );
+static void entry_arguments_x86_64 ( node_t *function );
+static bool is_jump ( instruction_t *this );
+static bool jumps_to ( instruction_t *jump, instruction_t *label );
+static bool is_indirect ( char *operand );
+static instruction_t *instruction_remove ( instruction_t *this );
+static bool is_register ( char *operand );
 
 
 /*
@@ -49,7 +119,7 @@ static void instructions_finalize ( void );
  * on duplicate code, not really necessary
  */
 #define RECUR() do {\
-    for ( int32_t i=0; i<root->n_children; i++ )\
+    for ( uint32_t i=0; i<root->n_children; i++ )\
     generate ( stream, root->children[i] );\
 } while(false)
 
@@ -85,30 +155,95 @@ static void instructions_finalize ( void );
     instruction_add ( SYSCALL, STRDUP("exit"), NULL, 0, 0 );\
 } while ( false )
 
+/*
+ * The same for x86-64: the arguments are converted in place in the argv
+ * array (r12 walks it, and is left at the last one), and loaded from there
+ * into argument registers and stack slots by entry_arguments_x86_64.
+ */
+#define TEXT_HEAD_X86_64() do {\
+    instruction_add ( STRING,       STRDUP("main:"), NULL, 0, 0 );      \
+    instruction_add ( PUSH,         rbp, NULL, 0, 0 );                  \
+    instruction_add ( MOVE,         rsp, rbp, 0, 0 );                   \
+    instruction_add ( MOVE,         rsi, r12, 0, 0 );                   \
+    instruction_add ( MOVE,         edi, ebx, 0, 0 );                   \
+    instruction_add ( DECL,         ebx, NULL, 0, 0 );                  \
+    instruction_add ( JUMPZERO,     STRDUP("noargs"), NULL, 0, 0 );     \
+    instruction_add ( STRING,       STRDUP("pusharg:"), NULL, 0, 0 );   \
+    instruction_add ( ADD,          STRDUP("$8"), r12, 0, 0 );          \
+    instruction_add ( MOVE,         STRDUP("(%r12)"), rdi, 0, 0 );      \
+    instruction_add ( MOVE,         STRDUP("$0"), esi, 0, 0 );          \
+    instruction_add ( MOVE,         STRDUP("$10"), edx, 0, 0 );         \
+    instruction_add ( SYSCALL,      STRDUP("strtol"), NULL, 0, 0 );     \
+    instruction_add ( MOVE,         rax, STRDUP("(%r12)"), 0, 0 );      \
+    instruction_add ( DECL,         ebx, NULL, 0, 0 );                  \
+    instruction_add ( JUMPNONZ,     STRDUP("pusharg"), NULL, 0, 0 );    \
+    instruction_add ( STRING,       STRDUP("noargs:"), NULL, 0, 0 );    \
+} while ( false )
+
+#define TEXT_TAIL_X86_64() do {\
+    instruction_add ( MOVE, eax, edi, 0, 0 );               \
+    instruction_add ( SYSCALL, STRDUP("exit"), NULL, 0, 0 );\
+} while ( false )
+
 void generate ( FILE *stream, node_t *root )
 {
     static int label_index = 0;
     int current_label_index;
     char *string_buffer;
-    int elegant_solution;
     if ( root == NULL )
         return;
 
     switch ( root->type.index )
     {
         case PROGRAM:
-            /* Output the data segment */
-            strings_output ( stream );
+            /* Registers of the stack convention */
+            word = (target == TARGET_X86_64) ? 8 : 4;
+            fp = (target == TARGET_X86_64) ? rbp : ebp;
+            sp = (target == TARGET_X86_64) ? rsp : esp;
+            scratch = (target == TARGET_X86_64) ? r11d : ebx;
+            counter = (target == TARGET_X86_64) ? ebx : esi;
+
+            /* Output the data segment, objects get it from the encoder */
+            if ( output == OUTPUT_ASSEMBLY )
+                strings_output ( stream );
             instruction_add ( STRING, STRDUP( ".text" ), NULL, 0, 0 );
 
+            functions = root->children[0];
+            memoize_analyse ( root );
             RECUR();
-            TEXT_HEAD();
+            memoize_finalize ();
+
+            if (target == TARGET_X86_64) {
+                frame_size = temporaries = 0;
+                TEXT_HEAD_X86_64();
+                entry_arguments_x86_64(root->children[0]->children[0]);
+                TEXT_TAIL_X86_64();
+            } else {
+                TEXT_HEAD();
+
+                instruction_add(CALL, STRDUP(root->children[0]->children[0]->children[0]->entry->label), NULL, 0, 0);
 
-            instruction_add(CALL, root->children[0]->children[0]->children[0]->entry->label, NULL, 0, 0);
+                TEXT_TAIL();
+            }
 
-            TEXT_TAIL();
+            passes_run_instructions ( &start );
 
-            instructions_print ( stream );
+            if ( output == OUTPUT_OBJECT )
+            {
+                object_t *object = object_encode ( start );
+                object_write_elf ( stream, object );
+                object_finalize ( object );
+            }
+            else if ( output == OUTPUT_RUN )
+            {
+                object_t *object = object_encode ( start );
+                instructions_finalize ();
+                if ( pass_report )
+                    passes_report ( stderr );
+                jit_run ( object );
+            }
+            else
+                instructions_print ( stream );
             instructions_finalize ();
             break;
 
@@ -120,6 +255,7 @@ void generate ( FILE *stream, node_t *root )
 
             //Entering new scope, 'depth' is the depth of the current scope
             depth++;
+            frame_size = 0;
 
             //Generating the string needed for the label instruction
             int len = strlen(root->children[0]->entry->label);
@@ -133,8 +269,27 @@ void generate ( FILE *stream, node_t *root )
 
             //Generate the label for the function, and the code to update the base ptr
             instruction_add(STRING, temp, NULL, 0, 0);
-            instruction_add(PUSH, ebp, NULL, 0,0);
-            instruction_add(MOVE, esp, ebp, 0,0);
+            instruction_add(PUSH, fp, NULL, 0,0);
+            instruction_add(MOVE, sp, fp, 0,0);
+
+            //Label after the prologue, self-recursive tail calls jump back here
+            current_function = root;
+            current_body_label = label_index++;
+            string_buffer = malloc(sizeof(*string_buffer) * 16);
+            sprintf(string_buffer, "BODY%d:", current_body_label);
+            instruction_add(STRING, string_buffer, NULL, 0, 0);
+
+            //Parameters passed in registers are stored below the base ptr
+            for (int32_t i = 0; i < register_parameter_count(function_parameter_count(root)); i++) {
+                instruction_add(PUSH, word_register(argument_register(i)), NULL, 0, 0);
+                frame_size++;
+            }
+
+            //Memoized functions return what the cache has for the arguments, if anything
+            current_memo = memoize_function(root) ? label_index++ : -1;
+            if (current_memo >= 0) {
+                generate_memo_lookup(root);
+            }
 
             //Generating code for the functions body
             //The body is the last child, the other children are the name of the function
@@ -145,6 +300,11 @@ void generate ( FILE *stream, node_t *root )
             instruction_add(LEAVE, NULL, NULL, 0,0);
             instruction_add(RET, NULL, NULL, 0,0);
 
+            if (current_memo >= 0) {
+                generate_memo_store(root);
+                current_memo = -1;
+            }
+
             //Leaving the scope, decreasing depth
             depth--;
             break;
@@ -152,21 +312,36 @@ void generate ( FILE *stream, node_t *root )
         case BLOCK:
             /*
              * Blocks:
-             * Set up/take down activation record, no return value
+             * Allocate locals in the function's activation record, release
+             * them at the end, no return value
              */
 
-            //Entering new scope
+            //Entering new scope, the locals go on top of what is there
             depth++;
+            if (depth >= block_base_size) {
+                block_base_size = 2 * depth;
+                block_base = realloc(block_base, sizeof(*block_base) * block_base_size);
+                if (block_base == NULL) {
+                    fprintf(stderr, "Failed to reallocate heap for block frames.\n");
+                    abort();
+                }
+            }
+            block_base[depth] = frame_size;
 
-            //Setting up the new activation record
-            instruction_add(PUSH, ebp, NULL, 0,0);
-            instruction_add(MOVE, esp, ebp, 0,0);
-
-            //Generating code for the body of the block
-            RECUR();
+            //Generating code for the body of the block, on x86-64 the
+            //locals are padded to keep the stack aligned between statements
+            generate(stream, root->children[0]);
+            if (alignment_padding(0) != 0) {
+                instruction_add(PUSH, STRDUP("$0"), NULL, 0, 0);
+                frame_size++;
+            }
+            generate(stream, root->children[1]);
 
-            //Restoring the old activation record
-            instruction_add(LEAVE, NULL, NULL, 0,0);
+            //Releasing the locals of this block
+            if (frame_size > block_base[depth]) {
+                instruction_add(ADD, immediate(word * (frame_size - block_base[depth])), sp, 0, 0);
+            }
+            frame_size = block_base[depth];
 
             //Leaving scope
             depth--;
@@ -180,9 +355,15 @@ void generate ( FILE *stream, node_t *root )
 
             //The declarations first child is a VARIABLE_LIST, the number of children
             //of the VARIABLE_LIST is the number of variables declared. A 0 is pushed on
-            //the stack for each
+            //the stack for each, unless they are always assigned before they are read
+            if (!DECLARATION_CLEARED(root)) {
+                instruction_add(SUB, immediate(word * root->children[0]->n_children), sp, 0, 0);
+                frame_size += root->children[0]->n_children;
+                break;
+            }
             for(uint32_t c = 0; c < root->children[0]->n_children; c++){
                 instruction_add(PUSH, STRDUP("$0"), NULL, 0,0);
+                frame_size++;
             }
             break;
 
@@ -195,11 +376,18 @@ void generate ( FILE *stream, node_t *root )
             //Generate code for all the PRINT_ITEMs
             RECUR();
 
+            //On x86-64 the newline is passed in edi
+            if (target == TARGET_X86_64) {
+                instruction_add(MOVE, STRDUP("$0x0A"), edi, 0, 0);
+                library_call("putchar");
+                break;
+            }
+
             //Print a newline, push the newline, call 'putchar', and pop the argument
             //(overwriting the value returned from putchar...)
-            instruction_add(PUSH, STRDUP("$0x0A"), NULL, 0, 0);
+            push_word(STRDUP("$0x0A"), 0);
             instruction_add(SYSCALL, STRDUP("putchar"), NULL, 0,0);
-            instruction_add(POP, eax, NULL, 0,0);
+            pop_word(eax, 0);
             break;
 
         case PRINT_ITEM:
@@ -209,6 +397,21 @@ void generate ( FILE *stream, node_t *root )
              * and set up a suitable call to printf
              */
 
+            //On x86-64 the format string goes in rdi and the value in esi
+            if (target == TARGET_X86_64) {
+                if (root->children[0]->type.index == TEXT) {
+                    string_buffer = malloc(sizeof(*string_buffer) * 24);
+                    sprintf(string_buffer, ".STRING%d(%%rip)", *(int32_t *) root->children[0]->data);
+                } else {
+                    generate_expression(stream, root->children[0]);
+                    instruction_add(MOVE, eax, esi, 0, 0);
+                    string_buffer = STRDUP(".INTEGER(%rip)");
+                }
+                instruction_add(LEA, string_buffer, rdi, 0, 0);
+                library_call("printf");
+                break;
+            }
+
             //Checking type of value, (of the child of the PRINT_ITEM,
             //which is what is going to be printed
             if(root->children[0]->type.index == TEXT){
@@ -224,9 +427,9 @@ void generate ( FILE *stream, node_t *root )
                 //Generating the instructions, pushing the argument of printf
                 //(the string), calling printf, and removing the argument from
                 //the stack (overwriting the returnvalue from printf)
-                instruction_add(PUSH, STRDUP(str_part), NULL, 0,0);
+                push_word(STRDUP(str_part), 0);
                 instruction_add(SYSCALL, STRDUP("printf"), NULL, 0,0);
-                instruction_add(POP, eax,NULL,0,0);
+                pop_word(eax, 0);
             }
             else{
                 //If the PRINT_ITEMs child isn't a string, it's an expression
@@ -239,288 +442,55 @@ void generate ( FILE *stream, node_t *root )
                 //Pushing the .INTEGER constant, which will be the second argument to printf,
                 //and cause the first argument, which is the result of the expression, and is
                 //allready on the stack to be printed as an integer
-                instruction_add(PUSH, STRDUP("$.INTEGER"), NULL, 0,0);
+                push_word(STRDUP("$.INTEGER"), 0);
                 instruction_add(SYSCALL, STRDUP("printf"), NULL,0,0);
 
                 //Poping both the arguments to printf
-                instruction_add(POP, eax, NULL, 0,0);
-                instruction_add(POP, eax, NULL, 0,0);
-            }
-
-
-            break;
-
-        case EXPRESSION:
-            /*
-             * Expressions:
-             * Handle any nested expressions first, then deal with the
-             * top of the stack according to the kind of expression
-             * (single variables/integers handled in separate switch/cases)
-             */
-
-
-            switch (root->n_children){
-                case 1:
-                    //One child, and some data, this is the -exp expression
-                    if(root->data != NULL){
-                        //Computing the exp part of -exp, the result is placed on the top of the stack
-                        RECUR();
-
-                        //Negating the exp by computing 0 - exp
-                        instruction_add(POP, ebx, NULL, 0,0);
-                        instruction_add(MOVE, STRDUP("$0"), eax, 0,0);
-                        instruction_add(SUB, ebx, eax, 0,0);
-
-                        //Pushing the result on the stack
-                        instruction_add(PUSH, eax, NULL, 0,0);
-                    }
-                    else{
-                        //One child, and no data, this is variables
-                        //They are handeled later
-                        RECUR();
-                    }
-                    break;
-
-                case 2:
-                    //Two children and no data, a function (call, not defenition)
-                    if(*(char*)(root->data) == 'F'){
-                        //Generate the code for the second child, the arguments, this will place them on the stack
-                        generate(stream, root->children[1]);
-
-                        //The call instruction
-                        instruction_add(CALL, STRDUP(root->children[0]->entry->label), NULL, 0,0);
-
-                        //Removing the arguments, changing the stack pointer directly, rather than poping
-                        //since the arguments aren't needed
-                        if(root->children[1] != NULL){
-                          for(int c = 0; c < root->children[1]->n_children; c++){
-                            instruction_add(ADD, STRDUP("$4"), esp, 0,0);
-                          }
-                        }
-
-                        //Pushing the returnvalue from the function on the stack
-                        instruction_add(PUSH, eax, NULL, 0, 0);
-                        break;
-                    }
-
-
-                    //Two children and data, this is the arithmetic expressions
-                    //The two children are evaluated first, which places their values
-                    //at the top of the stack. More precisely, the result of the second
-                    //subexpression will be placed at the top of the stack, the result of
-                    //the first on the position below it
-                    RECUR();
-                    if(strlen((char*)root->data) == 1){
-                        switch (*(char*)root->data){
-
-                            // Addition and subtraction is handeled equally
-                            // The arguments are placed in the eax and ebx registers
-                            // they are added/subtracted, and the result is pushed on the stack
-                            case '+':
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(ADD, ebx, eax, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                            case '-':
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(SUB, ebx, eax, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-
-                                //With multiplication/division it's also necessary to sign extend the
-                                //arguments, using the CLTD instruction, the MUL/DIV instructions only need
-                                //one argument, the other one is eax
-                            case '*':
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(CLTD, NULL, NULL, 0,0);
-                                instruction_add(MUL, ebx, NULL, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                            case '/':
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(CLTD, NULL, NULL, 0,0);
-                                instruction_add(DIV, ebx, NULL, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                            case '>':
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(CMP, ebx, eax, 0,0);
-                                instruction_add(SETG, al, NULL, 0,0);
-                                instruction_add(CBW, NULL, NULL, 0,0);
-                                instruction_add(CWDE, NULL, NULL, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                            case '<':
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(CMP, ebx, eax, 0,0);
-                                instruction_add(SETL, al, NULL, 0,0);
-                                instruction_add(CBW, NULL, NULL, 0,0);
-                                instruction_add(CWDE, NULL, NULL, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                        }
-
-                    }
-                    else{
-                        switch (*(char*)root->data){
-                            case '>':
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(CMP, ebx, eax, 0,0);
-                                instruction_add(SETGE, al, NULL, 0,0);
-                                instruction_add(CBW, NULL, NULL, 0,0);
-                                instruction_add(CWDE, NULL, NULL, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                            case '<':
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(CMP, ebx, eax, 0,0);
-                                instruction_add(SETLE, al, NULL, 0,0);
-                                instruction_add(CBW, NULL, NULL, 0,0);
-                                instruction_add(CWDE, NULL, NULL, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                            case '=':
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(CMP, ebx, eax, 0,0);
-                                instruction_add(SETE, al, NULL, 0,0);
-                                instruction_add(CBW, NULL, NULL, 0,0);
-                                instruction_add(CWDE, NULL, NULL, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                            case '!':
-                                instruction_add(POP, ebx, NULL, 0,0);
-                                instruction_add(POP, eax, NULL, 0,0);
-                                instruction_add(CMP, ebx, eax, 0,0);
-                                instruction_add(SETNE, al, NULL, 0,0);
-                                instruction_add(CBW, NULL, NULL, 0,0);
-                                instruction_add(CWDE, NULL, NULL, 0,0);
-                                instruction_add(PUSH, eax, NULL, 0,0);
-                                break;
-                        }
-                    }
-            }
-
-
-            break;
-
-        case VARIABLE:
-            /*
-             * Occurrences of variables: (declarations have their own case)
-             * - Find the variable's stack offset
-             * - If var is not local, unwind the stack to its correct base
-             */
-
-            //Finding the scope of the variable. If the difference is 0, it is
-            //defined in this scope, if it is 1, the previous one and so on
-            depth_difference = depth - root->entry->depth;
-
-            //The offset of the variable is relative to its ebp. The current ebp is saved
-            //on the stack, and the needed one retrived
-            instruction_add(PUSH, ebp, NULL, 0,0);
-
-            //The ebp points to the previous ebp, which points to the ebp before it and so on.
-            //The ideal instruction to use would be 'movl (%ebp) %ebp', but that can't be done
-            //with this framework. Rather than changing the framework, the following hack is used:
-            //
-            //The constant 4 and the contents of ebp is added and placed in eax, then the
-            //the value pointed to by eax with an offset of -4, that is -4(%eax), is placed in ebp
-            //since eax is ebp + 4, -4(%eax) is really (%ebp)
-            for(int c = 0; c < depth_difference; c++){
-                instruction_add(MOVE, STRDUP("$4"), eax, 0,0);
-                instruction_add(ADD, ebp, eax, 0,0);
-                instruction_add(MOVE, eax, ebp, -4,0);
+                pop_word(eax, 0);
+                pop_word(eax, 0);
             }
 
-            //The offset of the vaiable (from its ebp)
-            int32_t offset = root->entry->stack_offset;
-
-            //The value of the variable is placed in eax, the right ebp is used, because of 
-            //the system above
-            instruction_add(MOVE, ebp, eax, offset, 0);
-
-            //The current ebp is restored
-            instruction_add(POP, ebp, NULL, 0,0);
-
-            //The value of the variable is placed on the stack (since it's a kind of expression)
-            instruction_add(PUSH, eax, NULL, 0,0);
 
             break;
 
-        case INTEGER:
+        case EXPRESSION: case VARIABLE: case INTEGER:
             /*
-             * Integers: constants which can just be put on stack
+             * Expressions, occurrences of variables and integers in value
+             * context (print items and arguments):
+             * The instruction selector computes the value, which is left on
+             * the top of the stack
              */
-
-            //We can't have a label followed by a declaration, so this is needed...
-            elegant_solution = 0;
-
-            //The value of the integer is fetched and converted to a string
-            char temp1[10]; //ints are 4 bytes, so this is enough
-            int32_t t = *((int32_t*)root->data);
-            sprintf(temp1, "%d", t);
-            char temp2[11] = "$";
-            strcat(temp2, temp1);
-
-            //The value is pushed on the stack
-            instruction_add(PUSH, STRDUP(temp2), NULL, 0,0);
+            generate_value(stream, root);
             break;
 
         case ASSIGNMENT_STATEMENT:
             /*
              * Assignments:
-             * Right hand side is an expression, find left hand side on stack
-             * (unwinding if necessary)
+             * Right hand side is an expression, left hand side is a slot in
+             * the function's activation record
              */
-
-            //Generating the code for the expression part of the assingment. The result is
-            //placed on the top of the stack
-            generate(stream, root->children[1]);
-
-            //Using same scheme as above
-            depth_difference = depth - root->children[0]->entry->depth;
-
-            instruction_add(PUSH, ebp, NULL, 0,0);
-            for(int c = 0; c < depth_difference; c++){
-                instruction_add(MOVE, STRDUP("$4"), eax, 0,0);
-                instruction_add(ADD, ebp, eax, 0,0);
-                instruction_add(MOVE, eax, ebp, -4,0);
-            }
-
-            int32_t offset_2 = root->children[0]->entry->stack_offset;
-
-            //Putting the current ebp in ebx
-            instruction_add(POP, ebx, NULL, 0,0);
-
-            //Putting the result of the expression in eax
-            instruction_add(POP, eax, NULL, 0,0);
-
-            //Putting the result of the expression in the variable (ebp is the ebp of the variable)
-            instruction_add(MOVE, eax, ebp, 0, offset_2);
-
-            //Restoring the current ebp
-            instruction_add(MOVE, ebx, ebp, 0, 0);
+            generate_store(stream, root->children[0], root->children[1]);
             break;
 
         case RETURN_STATEMENT:
             /*
              * Return statements:
              * Evaluate the expression and put it in EAX
+             * Calls in tail position reuse the current activation record
              */
-            RECUR();
-            instruction_add(POP, eax, NULL, 0,0);
+            if (generate_tail_call(stream, root->children[0])) {
+                break;
+            }
+
+            generate_expression(stream, root->children[0]);
 
-            for ( int u=0; u<depth-1; u++ ){
-                instruction_add ( LEAVE, NULL, NULL, 0, 0 );
+            if (current_memo >= 0) {
+                string_buffer = malloc(sizeof(*string_buffer) * 24);
+                sprintf(string_buffer, "MEMOSTORE%d", current_memo);
+                instruction_add(JUMP, string_buffer, NULL, 0, 0);
+                break;
             }
+            instruction_add ( LEAVE, NULL, NULL, 0, 0 );
             instruction_add ( RET, eax, NULL, 0, 0 );
 
             break;
@@ -528,22 +498,20 @@ void generate ( FILE *stream, node_t *root )
         case WHILE_STATEMENT:
             /* Start-label for the while statement. */
             current_label_index = label_index++;
+            if (pass_enabled(PASS_LOOP_ROTATION)) {
+                generate_rotated_while(stream, root, current_label_index);
+                break;
+            }
             string_buffer = malloc(sizeof(*string_buffer) * 17);
             sprintf(string_buffer, "WHILE%d:", current_label_index);
 
             instruction_add(STRING, string_buffer, NULL, 0, 0);
 
-            /* Evaulate the expression and compare it to 0. */
-            generate(stream, root->children[0]);
-
-            /* Jump out of the loop if the expression evaluated to 0. */
-            instruction_add(POP, eax, NULL, 0, 0);
-            instruction_add(CMPZERO, eax, NULL, 0, 0);
-
+            /* Jump out of the loop if the expression evaluates to 0. */
             string_buffer = malloc(sizeof(*string_buffer) * 19);
             sprintf(string_buffer, "WHLIEEND%d", current_label_index);
 
-            instruction_add(JUMPZERO, string_buffer, NULL, 0, 0);
+            generate_condition(stream, root->children[0], string_buffer);
 
             /* Execute the loop body. */
             generate(stream, root->children[1]);
@@ -565,6 +533,10 @@ void generate ( FILE *stream, node_t *root )
             current_label_index = label_index++;
             /* Initialise the loop variable. */
             generate(stream, root->children[0]);
+            if (pass_enabled(PASS_LOOP_ROTATION)) {
+                generate_rotated_for(stream, root, current_label_index);
+                break;
+            }
 
             /* Start-label for the for-loop. */
             string_buffer = malloc(sizeof(*string_buffer) * 20);
@@ -573,43 +545,21 @@ void generate ( FILE *stream, node_t *root )
             instruction_add(STRING, string_buffer, NULL, 0, 0);
 
             /*
-             * Push both the variable and the end result on the stack for
-             * comparison.
+             * Exit the loop when the variable equals the end value, which is
+             * the branch generated for the condition 'variable != end'.
              */
-            generate(stream, root->children[0]->children[0]);
-            generate(stream, root->children[1]);
-
-            instruction_add(POP, eax, NULL, 0, 0);
-            instruction_add(POP, ebx, NULL, 0, 0);
-            instruction_add(CMP, eax, ebx, 0, 0);
-
-            /* Exit the loop if both are equal. */
             string_buffer = malloc(sizeof(*string_buffer) * 17);
             sprintf(string_buffer, "FOREND%d", current_label_index);
-            instruction_add(JUMPEQ, string_buffer, NULL, 0, 0);
+
+            node_t *for_operands[2] = { root->children[0]->children[0], root->children[1] };
+            node_t for_condition = { expression_n, "!=", NULL, 2, for_operands };
+            generate_condition(stream, &for_condition, string_buffer);
 
             /* Execute loop body. */
             generate(stream, root->children[2]);
 
-            /*
-             * Find the variable and increase it's value by one. Code copied
-             * from the VARIABLE case. Comments and extra empty lines removed to
-             * preserve space.
-             */
-            depth_difference = depth - root->children[0]->children[0]->entry->depth;
-            instruction_add(PUSH, ebp, NULL, 0,0);
-            for(int c = 0; c < depth_difference; c++){
-                instruction_add(MOVE, STRDUP("$4"), eax, 0,0);
-                instruction_add(ADD, ebp, eax, 0,0);
-                instruction_add(MOVE, eax, ebp, -4,0);
-            }
-            int32_t offset2 = root->children[0]->children[0]->entry->stack_offset;
-            /* Add one to the memory location. */
-            instruction_add(ADD, STRDUP("$1"), ebp, 0, offset2);
-            instruction_add(POP, ebp, NULL, 0,0);
-            /*
-             * End of copied section.
-             */
+            /* Increase the variable by one, in memory. */
+            instruction_add(ADD, STRDUP("$1"), fp, 0, variable_offset(root->children[0]->children[0]->entry));
 
             /* Jump to the start of the loop. */
             string_buffer = malloc(sizeof(*string_buffer) * 19);
@@ -626,22 +576,25 @@ void generate ( FILE *stream, node_t *root )
             break;
 
         case IF_STATEMENT:
+            /* Assignments of one of two values without branching */
+            if (generate_conditional_move(stream, root)) {
+                break;
+            }
             current_label_index = label_index++;
 
-            /* Evaluate the if-expression, and compare it to 0. */
-            generate(stream, root->children[0]);
-
-            instruction_add(POP, eax, NULL, 0, 0);
-            instruction_add(CMPZERO, eax, NULL, 0, 0);
+            /* Chains of comparisons of a variable with constants */
+            if (generate_switch(stream, root, current_label_index)) {
+                break;
+            }
 
             /*
-             * Jump to the end of the if-block if the expression evaluated to
-             * 0.
+             * Evaluate the if-expression, and jump to the end of the if-block
+             * if it evaluates to 0.
              */
             string_buffer = malloc(sizeof(*string_buffer) * 16);
             sprintf(string_buffer, "IFEND%d", current_label_index);
 
-            instruction_add(JUMPZERO, string_buffer, NULL, 0, 0);
+            generate_condition(stream, root->children[0], string_buffer);
 
             /* The if body. */
             generate(stream, root->children[1]);
@@ -688,98 +641,1733 @@ void generate ( FILE *stream, node_t *root )
 }
 
 
-/* Provided auxiliaries... */
+/*
+ * Instruction selection for expressions.
+ *
+ * A bottom-up labelling pass finds the cheapest way to compute every subtree
+ * as one of the nonterminals below, by matching the rules of a small tree
+ * grammar for x86 (BURS style dynamic programming). A top-down reduction
+ * then emits the instructions of the chosen rules. Integers and variables
+ * are not computed at all, they are used directly as immediate and memory
+ * operands of the instruction that consumes them.
+ *
+ * Costs are rough cycle counts, so strength reduced multiplications and
+ * divisions win over imull/idivl.
+ */
+typedef enum { NT_REG, NT_IMM, NT_MEM, N_NONTERMINALS } nonterminal_t;
+
+typedef enum {
+    NO_RULE,
+    IMM_INTEGER,        /* imm: INTEGER                                  */
+    MEM_VARIABLE,       /* mem: VARIABLE                                 */
+    REG_IMM,            /* reg: imm             movl $c,%eax             */
+    REG_MEM,            /* reg: mem             movl off(%ebp),%eax      */
+    REG_CALL,           /* reg: F(args)         push args, call          */
+    REG_NEGATE,         /* reg: -(reg)          negl %eax                */
+    REG_OP_REG_LEAF,    /* reg: op(reg,imm|mem) op  operand,%eax         */
+    REG_OP_LEAF_REG,    /* reg: op(imm|mem,reg) swapped operands         */
+    REG_OP_REG_REG,     /* reg: op(reg,reg)     left is saved on stack   */
+    REG_INCREMENT,      /* reg: +(reg,1)        incl %eax / decl %eax    */
+    REG_MUL_CONSTANT,   /* reg: *(reg,imm)      shifts and lea           */
+    REG_DIV_CONSTANT    /* reg: /(reg,imm)      shifts or magic multiply */
+} rule_t;
+
+typedef struct label {
+    int32_t cost[N_NONTERMINALS];
+    rule_t rule[N_NONTERMINALS];
+    struct label **children;
+    uint32_t n_children;
+} label_t;
+
+static void push_value ( FILE *stream, node_t *root, label_t *label );
+static void reduce_operands ( FILE *stream, node_t *left, label_t *left_label,
+    node_t *right, label_t *right_label );
+static void generate_call ( FILE *stream, node_t *root, label_t *label );
+
+#define INFINITE_COST (INT32_MAX / 4)
+#define COST_ALU 1
+#define COST_MEMORY 1
+#define COST_MUL 3
+#define COST_DIV 25
+#define COST_CALL 5
+#define COST_CMOV 1
+#define COST_BRANCH 1
+#define COST_MISPREDICT 16
+
+/*
+ * Relational operators: set/jump opcodes, the ones for swapped operands, and
+ * the conditional move made when the relation holds
+ */
+typedef struct {
+    char *op;
+    opcode_t set, jump_false, swapped_set, swapped_jump_false, move;
+} relation_t;
+
+static const relation_t relations[] = {
+    { ">",  SETG,  JUMPLE, SETL,  JUMPGE, CMOVG  },
+    { "<",  SETL,  JUMPGE, SETG,  JUMPLE, CMOVL  },
+    { ">=", SETGE, JUMPL,  SETLE, JUMPG,  CMOVGE },
+    { "<=", SETLE, JUMPG,  SETGE, JUMPL,  CMOVLE },
+    { "==", SETE,  JUMPNE, SETE,  JUMPNE, CMOVE  },
+    { "!=", SETNE, JUMPEQ, SETNE, JUMPEQ, CMOVNE }
+};
+
+
+/* The relational operator of an expression, NULL for anything else */
+    static const relation_t *
+relation ( node_t *root )
+{
+    if (root->type.index != EXPRESSION || root->n_children != 2 || root->data == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < sizeof(relations) / sizeof(relations[0]); i++) {
+        if (strcmp(relations[i].op, root->data) == 0) {
+            return &relations[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Heap-allocated immediate operand string for a constant */
+    static char *
+immediate ( int32_t value )
+{
+    char *operand = malloc(sizeof(*operand) * 13);
+    sprintf(operand, "$%d", value);
+    return operand;
+}
+
+
+/* Index of the set bit if value is a power of two, -1 otherwise */
+    static int32_t
+power_of_two ( uint32_t value )
+{
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return -1;
+    }
+
+    int32_t k = 0;
+    while ((value >> k) != 1) {
+        k++;
+    }
+    return k;
+}
+
+
+/* True if node is an INTEGER with the given value */
+    static bool
+is_integer ( node_t *root, int32_t value )
+{
+    return root->type.index == INTEGER && *(int32_t *) root->data == value;
+}
+
+
+/*
+ * Multiply eax by a constant with shifts and lea (scale 2, 4 and 8 give
+ * factors 3, 5 and 9) where the factor allows it, imull with an immediate
+ * otherwise. Negative factors multiply by the magnitude and negate. Returns
+ * the cost of the sequence, instructions are only emitted if emit is set.
+ */
+    static int32_t
+multiply_constant ( int32_t factor, bool emit )
+{
+    uint32_t magnitude = (factor < 0) ? -(uint32_t) factor : (uint32_t) factor;
+    int32_t k = power_of_two(magnitude), cost = 0, scale = 0;
+
+    if (magnitude == 0) {
+        if (emit) {
+            instruction_add(MOVE, STRDUP("$0"), eax, 0, 0);
+        }
+        return COST_ALU;
+    } else if (k >= 0) {
+        if (k > 0) {
+            cost += COST_ALU;
+            if (emit) {
+                instruction_add(SHL, immediate(k), eax, 0, 0);
+            }
+        }
+    } else if (magnitude % 3 == 0 && power_of_two(magnitude / 3) >= 0) {
+        scale = 2;
+        k = power_of_two(magnitude / 3);
+    } else if (magnitude % 5 == 0 && power_of_two(magnitude / 5) >= 0) {
+        scale = 4;
+        k = power_of_two(magnitude / 5);
+    } else if (magnitude % 9 == 0 && power_of_two(magnitude / 9) >= 0) {
+        scale = 8;
+        k = power_of_two(magnitude / 9);
+    } else if (power_of_two(magnitude - 1) >= 0 || power_of_two(magnitude + 1) >= 0) {
+        /* 2^k + 1 and 2^k - 1 */
+        bool plus = power_of_two(magnitude - 1) >= 0;
+        cost += 3 * COST_ALU;
+        if (emit) {
+            instruction_add(MOVE, eax, scratch, 0, 0);
+            instruction_add(SHL, immediate(power_of_two(plus ? magnitude - 1 : magnitude + 1)), eax, 0, 0);
+            instruction_add(plus ? ADD : SUB, scratch, eax, 0, 0);
+        }
+    } else {
+        if (emit) {
+            instruction_add(MULI, immediate(factor), eax, 0, 0);
+        }
+        return COST_MUL;
+    }
+
+    if (scale != 0) {
+        cost += COST_ALU;
+        if (emit) {
+            char *scaled = malloc(sizeof(*scaled) * 16);
+            sprintf(scaled, "(%s,%s,%d)", word_register(eax), word_register(eax), scale);
+            instruction_add(LEA, scaled, eax, 0, 0);
+        }
+        if (k > 0) {
+            cost += COST_ALU;
+            if (emit) {
+                instruction_add(SHL, immediate(k), eax, 0, 0);
+            }
+        }
+    }
+
+    if (factor < 0) {
+        cost += COST_ALU;
+        if (emit) {
+            instruction_add(NEG, eax, NULL, 0, 0);
+        }
+    }
+    return cost;
+}
+
+
+/*
+ * Divide eax by a constant (other than 0 and -1), rounding towards zero like idivl.
+ * Powers of two are shifted after adding 2^k-1 to negative dividends, other
+ * divisors multiply by a magic number and keep the high half of the product
+ * (see Warren, "Hacker's Delight", chapter 10). Returns the cost of the
+ * sequence, instructions are only emitted if emit is set.
+ */
+    static int32_t
+divide_constant ( int32_t divisor, bool emit )
+{
+    uint32_t magnitude = (divisor < 0) ? -(uint32_t) divisor : (uint32_t) divisor;
+    int32_t k = power_of_two(magnitude), cost = 0;
+
+    if (k >= 0) {
+        if (k > 0) {
+            /* edx is all ones for negative dividends, the shift leaves 2^k-1 */
+            cost += 4 * COST_ALU;
+            if (emit) {
+                instruction_add(CLTD, NULL, NULL, 0, 0);
+                instruction_add(SHR, immediate(32 - k), edx, 0, 0);
+                instruction_add(ADD, edx, eax, 0, 0);
+                instruction_add(SAR, immediate(k), eax, 0, 0);
+            }
+        }
+        if (divisor < 0) {
+            cost += COST_ALU;
+            if (emit) {
+                instruction_add(NEG, eax, NULL, 0, 0);
+            }
+        }
+        return cost;
+    }
+
+    /* Find the magic number and shift amount */
+    const uint32_t two31 = 0x80000000;
+    uint32_t t = two31 + ((uint32_t) divisor >> 31);
+    uint32_t anc = t - 1 - t % magnitude;
+    uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+    uint32_t q2 = two31 / magnitude, r2 = two31 - q2 * magnitude;
+    uint32_t delta;
+    int32_t p = 31, magic, shift;
+    do {
+        p++;
+        q1 = 2 * q1; r1 = 2 * r1;
+        if (r1 >= anc) { q1++; r1 -= anc; }
+        q2 = 2 * q2; r2 = 2 * r2;
+        if (r2 >= magnitude) { q2++; r2 -= magnitude; }
+        delta = magnitude - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    magic = (int32_t) (q2 + 1);
+    if (divisor < 0) {
+        magic = -magic;
+    }
+    shift = p - 32;
+
+    cost = COST_MUL + 7 * COST_ALU;
+    if (!emit) {
+        return cost;
+    }
+
+    /* edx := high half of magic * n, corrected and shifted */
+    instruction_add(MOVE, eax, ecx, 0, 0);
+    instruction_add(MOVE, immediate(magic), eax, 0, 0);
+    instruction_add(MUL, ecx, NULL, 0, 0);
+    if (divisor > 0 && magic < 0) {
+        instruction_add(ADD, ecx, edx, 0, 0);
+    } else if (divisor < 0 && magic > 0) {
+        instruction_add(SUB, ecx, edx, 0, 0);
+    }
+    if (shift > 0) {
+        instruction_add(SAR, immediate(shift), edx, 0, 0);
+    }
+
+    /* Add one to negative quotients */
+    instruction_add(MOVE, edx, eax, 0, 0);
+    instruction_add(SHR, STRDUP("$31"), eax, 0, 0);
+    instruction_add(ADD, edx, eax, 0, 0);
+    return cost;
+}
+
+
+/* Cost of applying a binary operator to eax and an operand */
+    static int32_t
+operation_cost ( char *op )
+{
+    switch (*op) {
+        case '*': return COST_MUL;
+        case '/': return COST_ALU + COST_DIV;
+        case '+': case '-': return COST_ALU;
+        default: return 3 * COST_ALU;   /* Relational: cmpl, setX, movzbl */
+    }
+}
 
 
+/* Record a rule for a nonterminal if it is cheaper than what we have */
     static void
-instruction_append ( instruction_t *next )
+match ( label_t *label, nonterminal_t nonterminal, rule_t rule, int32_t cost )
 {
-    if ( start != NULL )
-    {
-        last->next = next;
-        last = next;
+    if (cost < label->cost[nonterminal]) {
+        label->cost[nonterminal] = cost;
+        label->rule[nonterminal] = rule;
     }
-    else
-        start = last = next;
+}
+
+
+/* Cost of using a subtree directly as an immediate or memory operand */
+    static int32_t
+leaf_cost ( label_t *label )
+{
+    return (label->cost[NT_IMM] < label->cost[NT_MEM]) ? label->cost[NT_IMM] : label->cost[NT_MEM];
+}
+
+
+/* Bottom-up labelling pass: cheapest rule for every nonterminal */
+    static label_t *
+label_tree ( node_t *root )
+{
+    if (root == NULL) {
+        return NULL;
+    }
+
+    label_t *label = malloc(sizeof(*label));
+    label->n_children = root->n_children;
+    label->children = malloc(sizeof(*label->children) * (root->n_children + 1));
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        label->children[i] = label_tree(root->children[i]);
+    }
+    for (int32_t nt = 0; nt < N_NONTERMINALS; nt++) {
+        label->cost[nt] = INFINITE_COST;
+        label->rule[nt] = NO_RULE;
+    }
+
+    char *op = (char *) root->data;
+    label_t **kids = label->children;
+
+    if (root->type.index == INTEGER) {
+        match(label, NT_IMM, IMM_INTEGER, 0);
+    } else if (root->type.index == VARIABLE) {
+        match(label, NT_MEM, MEM_VARIABLE, 0);
+    } else if (root->type.index == EXPRESSION && root->n_children == 1 && op != NULL) {
+        match(label, NT_REG, REG_NEGATE, kids[0]->cost[NT_REG] + COST_ALU);
+    } else if (root->type.index == EXPRESSION && root->n_children == 2 && *op == 'F') {
+        int32_t cost = COST_CALL + COST_ALU;
+        if (kids[1] != NULL) {
+            for (uint32_t i = 0; i < kids[1]->n_children; i++) {
+                label_t *argument = kids[1]->children[i];
+                int32_t leaf = leaf_cost(argument);
+                cost += COST_MEMORY + ((leaf < argument->cost[NT_REG]) ? leaf : argument->cost[NT_REG]);
+            }
+        }
+        match(label, NT_REG, REG_CALL, cost);
+    } else if (root->type.index == EXPRESSION && root->n_children == 2) {
+        node_t *left = root->children[0], *right = root->children[1];
+        int32_t left_reg = kids[0]->cost[NT_REG], right_reg = kids[1]->cost[NT_REG];
+        bool reduce = pass_enabled(PASS_STRENGTH_REDUCTION);
+
+        if ((*op == '+' && (is_integer(right, 1) || is_integer(right, -1)))
+            || (strcmp(op, "-") == 0 && (is_integer(right, 1) || is_integer(right, -1)))) {
+            match(label, NT_REG, REG_INCREMENT, left_reg + COST_ALU);
+        } else if (*op == '+' && (is_integer(left, 1) || is_integer(left, -1))) {
+            match(label, NT_REG, REG_INCREMENT, right_reg + COST_ALU);
+        }
+
+        if (reduce && *op == '*' && right->type.index == INTEGER) {
+            match(label, NT_REG, REG_MUL_CONSTANT,
+                left_reg + multiply_constant(*(int32_t *) right->data, false));
+        } else if (reduce && *op == '*' && left->type.index == INTEGER) {
+            match(label, NT_REG, REG_MUL_CONSTANT,
+                right_reg + multiply_constant(*(int32_t *) left->data, false));
+        }
+
+        /* -1 keeps the idivl, which traps on INT_MIN / -1 like every other backend */
+        if (reduce && *op == '/' && right->type.index == INTEGER && *(int32_t *) right->data != 0
+            && *(int32_t *) right->data != -1) {
+            match(label, NT_REG, REG_DIV_CONSTANT,
+                left_reg + divide_constant(*(int32_t *) right->data, false));
+        }
+
+        /* Immediate divisors need a register */
+        match(label, NT_REG, REG_OP_REG_LEAF, left_reg + leaf_cost(kids[1]) + operation_cost(op)
+            + ((*op == '/' && right->type.index == INTEGER) ? COST_ALU : 0));
+
+        /* Swapped operands: '-' negates first, '/' moves both operands */
+        match(label, NT_REG, REG_OP_LEAF_REG, right_reg + leaf_cost(kids[0]) + operation_cost(op)
+            + ((strcmp(op, "-") == 0) ? COST_ALU : 0) + ((*op == '/') ? 2 * COST_ALU : 0));
+
+        match(label, NT_REG, REG_OP_REG_REG,
+            left_reg + right_reg + 2 * COST_MEMORY + COST_ALU + operation_cost(op));
+    }
+
+    /* Chain rules: any leaf can be loaded into a register */
+    match(label, NT_REG, REG_IMM, label->cost[NT_IMM] + COST_ALU);
+    match(label, NT_REG, REG_MEM, label->cost[NT_MEM] + COST_MEMORY);
+
+    return label;
 }
 
 
     static void
-instruction_add (
-        opcode_t op, char *arg1, char *arg2, int32_t off1, int32_t off2 
-        )
+label_finalize ( label_t *label )
 {
-    instruction_t *i = (instruction_t *) malloc ( sizeof(instruction_t) );
-    *i = (instruction_t) { op, {arg1, arg2}, {off1, off2}, NULL };
-    instruction_append ( i );
+    if (label != NULL) {
+        for (uint32_t i = 0; i < label->n_children; i++) {
+            label_finalize(label->children[i]);
+        }
+        free(label->children);
+        free(label);
+    }
 }
 
 
+/*
+ * The operand of an immediate or memory leaf. Immediates are fresh heap
+ * strings, memory operands are an offset from ebp.
+ */
     static void
-instructions_print ( FILE *stream )
+leaf_operand ( node_t *root, label_t *label, char **operand, int32_t *offset )
 {
-    instruction_t *this = start;
-    while ( this != NULL )
-    {
-        switch ( this->opcode )
-        {
-            case PUSH:
-                if ( this->offsets[0] == 0 )
-                    fprintf ( stream, "\tpushl\t%s\n", this->operands[0] );
-                else
-                    fprintf ( stream, "\tpushl\t%d(%s)\n",
-                            this->offsets[0], this->operands[0]
+    if (label->cost[NT_IMM] <= label->cost[NT_MEM]) {
+        *operand = immediate(*(int32_t *) root->data);
+        *offset = 0;
+    } else {
+        *operand = fp;
+        *offset = variable_offset(root->entry);
+    }
+}
+
+
+/*
+ * Apply a binary operator to eax and an operand. With swapped set, eax holds
+ * the right operand and the operand is the left one.
+ */
+    static void
+emit_operation ( char *op, char *operand, int32_t offset, bool swapped )
+{
+    const relation_t *relational = NULL;
+
+    for (uint32_t i = 0; i < sizeof(relations) / sizeof(relations[0]); i++) {
+        if (strcmp(relations[i].op, op) == 0) {
+            relational = &relations[i];
+        }
+    }
+
+    if (relational != NULL) {
+        instruction_add(CMP, operand, eax, offset, 0);
+        instruction_add(swapped ? relational->swapped_set : relational->set, al, NULL, 0, 0);
+        instruction_add(MOVZBL, al, eax, 0, 0);
+        return;
+    }
+
+    switch (*op) {
+        case '+':
+            instruction_add(ADD, operand, eax, offset, 0);
+            break;
+        case '*':
+            instruction_add(MULI, operand, eax, offset, 0);
+            break;
+        case '-':
+            if (swapped) {
+                instruction_add(NEG, eax, NULL, 0, 0);
+                instruction_add(ADD, operand, eax, offset, 0);
+            } else {
+                instruction_add(SUB, operand, eax, offset, 0);
+            }
+            break;
+        case '/':
+            if (swapped) {
+                instruction_add(MOVE, eax, scratch, 0, 0);
+                instruction_add(MOVE, operand, eax, offset, 0);
+                operand = scratch;
+                offset = 0;
+            } else if (*operand == '$') {
+                instruction_add(MOVE, operand, scratch, 0, 0);
+                operand = scratch;
+            }
+            instruction_add(CLTD, NULL, NULL, 0, 0);
+            instruction_add(DIV, operand, NULL, offset, 0);
+            break;
+    }
+}
+
+
+/* Top-down reduction: emit the rule chosen for an expression to end in eax */
+    static void
+reduce_expression ( FILE *stream, node_t *root, label_t *label )
+{
+    char *operand;
+    int32_t offset;
+    node_t **children = root->children;
+    label_t **kids = label->children;
+
+    switch (label->rule[NT_REG]) {
+        case REG_IMM: case REG_MEM:
+            leaf_operand(root, label, &operand, &offset);
+            instruction_add(MOVE, operand, eax, offset, 0);
+            break;
+
+        case REG_NEGATE:
+            reduce_expression(stream, children[0], kids[0]);
+            instruction_add(NEG, eax, NULL, 0, 0);
+            break;
+
+        case REG_CALL:
+            generate_call(stream, root, label);
+            break;
+
+        case REG_OP_REG_LEAF:
+            reduce_expression(stream, children[0], kids[0]);
+            leaf_operand(children[1], kids[1], &operand, &offset);
+            emit_operation(root->data, operand, offset, false);
+            break;
+
+        case REG_OP_LEAF_REG:
+            reduce_expression(stream, children[1], kids[1]);
+            leaf_operand(children[0], kids[0], &operand, &offset);
+            emit_operation(root->data, operand, offset, true);
+            break;
+
+        case REG_OP_REG_REG:
+            reduce_operands(stream, children[0], kids[0], children[1], kids[1]);
+            emit_operation(root->data, scratch, 0, false);
+            break;
+
+        case REG_INCREMENT:
+            if (is_integer(children[1], 1) || is_integer(children[1], -1)) {
+                reduce_expression(stream, children[0], kids[0]);
+                bool up = (*(char *) root->data == '+') == is_integer(children[1], 1);
+                instruction_add(up ? INC : DEC, eax, NULL, 0, 0);
+            } else {
+                reduce_expression(stream, children[1], kids[1]);
+                instruction_add(is_integer(children[0], 1) ? INC : DEC, eax, NULL, 0, 0);
+            }
+            break;
+
+        case REG_MUL_CONSTANT:
+            pass_count(PASS_STRENGTH_REDUCTION, 1);
+            if (children[1]->type.index == INTEGER) {
+                reduce_expression(stream, children[0], kids[0]);
+                multiply_constant(*(int32_t *) children[1]->data, true);
+            } else {
+                reduce_expression(stream, children[1], kids[1]);
+                multiply_constant(*(int32_t *) children[0]->data, true);
+            }
+            break;
+
+        case REG_DIV_CONSTANT:
+            pass_count(PASS_STRENGTH_REDUCTION, 1);
+            reduce_expression(stream, children[0], kids[0]);
+            divide_constant(*(int32_t *) children[1]->data, true);
+            break;
+
+        default:
+            fprintf(stderr, "No instruction selected for %s\n", root->type.text);
+            break;
+    }
+}
+
+
+/* Push the value of an expression, leaves are pushed directly */
+    static void
+push_value ( FILE *stream, node_t *root, label_t *label )
+{
+    char *operand;
+    int32_t offset;
+
+    if (leaf_cost(label) < label->cost[NT_REG]) {
+        leaf_operand(root, label, &operand, &offset);
+        push_word(operand, offset);
+    } else {
+        reduce_expression(stream, root, label);
+        push_word(eax, 0);
+    }
+}
+
+
+/*
+ * Compute the operands of a binary operation, the left one into eax and the
+ * right one into the scratch register. The left operand is saved on the
+ * stack while the right one is computed, or on x86-64 in a spare register
+ * when no call in the right operand can overwrite it.
+ */
+    static void
+reduce_operands ( FILE *stream, node_t *left, label_t *left_label,
+    node_t *right, label_t *right_label )
+{
+    static int32_t saved_registers = 0;
+    char *spare[] = { r8d, r9d, r10d, esi, edi };
+
+    reduce_expression(stream, left, left_label);
+
+    if (target == TARGET_X86_64 && saved_registers < 5 && !expression_has_call(right)) {
+        char *saved = spare[saved_registers++];
+        instruction_add(MOVE, eax, saved, 0, 0);
+        reduce_expression(stream, right, right_label);
+        instruction_add(MOVE, eax, scratch, 0, 0);
+        instruction_add(MOVE, saved, eax, 0, 0);
+        saved_registers--;
+    } else {
+        push_word(eax, 0);
+        reduce_expression(stream, right, right_label);
+        instruction_add(MOVE, eax, scratch, 0, 0);
+        pop_word(eax, 0);
+    }
+}
+
+
+/*
+ * Call a function. On x86 the arguments are pushed in order, and removed with
+ * one adjustment of the stack pointer afterwards. On x86-64 the first six
+ * are passed in registers (System V), the others are stored in stack slots
+ * reserved before any argument is evaluated, and the stack is padded to a
+ * 16 byte boundary at the call.
+ */
+    static void
+generate_call ( FILE *stream, node_t *root, label_t *label )
+{
+    node_t *arguments = root->children[1];
+    label_t **kids = (arguments == NULL) ? NULL : label->children[1]->children;
+    int32_t n_args = (arguments == NULL) ? 0 : arguments->n_children;
+    int32_t n_registers = register_parameter_count(n_args);
+    int32_t reserved = 0, pushed = 0;
+
+    if (target == TARGET_X86_64) {
+        reserved = alignment_padding(n_args - n_registers) + n_args - n_registers;
+        reserve_stack(reserved);
+    }
+
+    //Immediates and local variables are pushed directly, or loaded into
+    //their argument register after all the others are computed
+    for (int32_t i = 0; i < n_args; i++) {
+        if (i < n_registers && leaf_cost(kids[i]) < kids[i]->cost[NT_REG]) {
+            continue;
+        } else if (target == TARGET_X86 || i < n_registers) {
+            push_value(stream, arguments->children[i], kids[i]);
+            pushed++;
+        } else {
+            //The pushed register arguments are on top of the slots
+            int32_t offset = word * (pushed + i - n_registers);
+            reduce_expression(stream, arguments->children[i], kids[i]);
+            if (offset == 0) {
+                instruction_add(MOVE, eax, STRDUP("(%rsp)"), 0, 0);
+            } else {
+                instruction_add(MOVE, eax, sp, 0, offset);
+            }
+        }
+    }
+
+    for (int32_t i = n_registers - 1; i >= 0; i--) {
+        char *operand;
+        int32_t offset;
+        if (leaf_cost(kids[i]) < kids[i]->cost[NT_REG]) {
+            leaf_operand(arguments->children[i], kids[i], &operand, &offset);
+            instruction_add(MOVE, operand, argument_register(i), offset, 0);
+        } else {
+            pop_word(argument_register(i), 0);
+        }
+    }
+
+    instruction_add(CALL, STRDUP(root->children[0]->entry->label), NULL, 0,0);
+
+    //Removing the arguments with one adjustment of the stack pointer
+    release_stack((target == TARGET_X86_64) ? reserved : n_args);
+}
+
+
+/* Compute an expression into eax */
+    static void
+generate_expression ( FILE *stream, node_t *root )
+{
+    label_t *label = label_tree(root);
+    reduce_expression(stream, root, label);
+    label_finalize(label);
+}
+
+
+/* Compute an expression and leave it on the top of the stack */
+    static void
+generate_value ( FILE *stream, node_t *root )
+{
+    label_t *label = label_tree(root);
+    push_value(stream, root, label);
+    label_finalize(label);
+}
+
+
+/*
+ * Offset from the frame pointer of a parameter of a function. On x86 they
+ * are all above the return address, the last one nearest. On x86-64 the
+ * first six are stored below the frame pointer by the prologue, the others
+ * are above the return address in order.
+ */
+    static int32_t
+parameter_offset ( int32_t index, int32_t n_parameters )
+{
+    if (target == TARGET_X86_64) {
+        return (index < 6) ? -8 * (index + 1) : 16 + 8 * (index - 6);
+    }
+    return 4 + 4 * n_parameters - 4 * index;
+}
+
+
+/*
+ * Offset from the frame pointer of a variable. The locals of a block are
+ * below the parameters stored in the frame and those of the blocks
+ * enclosing it. bind_names numbers everything in 4 byte words for the x86
+ * stack convention.
+ */
+    static int32_t
+variable_offset ( symbol_t *entry )
+{
+    if (entry->stack_offset > 0) {
+        int32_t n_parameters = function_parameter_count(current_function);
+        return parameter_offset(n_parameters + 1 - entry->stack_offset / 4, n_parameters);
+    }
+    return word * (entry->stack_offset / 4 - block_base[entry->depth]);
+}
+
+
+/*
+ * Assignment to a variable. Immediates are stored
+ * directly, and 'x := x + c' / 'x := x - c' update the variable in memory.
+ */
+    static void
+generate_store ( FILE *stream, node_t *variable, node_t *value )
+{
+    int32_t offset = variable_offset(variable->entry);
+    char *op = (char *) value->data;
+
+    if (value->type.index == INTEGER) {
+        instruction_add(MOVE, immediate(*(int32_t *) value->data), fp, 0, offset);
+        return;
+    }
+
+    if (value->type.index == EXPRESSION && value->n_children == 2 && op != NULL
+        && (strcmp(op, "+") == 0 || strcmp(op, "-") == 0)) {
+        node_t *left = value->children[0], *right = value->children[1];
+
+        if (left->type.index == VARIABLE && left->entry == variable->entry
+            && right->type.index == INTEGER) {
+            instruction_add(*op == '+' ? ADD : SUB, immediate(*(int32_t *) right->data), fp, 0, offset);
+            return;
+        }
+        if (*op == '+' && right->type.index == VARIABLE && right->entry == variable->entry
+            && left->type.index == INTEGER) {
+            instruction_add(ADD, immediate(*(int32_t *) left->data), fp, 0, offset);
+            return;
+        }
+    }
+
+    generate_expression(stream, value);
+    instruction_add(MOVE, eax, fp, 0, offset);
+}
+
+
+/* The conditional jump taken exactly when the given one is not */
+    static opcode_t
+jump_negate ( opcode_t jump )
+{
+    switch (jump) {
+        case JUMPEQ: return JUMPNE;
+        case JUMPNE: return JUMPEQ;
+        case JUMPL: return JUMPGE;
+        case JUMPGE: return JUMPL;
+        case JUMPG: return JUMPLE;
+        case JUMPLE: return JUMPG;
+        case JUMPZERO: return JUMPNONZ;
+        case JUMPNONZ: return JUMPZERO;
+        default: return jump;
+    }
+}
+
+
+/*
+ * Generate a condition in branch context: jump to false_label when the
+ * expression is 0. Relational operators compare their operands directly and
+ * jump on the inverted condition, instead of materializing a boolean and
+ * testing it against 0 afterwards.
+ */
+    static void
+generate_condition ( FILE *stream, node_t *root, char *false_label )
+{
+    generate_branch(stream, root, false_label, false);
+}
+
+
+/* Jump to destination when the expression is true, or when it is 0 */
+    static void
+generate_branch ( FILE *stream, node_t *root, char *destination, bool when )
+{
+    const relation_t *relational = relation(root);
+    label_t *label = label_tree(root);
+    opcode_t jump_false = JUMPZERO;
+    char *operand;
+    int32_t offset;
+
+    if (relational != NULL) {
+        label_t *left = label->children[0], *right = label->children[1];
+        int32_t reg_leaf = left->cost[NT_REG] + leaf_cost(right);
+        int32_t leaf_reg = right->cost[NT_REG] + leaf_cost(left);
+        int32_t reg_reg = left->cost[NT_REG] + right->cost[NT_REG] + 2 * COST_MEMORY + COST_ALU;
+
+        jump_false = relational->jump_false;
+        if (reg_leaf <= leaf_reg && reg_leaf <= reg_reg) {
+            reduce_expression(stream, root->children[0], left);
+            leaf_operand(root->children[1], right, &operand, &offset);
+            instruction_add(CMP, operand, eax, offset, 0);
+        } else if (leaf_reg <= reg_reg) {
+            reduce_expression(stream, root->children[1], right);
+            leaf_operand(root->children[0], left, &operand, &offset);
+            instruction_add(CMP, operand, eax, offset, 0);
+            jump_false = relational->swapped_jump_false;
+        } else {
+            reduce_operands(stream, root->children[0], left, root->children[1], right);
+            instruction_add(CMP, scratch, eax, 0, 0);
+        }
+    } else if (label->cost[NT_MEM] == 0) {
+        /* Test a local variable in memory */
+        instruction_add(CMPZERO, fp, NULL, variable_offset(root->entry), 0);
+    } else {
+        /* Value context: evaluate the expression and compare it to 0. */
+        reduce_expression(stream, root, label);
+        instruction_add(CMPZERO, eax, NULL, 0, 0);
+    }
+    instruction_add(when ? jump_negate(jump_false) : jump_false, destination, NULL, 0, 0);
+
+    label_finalize(label);
+}
+
+
+/* The statement an arm of an IF statement consists of, inside lists and blocks of one */
+    static node_t *
+sole_statement ( node_t *arm )
+{
+    while ((arm->type.index == STATEMENT_LIST && arm->n_children == 1)
+        || (arm->type.index == BLOCK && arm->children[0] == NULL)) {
+        arm = (arm->type.index == BLOCK) ? arm->children[1] : arm->children[0];
+    }
+    return arm;
+}
+
+
+/* The assignment which is all an arm of an IF statement does, NULL if it does more */
+    static node_t *
+single_assignment ( node_t *arm )
+{
+    arm = sole_statement(arm);
+    return (arm->type.index == ASSIGNMENT_STATEMENT) ? arm : NULL;
+}
+
+
+/*
+ * If-conversion. An IF statement whose arms only assign the same variable,
+ * under a condition comparing variables and constants, can compute both
+ * values and pick one with a conditional move instead of branching. A
+ * missing ELSE keeps the value the variable has. The values must not call
+ * functions or divide, so computing the one which is not used makes no
+ * difference, and the then value is kept in ecx, which nothing else they
+ * compile to uses. edx holds the left operand of the comparison. Branching
+ * is still better when computing the unused value costs more than a
+ * branch which is mispredicted half of the time. Returns false when the
+ * statement has to branch.
+ */
+    static bool
+generate_conditional_move ( FILE *stream, node_t *root )
+{
+    node_t *condition = root->children[0], *then, *otherwise, *variable, *values[2];
+    const relation_t *relational = relation(condition);
+    label_t *labels[2];
+    int32_t moved, branched, offset = 0;
+    opcode_t move = CMOVNE;
+    char *source = ecx, *operand;
+
+    if (!pass_enabled(PASS_IF_CONVERSION)) {
+        return false;
+    }
+    then = single_assignment(root->children[1]);
+    otherwise = (root->n_children == 3) ? single_assignment(root->children[2]) : NULL;
+    if (then == NULL || (root->n_children == 3
+        && (otherwise == NULL || otherwise->children[0]->entry != then->children[0]->entry))) {
+        return false;
+    }
+    if (relational != NULL) {
+        for (uint32_t i = 0; i < 2; i++) {
+            nt_number type = condition->children[i]->type.index;
+            if (type != VARIABLE && type != INTEGER) {
+                return false;
+            }
+        }
+    } else if (condition->type.index != VARIABLE) {
+        return false;
+    }
+
+    variable = then->children[0];
+    values[0] = then->children[1];
+    values[1] = (otherwise != NULL) ? otherwise->children[1] : variable;
+    for (uint32_t i = 0; i < 2; i++) {
+        if (expression_has_call(values[i]) || expression_has_division(values[i])) {
+            return false;
+        }
+    }
+
+    labels[0] = label_tree(values[0]);
+    labels[1] = label_tree(values[1]);
+    moved = labels[0]->cost[NT_REG] + labels[1]->cost[NT_REG] + COST_CMOV;
+    branched = (labels[0]->cost[NT_REG] + labels[1]->cost[NT_REG]) / 2 + COST_BRANCH + COST_MISPREDICT / 2;
+    if (moved > branched) {
+        label_finalize(labels[0]);
+        label_finalize(labels[1]);
+        return false;
+    }
+    pass_count(PASS_IF_CONVERSION, 1);
+
+    /* A local is moved from memory, anything else from ecx */
+    if (values[0]->type.index == VARIABLE) {
+        source = fp;
+        offset = variable_offset(values[0]->entry);
+    } else {
+        reduce_expression(stream, values[0], labels[0]);
+        instruction_add(MOVE, eax, ecx, 0, 0);
+    }
+    reduce_expression(stream, values[1], labels[1]);
+    label_finalize(labels[0]);
+    label_finalize(labels[1]);
+
+    if (relational == NULL) {
+        instruction_add(CMPZERO, fp, NULL, variable_offset(condition->entry), 0);
+    } else {
+        node_t *left = condition->children[0], *right = condition->children[1];
+        operand = (right->type.index == INTEGER) ? immediate(*(int32_t *) right->data) : fp;
+        if (left->type.index == VARIABLE && right->type.index == INTEGER) {
+            instruction_add(CMP, operand, fp, 0, variable_offset(left->entry));
+        } else {
+            if (left->type.index == INTEGER) {
+                instruction_add(MOVE, immediate(*(int32_t *) left->data), edx, 0, 0);
+            } else {
+                instruction_add(MOVE, fp, edx, variable_offset(left->entry), 0);
+            }
+            instruction_add(CMP, operand, edx,
+                (right->type.index == VARIABLE) ? variable_offset(right->entry) : 0, 0);
+        }
+        move = relational->move;
+    }
+    instruction_add(move, source, eax, offset, 0);
+    instruction_add(MOVE, eax, fp, 0, variable_offset(variable->entry));
+    return true;
+}
+
+
+/* Number of parameters passed in registers, the others are on the stack */
+    static int32_t
+register_parameter_count ( int32_t n_parameters )
+{
+    if (target == TARGET_X86_64) {
+        return (n_parameters < 6) ? n_parameters : 6;
+    }
+    return 0;
+}
+
+
+/* Find the definition of the function with a given label */
+    static node_t *
+function_lookup ( char *label )
+{
+    for (uint32_t i = 0; i < functions->n_children; i++) {
+        if (strcmp(functions->children[i]->children[0]->entry->label, label) == 0) {
+            return functions->children[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Generate a function call in tail position (the expression of a RETURN
+ * statement) as an overwrite of the current argument slots followed by a
+ * jump. Self-recursive calls release the locals and loop back to the body of
+ * the current function, other calls jump to the callee's entry with the
+ * caller's return address still on the stack. Arguments passed in registers
+ * are loaded into them instead. The caller of the current function removes
+ * its own number of stack arguments, so this only works when the callee has
+ * no more stack parameters than the current function. Returns false when
+ * the call had to be left alone.
+ */
+    static bool
+generate_tail_call ( FILE *stream, node_t *call )
+{
+    node_t *callee;
+    int32_t n_args, n_current;
+    char *label;
+
+    /* Memoized functions store what they return before they do */
+    if (!pass_enabled(PASS_TAIL_CALLS) || current_memo >= 0) {
+        return false;
+    }
+    if (!expression_is_call(call)) {
+        return false;
+    }
+
+    callee = function_lookup(call->children[0]->entry->label);
+    if (callee == NULL) {
+        return false;
+    }
+
+    n_args = function_parameter_count(callee);
+    n_current = function_parameter_count(current_function);
+    if (n_args - register_parameter_count(n_args) > n_current - register_parameter_count(n_current)) {
+        return false;
+    }
+
+    /* All the arguments are evaluated before any slot is overwritten. */
+    generate(stream, call->children[1]);
+
+    /* The last argument is on top of the stack, and goes in 8(%ebp) on x86. */
+    for (int32_t i = n_args - 1; i >= 0; i--) {
+        if (i < register_parameter_count(n_args)) {
+            pop_word(argument_register(i), 0);
+        } else {
+            pop_word(fp, parameter_offset(i, n_args));
+        }
+    }
+
+    if (callee == current_function) {
+        /* Release the locals (and stored parameters) and loop. */
+        instruction_add(MOVE, fp, sp, 0, 0);
+        label = malloc(sizeof(*label) * 16);
+        sprintf(label, "BODY%d", current_body_label);
+    } else {
+        /* Tear down the frame, the callee sets up its own. */
+        instruction_add(LEAVE, NULL, NULL, 0, 0);
+        label = malloc(sizeof(*label) * (strlen(callee->children[0]->entry->label) + 2));
+        sprintf(label, "_%s", callee->children[0]->entry->label);
+    }
+    instruction_add(JUMP, label, NULL, 0, 0);
+    pass_count(PASS_TAIL_CALLS, 1);
+
+    return true;
+}
+
+
+/* Heap-allocated label of a loop, from a format with its index in it */
+    static char *
+loop_label ( char *format, int32_t index )
+{
+    char *label = malloc(sizeof(*label) * (strlen(format) + 12));
+    sprintf(label, format, index);
+    return label;
+}
+
+
+/*
+ * Memoization: the cache of a function is MEMOn in the data, 1 << MEMO_BITS
+ * entries of 8 words: one which is 1 when the entry is used, the value,
+ * and MEMO_KEYS arguments. The hash of the arguments picks the entry, the
+ * lookup returns its value if they are the ones stored there. Otherwise
+ * the address of the entry and a copy of the arguments are pushed, after
+ * the parameters stored in the frame, for the store when the body
+ * returns. The parameters can be assigned to before that.
+ */
+#define MEMO_ENTRY_BITS 5
+
+    static void
+generate_memo_lookup ( node_t *function )
+{
+    int32_t n_parameters = function_parameter_count(function);
+    char *entry = word_register(ecx), *miss = loop_label("MEMOMISS%d", current_memo);
+    char *used = (target == TARGET_X86_64) ? "(%rcx)" : "(%ecx)";
+
+    /* Hash like memoize_hash, then keep the index and scale it to the size of an entry */
+    instruction_add(MOVE, fp, eax, parameter_offset(0, n_parameters), 0);
+    for (int32_t i = 1; i < n_parameters; i++) {
+        instruction_add(MULI, STRDUP("$31"), eax, 0, 0);
+        instruction_add(ADD, fp, eax, parameter_offset(i, n_parameters), 0);
+    }
+    instruction_add(SHL, immediate(32 - MEMO_BITS), eax, 0, 0);
+    instruction_add(SHR, immediate(32 - MEMO_BITS - MEMO_ENTRY_BITS), eax, 0, 0);
+    if (target == TARGET_X86_64) {
+        instruction_add(LEA, loop_label("MEMO%d(%%rip)", current_memo), rcx, 0, 0);
+        instruction_add(ADD, rax, rcx, 0, 0);
+    } else {
+        instruction_add(MOVE, loop_label("$MEMO%d", current_memo), ecx, 0, 0);
+        instruction_add(ADD, eax, ecx, 0, 0);
+    }
+    instruction_add(PUSH, entry, NULL, 0, 0);
+    frame_size++;
+
+    /* A hit returns the value right away */
+    instruction_add(CMPZERO, STRDUP(used), NULL, 0, 0);
+    instruction_add(JUMPZERO, STRDUP(miss), NULL, 0, 0);
+    for (int32_t i = 0; i < n_parameters; i++) {
+        instruction_add(MOVE, fp, eax, parameter_offset(i, n_parameters), 0);
+        instruction_add(CMP, entry, eax, 4 * (i + 2), 0);
+        instruction_add(JUMPNE, STRDUP(miss), NULL, 0, 0);
+    }
+    instruction_add(MOVE, entry, eax, 4, 0);
+    instruction_add(LEAVE, NULL, NULL, 0, 0);
+    instruction_add(RET, NULL, NULL, 0, 0);
+
+    /* A miss keeps the arguments as they are now */
+    instruction_add(STRING, loop_label("MEMOMISS%d:", current_memo), NULL, 0, 0);
+    for (int32_t i = 0; i < n_parameters; i++) {
+        instruction_add(PUSH, fp, NULL, parameter_offset(i, n_parameters), 0);
+        frame_size++;
+    }
+    free(miss);
+    pass_count(PASS_MEMOIZE, 1);
+}
+
+
+/* Store the value in eax with the arguments of the call, and return it */
+    static void
+generate_memo_store ( node_t *function )
+{
+    int32_t n_parameters = function_parameter_count(function);
+    int32_t saved = register_parameter_count(n_parameters) + 1;
+    char *entry = word_register(ecx), *table = malloc(sizeof(*table) * 32);
+    char *used = (target == TARGET_X86_64) ? "(%rcx)" : "(%ecx)";
+
+    instruction_add(STRING, loop_label("MEMOSTORE%d:", current_memo), NULL, 0, 0);
+    instruction_add(MOVE, fp, entry, -word * saved, 0);
+    instruction_add(MOVE, eax, entry, 0, 4);
+    for (int32_t i = 0; i < n_parameters; i++) {
+        instruction_add(MOVE, fp, edx, -word * (saved + 1 + i), 0);
+        instruction_add(MOVE, edx, entry, 0, 4 * (i + 2));
+    }
+    instruction_add(MOVE, STRDUP("$1"), STRDUP(used), 0, 0);
+    instruction_add(LEAVE, NULL, NULL, 0, 0);
+    instruction_add(RET, NULL, NULL, 0, 0);
+
+    sprintf(table, "MEMO%d %d", current_memo, (1 << MEMO_BITS) << MEMO_ENTRY_BITS);
+    instruction_add(MEMOTABLE, table, NULL, 0, 0);
+}
+
+
+/* True if a statement contains a FOR loop */
+    static bool
+has_for ( node_t *root )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (root->type.index == FOR_STATEMENT) {
+        return true;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (has_for(root->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* True if the variable occurs in a statement or expression */
+    static bool
+reads_variable ( node_t *root, symbol_t *entry )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (root->type.index == VARIABLE && root->entry == entry) {
+        return true;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (reads_variable(root->children[i], entry)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* True if an end value has the same value every time a loop body has run */
+    static bool
+is_loop_invariant ( node_t *root, node_t *body, symbol_t *entry )
+{
+    if (root->type.index == VARIABLE) {
+        return root->entry != entry && !subtree_assigns(body, root->entry);
+    }
+    if (expression_has_call(root)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (!is_loop_invariant(root->children[i], body, entry)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Loops in rotated form: the condition is tested once in front of the
+ * loop, to skip it, and then at the bottom of the body, which jumps back
+ * to the top while it holds. An iteration takes one branch instead of a
+ * conditional one at the top and a jump at the bottom.
+ */
+    static void
+generate_rotated_while ( FILE *stream, node_t *root, int32_t index )
+{
+    generate_condition(stream, root->children[0], loop_label("WHLIEEND%d", index));
+    instruction_add(STRING, loop_label("WHILE%d:", index), NULL, 0, 0);
+    generate(stream, root->children[1]);
+    generate_branch(stream, root->children[0], loop_label("WHILE%d", index), true);
+    instruction_add(STRING, loop_label("WHLIEEND%d:", index), NULL, 0, 0);
+    pass_count(PASS_LOOP_ROTATION, 1);
+}
+
+
+/*
+ * A FOR loop runs until its variable equals the end value. When the body
+ * assigns neither, the number of iterations is known when the loop starts,
+ * and in innermost loops the counter register counts them down with decl
+ * and jnz. The
+ * variable is only incremented when the body reads it, otherwise it gets
+ * its last value before the loop. Other FOR loops are rotated like WHILE.
+ */
+    static void
+generate_rotated_for ( FILE *stream, node_t *root, int32_t index )
+{
+    node_t *variable = root->children[0]->children[0], *body = root->children[2];
+    int32_t offset = variable_offset(variable->entry);
+    node_t *for_operands[2] = { variable, root->children[1] };
+    node_t for_condition = { expression_n, "!=", NULL, 2, for_operands };
+    bool counting;
+
+    pass_count(PASS_LOOP_ROTATION, 1);
+    if (has_for(body) || expression_has_call(body) || subtree_assigns(body, variable->entry)
+        || !is_loop_invariant(root->children[1], body, variable->entry)) {
+        generate_condition(stream, &for_condition, loop_label("FOREND%d", index));
+        instruction_add(STRING, loop_label("FORSTART%d:", index), NULL, 0, 0);
+        generate(stream, body);
+        instruction_add(ADD, STRDUP("$1"), fp, 0, offset);
+        generate_branch(stream, &for_condition, loop_label("FORSTART%d", index), true);
+        instruction_add(STRING, loop_label("FOREND%d:", index), NULL, 0, 0);
+        return;
+    }
+
+    /* The end value less the start value, modulo 2^32 like the variable */
+    generate_expression(stream, root->children[1]);
+    instruction_add(SUB, fp, eax, offset, 0);
+    instruction_add(MOVE, eax, counter, 0, 0);
+    counting = reads_variable(body, variable->entry);
+    if (!counting) {
+        instruction_add(ADD, eax, fp, 0, offset);
+    }
+    instruction_add(CMPZERO, counter, NULL, 0, 0);
+    instruction_add(JUMPZERO, loop_label("FOREND%d", index), NULL, 0, 0);
+
+    instruction_add(STRING, loop_label("FORSTART%d:", index), NULL, 0, 0);
+    generate(stream, body);
+    if (counting) {
+        instruction_add(ADD, STRDUP("$1"), fp, 0, offset);
+    }
+    instruction_add(DECL, counter, NULL, 0, 0);
+    instruction_add(JUMPNONZ, loop_label("FORSTART%d", index), NULL, 0, 0);
+    instruction_add(STRING, loop_label("FOREND%d:", index), NULL, 0, 0);
+}
+
+
+/*
+ * Switches. A chain of IF statements, each comparing the same variable
+ * with a constant for equality and continuing in its ELSE, is a switch
+ * with a case for every constant and the last ELSE as its default. With
+ * enough cases it is dispatched in one step: through a table in the data
+ * when the constants are dense, by a binary search of comparisons when
+ * they are not. A constant which comes again never matches, its arm is
+ * left out.
+ */
+
+/* Fewest cases worth a switch, and the sparsest and largest jump tables */
+#define SWITCH_CASES 4
+#define SWITCH_DENSITY 3
+#define SWITCH_TABLE 4096
+
+typedef struct {
+    int32_t value;
+    node_t *arm;
+    uint32_t position;      /* In the chain, which numbers the label */
+} switch_case_t;
+
+
+    static int
+switch_case_compare ( const void *a, const void *b )
+{
+    int32_t x = ((const switch_case_t *) a)->value, y = ((const switch_case_t *) b)->value;
+    return (x > y) - (x < y);
+}
+
+
+    static int
+switch_position_compare ( const void *a, const void *b )
+{
+    uint32_t x = ((const switch_case_t *) a)->position, y = ((const switch_case_t *) b)->position;
+    return (x > y) - (x < y);
+}
+
+
+/* The variable a condition compares with a constant, setting it, or NULL */
+    static node_t *
+switch_variable ( node_t *condition, int32_t *value )
+{
+    node_t *left, *right;
+
+    if (condition->type.index != EXPRESSION || condition->n_children != 2
+        || strcmp(condition->data, "==") != 0) {
+        return NULL;
+    }
+    left = condition->children[0];
+    right = condition->children[1];
+    if (left->type.index == INTEGER && right->type.index == VARIABLE) {
+        left = right;
+        right = condition->children[0];
+    }
+    if (left->type.index != VARIABLE || right->type.index != INTEGER) {
+        return NULL;
+    }
+    *value = *(int32_t *) right->data;
+    return left;
+}
+
+
+/* Heap-allocated label of a switch, from a format with its index and a number in it */
+    static char *
+switch_label ( char *format, int32_t index, uint32_t n )
+{
+    char *label = malloc(sizeof(*label) * (strlen(format) + 24));
+    sprintf(label, format, index, n);
+    return label;
+}
+
+
+/* Compare eax with the sorted cases from first to last, jumping to the one it equals */
+    static void
+switch_search ( switch_case_t *cases, int32_t first, int32_t last, int32_t index, char *otherwise )
+{
+    int32_t middle = (first + last) / 2;
+
+    if (last - first < 3) {
+        for (int32_t c = first; c <= last; c++) {
+            instruction_add(CMP, immediate(cases[c].value), eax, 0, 0);
+            instruction_add(JUMPEQ, switch_label("CASE%d_%u", index, cases[c].position), NULL, 0, 0);
+        }
+        instruction_add(JUMP, STRDUP(otherwise), NULL, 0, 0);
+        return;
+    }
+
+    instruction_add(CMP, immediate(cases[middle].value), eax, 0, 0);
+    instruction_add(JUMPEQ, switch_label("CASE%d_%u", index, cases[middle].position), NULL, 0, 0);
+    instruction_add(JUMPL, switch_label("SEARCH%d_%u", index, middle), NULL, 0, 0);
+    switch_search(cases, middle + 1, last, index, otherwise);
+    instruction_add(STRING, switch_label("SEARCH%d_%u:", index, middle), NULL, 0, 0);
+    switch_search(cases, first, middle - 1, index, otherwise);
+}
+
+
+/*
+ * Jump through a table, indexed by eax less the smallest constant, which
+ * has the distance of every case from the SWITCH label after the jump.
+ * Values outside the range of the constants are above it unsigned.
+ */
+    static void
+switch_table ( switch_case_t *cases, uint32_t range, int32_t index, char *otherwise )
+{
+    char *table = malloc(sizeof(*table) * (48 + 32 * range)), *end = table;
+
+    if (cases[0].value != 0) {
+        instruction_add(SUB, immediate(cases[0].value), eax, 0, 0);
+    }
+    instruction_add(CMP, immediate(range - 1), eax, 0, 0);
+    instruction_add(JUMPA, STRDUP(otherwise), NULL, 0, 0);
+    if (target == TARGET_X86_64) {
+        instruction_add(LEA, loop_label("TABLE%d(%%rip)", index), rcx, 0, 0);
+        instruction_add(MOVE, STRDUP("(%rcx,%rax,4)"), eax, 0, 0);
+        instruction_add(LEA, loop_label("SWITCH%d(%%rip)", index), rcx, 0, 0);
+        instruction_add(ADD, rcx, rax, 0, 0);
+        instruction_add(JUMPINDIRECT, rax, NULL, 0, 0);
+    } else {
+        instruction_add(MOVE, loop_label("$TABLE%d", index), ecx, 0, 0);
+        instruction_add(MOVE, STRDUP("(%ecx,%eax,4)"), eax, 0, 0);
+        instruction_add(ADD, loop_label("$SWITCH%d", index), eax, 0, 0);
+        instruction_add(JUMPINDIRECT, eax, NULL, 0, 0);
+    }
+    instruction_add(STRING, loop_label("SWITCH%d:", index), NULL, 0, 0);
+
+    end += sprintf(end, "TABLE%d SWITCH%d", index, index);
+    for (uint32_t v = 0, c = 0; v < range; v++) {
+        int32_t value = (int32_t) ((uint32_t) cases[0].value + v);
+        while (cases[c].value < value) {
+            c++;
+        }
+        if (cases[c].value == value) {
+            end += sprintf(end, " CASE%d_%u", index, cases[c].position);
+        } else {
+            end += sprintf(end, " %s", otherwise);
+        }
+    }
+    instruction_add(JUMPTABLE, table, NULL, 0, 0);
+}
+
+
+/* Generate a chain of IF statements as a switch, returning false if it is not one */
+    static bool
+generate_switch ( FILE *stream, node_t *root, int32_t index )
+{
+    switch_case_t *cases = NULL, *sorted;
+    node_t *variable = NULL, *statement = root, *otherwise = NULL;
+    uint32_t n_cases = 0, n_distinct = 0, range;
+    char *otherwise_label, *end_label;
+
+    if (!pass_enabled(PASS_SWITCH)) {
+        return false;
+    }
+
+    /* Follow the chain down its ELSE arms */
+    while (statement != NULL) {
+        int32_t value;
+        node_t *compared;
+        if (statement->type.index != IF_STATEMENT
+            || (compared = switch_variable(statement->children[0], &value)) == NULL
+            || (variable != NULL && compared->entry != variable->entry)) {
+            otherwise = statement;
+            break;
+        }
+        variable = compared;
+        cases = realloc(cases, sizeof(*cases) * (n_cases + 1));
+        if (cases == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for a switch.\n");
+            abort();
+        }
+        cases[n_cases] = (switch_case_t) { value, statement->children[1], n_cases };
+        n_cases++;
+        statement = (statement->n_children == 3) ? sole_statement(statement->children[2]) : NULL;
+    }
+    if (n_cases < SWITCH_CASES) {
+        free(cases);
+        return false;
+    }
+    if (otherwise != NULL) {
+        /* The ELSE arm itself, with the lists and blocks around its statement */
+        node_t *parent = root;
+        while (sole_statement(parent->children[2]) != otherwise) {
+            parent = sole_statement(parent->children[2]);
+        }
+        otherwise = parent->children[2];
+    }
+
+    /* The first of equal constants is the one which matches */
+    sorted = malloc(sizeof(*sorted) * n_cases);
+    memcpy(sorted, cases, sizeof(*sorted) * n_cases);
+    qsort(sorted, n_cases, sizeof(*sorted), switch_case_compare);
+    for (uint32_t c = 0; c < n_cases; c++) {
+        if (n_distinct == 0 || sorted[c].value != sorted[n_distinct - 1].value) {
+            sorted[n_distinct++] = sorted[c];
+        } else if (sorted[c].position < sorted[n_distinct - 1].position) {
+            sorted[n_distinct - 1] = sorted[c];
+        }
+    }
+    pass_count(PASS_SWITCH, 1);
+
+    end_label = loop_label("SWITCHEND%d", index);
+    otherwise_label = (otherwise != NULL) ? loop_label("DEFAULT%d", index) : STRDUP(end_label);
+    instruction_add(MOVE, fp, eax, variable_offset(variable->entry), 0);
+    range = (uint32_t) sorted[n_distinct - 1].value - (uint32_t) sorted[0].value + 1;
+    if (range != 0 && range <= SWITCH_TABLE && range <= SWITCH_DENSITY * n_distinct) {
+        switch_table(sorted, range, index, otherwise_label);
+    } else {
+        switch_search(sorted, 0, n_distinct - 1, index, otherwise_label);
+    }
+
+    /* The arms which can match, in the order they were written */
+    qsort(sorted, n_distinct, sizeof(*sorted), switch_position_compare);
+    for (uint32_t d = 0; d < n_distinct; d++) {
+        instruction_add(STRING, switch_label("CASE%d_%u:", index, sorted[d].position), NULL, 0, 0);
+        generate(stream, sorted[d].arm);
+        instruction_add(JUMP, STRDUP(end_label), NULL, 0, 0);
+    }
+    if (otherwise != NULL) {
+        instruction_add(STRING, loop_label("DEFAULT%d:", index), NULL, 0, 0);
+        generate(stream, otherwise);
+    }
+    instruction_add(STRING, loop_label("SWITCHEND%d:", index), NULL, 0, 0);
+
+    free(end_label);
+    free(otherwise_label);
+    free(sorted);
+    free(cases);
+    return true;
+}
+
+
+/*
+ * Load the command line arguments converted by TEXT_HEAD_X86_64 for the
+ * first function, and call it. Like the pushes of TEXT_HEAD, the last
+ * arguments go to the parameters when there are more than it takes.
+ */
+    static void
+entry_arguments_x86_64 ( node_t *function )
+{
+    int32_t n_args = function_parameter_count(function);
+    int32_t n_registers = register_parameter_count(n_args);
+    int32_t reserved = alignment_padding(n_args - n_registers);
+
+    /* Past the last argument, where argv ends */
+    instruction_add(ADD, STRDUP("$8"), r12, 0, 0);
+    reserve_stack(reserved);
+    for (int32_t i = n_args - 1; i >= n_registers; i--) {
+        push_word(r12, 8 * (i - n_args));
+    }
+    for (int32_t i = 0; i < n_registers; i++) {
+        instruction_add(MOVE, r12, argument_register(i), 8 * (i - n_args), 0);
+    }
+
+    instruction_add(CALL, STRDUP(function->children[0]->entry->label), NULL, 0, 0);
+}
+
+
+/* Stack words and registers */
+
+
+/* The register holding a whole stack word, 64 bits wide on x86-64 */
+    static char *
+word_register ( char *reg )
+{
+    char *narrow[] = { eax, ebx, ecx, edx, ebp, esp, esi, edi, r8d, r9d };
+    char *wide[] = { rax, rbx, rcx, rdx, rbp, rsp, rsi, rdi, r8, r9 };
+
+    if (target == TARGET_X86_64) {
+        for (uint32_t i = 0; i < sizeof(narrow) / sizeof(narrow[0]); i++) {
+            if (reg == narrow[i]) {
+                return wide[i];
+            }
+        }
+    }
+    return reg;
+}
+
+
+/* System V argument registers on x86-64 (the 32 bit parts) */
+    static char *
+argument_register ( int32_t index )
+{
+    char *arguments[] = { edi, esi, edx, ecx, r8d, r9d };
+    return arguments[index];
+}
+
+
+/* Push and pop temporary words for the statement being generated */
+    static void
+push_word ( char *operand, int32_t offset )
+{
+    instruction_add(PUSH, word_register(operand), NULL, offset, 0);
+    temporaries++;
+}
+
+
+    static void
+pop_word ( char *operand, int32_t offset )
+{
+    instruction_add(POP, word_register(operand), NULL, offset, 0);
+    temporaries--;
+}
+
+
+/*
+ * Number of padding words (0 or 1) needed to have the stack on a 16 byte
+ * boundary at a call on x86-64, after pushing the given number of words.
+ * The frame pointer is on such a boundary.
+ */
+    static int32_t
+alignment_padding ( int32_t words )
+{
+    if (target != TARGET_X86_64) {
+        return 0;
+    }
+    return (frame_size + temporaries + words) % 2;
+}
+
+
+    static void
+reserve_stack ( int32_t words )
+{
+    if (words > 0) {
+        instruction_add(SUB, immediate(word * words), sp, 0, 0);
+        temporaries += words;
+    }
+}
+
+
+    static void
+release_stack ( int32_t words )
+{
+    if (words > 0) {
+        instruction_add(ADD, immediate(word * words), sp, 0, 0);
+        temporaries -= words;
+    }
+}
+
+
+/*
+ * Call a C library function on x86-64 with the arguments in registers. eax
+ * holds the number of vector registers used by variadic functions.
+ */
+    static void
+library_call ( char *function )
+{
+    int32_t padding = alignment_padding(0);
+
+    reserve_stack(padding);
+    instruction_add(MOVE, STRDUP("$0"), eax, 0, 0);
+    instruction_add(SYSCALL, STRDUP(function), NULL, 0, 0);
+    release_stack(padding);
+}
+
+
+/* Provided auxiliaries... */
+
+
+    static void
+instruction_append ( instruction_t *next )
+{
+    if ( start != NULL )
+    {
+        last->next = next;
+        last = next;
+    }
+    else
+        start = last = next;
+}
+
+
+    static void
+instruction_add (
+        opcode_t op, char *arg1, char *arg2, int32_t off1, int32_t off2 
+        )
+{
+    instruction_t *i = (instruction_t *) malloc ( sizeof(instruction_t) );
+    *i = (instruction_t) { op, {arg1, arg2}, {off1, off2}, NULL };
+    instruction_append ( i );
+}
+
+
+/*
+ * Operand size suffix: stack words are 64 bits wide on x86-64, other
+ * instructions are if they have a 64 bit register operand. Values are
+ * always 32 bits.
+ */
+    static char
+size_suffix ( instruction_t *this )
+{
+    char *wide[] = { rax, rbx, rcx, rdx, rbp, rsp, rsi, rdi, r8, r9, r12, r13 };
+
+    if ( this->opcode == PUSH || this->opcode == POP )
+        return ( target == TARGET_X86_64 ) ? 'q' : 'l';
+
+    for ( int i = 0; i < 2; i++ )
+        for ( uint32_t r = 0; r < sizeof(wide) / sizeof(wide[0]); r++ )
+            if ( this->operands[i] == wide[r] && this->offsets[i] == 0 )
+                return 'q';
+    return 'l';
+}
+
+
+    static void
+instructions_print ( FILE *stream )
+{
+    instruction_t *this = start;
+    while ( this != NULL )
+    {
+        char size = size_suffix ( this );
+        switch ( this->opcode )
+        {
+            case PUSH:
+                if ( this->offsets[0] == 0 )
+                    fprintf ( stream, "\tpush%c\t%s\n", size, this->operands[0] );
+                else
+                    fprintf ( stream, "\tpush%c\t%d(%s)\n",
+                            size, this->offsets[0], this->operands[0]
                             );
                 break;
             case POP:
                 if ( this->offsets[0] == 0 )
-                    fprintf ( stream, "\tpopl\t%s\n", this->operands[0] );
+                    fprintf ( stream, "\tpop%c\t%s\n", size, this->operands[0] );
                 else
-                    fprintf ( stream, "\tpopl\t%d(%s)\n",
-                            this->offsets[0], this->operands[0]
+                    fprintf ( stream, "\tpop%c\t%d(%s)\n",
+                            size, this->offsets[0], this->operands[0]
                             );
                 break;
             case MOVE:
                 if ( this->offsets[0] == 0 && this->offsets[1] == 0 )
-                    fprintf ( stream, "\tmovl\t%s,%s\n",
-                            this->operands[0], this->operands[1]
+                    fprintf ( stream, "\tmov%c\t%s,%s\n",
+                            size, this->operands[0], this->operands[1]
                             );
                 else if ( this->offsets[0] != 0 && this->offsets[1] == 0 )
-                    fprintf ( stream, "\tmovl\t%d(%s),%s\n",
-                            this->offsets[0], this->operands[0], this->operands[1]
+                    fprintf ( stream, "\tmov%c\t%d(%s),%s\n",
+                            size, this->offsets[0], this->operands[0], this->operands[1]
                             );
                 else if ( this->offsets[0] == 0 && this->offsets[1] != 0 )
-                    fprintf ( stream, "\tmovl\t%s,%d(%s)\n",
-                            this->operands[0], this->offsets[1], this->operands[1]
+                    fprintf ( stream, "\tmov%c\t%s,%d(%s)\n",
+                            size, this->operands[0], this->offsets[1], this->operands[1]
                             );
                 break;
 
             case ADD:
                 if ( this->offsets[0] == 0 && this->offsets[1] == 0 )
-                    fprintf ( stream, "\taddl\t%s,%s\n",
-                            this->operands[0], this->operands[1]
+                    fprintf ( stream, "\tadd%c\t%s,%s\n",
+                            size, this->operands[0], this->operands[1]
                             );
                 else if ( this->offsets[0] != 0 && this->offsets[1] == 0 )
-                    fprintf ( stream, "\taddl\t%d(%s),%s\n",
-                            this->offsets[0], this->operands[0], this->operands[1]
+                    fprintf ( stream, "\tadd%c\t%d(%s),%s\n",
+                            size, this->offsets[0], this->operands[0], this->operands[1]
                             );
                 else if ( this->offsets[0] == 0 && this->offsets[1] != 0 )
-                    fprintf ( stream, "\taddl\t%s,%d(%s)\n",
-                            this->operands[0], this->offsets[1], this->operands[1]
+                    fprintf ( stream, "\tadd%c\t%s,%d(%s)\n",
+                            size, this->operands[0], this->offsets[1], this->operands[1]
                             );
                 break;
             case SUB:
                 if ( this->offsets[0] == 0 && this->offsets[1] == 0 )
-                    fprintf ( stream, "\tsubl\t%s,%s\n",
-                            this->operands[0], this->operands[1]
+                    fprintf ( stream, "\tsub%c\t%s,%s\n",
+                            size, this->operands[0], this->operands[1]
                             );
                 else if ( this->offsets[0] != 0 && this->offsets[1] == 0 )
-                    fprintf ( stream, "\tsubl\t%d(%s),%s\n",
-                            this->offsets[0], this->operands[0], this->operands[1]
+                    fprintf ( stream, "\tsub%c\t%d(%s),%s\n",
+                            size, this->offsets[0], this->operands[0], this->operands[1]
                             );
                 else if ( this->offsets[0] == 0 && this->offsets[1] != 0 )
-                    fprintf ( stream, "\tsubl\t%s,%d(%s)\n",
-                            this->operands[0], this->offsets[1], this->operands[1]
+                    fprintf ( stream, "\tsub%c\t%s,%d(%s)\n",
+                            size, this->operands[0], this->offsets[1], this->operands[1]
                             );
                 break;
             case MUL:
@@ -807,6 +2395,51 @@ instructions_print ( FILE *stream )
                             );
                 break;
 
+            case SHL:
+                fprintf ( stream, "\tshll\t%s,%s\n", this->operands[0], this->operands[1] );
+                break;
+            case SAR:
+                fprintf ( stream, "\tsarl\t%s,%s\n", this->operands[0], this->operands[1] );
+                break;
+            case SHR:
+                fprintf ( stream, "\tshrl\t%s,%s\n", this->operands[0], this->operands[1] );
+                break;
+            case LEA:
+                fprintf ( stream, "\tlea%c\t%s,%s\n", size, this->operands[0], this->operands[1] );
+                break;
+            case MULI:
+                if ( this->offsets[0] == 0 )
+                    fprintf ( stream, "\timull\t%s,%s\n",
+                            this->operands[0], this->operands[1]
+                            );
+                else
+                    fprintf ( stream, "\timull\t%d(%s),%s\n",
+                            this->offsets[0], this->operands[0], this->operands[1]
+                            );
+                break;
+            case INC:
+                fprintf ( stream, "\tincl\t%s\n", this->operands[0] );
+                break;
+            case DEC:
+                fprintf ( stream, "\tdecl\t%s\n", this->operands[0] );
+                break;
+            case MOVZBL:
+                fprintf ( stream, "\tmovzbl\t%s,%s\n", this->operands[0], this->operands[1] );
+                break;
+            case CMOVL: case CMOVG: case CMOVLE: case CMOVGE: case CMOVE: case CMOVNE:
+                {
+                    char *condition[] = { "l", "g", "le", "ge", "e", "ne" };
+                    if ( this->offsets[0] == 0 )
+                        fprintf ( stream, "\tcmov%s\t%s,%s\n", condition[this->opcode - CMOVL],
+                                this->operands[0], this->operands[1]
+                                );
+                    else
+                        fprintf ( stream, "\tcmov%s\t%d(%s),%s\n", condition[this->opcode - CMOVL],
+                                this->offsets[0], this->operands[0], this->operands[1]
+                                );
+                }
+                break;
+
             case DECL:
                 fprintf ( stream, "\tdecl\t%s\n", this->operands[0] );
                 break;
@@ -912,6 +2545,47 @@ instructions_print ( FILE *stream )
             case JUMPNONZ:
                 fprintf ( stream, "\tjnz\t%s\n", this->operands[0] );
                 break;
+            case JUMPNE:
+                fprintf ( stream, "\tjne\t%s\n", this->operands[0] );
+                break;
+            case JUMPL:
+                fprintf ( stream, "\tjl\t%s\n", this->operands[0] );
+                break;
+            case JUMPG:
+                fprintf ( stream, "\tjg\t%s\n", this->operands[0] );
+                break;
+            case JUMPLE:
+                fprintf ( stream, "\tjle\t%s\n", this->operands[0] );
+                break;
+            case JUMPGE:
+                fprintf ( stream, "\tjge\t%s\n", this->operands[0] );
+                break;
+            case JUMPA:
+                fprintf ( stream, "\tja\t%s\n", this->operands[0] );
+                break;
+            case JUMPINDIRECT:
+                fprintf ( stream, "\tjmp\t*%s\n", this->operands[0] );
+                break;
+            case MEMOTABLE:
+                {
+                    char *name = STRDUP ( this->operands[0] );
+                    int32_t size = atoi ( strchr ( name, ' ' ) + 1 );
+                    *strchr ( name, ' ' ) = '\0';
+                    fprintf ( stream, ".data\n.align 4\n%s:\n\t.zero\t%d\n.text\n", name, size );
+                    free ( name );
+                }
+                break;
+            case JUMPTABLE:
+                {
+                    char *labels = STRDUP ( this->operands[0] ), *base;
+                    fprintf ( stream, ".data\n.align 4\n%s:\n", strtok ( labels, " " ) );
+                    base = strtok ( NULL, " " );
+                    for ( char *entry = strtok ( NULL, " " ); entry != NULL; entry = strtok ( NULL, " " ) )
+                        fprintf ( stream, "\t.long\t%s-%s\n", entry, base );
+                    fprintf ( stream, ".text\n" );
+                    free ( labels );
+                }
+                break;
 
             case LEAVE: fputs ( "\tleave\n", stream ); break;
             case RET:   fputs ( "\tret\n", stream );   break;
@@ -932,6 +2606,138 @@ instructions_print ( FILE *stream )
 }
 
 
+/*
+ * Peephole optimization of the instruction list, repeated until nothing
+ * changes:
+ *   jumps to the label right after them are removed,
+ *   a push followed by a pop becomes a move (or nothing, if they name the
+ *   same place),
+ *   moves from a register to itself are removed,
+ *   a load of the slot the previous instruction stored the same register
+ *   in is removed.
+ * Returns the number of instructions removed or rewritten.
+ */
+    int32_t
+peephole_optimize ( instruction_t **list )
+{
+    int32_t changes = 0, round;
+
+    do {
+        round = 0;
+        for ( instruction_t **link = list; *link != NULL; )
+        {
+            instruction_t *this = *link, *next = this->next;
+
+            if ( is_jump ( this ) && next != NULL && jumps_to ( this, next ) )
+            {
+                *link = instruction_remove ( this );
+                round++;
+            }
+            else if ( this->opcode == PUSH && next != NULL && next->opcode == POP
+                && !is_indirect ( this->operands[0] ) && !is_indirect ( next->operands[0] )
+                && !( this->offsets[0] != 0 && next->offsets[0] != 0 )
+                && !( target == TARGET_X86_64 && *this->operands[0] == '$' && next->offsets[0] != 0 ) )
+            {
+                if ( this->operands[0] == next->operands[0] && this->offsets[0] == next->offsets[0] )
+                {
+                    *link = instruction_remove ( instruction_remove ( this ) );
+                }
+                else
+                {
+                    /* The pop's operand is a register, it is not freed */
+                    *this = (instruction_t) { MOVE, { this->operands[0], next->operands[0] },
+                        { this->offsets[0], next->offsets[0] }, next->next };
+                    free ( next );
+                }
+                round++;
+            }
+            else if ( this->opcode == MOVE && this->operands[0] == this->operands[1]
+                && this->offsets[0] == 0 && this->offsets[1] == 0 && is_register ( this->operands[0] ) )
+            {
+                *link = instruction_remove ( this );
+                round++;
+            }
+            else if ( this->opcode == MOVE && next != NULL && next->opcode == MOVE
+                && this->offsets[0] == 0 && is_register ( this->operands[0] ) && this->offsets[1] != 0
+                && next->operands[0] == this->operands[1] && next->offsets[0] == this->offsets[1]
+                && next->operands[1] == this->operands[0] && next->offsets[1] == 0 )
+            {
+                this->next = instruction_remove ( next );
+                round++;
+            }
+            else
+                link = &this->next;
+        }
+        changes += round;
+    } while ( round > 0 );
+
+    return changes;
+}
+
+
+    static bool
+is_jump ( instruction_t *this )
+{
+    switch ( this->opcode )
+    {
+        case JUMP: case JUMPZERO: case JUMPNONZ: case JUMPEQ: case JUMPNE:
+        case JUMPL: case JUMPG: case JUMPLE: case JUMPGE: case JUMPA:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/* True if a jump's target is the label instruction given */
+    static bool
+jumps_to ( instruction_t *jump, instruction_t *label )
+{
+    char *destination = jump->operands[0];
+    size_t length = strlen ( destination );
+
+    if ( label->opcode == LABEL )
+        return destination[0] == '_' && strcmp ( destination + 1, label->operands[0] ) == 0;
+    return label->opcode == STRING && strncmp ( destination, label->operands[0], length ) == 0
+        && strcmp ( label->operands[0] + length, ":" ) == 0;
+}
+
+
+/* Memory operands written out in full, like (%ebx) */
+    static bool
+is_indirect ( char *operand )
+{
+    return operand != NULL && *operand == '(';
+}
+
+
+/* Unlink an instruction from the list, returning the one after it */
+    static instruction_t *
+instruction_remove ( instruction_t *this )
+{
+    instruction_t *next = this->next;
+    if ( !is_register ( this->operands[0] ) )
+        free ( this->operands[0] );
+    free ( this );
+    return next;
+}
+
+
+    static bool
+is_register ( char *operand )
+{
+    char *registers[] = {
+        eax, ebx, ecx, edx, ebp, esp, esi, edi, al, bl,
+        r8d, r9d, r10d, r11d, rax, rbx, rcx, rdx, rbp, rsp, rsi, rdi,
+        r8, r9, r12, r13
+    };
+    for ( uint32_t r = 0; r < sizeof(registers) / sizeof(registers[0]); r++ )
+        if ( operand == registers[r] )
+            return true;
+    return false;
+}
+
+
     static void
 instructions_finalize ( void )
 {
@@ -939,12 +2745,7 @@ instructions_finalize ( void )
     while ( this != NULL )
     {
         next = this->next;
-        if ( this->operands[0] != eax && this->operands[0] != ebx &&
-                this->operands[0] != ecx && this->operands[0] != edx &&
-                this->operands[0] != ebp && this->operands[0] != esp &&
-                this->operands[0] != esi && this->operands[0] != edi &&
-                this->operands[0] != al && this->operands[0] != bl 
-           )
+        if ( !is_register ( this->operands[0] ) )
             free ( this->operands[0] );
         free ( this );
         this = next;
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+/*
+ * Helpers the passes and the backends share: growing arrays, and questions
+ * about subtrees of the bound syntax tree and copies of them.
+ */
+
+
+/* Grow an array of elements to hold at least one more than used */
+    void *
+array_grow ( void *array, uint32_t used, uint32_t *capacity, size_t element )
+{
+    if (used < *capacity) {
+        return array;
+    }
+    *capacity = 2 * *capacity + 16;
+    array = realloc(array, element * *capacity);
+    if (array == NULL) {
+        fprintf(stderr, "Failed to reallocate heap for an array.\n");
+        abort();
+    }
+    return array;
+}
+
+
+/* Zeroed heap memory */
+    void *
+allocate_zeroed ( size_t size )
+{
+    void *memory = calloc(1, size);
+    if (memory == NULL) {
+        fprintf(stderr, "Failed to allocate heap.\n");
+        abort();
+    }
+    return memory;
+}
+
+
+/* Orders pointers to nodes by address, for qsort and bsearch */
+    int
+node_compare ( const void *a, const void *b )
+{
+    uintptr_t x = (uintptr_t) *(node_t * const *) a, y = (uintptr_t) *(node_t * const *) b;
+    return (x > y) - (x < y);
+}
+
+
+/* True if the node is a function call */
+    bool
+expression_is_call ( node_t *root )
+{
+    return root->type.index == EXPRESSION && root->n_children == 2
+        && root->data != NULL && *(char *) root->data == 'F';
+}
+
+
+/* True if evaluating the expression can have side effects */
+    bool
+expression_has_call ( node_t *root )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (expression_is_call(root)) {
+        return true;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (expression_has_call(root->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* True if an expression divides, which can trap */
+    bool
+expression_has_division ( node_t *root )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (root->type.index == EXPRESSION && root->n_children == 2 && root->data != NULL
+        && strcmp(root->data, "/") == 0) {
+        return true;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (expression_has_division(root->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* True if a statement assigns to the variable */
+    bool
+subtree_assigns ( node_t *root, symbol_t *entry )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (root->type.index == ASSIGNMENT_STATEMENT && root->children[0]->entry == entry) {
+        return true;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (subtree_assigns(root->children[i], entry)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* Number of nodes in a subtree */
+    uint32_t
+subtree_size ( node_t *root )
+{
+    uint32_t n = 1;
+
+    if (root == NULL) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        n += subtree_size(root->children[i]);
+    }
+    return n;
+}
+
+
+/* Number of parameters of a function definition */
+    uint32_t
+function_parameter_count ( node_t *function )
+{
+    return (function->children[1] == NULL) ? 0 : function->children[1]->n_children;
+}
+
+
+/* A statement list with room for n statements */
+    node_t *
+statement_list_new ( uint32_t n )
+{
+    node_t *list = malloc(sizeof(*list));
+
+    if (list == NULL) {
+        fprintf(stderr, "Failed to allocate heap for a statement list.\n");
+        abort();
+    }
+    node_init(list, statement_list_n, NULL, 0);
+    list->children = realloc(list->children, sizeof(node_t *) * (n + 1));
+    if (list->children == NULL) {
+        fprintf(stderr, "Failed to allocate heap for a statement list.\n");
+        abort();
+    }
+    return list;
+}
+
+
+/* A node of a list type with n children, which the caller fills in */
+    node_t *
+node_list_new ( nodetype_t type, uint32_t n )
+{
+    node_t *list = statement_list_new(n);
+
+    list->type = type;
+    list->n_children = n;
+    return list;
+}
+
+
+/* Replace an expression node with an integer, in place */
+    node_t *
+node_make_integer ( node_t *root, int32_t value )
+{
+    int32_t *data = malloc(sizeof(*data));
+
+    if (data == NULL) {
+        fprintf(stderr, "Failed to allocate memory for a constant\n");
+        abort();
+    }
+    *data = value;
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        destroy_subtree(root->children[i]);
+    }
+    free(root->children);
+    free(root->data);
+    node_init(root, integer_n, data, 0);
+    return root;
+}
+
+
+/* A copy of a subtree, with its own data, referring to the same symbols */
+    node_t *
+subtree_copy ( node_t *root )
+{
+    node_t *copy;
+    void *data = NULL;
+
+    if (root == NULL) {
+        return NULL;
+    }
+    copy = malloc(sizeof(*copy));
+    if (copy == NULL) {
+        fprintf(stderr, "Failed to allocate memory for a copy\n");
+        abort();
+    }
+    if (root->data != NULL && (root->type.index == INTEGER || root->type.index == TEXT)) {
+        data = malloc(sizeof(int32_t));
+        if (data == NULL) {
+            fprintf(stderr, "Failed to allocate memory for a copy\n");
+            abort();
+        }
+        *(int32_t *) data = *(int32_t *) root->data;
+    } else if (root->data != NULL) {
+        data = STRDUP(root->data);
+    }
+
+    node_init(copy, root->type, data, 0);
+    copy->entry = root->entry;
+    copy->n_children = root->n_children;
+    copy->children = realloc(copy->children, sizeof(node_t *) * (root->n_children + 1));
+    if (copy->children == NULL) {
+        fprintf(stderr, "Failed to allocate memory for a copy\n");
+        abort();
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        copy->children[i] = subtree_copy(root->children[i]);
+    }
+    return copy;
+}
@@ -0,0 +1,469 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+/*
+ * Strength reduction of induction variables. The variable of a FOR loop
+ * goes up by 1 every iteration, and a variable which a loop only assigns
+ * in top level statements of its body, by adding or subtracting a
+ * constant, goes up or down by that constant in each of them. Unrolled
+ * FOR loops count their variable up like that between copies of the body.
+ * An expression in the loop which is a*i + b for such a variable i, a
+ * constant a and a part b which does not change in the loop, and which
+ * multiplies i, is a derived induction variable. It is replaced by a new
+ * local, set to the expression in front of the loop and increased by a
+ * times the step wherever i is.
+ *
+ * b must not call functions or divide, so computing it in front of a
+ * loop which might not run it can make no difference. A FOR loop whose
+ * body then no longer reads its variable is counted down in a register by
+ * the code generator, without the variable.
+ */
+
+/* A derived induction variable */
+typedef struct {
+    node_t *expression;             /* The first one replaced, as it was */
+    symbol_t *temporary;
+    int32_t factor;
+} derived_t;
+
+/* The loop being reduced, and its induction variable */
+static node_t *loop;
+static symbol_t *induction;
+static derived_t *derived;
+static uint32_t n_derived, derived_capacity;
+
+
+/* Number of assignments to the variable in a statement */
+    static uint32_t
+count_assignments ( node_t *root, symbol_t *entry )
+{
+    uint32_t n = 0;
+
+    if (root == NULL) {
+        return 0;
+    }
+    if (root->type.index == ASSIGNMENT_STATEMENT && root->children[0]->entry == entry) {
+        n++;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        n += count_assignments(root->children[i], entry);
+    }
+    return n;
+}
+
+
+/*
+ * True if an expression is a*i + b for the induction variable, with b
+ * the same in every iteration. Sets the factor a, and whether i is
+ * multiplied by anything but 1 and -1.
+ */
+    static bool
+is_linear ( node_t *root, int32_t *factor, bool *scaled )
+{
+    int32_t left, right;
+    char *op;
+
+    switch (root->type.index) {
+        case INTEGER:
+            *factor = 0;
+            return true;
+
+        case VARIABLE:
+            *factor = (root->entry == induction) ? 1 : 0;
+            return root->entry == induction || !subtree_assigns(loop, root->entry);
+
+        case EXPRESSION:
+            op = root->data;
+            if (root->n_children == 1) {
+                if (!is_linear(root->children[0], &left, scaled)) {
+                    return false;
+                }
+                *factor = (int32_t) -(uint32_t) left;
+                return true;
+            }
+            if ((strcmp(op, "+") != 0 && strcmp(op, "-") != 0 && strcmp(op, "*") != 0)
+                || !is_linear(root->children[0], &left, scaled)
+                || !is_linear(root->children[1], &right, scaled)) {
+                return false;
+            }
+            if (*op == '+') {
+                *factor = (int32_t) ((uint32_t) left + (uint32_t) right);
+            } else if (*op == '-') {
+                *factor = (int32_t) ((uint32_t) left - (uint32_t) right);
+            } else if (left != 0 && right != 0) {
+                return false;
+            } else if (left == 0 && right == 0) {
+                *factor = 0;
+            } else {
+                /* The step has to be a constant */
+                node_t *constant = root->children[(left != 0) ? 1 : 0];
+                int32_t c;
+                if (constant->type.index != INTEGER) {
+                    return false;
+                }
+                c = *(int32_t *) constant->data;
+                *factor = (int32_t) ((uint32_t) (left + right) * (uint32_t) c);
+                *scaled = *scaled || (c != 1 && c != -1);
+            }
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+/* True if two expressions are written the same */
+    static bool
+same_expression ( node_t *a, node_t *b )
+{
+    if (a->type.index != b->type.index || a->n_children != b->n_children || a->entry != b->entry) {
+        return false;
+    }
+    if (a->type.index == INTEGER && *(int32_t *) a->data != *(int32_t *) b->data) {
+        return false;
+    }
+    if (a->type.index == EXPRESSION && strcmp(a->data, b->data) != 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < a->n_children; i++) {
+        if (!same_expression(a->children[i], b->children[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Replace derived induction variables in an expression with their locals */
+    static node_t *
+reduce ( node_t *root, int32_t *changes )
+{
+    int32_t factor;
+    bool scaled = false;
+    derived_t *found = NULL;
+
+    if (root == NULL) {
+        return NULL;
+    }
+    if (root->type.index != EXPRESSION || !is_linear(root, &factor, &scaled) || factor == 0 || !scaled) {
+        for (uint32_t i = 0; i < root->n_children; i++) {
+            root->children[i] = reduce(root->children[i], changes);
+        }
+        return root;
+    }
+
+    for (uint32_t d = 0; d < n_derived && found == NULL; d++) {
+        if (same_expression(derived[d].expression, root)) {
+            found = &derived[d];
+        }
+    }
+    if (found == NULL) {
+        if (n_derived == derived_capacity) {
+            derived_capacity = 2 * derived_capacity + 8;
+            derived = realloc(derived, sizeof(*derived) * derived_capacity);
+            if (derived == NULL) {
+                fprintf(stderr, "Failed to reallocate heap for induction variables.\n");
+                abort();
+            }
+        }
+        found = &derived[n_derived++];
+        *found = (derived_t) { root, temporary_new("iv"), factor };
+        (*changes)++;
+        return temporary_read(found->temporary);
+    }
+    destroy_subtree(root);
+    (*changes)++;
+    return temporary_read(found->temporary);
+}
+
+
+/* Replace reads of the induction variable with copies of an expression */
+    static node_t *
+substitute ( node_t *root, node_t *value )
+{
+    if (root->type.index == VARIABLE && root->entry == induction) {
+        destroy_subtree(root);
+        return subtree_copy(value);
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = substitute(root->children[i], value);
+    }
+    return root;
+}
+
+
+/* The statements which add the factor times the step to every local */
+    static node_t *
+steps ( int32_t step )
+{
+    node_t *list = statement_list_new(n_derived);
+
+    for (uint32_t d = 0; d < n_derived; d++) {
+        node_t *sum = malloc(sizeof(*sum)), *increment = malloc(sizeof(*increment));
+        node_make_integer(node_init(increment, integer_n, NULL, 0),
+            (int32_t) ((uint32_t) derived[d].factor * (uint32_t) step));
+        node_init(sum, expression_n, STRDUP("+"), 2, temporary_read(derived[d].temporary), increment);
+        list->children[list->n_children++] = temporary_assign(derived[d].temporary, sum);
+    }
+    return list;
+}
+
+
+/*
+ * Reduce the derived induction variables of one variable of a loop, and
+ * return the loop with the locals set in front of it. start is what the
+ * variable is when the loop begins, NULL if it is the variable itself.
+ */
+    static node_t *
+reduce_loop ( node_t **expressions, uint32_t n_expressions, node_t *start, int32_t *changes )
+{
+    node_t *list;
+
+    n_derived = 0;
+    for (uint32_t e = 0; e < n_expressions; e++) {
+        expressions[e] = reduce(expressions[e], changes);
+    }
+    if (n_derived == 0) {
+        return NULL;
+    }
+
+    list = statement_list_new(n_derived + 1);
+    for (uint32_t d = 0; d < n_derived; d++) {
+        node_t *value = derived[d].expression;
+        if (start != NULL) {
+            value = substitute(value, start);
+        }
+        list->children[list->n_children] = temporary_assign(derived[d].temporary, value);
+        fold_constants(list->children[list->n_children++]);
+    }
+    return list;
+}
+
+
+/* The step of an assignment which adds a constant to its variable, 0 if it is not one */
+    static int32_t
+update_step ( node_t *statement, symbol_t *entry )
+{
+    node_t *value, *left, *right;
+
+    if (statement->type.index != ASSIGNMENT_STATEMENT || statement->children[0]->entry != entry) {
+        return 0;
+    }
+    value = statement->children[1];
+    if (value->type.index != EXPRESSION || value->n_children != 2) {
+        return 0;
+    }
+    left = value->children[0];
+    right = value->children[1];
+    if (strcmp(value->data, "+") == 0 && left->type.index == VARIABLE && left->entry == entry
+        && right->type.index == INTEGER) {
+        return *(int32_t *) right->data;
+    }
+    if (strcmp(value->data, "+") == 0 && right->type.index == VARIABLE && right->entry == entry
+        && left->type.index == INTEGER) {
+        return *(int32_t *) left->data;
+    }
+    if (strcmp(value->data, "-") == 0 && left->type.index == VARIABLE && left->entry == entry
+        && right->type.index == INTEGER) {
+        return (int32_t) -(uint32_t) *(int32_t *) right->data;
+    }
+    return 0;
+}
+
+
+/* The statement list of a loop body, NULL if it has none */
+    static node_t *
+body_list ( node_t *body )
+{
+    if (body->type.index == BLOCK) {
+        body = body->children[1];
+    }
+    return (body->type.index == STATEMENT_LIST) ? body : NULL;
+}
+
+
+/*
+ * Reduce the variable in the head of a loop and a list of statements,
+ * where every assignment to it is a top level statement which counts it
+ * up or down, and put steps of the locals right after those.
+ */
+    static node_t *
+reduce_list ( node_t **head, node_t *list, node_t *start, int32_t *changes )
+{
+    node_t **expressions = malloc(sizeof(*expressions) * (list->n_children + 1)), *prefix;
+    uint32_t n = 0;
+
+    if (expressions == NULL) {
+        fprintf(stderr, "Failed to allocate heap for induction variables.\n");
+        abort();
+    }
+    expressions[n++] = *head;
+    for (uint32_t s = 0; s < list->n_children; s++) {
+        if (update_step(list->children[s], induction) == 0) {
+            expressions[n++] = list->children[s];
+        }
+    }
+    prefix = reduce_loop(expressions, n, start, changes);
+
+    n = 0;
+    *head = expressions[n++];
+    for (uint32_t s = 0; s < list->n_children; s++) {
+        int32_t step = update_step(list->children[s], induction);
+        if (step == 0) {
+            list->children[s] = expressions[n++];
+        } else if (prefix != NULL) {
+            node_t *counted = statement_list_new(2);
+            counted->children[counted->n_children++] = list->children[s];
+            counted->children[counted->n_children++] = steps(step);
+            list->children[s] = counted;
+        }
+    }
+    free(expressions);
+    return prefix;
+}
+
+
+/* Number of top level statements in a list which count the variable up or down */
+    static uint32_t
+count_updates ( node_t *list )
+{
+    uint32_t n = 0;
+
+    for (uint32_t s = 0; s < list->n_children; s++) {
+        if (update_step(list->children[s], induction) != 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+
+    static node_t *
+reduce_for ( node_t *root, int32_t *changes )
+{
+    node_t *start = root->children[0]->children[1], *list, *body, *prefix;
+    node_t *expressions[2] = { root->children[1], root->children[2] };
+
+    loop = root;
+    induction = root->children[0]->children[0]->entry;
+    if (expression_has_call(start)) {
+        return root;
+    }
+
+    if (!subtree_assigns(root->children[2], induction)) {
+        prefix = reduce_loop(expressions, 2, start, changes);
+        root->children[1] = expressions[0];
+        root->children[2] = expressions[1];
+    } else {
+        /* A partially unrolled body counts the variable up between its copies */
+        list = body_list(root->children[2]);
+        if (list == NULL || count_updates(list) != count_assignments(list, induction)) {
+            return root;
+        }
+        prefix = reduce_list(&root->children[1], list, start, changes);
+    }
+    if (prefix == NULL) {
+        return root;
+    }
+
+    /* The locals go up at the end of the body, where the variable does */
+    body = statement_list_new(2);
+    body->children[body->n_children++] = root->children[2];
+    body->children[body->n_children++] = steps(1);
+    root->children[2] = body;
+    prefix->children[prefix->n_children++] = root;
+    return prefix;
+}
+
+
+    static node_t *
+reduce_while ( node_t *root, int32_t *changes )
+{
+    node_t *list = body_list(root->children[1]), *result = NULL;
+
+    if (list == NULL) {
+        return root;
+    }
+
+    /* Every variable which top level statements count up or down, and nothing else assigns */
+    for (uint32_t s = 0; s < list->n_children; s++) {
+        node_t *update = list->children[s], *prefix;
+        bool first = true;
+
+        if (update->type.index != ASSIGNMENT_STATEMENT) {
+            continue;
+        }
+        loop = root;
+        induction = update->children[0]->entry;
+        for (uint32_t t = 0; t < s; t++) {
+            first = first && !subtree_assigns(list->children[t], induction);
+        }
+        if (!first || update_step(update, induction) == 0
+            || count_updates(list) != count_assignments(root, induction)) {
+            continue;
+        }
+
+        prefix = reduce_list(&root->children[0], list, NULL, changes);
+        if (prefix == NULL) {
+            continue;
+        }
+        if (result == NULL) {
+            result = statement_list_new(1);
+        }
+        result->children = realloc(result->children, sizeof(node_t *) * (result->n_children + 2));
+        if (result->children == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for induction variables.\n");
+            abort();
+        }
+        result->children[result->n_children++] = prefix;
+    }
+
+    if (result == NULL) {
+        return root;
+    }
+    result->children[result->n_children++] = root;
+    return result;
+}
+
+
+    static node_t *
+reduce_statement ( node_t *root, int32_t *changes )
+{
+    if (root == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = reduce_statement(root->children[i], changes);
+    }
+    switch (root->type.index) {
+        case FOR_STATEMENT:
+            return reduce_for(root, changes);
+        case WHILE_STATEMENT:
+            return reduce_while(root, changes);
+        default:
+            return root;
+    }
+}
+
+
+    int32_t
+reduce_induction_variables ( node_t *root )
+{
+    node_t *functions = root->children[0];
+    int32_t changes = 0;
+
+    for (uint32_t f = 0; f < functions->n_children; f++) {
+        node_t *function = functions->children[f], *body = function->children[function->n_children - 1];
+        if (temporaries_open(function)) {
+            body->children[1] = reduce_statement(body->children[1], &changes);
+            temporaries_close();
+        }
+    }
+    free(derived);
+    derived = NULL;
+    derived_capacity = 0;
+    return changes;
+}
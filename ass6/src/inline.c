@@ -0,0 +1,728 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+/*
+ * Inlining of small functions. A call in an assignment, a return, an IF
+ * condition or a print statement is replaced by statements which assign
+ * the arguments to new locals standing in for the parameters, zero new
+ * locals standing in for the callee's own, and run a copy of its body in
+ * which every return assigns a local for the result, which is what the
+ * call reads instead. A function is inlined if its body, with returns
+ * made into assignments, has at most SMALL_SIZE nodes, or LEAF_SIZE if
+ * it calls nothing. The limit doubles for calls with a literal argument,
+ * which fold and sccp then propagate into the copy, and a function grows
+ * by at most GROWTH nodes in all. Functions which can reach themselves
+ * through calls are never inlined, and the others are rewritten callees
+ * first, so what is inlined already has its own calls inlined.
+ *
+ * The copy runs before the rest of the statement, so a call is only
+ * inlined if what the statement does before it has no effect and cannot
+ * trap, or the function and the arguments are pure, cannot trap, and
+ * always return. Returns have to end every way through the body, and
+ * the statements after an IF which returns in one arm are moved into the
+ * other, so a body with a return in a loop is not inlined. WHILE
+ * conditions and FOR bounds are left alone.
+ */
+
+enum { SMALL_SIZE = 24, LEAF_SIZE = 64, GROWTH = 512 };
+
+typedef struct {
+    node_t *function;
+    symbol_t *entry;
+    uint32_t *callees, n_callees, capacity;
+    bool recursive, visited, done;
+    bool prepared;
+    node_t *body;                   /* Copy with assigned returns, NULL if it cannot be had */
+} inline_function_t;
+
+/* What a symbol of the callee is replaced by in a copy */
+typedef struct {
+    symbol_t *from, *to;
+} rename_t;
+
+static inline_function_t *functions;
+static uint32_t n_functions;
+
+static rename_t *renames;
+static uint32_t n_renames, renames_capacity;
+
+/* Stands in for the result in the prepared bodies */
+static symbol_t result = { 0, 0, NULL };
+
+static inline_function_t *caller;
+static int32_t growth;
+
+
+    static inline_function_t *
+function_find ( symbol_t *entry )
+{
+    for (uint32_t f = 0; f < n_functions; f++) {
+        if (functions[f].entry == entry) {
+            return &functions[f];
+        }
+    }
+    return NULL;
+}
+
+
+/* True if the subtree has a node of the type */
+    static bool
+contains ( node_t *root, uint32_t type )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (root->type.index == type) {
+        return true;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (contains(root->children[i], type)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* True if the subtree divides by something other than a constant which cannot trap */
+    static bool
+traps ( node_t *root )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (root->type.index == EXPRESSION && root->n_children == 2 && strcmp(root->data, "/") == 0) {
+        node_t *divisor = root->children[1];
+        if (divisor->type.index != INTEGER || *(int32_t *) divisor->data == 0
+            || *(int32_t *) divisor->data == -1) {
+            return true;
+        }
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (traps(root->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* True if running the function has no effect, cannot trap, and always returns */
+    static bool
+is_safe ( inline_function_t *function )
+{
+    node_t *body = function->function->children[function->function->n_children - 1];
+    return purity_is_pure(function->entry) && !expression_has_call(body) && !traps(body)
+        && !contains(body, WHILE_STATEMENT) && !contains(body, FOR_STATEMENT);
+}
+
+
+/* Call graph */
+
+
+    static void
+find_callees ( node_t *root, inline_function_t *function )
+{
+    if (root == NULL) {
+        return;
+    }
+    if (expression_is_call(root)) {
+        inline_function_t *callee = function_find(root->children[0]->entry);
+        if (callee != NULL) {
+            function->callees = array_grow(function->callees, function->n_callees, &function->capacity,
+                sizeof(*function->callees));
+            function->callees[function->n_callees++] = callee - functions;
+        }
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        find_callees(root->children[i], function);
+    }
+}
+
+
+    static bool
+reaches ( inline_function_t *from, inline_function_t *target, bool *seen )
+{
+    for (uint32_t c = 0; c < from->n_callees; c++) {
+        inline_function_t *callee = &functions[from->callees[c]];
+        if (callee == target) {
+            return true;
+        }
+        if (!seen[from->callees[c]]) {
+            seen[from->callees[c]] = true;
+            if (reaches(callee, target, seen)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+/* Preparing bodies */
+
+
+/* Add statements to the end of a list */
+    static void
+list_append ( node_t *list, node_t **statements, uint32_t n )
+{
+    list->children = realloc(list->children, sizeof(node_t *) * (list->n_children + n + 1));
+    if (list->children == NULL) {
+        fprintf(stderr, "Failed to reallocate heap for inlining.\n");
+        abort();
+    }
+    memcpy(&list->children[list->n_children], statements, sizeof(node_t *) * n);
+    list->n_children += n;
+}
+
+
+    static node_t *
+as_list ( node_t *statement )
+{
+    node_t *list;
+
+    if (statement->type.index == STATEMENT_LIST) {
+        return statement;
+    }
+    list = statement_list_new(1);
+    list->children[list->n_children++] = statement;
+    return list;
+}
+
+
+/* The symbol a block declares for a name, the shallowest one by that name in it */
+    static symbol_t *
+declared ( node_t *root, char *name )
+{
+    symbol_t *found = NULL;
+
+    if (root == NULL) {
+        return NULL;
+    }
+    if (root->type.index == VARIABLE && root->entry != NULL && function_find(root->entry) == NULL
+        && strcmp(root->data, name) == 0) {
+        return root->entry;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        symbol_t *entry = declared(root->children[i], name);
+        if (entry != NULL && (found == NULL || entry->depth < found->depth)) {
+            found = entry;
+        }
+    }
+    return found;
+}
+
+
+/* An assignment of 0 to a variable */
+    static node_t *
+assign_zero ( symbol_t *entry, char *name )
+{
+    node_t *variable = malloc(sizeof(*variable)), *zero = malloc(sizeof(*zero));
+    node_t *assignment = malloc(sizeof(*assignment));
+
+    node_init(variable, variable_n, STRDUP(name), 0);
+    variable->entry = entry;
+    node_make_integer(node_init(zero, integer_n, NULL, 0), 0);
+    return node_init(assignment, assignment_statement_n, NULL, 2, variable, zero);
+}
+
+
+/*
+ * Replace blocks by lists which zero the locals they declare, and put
+ * the statements of lists in lists into the lists around them. Locals
+ * which are never used are left out.
+ */
+    static node_t *
+unblock ( node_t *root )
+{
+    if (root == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = unblock(root->children[i]);
+    }
+
+    if (root->type.index == BLOCK) {
+        node_t *declarations = root->children[0], *statements = as_list(root->children[1]);
+        node_t *list = statement_list_new(0);
+
+        for (uint32_t d = 0; declarations != NULL && d < declarations->n_children; d++) {
+            node_t *variables = declarations->children[d]->children[0];
+            for (uint32_t v = 0; v < variables->n_children; v++) {
+                symbol_t *entry = declared(statements, variables->children[v]->data);
+                if (entry != NULL) {
+                    node_t *zero = assign_zero(entry, variables->children[v]->data);
+                    list_append(list, &zero, 1);
+                }
+            }
+        }
+        destroy_subtree(declarations);
+        root->n_children = 0;
+        node_finalize(root);
+        root = list;
+        list_append(list, statements->children, statements->n_children);
+        statements->n_children = 0;
+        node_finalize(statements);
+    }
+
+    if (root->type.index == STATEMENT_LIST) {
+        node_t *list = statement_list_new(0);
+        for (uint32_t i = 0; i < root->n_children; i++) {
+            node_t *statement = root->children[i];
+            if (statement->type.index == STATEMENT_LIST) {
+                list_append(list, statement->children, statement->n_children);
+                statement->n_children = 0;
+                node_finalize(statement);
+            } else {
+                list_append(list, &statement, 1);
+            }
+        }
+        root->n_children = 0;
+        node_finalize(root);
+        root = list;
+    }
+    return root;
+}
+
+
+/* Remove the statements after one in a list */
+    static void
+drop_after ( node_t *list, uint32_t i )
+{
+    for (uint32_t k = i + 1; k < list->n_children; k++) {
+        destroy_subtree(list->children[k]);
+    }
+    list->n_children = i + 1;
+}
+
+
+/*
+ * Make the returns of a list into assignments to the result, true if
+ * every way through it ends in one. Nothing runs after a result is set:
+ * statements after a return are dropped, and those after an IF with a
+ * return in only one arm are moved into the other.
+ */
+    static bool
+assign_returns ( node_t *list )
+{
+    for (uint32_t i = 0; i < list->n_children; i++) {
+        node_t *statement = list->children[i], *variable, *assignment;
+        node_t *then, *otherwise;
+        bool then_returns, otherwise_returns;
+
+        if (!contains(statement, RETURN_STATEMENT)) {
+            continue;
+        }
+
+        switch (statement->type.index) {
+            case RETURN_STATEMENT:
+                variable = malloc(sizeof(*variable));
+                assignment = malloc(sizeof(*assignment));
+                node_init(variable, variable_n, STRDUP("_result"), 0);
+                variable->entry = &result;
+                list->children[i] = node_init(assignment, assignment_statement_n, NULL, 2,
+                    variable, statement->children[0]);
+                statement->n_children = 0;
+                node_finalize(statement);
+                drop_after(list, i);
+                return true;
+
+            case IF_STATEMENT:
+                if (statement->n_children == 2) {
+                    statement->children = realloc(statement->children, sizeof(node_t *) * 3);
+                    if (statement->children == NULL) {
+                        fprintf(stderr, "Failed to reallocate heap for inlining.\n");
+                        abort();
+                    }
+                    statement->children[statement->n_children++] = statement_list_new(0);
+                }
+                then = statement->children[1] = as_list(statement->children[1]);
+                otherwise = statement->children[2] = as_list(statement->children[2]);
+                then_returns = contains(then, RETURN_STATEMENT);
+                otherwise_returns = contains(otherwise, RETURN_STATEMENT);
+
+                if (!then_returns || !otherwise_returns) {
+                    list_append(then_returns ? otherwise : then,
+                        &list->children[i + 1], list->n_children - i - 1);
+                    list->n_children = i + 1;
+                }
+                drop_after(list, i);
+                return assign_returns(then) && assign_returns(otherwise);
+
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+
+/* The body to copy for a function, prepared the first time it is asked for */
+    static node_t *
+prepared_body ( inline_function_t *function )
+{
+    node_t *body;
+
+    if (function->prepared) {
+        return function->body;
+    }
+    function->prepared = true;
+    body = subtree_copy(function->function->children[function->function->n_children - 1]);
+    body = unblock(as_list(body));
+    if (assign_returns(body)) {
+        function->body = body;
+    } else {
+        destroy_subtree(body);
+    }
+    return function->body;
+}
+
+
+/* Rewriting call sites */
+
+
+    static symbol_t *
+renamed ( symbol_t *from )
+{
+    for (uint32_t r = 0; r < n_renames; r++) {
+        if (renames[r].from == from) {
+            return renames[r].to;
+        }
+    }
+    renames = array_grow(renames, n_renames, &renames_capacity, sizeof(*renames));
+    renames[n_renames++] = (rename_t) { from, temporary_new("in") };
+    return renames[n_renames - 1].to;
+}
+
+
+/* Make every local and parameter of the callee in a copy refer to a temporary */
+    static void
+rename_variables ( node_t *root )
+{
+    if (root == NULL) {
+        return;
+    }
+    if (root->type.index == VARIABLE && root->entry != NULL && function_find(root->entry) == NULL) {
+        node_t *read = temporary_read(renamed(root->entry));
+        free(root->data);
+        root->data = read->data;
+        root->entry = read->entry;
+        read->data = NULL;
+        node_finalize(read);
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        rename_variables(root->children[i]);
+    }
+}
+
+
+/* The symbol of a parameter, from the uses of its name in the body, NULL if it has none */
+    static symbol_t *
+parameter ( node_t *root, char *name )
+{
+    symbol_t *found = NULL;
+
+    if (root == NULL) {
+        return NULL;
+    }
+    if (root->type.index == VARIABLE && root->entry != NULL && function_find(root->entry) == NULL
+        && root->entry->stack_offset > 0 && strcmp(root->data, name) == 0) {
+        return root->entry;
+    }
+    for (uint32_t i = 0; i < root->n_children && found == NULL; i++) {
+        found = parameter(root->children[i], name);
+    }
+    return found;
+}
+
+
+    static bool
+is_inlinable ( inline_function_t *callee, node_t *call )
+{
+    node_t *parameters = callee->function->children[1], *arguments = call->children[1], *body;
+    uint32_t n_parameters = (parameters == NULL) ? 0 : parameters->n_children;
+    uint32_t n_arguments = (arguments == NULL) ? 0 : arguments->n_children;
+    uint32_t limit, cost;
+
+    if (callee->recursive || callee == caller || !callee->done || n_parameters != n_arguments) {
+        return false;
+    }
+    body = prepared_body(callee);
+    if (body == NULL) {
+        return false;
+    }
+
+    cost = subtree_size(body);
+    limit = expression_has_call(body) ? SMALL_SIZE : LEAF_SIZE;
+    for (uint32_t a = 0; a < n_arguments; a++) {
+        if (arguments->children[a]->type.index == INTEGER) {
+            limit *= 2;
+            break;
+        }
+    }
+    return cost <= limit && growth + (int32_t) cost <= GROWTH;
+}
+
+
+/*
+ * The first call in an expression which can be inlined, in the order
+ * they are made. dirty is set once something which has an effect or can
+ * trap has been evaluated, and only safe calls can go before that.
+ */
+    static node_t *
+find_call ( node_t *root, bool *dirty )
+{
+    node_t *found;
+
+    if (root == NULL || root->type.index == INTEGER || root->type.index == VARIABLE
+        || root->type.index == TEXT) {
+        return NULL;
+    }
+
+    if (expression_is_call(root)) {
+        inline_function_t *callee = function_find(root->children[0]->entry);
+        bool safe = callee != NULL && is_safe(callee);
+
+        if (callee != NULL && is_inlinable(callee, root)
+            && (!*dirty || (safe && !expression_has_call(root->children[1]) && !traps(root->children[1])))) {
+            return root;
+        }
+        found = find_call(root->children[1], dirty);
+        if (!safe) {
+            *dirty = true;
+        }
+        return found;
+    }
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if ((found = find_call(root->children[i], dirty)) != NULL) {
+            return found;
+        }
+    }
+    if (root->type.index == EXPRESSION && traps(root)) {
+        *dirty = true;
+    }
+    return NULL;
+}
+
+
+/* The call in a simple statement to inline first, NULL if there is none */
+    static node_t *
+statement_call ( node_t *statement )
+{
+    bool dirty = false;
+    node_t *found, *items;
+
+    switch (statement->type.index) {
+        case ASSIGNMENT_STATEMENT:
+            return find_call(statement->children[1], &dirty);
+
+        case RETURN_STATEMENT:
+        case IF_STATEMENT:
+            return find_call(statement->children[0], &dirty);
+
+        case PRINT_STATEMENT:
+            /* Items are printed as they are evaluated */
+            items = statement->children[0];
+            for (uint32_t i = 0; i < items->n_children; i++) {
+                if ((found = find_call(items->children[i]->children[0], &dirty)) != NULL) {
+                    return found;
+                }
+                dirty = true;
+            }
+            return NULL;
+
+        default:
+            return NULL;
+    }
+}
+
+
+/* The statements which run a call, leaving a read of its result in its place */
+    static node_t *
+expand ( node_t *call )
+{
+    inline_function_t *callee = function_find(call->children[0]->entry);
+    node_t *parameters = callee->function->children[1], *arguments = call->children[1];
+    node_t *original = callee->function->children[callee->function->n_children - 1];
+    node_t *body = subtree_copy(prepared_body(callee)), *list, *read;
+    uint32_t n_arguments = (arguments == NULL) ? 0 : arguments->n_children;
+
+    growth += subtree_size(body);
+    n_renames = 0;
+    list = statement_list_new(n_arguments + body->n_children);
+    for (uint32_t a = 0; a < n_arguments; a++) {
+        symbol_t *entry = parameter(original, parameters->children[a]->data);
+        symbol_t *temporary = (entry != NULL) ? renamed(entry) : temporary_new("in");
+        list->children[list->n_children++] = temporary_assign(temporary, arguments->children[a]);
+        arguments->children[a] = NULL;
+    }
+    rename_variables(body);
+    list_append(list, body->children, body->n_children);
+    body->n_children = 0;
+    node_finalize(body);
+
+    /* The call reads the result instead */
+    read = temporary_read(renamed(&result));
+    destroy_subtree(call->children[0]);
+    destroy_subtree(arguments);
+    free(call->children);
+    free(call->data);
+    *call = *read;
+    free(read);
+    return list;
+}
+
+
+static void inline_statement ( node_t **slot, int32_t *changes );
+
+
+    static void
+inline_list ( node_t *list, int32_t *changes )
+{
+    uint32_t i = 0;
+
+    while (i < list->n_children) {
+        node_t *call = statement_call(list->children[i]), *statements;
+
+        if (call == NULL) {
+            inline_statement(&list->children[i], changes);
+            i++;
+            continue;
+        }
+
+        /* The statements go in front, and are looked at next */
+        statements = expand(call);
+        list->children = realloc(list->children,
+            sizeof(node_t *) * (list->n_children + statements->n_children + 1));
+        if (list->children == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for inlining.\n");
+            abort();
+        }
+        memmove(&list->children[i + statements->n_children], &list->children[i],
+            sizeof(node_t *) * (list->n_children - i));
+        memcpy(&list->children[i], statements->children, sizeof(node_t *) * statements->n_children);
+        list->n_children += statements->n_children;
+        statements->n_children = 0;
+        node_finalize(statements);
+        (*changes)++;
+    }
+}
+
+
+    static void
+inline_statement ( node_t **slot, int32_t *changes )
+{
+    node_t *statement = *slot;
+
+    if (statement == NULL) {
+        return;
+    }
+
+    switch (statement->type.index) {
+        case STATEMENT_LIST:
+            inline_list(statement, changes);
+            break;
+
+        case BLOCK:
+            inline_statement(&statement->children[1], changes);
+            break;
+
+        case IF_STATEMENT:
+            for (uint32_t i = 1; i < statement->n_children; i++) {
+                inline_statement(&statement->children[i], changes);
+            }
+            break;
+
+        case WHILE_STATEMENT:
+            inline_statement(&statement->children[1], changes);
+            break;
+
+        case FOR_STATEMENT:
+            inline_statement(&statement->children[2], changes);
+            break;
+
+        default:
+            /* A statement on its own in an arm or a loop becomes a list to put the copy in */
+            if (statement_call(statement) != NULL) {
+                *slot = as_list(statement);
+                inline_list(*slot, changes);
+            }
+            break;
+    }
+}
+
+
+/* Rewrite the callees of a function first, and then the function */
+    static void
+visit ( inline_function_t *function, int32_t *changes )
+{
+    node_t *body;
+
+    if (function->visited) {
+        return;
+    }
+    function->visited = true;
+    for (uint32_t c = 0; c < function->n_callees; c++) {
+        visit(&functions[function->callees[c]], changes);
+    }
+
+    body = function->function->children[function->function->n_children - 1];
+    caller = function;
+    growth = 0;
+    if (temporaries_open(function->function)) {
+        inline_statement(&body->children[1], changes);
+        temporaries_close();
+    }
+    caller = NULL;
+    function->done = true;
+}
+
+
+    int32_t
+inline_functions ( node_t *root )
+{
+    node_t *list = root->children[0];
+    int32_t changes = 0;
+    bool *seen;
+
+    purity_analyse(root);
+    n_functions = list->n_children;
+    functions = calloc(n_functions + 1, sizeof(*functions));
+    seen = calloc(n_functions + 1, sizeof(*seen));
+    if (functions == NULL || seen == NULL) {
+        fprintf(stderr, "Failed to allocate heap for inlining.\n");
+        abort();
+    }
+    for (uint32_t f = 0; f < n_functions; f++) {
+        functions[f].function = list->children[f];
+        functions[f].entry = list->children[f]->children[0]->entry;
+    }
+    for (uint32_t f = 0; f < n_functions; f++) {
+        node_t *function = functions[f].function;
+        find_callees(function->children[function->n_children - 1], &functions[f]);
+    }
+    for (uint32_t f = 0; f < n_functions; f++) {
+        memset(seen, 0, sizeof(*seen) * n_functions);
+        functions[f].recursive = reaches(&functions[f], &functions[f], seen);
+    }
+
+    for (uint32_t f = 0; f < n_functions; f++) {
+        visit(&functions[f], &changes);
+    }
+
+    for (uint32_t f = 0; f < n_functions; f++) {
+        free(functions[f].callees);
+        destroy_subtree(functions[f].body);
+    }
+    free(functions);
+    free(seen);
+    free(renames);
+    functions = NULL;
+    renames = NULL;
+    n_functions = n_renames = renames_capacity = 0;
+    purity_finalize();
+    return changes;
+}
@@ -0,0 +1,1016 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+#include "passes.h"
+
+/*
+ * Construction of the mid-level IR. Blocks are made while walking the
+ * statements of a function, and SSA form is built on the way with the
+ * algorithm of Braun et al. (Simple and Efficient Construction of Static
+ * Single Assignment Form, CC 2013): every block maps each variable to its
+ * current value, a read in a block without a definition asks the
+ * predecessors, and a block which may get more predecessors (a loop
+ * header) is sealed when they are all known. Phis which end up with one
+ * distinct operand are removed at the end. Reverse postorder and the
+ * dominator tree (Cooper, Harvey and Kennedy) are computed last.
+ */
+
+
+/* The function being built, depth is the same scope depth as in symtab */
+static ir_function_t *function;
+static ir_block_t *current;
+static uint32_t blocks_capacity, uses_capacity;
+static int32_t n_locals, depth;
+static int32_t *block_base = NULL, block_base_size = 0;
+
+static const char *opcode_names[N_IR_OPCODES] = {
+    [IR_CONSTANT] = "constant", [IR_PARAMETER] = "parameter", [IR_UNDEFINED] = "undefined",
+    [IR_PHI] = "phi", [IR_COPY] = "copy", [IR_NEGATE] = "negate", [IR_BINARY] = "binary",
+    [IR_CALL] = "call", [IR_PRINT] = "print", [IR_JUMP] = "jump", [IR_BRANCH] = "branch",
+    [IR_RETURN] = "return"
+};
+
+static void build_statement ( node_t *root );
+static ir_instruction_t *build_expression ( node_t *root );
+static ir_instruction_t *read_variable ( int32_t variable, ir_block_t *block );
+
+
+/* Instructions */
+
+
+    static ir_instruction_t *
+instruction_new ( ir_opcode_t opcode, node_t *node, uint32_t n_operands )
+{
+    ir_instruction_t *instruction = allocate_zeroed(sizeof(*instruction));
+    instruction->opcode = opcode;
+    instruction->node = node;
+    instruction->variable = -1;
+    instruction->n_operands = n_operands;
+    instruction->operands = allocate_zeroed(sizeof(*instruction->operands) * (n_operands + 1));
+    return instruction;
+}
+
+
+/* Add an instruction at the end of a block, or at its start */
+    static ir_instruction_t *
+append ( ir_block_t *block, ir_instruction_t *instruction )
+{
+    instruction->block = block;
+    instruction->previous = block->last;
+    instruction->next = NULL;
+    if (block->last != NULL) {
+        block->last->next = instruction;
+    } else {
+        block->first = instruction;
+    }
+    block->last = instruction;
+    return instruction;
+}
+
+
+    static ir_instruction_t *
+prepend ( ir_block_t *block, ir_instruction_t *instruction )
+{
+    instruction->block = block;
+    instruction->previous = NULL;
+    instruction->next = block->first;
+    if (block->first != NULL) {
+        block->first->previous = instruction;
+    } else {
+        block->last = instruction;
+    }
+    block->first = instruction;
+    return instruction;
+}
+
+
+    static void
+unlink ( ir_instruction_t *instruction )
+{
+    ir_block_t *block = instruction->block;
+    if (instruction->previous != NULL) {
+        instruction->previous->next = instruction->next;
+    } else {
+        block->first = instruction->next;
+    }
+    if (instruction->next != NULL) {
+        instruction->next->previous = instruction->previous;
+    } else {
+        block->last = instruction->previous;
+    }
+    instruction->previous = instruction->next = NULL;
+}
+
+
+    static ir_instruction_t *
+emit ( ir_opcode_t opcode, node_t *node, uint32_t n_operands )
+{
+    return append(current, instruction_new(opcode, node, n_operands));
+}
+
+
+    static ir_instruction_t *
+constant ( int32_t value, node_t *node )
+{
+    ir_instruction_t *instruction = emit(IR_CONSTANT, node, 0);
+    instruction->value = value;
+    return instruction;
+}
+
+
+/* The value a removed phi stands for */
+    static ir_instruction_t *
+resolve ( ir_instruction_t *value )
+{
+    while (value != NULL && value->replacement != NULL) {
+        value = value->replacement;
+    }
+    return value;
+}
+
+
+    bool
+ir_is_terminator ( ir_instruction_t *instruction )
+{
+    return instruction != NULL && (instruction->opcode == IR_JUMP
+        || instruction->opcode == IR_BRANCH || instruction->opcode == IR_RETURN);
+}
+
+
+/* Blocks */
+
+
+    static ir_block_t *
+block_new ( bool sealed )
+{
+    ir_block_t *block = allocate_zeroed(sizeof(*block));
+    block->id = function->n_blocks;
+    block->order = -1;
+    block->sealed = sealed;
+    block->definitions = allocate_zeroed(sizeof(*block->definitions) * (function->n_variables + 1));
+
+    function->blocks = array_grow(function->blocks, function->n_blocks, &blocks_capacity, sizeof(*function->blocks));
+    function->blocks[function->n_blocks++] = block;
+    return block;
+}
+
+
+    static void
+edge ( ir_block_t *from, ir_block_t *to )
+{
+    from->successors[from->n_successors++] = to;
+    to->predecessors = realloc(to->predecessors, sizeof(*to->predecessors) * (to->n_predecessors + 1));
+    if (to->predecessors == NULL) {
+        fprintf(stderr, "Failed to reallocate heap for the IR.\n");
+        abort();
+    }
+    to->predecessors[to->n_predecessors++] = from;
+}
+
+
+/* End the current block with a jump */
+    static void
+jump ( ir_block_t *to, node_t *node )
+{
+    emit(IR_JUMP, node, 0);
+    edge(current, to);
+}
+
+
+/* End the current block with a branch on a value */
+    static void
+branch ( ir_instruction_t *condition, ir_block_t *taken, ir_block_t *not_taken, node_t *node )
+{
+    ir_instruction_t *instruction = emit(IR_BRANCH, node, 1);
+    instruction->operands[0] = condition;
+    edge(current, taken);
+    edge(current, not_taken);
+}
+
+
+/* SSA construction */
+
+
+    static void
+write_variable ( int32_t variable, ir_block_t *block, ir_instruction_t *value )
+{
+    block->definitions[variable] = value;
+}
+
+
+/*
+ * Remove a phi whose operands are all the same value, or the phi itself.
+ * Its uses are redirected when the function is finished.
+ */
+    static ir_instruction_t *
+remove_trivial_phi ( ir_instruction_t *phi )
+{
+    ir_instruction_t *same = NULL;
+
+    for (uint32_t i = 0; i < phi->n_operands; i++) {
+        ir_instruction_t *operand = resolve(phi->operands[i]);
+        if (operand == same || operand == phi) {
+            continue;
+        }
+        if (same != NULL) {
+            return phi;
+        }
+        same = operand;
+    }
+
+    /* Only reachable through itself: a loop nothing enters */
+    if (same == NULL) {
+        same = prepend(phi->block, instruction_new(IR_UNDEFINED, phi->node, 0));
+        same->variable = phi->variable;
+    }
+
+    unlink(phi);
+    phi->replacement = same;
+    phi->next = function->removed;
+    function->removed = phi;
+    return same;
+}
+
+
+    static ir_instruction_t *
+add_phi_operands ( ir_instruction_t *phi )
+{
+    ir_block_t *block = phi->block;
+
+    free(phi->operands);
+    phi->n_operands = block->n_predecessors;
+    phi->operands = allocate_zeroed(sizeof(*phi->operands) * (phi->n_operands + 1));
+    for (uint32_t i = 0; i < block->n_predecessors; i++) {
+        phi->operands[i] = read_variable(phi->variable, block->predecessors[i]);
+    }
+    return remove_trivial_phi(phi);
+}
+
+
+    static ir_instruction_t *
+new_phi ( int32_t variable, ir_block_t *block )
+{
+    ir_instruction_t *phi = prepend(block, instruction_new(IR_PHI, NULL, 0));
+    phi->variable = variable;
+    return phi;
+}
+
+
+    static ir_instruction_t *
+read_variable ( int32_t variable, ir_block_t *block )
+{
+    ir_instruction_t *value = resolve(block->definitions[variable]);
+
+    if (value != NULL) {
+        return value;
+    }
+
+    if (!block->sealed) {
+        /* Operands are added when the block is sealed */
+        value = new_phi(variable, block);
+    } else if (block->n_predecessors == 0) {
+        value = prepend(block, instruction_new(IR_UNDEFINED, NULL, 0));
+        value->variable = variable;
+    } else if (block->n_predecessors == 1) {
+        value = read_variable(variable, block->predecessors[0]);
+    } else {
+        /* Break cycles through loops with the phi before reading */
+        value = new_phi(variable, block);
+        write_variable(variable, block, value);
+        value = add_phi_operands(value);
+    }
+    write_variable(variable, block, value);
+    return value;
+}
+
+
+/* All the predecessors are known, finish the phis made before */
+    static void
+seal ( ir_block_t *block )
+{
+    ir_instruction_t *instruction = block->first, *next;
+
+    block->sealed = true;
+    while (instruction != NULL && (instruction->opcode == IR_PHI || instruction->opcode == IR_UNDEFINED)) {
+        next = instruction->next;
+        if (instruction->opcode == IR_PHI && instruction->n_operands == 0) {
+            add_phi_operands(instruction);
+        }
+        instruction = next;
+    }
+}
+
+
+/* Slots */
+
+
+/* The slot of a variable, numbered like variable_register in the bytecode compiler */
+    static int32_t
+variable_slot ( symbol_t *entry )
+{
+    if (entry->stack_offset > 0) {
+        return function->n_parameters - entry->stack_offset / 4 + 1;
+    }
+    return function->n_parameters + block_base[entry->depth] - entry->stack_offset / 4 - 1;
+}
+
+
+/* The most locals live at the same time in a statement */
+    static int32_t
+local_slots ( node_t *root )
+{
+    int32_t most = 0, own = 0;
+
+    if (root == NULL) {
+        return 0;
+    }
+    if (root->type.index == BLOCK && root->children[0] != NULL) {
+        for (uint32_t i = 0; i < root->children[0]->n_children; i++) {
+            own += root->children[0]->children[i]->children[0]->n_children;
+        }
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        int32_t inner = local_slots(root->children[i]);
+        if (inner > most) {
+            most = inner;
+        }
+    }
+    return own + most;
+}
+
+
+/* Tree walk */
+
+
+    static ir_instruction_t *
+build_expression ( node_t *root )
+{
+    ir_instruction_t *instruction, *left;
+
+    switch (root->type.index) {
+        case INTEGER:
+            return constant(*(int32_t *) root->data, root);
+
+        case VARIABLE: {
+            int32_t variable = variable_slot(root->entry);
+            instruction = read_variable(variable, current);
+            function->uses = array_grow(function->uses, function->n_uses, &uses_capacity, sizeof(*function->uses));
+            function->uses[function->n_uses++] = (ir_use_t) { root, instruction, variable };
+            return instruction;
+        }
+
+        case EXPRESSION:
+            if (root->n_children == 1) {
+                left = build_expression(root->children[0]);
+                instruction = emit(IR_NEGATE, root, 1);
+                instruction->operands[0] = left;
+                return instruction;
+            }
+            if (*(char *) root->data == 'F') {
+                node_t *arguments = root->children[1];
+                uint32_t n_arguments = (arguments != NULL) ? arguments->n_children : 0;
+                ir_instruction_t **values = allocate_zeroed(sizeof(*values) * (n_arguments + 1));
+
+                for (uint32_t i = 0; i < n_arguments; i++) {
+                    values[i] = build_expression(arguments->children[i]);
+                }
+                instruction = emit(IR_CALL, root, 0);
+                free(instruction->operands);
+                instruction->operands = values;
+                instruction->n_operands = n_arguments;
+                instruction->label = root->children[0]->entry->label;
+                return instruction;
+            }
+            left = build_expression(root->children[0]);
+            ir_instruction_t *right = build_expression(root->children[1]);
+            instruction = emit(IR_BINARY, root, 2);
+            instruction->op = root->data;
+            instruction->operands[0] = left;
+            instruction->operands[1] = right;
+            return instruction;
+
+        default:
+            fprintf(stderr, "IR: unexpected %s in an expression\n", root->type.text);
+            exit(EXIT_FAILURE);
+    }
+}
+
+
+    static void
+build_block ( node_t *root )
+{
+    node_t *declarations = root->children[0];
+
+    depth++;
+    if (depth >= block_base_size) {
+        block_base_size = 2 * depth + 8;
+        block_base = realloc(block_base, sizeof(*block_base) * block_base_size);
+        if (block_base == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for block frames.\n");
+            abort();
+        }
+    }
+    block_base[depth] = n_locals;
+
+    /* Declared variables start out as 0, unless they are not cleared */
+    if (declarations != NULL) {
+        for (uint32_t i = 0; i < declarations->n_children; i++) {
+            node_t *variables = declarations->children[i]->children[0];
+            bool cleared = DECLARATION_CLEARED(declarations->children[i]);
+            for (uint32_t n = 0; n < variables->n_children; n++) {
+                int32_t variable = function->n_parameters + n_locals++;
+                ir_instruction_t *value = constant(0, variables->children[n]);
+                if (!cleared) {
+                    value->opcode = IR_UNDEFINED;
+                    value->variable = variable;
+                }
+                write_variable(variable, current, value);
+            }
+        }
+    }
+
+    build_statement(root->children[1]);
+
+    n_locals = block_base[depth];
+    depth--;
+}
+
+
+    static void
+build_if ( node_t *root )
+{
+    ir_instruction_t *condition = build_expression(root->children[0]);
+    ir_block_t *then = block_new(false), *otherwise = NULL, *join = block_new(false);
+
+    if (root->n_children == 3) {
+        otherwise = block_new(false);
+    }
+    branch(condition, then, (otherwise != NULL) ? otherwise : join, root);
+    seal(then);
+
+    current = then;
+    build_statement(root->children[1]);
+    if (current != NULL) {
+        jump(join, root);
+    }
+
+    if (otherwise != NULL) {
+        seal(otherwise);
+        current = otherwise;
+        build_statement(root->children[2]);
+        if (current != NULL) {
+            jump(join, root);
+        }
+    }
+
+    seal(join);
+    current = join;
+}
+
+
+    static void
+build_while ( node_t *root )
+{
+    ir_block_t *header = block_new(false), *body = block_new(false), *exit = block_new(false);
+
+    jump(header, root);
+    current = header;
+    branch(build_expression(root->children[0]), body, exit, root);
+    seal(body);
+    seal(exit);
+
+    current = body;
+    build_statement(root->children[1]);
+    if (current != NULL) {
+        jump(header, root);
+    }
+
+    seal(header);
+    current = exit;
+}
+
+
+/*
+ * FOR loops assign the start value, and leave when the variable equals
+ * the end, which is evaluated again before every iteration. The variable
+ * is incremented after the body.
+ */
+    static void
+build_for ( node_t *root )
+{
+    ir_block_t *header = block_new(false), *body = block_new(false), *exit = block_new(false);
+    int32_t variable = variable_slot(root->children[0]->children[0]->entry);
+    ir_instruction_t *test, *increment, *value, *end;
+
+    build_statement(root->children[0]);
+    jump(header, root);
+
+    current = header;
+    value = read_variable(variable, current);
+    end = build_expression(root->children[1]);
+    test = emit(IR_BINARY, root, 2);
+    test->op = "!=";
+    test->operands[0] = value;
+    test->operands[1] = end;
+    branch(test, body, exit, root);
+    seal(body);
+    seal(exit);
+
+    current = body;
+    build_statement(root->children[2]);
+    if (current != NULL) {
+        value = read_variable(variable, current);
+        ir_instruction_t *one = constant(1, root);
+        increment = emit(IR_BINARY, root, 2);
+        increment->op = "+";
+        increment->variable = variable;
+        increment->operands[0] = value;
+        increment->operands[1] = one;
+        write_variable(variable, current, increment);
+        jump(header, root);
+    }
+
+    seal(header);
+    current = exit;
+}
+
+
+    static void
+build_statement ( node_t *root )
+{
+    ir_instruction_t *instruction, *value;
+
+    if (root == NULL) {
+        return;
+    }
+
+    /* Statements after a return get a block nothing jumps to */
+    if (current == NULL) {
+        current = block_new(true);
+    }
+
+    switch (root->type.index) {
+        case BLOCK:
+            build_block(root);
+            break;
+
+        case ASSIGNMENT_STATEMENT:
+            value = build_expression(root->children[1]);
+            instruction = emit(IR_COPY, root, 1);
+            instruction->operands[0] = value;
+            instruction->variable = variable_slot(root->children[0]->entry);
+            write_variable(instruction->variable, current, instruction);
+            break;
+
+        case RETURN_STATEMENT:
+            value = build_expression(root->children[0]);
+            instruction = emit(IR_RETURN, root, 1);
+            instruction->operands[0] = value;
+            current = NULL;
+            break;
+
+        case PRINT_LIST: {
+            uint32_t n_values = 0;
+            ir_instruction_t **values = allocate_zeroed(sizeof(*values) * (root->n_children + 1));
+
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                node_t *item = root->children[i]->children[0];
+                if (item->type.index != TEXT) {
+                    values[n_values++] = build_expression(item);
+                }
+            }
+            instruction = emit(IR_PRINT, root, 0);
+            free(instruction->operands);
+            instruction->operands = values;
+            instruction->n_operands = n_values;
+            break;
+        }
+
+        case IF_STATEMENT:
+            build_if(root);
+            break;
+
+        case WHILE_STATEMENT:
+            build_while(root);
+            break;
+
+        case FOR_STATEMENT:
+            build_for(root);
+            break;
+
+        case NULL_STATEMENT:
+            break;
+
+        default:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                build_statement(root->children[i]);
+            }
+            break;
+    }
+}
+
+
+/* Finishing a function */
+
+
+/* Point every operand and use past the phis which were removed */
+    static void
+resolve_operands ( void )
+{
+    bool changed = true;
+
+    /* Removing a phi can leave the phis that use it with one operand */
+    while (changed) {
+        changed = false;
+        for (uint32_t b = 0; b < function->n_blocks; b++) {
+            ir_instruction_t *instruction = function->blocks[b]->first, *next;
+            while (instruction != NULL && instruction->opcode == IR_PHI) {
+                next = instruction->next;
+                if (remove_trivial_phi(instruction) != instruction) {
+                    changed = true;
+                }
+                instruction = next;
+            }
+        }
+    }
+
+    for (uint32_t b = 0; b < function->n_blocks; b++) {
+        for (ir_instruction_t *i = function->blocks[b]->first; i != NULL; i = i->next) {
+            for (uint32_t k = 0; k < i->n_operands; k++) {
+                i->operands[k] = resolve(i->operands[k]);
+            }
+        }
+    }
+    for (uint32_t u = 0; u < function->n_uses; u++) {
+        function->uses[u].value = resolve(function->uses[u].value);
+    }
+}
+
+
+    static void
+postorder ( ir_block_t *block, ir_block_t **order, uint32_t *n_order )
+{
+    block->order = 0;
+    for (uint32_t s = block->n_successors; s > 0; s--) {
+        if (block->successors[s - 1]->order < 0) {
+            postorder(block->successors[s - 1], order, n_order);
+        }
+    }
+    order[(*n_order)++] = block;
+}
+
+
+    static ir_block_t *
+intersect ( ir_block_t *a, ir_block_t *b )
+{
+    while (a != b) {
+        while (a->order > b->order) {
+            a = a->dominator;
+        }
+        while (b->order > a->order) {
+            b = b->dominator;
+        }
+    }
+    return a;
+}
+
+
+/*
+ * Sort the blocks in reverse postorder, unreachable ones last, number
+ * them and their values in that order, and find immediate dominators.
+ */
+    static void
+order_blocks ( void )
+{
+    ir_block_t **order = allocate_zeroed(sizeof(*order) * (function->n_blocks + 1));
+    ir_block_t **sorted = allocate_zeroed(sizeof(*sorted) * (function->n_blocks + 1));
+    uint32_t n_order = 0, n_sorted = 0;
+    bool changed = true;
+
+    postorder(function->blocks[0], order, &n_order);
+    for (uint32_t b = n_order; b > 0; b--) {
+        order[b - 1]->order = n_sorted;
+        sorted[n_sorted++] = order[b - 1];
+    }
+    for (uint32_t b = 0; b < function->n_blocks; b++) {
+        if (function->blocks[b]->order < 0) {
+            sorted[n_sorted++] = function->blocks[b];
+        }
+    }
+    free(function->blocks);
+    free(order);
+    function->blocks = sorted;
+
+    function->n_values = 0;
+    for (uint32_t b = 0; b < function->n_blocks; b++) {
+        function->blocks[b]->id = b;
+        for (ir_instruction_t *i = function->blocks[b]->first; i != NULL; i = i->next) {
+            i->id = function->n_values++;
+        }
+    }
+
+    /* Dominators, the entry is its own while this runs */
+    function->blocks[0]->dominator = function->blocks[0];
+    while (changed) {
+        changed = false;
+        for (uint32_t b = 1; b < n_order; b++) {
+            ir_block_t *block = function->blocks[b], *dominator = NULL;
+            for (uint32_t p = 0; p < block->n_predecessors; p++) {
+                ir_block_t *predecessor = block->predecessors[p];
+                if (predecessor->order < 0 || predecessor->dominator == NULL) {
+                    continue;
+                }
+                dominator = (dominator == NULL) ? predecessor : intersect(predecessor, dominator);
+            }
+            if (dominator != block->dominator) {
+                block->dominator = dominator;
+                changed = true;
+            }
+        }
+    }
+    function->blocks[0]->dominator = NULL;
+}
+
+
+    static void
+build_function ( node_t *root, ir_function_t *result )
+{
+    node_t *parameters = root->children[1];
+
+    function = result;
+    *function = (ir_function_t) { 0 };
+    function->node = root;
+    function->name = root->children[0]->entry->label;
+    function->n_parameters = (parameters != NULL) ? parameters->n_children : 0;
+    function->n_variables = function->n_parameters + local_slots(root->children[root->n_children - 1]);
+    blocks_capacity = uses_capacity = 0;
+    n_locals = 0;
+    depth = 2;
+
+    current = block_new(true);
+    for (int32_t p = 0; p < function->n_parameters; p++) {
+        ir_instruction_t *parameter = emit(IR_PARAMETER, parameters->children[p], 0);
+        parameter->value = p;
+        parameter->variable = p;
+        write_variable(p, current, parameter);
+    }
+
+    build_statement(root->children[root->n_children - 1]);
+
+    /* Falling off the end of the body */
+    if (current != NULL) {
+        emit(IR_RETURN, root, 0);
+    }
+
+    resolve_operands();
+    order_blocks();
+
+    for (uint32_t b = 0; b < function->n_blocks; b++) {
+        free(function->blocks[b]->definitions);
+        function->blocks[b]->definitions = NULL;
+    }
+}
+
+
+    ir_program_t *
+ir_build ( node_t *root )
+{
+    node_t *functions = root->children[0];
+    ir_program_t *program = allocate_zeroed(sizeof(*program));
+
+    program->n_functions = functions->n_children;
+    program->functions = allocate_zeroed(sizeof(*program->functions) * (program->n_functions + 1));
+    for (uint32_t f = 0; f < functions->n_children; f++) {
+        build_function(functions->children[f], &program->functions[f]);
+    }
+    return program;
+}
+
+
+/* Queries */
+
+
+    bool
+ir_dominates ( ir_block_t *dominator, ir_block_t *block )
+{
+    if (dominator->order < 0 || block->order < 0) {
+        return false;
+    }
+    while (block != NULL && block != dominator) {
+        block = block->dominator;
+    }
+    return block == dominator;
+}
+
+
+/* True if a value is computed before it is used at an instruction */
+    static bool
+available ( ir_instruction_t *value, ir_instruction_t *use, ir_block_t *at )
+{
+    if (value->block != at) {
+        return ir_dominates(value->block, at);
+    }
+    if (use == NULL) {
+        return true;
+    }
+    for (ir_instruction_t *i = value; i != NULL; i = i->next) {
+        if (i == use) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*
+ * Check the SSA form of reachable code: every operand is computed on all
+ * paths to its use, phis have an operand per predecessor, and blocks end
+ * in exactly one terminator. Problems are written to the stream.
+ */
+    bool
+ir_verify ( FILE *stream, ir_program_t *program )
+{
+    bool valid = true;
+
+    for (uint32_t f = 0; f < program->n_functions; f++) {
+        ir_function_t *fn = &program->functions[f];
+        for (uint32_t b = 0; b < fn->n_blocks && fn->blocks[b]->order >= 0; b++) {
+            ir_block_t *block = fn->blocks[b];
+            if (!ir_is_terminator(block->last)) {
+                fprintf(stream, "IR: %s B%d does not end in a terminator\n", fn->name, block->id);
+                valid = false;
+            }
+            for (ir_instruction_t *i = block->first; i != NULL; i = i->next) {
+                if (ir_is_terminator(i) && i != block->last) {
+                    fprintf(stream, "IR: %s v%d ends B%d early\n", fn->name, i->id, block->id);
+                    valid = false;
+                }
+                if (i->opcode == IR_PHI && i->n_operands != block->n_predecessors) {
+                    fprintf(stream, "IR: %s phi v%d has the wrong number of operands\n", fn->name, i->id);
+                    valid = false;
+                }
+                for (uint32_t k = 0; k < i->n_operands; k++) {
+                    ir_instruction_t *operand = i->operands[k];
+                    bool ok = (i->opcode == IR_PHI)
+                        ? (block->predecessors[k]->order < 0 || available(operand, NULL, block->predecessors[k]))
+                        : available(operand, i, block);
+                    if (!ok) {
+                        fprintf(stream, "IR: %s v%d uses v%d where it is not available\n",
+                            fn->name, i->id, operand->id);
+                        valid = false;
+                    }
+                }
+            }
+        }
+    }
+    return valid;
+}
+
+
+/* Printing */
+
+
+/* The name of the variable an instruction defines, if the tree has it */
+    static char *
+variable_name ( ir_instruction_t *i )
+{
+    if (i->node == NULL) {
+        return NULL;
+    }
+    switch (i->node->type.index) {
+        case VARIABLE: return i->node->data;
+        case ASSIGNMENT_STATEMENT: return i->node->children[0]->data;
+        case FOR_STATEMENT: return i->node->children[0]->children[0]->data;
+        default: return NULL;
+    }
+}
+
+
+    static void
+print_instruction ( FILE *stream, ir_instruction_t *i )
+{
+    fprintf(stream, "    ");
+    if (!ir_is_terminator(i) && i->opcode != IR_PRINT) {
+        fprintf(stream, "v%d = ", i->id);
+    }
+
+    switch (i->opcode) {
+        case IR_CONSTANT:
+            fprintf(stream, "%d", i->value);
+            break;
+        case IR_BINARY:
+            fprintf(stream, "v%d %s v%d", i->operands[0]->id, i->op, i->operands[1]->id);
+            break;
+        case IR_NEGATE:
+            fprintf(stream, "-v%d", i->operands[0]->id);
+            break;
+        case IR_COPY:
+            fprintf(stream, "v%d", i->operands[0]->id);
+            break;
+        case IR_PHI:
+            fprintf(stream, "phi");
+            for (uint32_t k = 0; k < i->n_operands; k++) {
+                fprintf(stream, "%s v%d B%d", (k > 0) ? "," : "", i->operands[k]->id,
+                    i->block->predecessors[k]->id);
+            }
+            break;
+        case IR_CALL:
+            fprintf(stream, "call %s (", i->label);
+            for (uint32_t k = 0; k < i->n_operands; k++) {
+                fprintf(stream, "%sv%d", (k > 0) ? ", " : "", i->operands[k]->id);
+            }
+            fprintf(stream, ")");
+            break;
+        case IR_JUMP:
+            fprintf(stream, "jump B%d", i->block->successors[0]->id);
+            break;
+        case IR_BRANCH:
+            fprintf(stream, "branch v%d, B%d, B%d", i->operands[0]->id,
+                i->block->successors[0]->id, i->block->successors[1]->id);
+            break;
+        default:
+            fprintf(stream, "%s", opcode_names[i->opcode]);
+            if (i->opcode == IR_PARAMETER) {
+                fprintf(stream, " %d", i->value);
+            }
+            for (uint32_t k = 0; k < i->n_operands; k++) {
+                fprintf(stream, "%s v%d", (k > 0) ? "," : "", i->operands[k]->id);
+            }
+            break;
+    }
+
+    if (i->variable >= 0) {
+        char *name = variable_name(i);
+        fprintf(stream, "\t; $%d%s%s", i->variable, (name != NULL) ? " " : "", (name != NULL) ? name : "");
+    }
+    fputc('\n', stream);
+}
+
+
+    void
+ir_print ( FILE *stream, ir_program_t *program )
+{
+    for (uint32_t f = 0; f < program->n_functions; f++) {
+        ir_function_t *fn = &program->functions[f];
+        fprintf(stream, "%sfunction %s, %d parameters, %d variables\n", (f > 0) ? "\n" : "",
+            fn->name, fn->n_parameters, fn->n_variables);
+        for (uint32_t b = 0; b < fn->n_blocks; b++) {
+            ir_block_t *block = fn->blocks[b];
+            fprintf(stream, "B%d:", block->id);
+            if (block->n_predecessors > 0) {
+                fprintf(stream, "\t; from");
+                for (uint32_t p = 0; p < block->n_predecessors; p++) {
+                    fprintf(stream, " B%d", block->predecessors[p]->id);
+                }
+            }
+            if (block->dominator != NULL) {
+                fprintf(stream, ", dominated by B%d", block->dominator->id);
+            }
+            if (block->order < 0) {
+                fprintf(stream, "\t; unreachable");
+            }
+            fputc('\n', stream);
+            for (ir_instruction_t *i = block->first; i != NULL; i = i->next) {
+                print_instruction(stream, i);
+            }
+        }
+    }
+}
+
+
+    static void
+instruction_finalize ( ir_instruction_t *instruction )
+{
+    free(instruction->operands);
+    free(instruction);
+}
+
+
+    void
+ir_finalize ( ir_program_t *program )
+{
+    for (uint32_t f = 0; f < program->n_functions; f++) {
+        ir_function_t *fn = &program->functions[f];
+        for (uint32_t b = 0; b < fn->n_blocks; b++) {
+            ir_instruction_t *instruction = fn->blocks[b]->first, *next;
+            while (instruction != NULL) {
+                next = instruction->next;
+                instruction_finalize(instruction);
+                instruction = next;
+            }
+            free(fn->blocks[b]->predecessors);
+            free(fn->blocks[b]->definitions);
+            free(fn->blocks[b]);
+        }
+        while (fn->removed != NULL) {
+            ir_instruction_t *next = fn->removed->next;
+            instruction_finalize(fn->removed);
+            fn->removed = next;
+        }
+        free(fn->blocks);
+        free(fn->uses);
+    }
+    free(program->functions);
+    free(program);
+}
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+
+/*
+ * Run an encoded program in this process: the text and data are copied
+ * into fresh pages, relocated against their own addresses and the library
+ * functions vslc is linked with, and main is called like the C runtime
+ * would call it. Programs end by calling exit, so this does not return.
+ */
+
+int32_t jit_argc = 0;
+char **jit_argv = NULL;
+
+/* The functions programs call, as the linker would resolve them */
+static const struct {
+    char *name;
+    void *address;
+} runtime[] = {
+    { "printf", (void *) printf },
+    { "putchar", (void *) putchar },
+    { "strtol", (void *) strtol },
+    { "exit", (void *) exit }
+};
+
+/*
+ * On x86-64 the library may be out of reach of a 32 bit displacement, so
+ * calls go through stubs after the text: jmp *address(%rip), then the
+ * address. 32 bit calls reach everywhere and need no stubs.
+ */
+#define STUB_SIZE 14
+
+
+    static void *
+runtime_lookup ( char *name )
+{
+    for (uint32_t i = 0; i < sizeof(runtime) / sizeof(runtime[0]); i++) {
+        if (strcmp(runtime[i].name, name) == 0) {
+            return runtime[i].address;
+        }
+    }
+    fprintf(stderr, "Undefined reference to '%s'\n", name);
+    exit(EXIT_FAILURE);
+}
+
+
+    static uintptr_t
+page_align ( uintptr_t size, uintptr_t page )
+{
+    return (size + page - 1) / page * page;
+}
+
+
+/*
+ * Tell perf where the functions are: one line of start, size and name per
+ * function, in /tmp/perf-<pid>.map
+ */
+    static void
+perf_map_write ( object_t *object, uint8_t *text )
+{
+    char name[32];
+    FILE *map;
+
+    sprintf(name, "/tmp/perf-%d.map", (int) getpid());
+    if ((map = fopen(name, "w")) == NULL) {
+        return;
+    }
+    for (uint32_t s = 0; s < object->n_symbols; s++) {
+        if (object->symbols[s].function) {
+            fprintf(map, "%lx %x %s\n", (unsigned long) (text + object->symbols[s].offset),
+                object->symbols[s].size, object->symbols[s].name);
+        }
+    }
+    fclose(map);
+}
+
+
+    void
+jit_run ( object_t *object )
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    bool stubs = (object->target == TARGET_X86_64);
+    uintptr_t code_size = page_align(object->text_size + (stubs ? STUB_SIZE * object->n_symbols : 0), page);
+    uintptr_t size = code_size + page_align(object->data_size + 1, page);
+    uint8_t *text, *data, *stub;
+    void *entry = NULL;
+
+    text = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (text == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    data = text + code_size;
+    stub = text + object->text_size;
+    memcpy(text, object->text, object->text_size);
+    memcpy(data, object->data, object->data_size);
+
+    /* Addresses of the symbols, library functions get a stub each */
+    uintptr_t *addresses = malloc(sizeof(*addresses) * (object->n_symbols + 1));
+    for (uint32_t s = 0; s < object->n_symbols; s++) {
+        object_symbol_t *symbol = &object->symbols[s];
+        if (symbol->section == SECTION_TEXT) {
+            addresses[s] = (uintptr_t) (text + symbol->offset);
+        } else if (symbol->section == SECTION_DATA) {
+            addresses[s] = (uintptr_t) (data + symbol->offset);
+        } else if (stubs) {
+            uintptr_t function = (uintptr_t) runtime_lookup(symbol->name);
+            memcpy(stub, "\xFF\x25\x00\x00\x00\x00", 6);
+            memcpy(stub + 6, &function, 8);
+            addresses[s] = (uintptr_t) stub;
+            stub += STUB_SIZE;
+        } else {
+            addresses[s] = (uintptr_t) runtime_lookup(symbol->name);
+        }
+        if (symbol->function && strcmp(symbol->name, "main") == 0) {
+            entry = (void *) addresses[s];
+        }
+    }
+
+    for (uint32_t r = 0; r < object->n_relocations; r++) {
+        relocation_t *relocation = &object->relocations[r];
+        uintptr_t place = (uintptr_t) (text + relocation->offset);
+        intptr_t value = addresses[relocation->symbol] + relocation->addend;
+        if (relocation->kind != RELOCATION_ABSOLUTE) {
+            value -= place;
+        }
+        if (value != (int32_t) value && (relocation->kind != RELOCATION_ABSOLUTE || value != (uint32_t) value)) {
+            fprintf(stderr, "Relocation out of range at text offset %u\n", relocation->offset);
+            exit(EXIT_FAILURE);
+        }
+        int32_t field = value;
+        memcpy((void *) place, &field, 4);
+    }
+    free(addresses);
+
+    if (entry == NULL) {
+        fprintf(stderr, "Program has no entry point\n");
+        exit(EXIT_FAILURE);
+    }
+    if (mprotect(text, code_size, PROT_READ | PROT_EXEC) != 0) {
+        perror("mprotect");
+        exit(EXIT_FAILURE);
+    }
+    perf_map_write(object, text);
+
+    ((int (*) ( int, char ** )) entry)(jit_argc, jit_argv);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+#include "ir.h"
+
+/*
+ * Loop-invariant code motion for WHILE and FOR loops. A loop is the
+ * block which tests its condition, and every block the test leads to
+ * before it gets back to it, which is its body even when the body always
+ * returns. An expression in a loop is invariant if every variable it
+ * reads has a value defined outside the loop, in code which runs, and
+ * every function it calls is pure. It
+ * is then computed once, into a new local assigned just before the loop
+ * statement, which plays the preheader. An expression goes in front of
+ * the outermost loop it is invariant in, and what is left of it can
+ * leave the loops further out on its own.
+ *
+ * Arithmetic which cannot trap is moved from anywhere in a loop, even
+ * when the loop might not run, or the expression might not be reached.
+ * Calls and divisions are only moved from the condition of a WHILE and
+ * the end value of a FOR, which are evaluated at least once whenever the
+ * loop is, and only when nothing the condition or the loop does before
+ * can be seen. Locals of enclosing functions are not reached through
+ * frames in this compiler, every variable is at a fixed offset from the
+ * frame of its own function, so there are no address computations to
+ * move.
+ */
+
+typedef struct {
+    node_t *node;                   /* The WHILE or FOR */
+    ir_block_t *header;
+    bool *in_loop;                  /* Indexed by block id */
+} loop_t;
+
+/* The value a variable read sees */
+typedef struct {
+    node_t *node;
+    ir_instruction_t *value;
+} read_t;
+
+/* Loops in the tree around what is being rewritten, outermost first */
+typedef struct {
+    loop_t *loop;
+    node_t **prefix;
+    uint32_t n_prefix, capacity;
+} open_loop_t;
+
+/* Loops and reads of the whole program, sorted by node */
+static loop_t *loops;
+static uint32_t n_loops, loops_capacity;
+static read_t *reads;
+static uint32_t n_reads, reads_capacity;
+
+static open_loop_t *open_loops;
+static uint32_t n_open, open_capacity;
+
+
+/* Loops and reads start with their node, so they sort and search like nodes */
+    static loop_t *
+loop_find ( node_t *node )
+{
+    return bsearch(&node, loops, n_loops, sizeof(*loops), node_compare);
+}
+
+
+    static read_t *
+read_find ( node_t *node )
+{
+    return bsearch(&node, reads, n_reads, sizeof(*reads), node_compare);
+}
+
+
+/* Analysis */
+
+
+    static void
+find_loops ( ir_function_t *function )
+{
+    for (uint32_t u = 0; u < function->n_uses; u++) {
+        reads = array_grow(reads, n_reads, &reads_capacity, sizeof(*reads));
+        reads[n_reads++] = (read_t) { function->uses[u].node, function->uses[u].value };
+    }
+
+    for (uint32_t b = 0; b < function->n_blocks; b++) {
+        ir_block_t *header = function->blocks[b], **stack;
+        ir_instruction_t *branch = header->last;
+        uint32_t n_stack = 0;
+        loop_t *loop;
+
+        if (branch == NULL || branch->opcode != IR_BRANCH
+            || (branch->node->type.index != WHILE_STATEMENT && branch->node->type.index != FOR_STATEMENT)) {
+            continue;
+        }
+
+        loops = array_grow(loops, n_loops, &loops_capacity, sizeof(*loops));
+        loop = &loops[n_loops++];
+        loop->node = branch->node;
+        loop->header = header;
+        loop->in_loop = calloc(function->n_blocks + 1, sizeof(*loop->in_loop));
+        stack = malloc(sizeof(*stack) * (function->n_blocks + 1));
+        if (loop->in_loop == NULL || stack == NULL) {
+            fprintf(stderr, "Failed to allocate heap for code motion.\n");
+            abort();
+        }
+
+        /* The body is whatever the test leads to before it gets back to it */
+        loop->in_loop[header->id] = true;
+        if (!loop->in_loop[header->successors[0]->id]) {
+            loop->in_loop[header->successors[0]->id] = true;
+            stack[n_stack++] = header->successors[0];
+        }
+        while (n_stack > 0) {
+            ir_block_t *block = stack[--n_stack];
+            for (uint32_t s = 0; s < block->n_successors; s++) {
+                ir_block_t *successor = block->successors[s];
+                if (!loop->in_loop[successor->id]) {
+                    loop->in_loop[successor->id] = true;
+                    stack[n_stack++] = successor;
+                }
+            }
+        }
+        free(stack);
+    }
+}
+
+
+    static bool
+is_invariant ( node_t *root, loop_t *loop )
+{
+    read_t *read;
+
+    switch (root->type.index) {
+        case INTEGER:
+            return true;
+
+        case VARIABLE:
+            read = read_find(root);
+            return read != NULL && read->value->opcode != IR_UNDEFINED
+                && read->value->block->order >= 0 && !loop->in_loop[read->value->block->id];
+
+        case EXPRESSION:
+            if (expression_is_call(root)) {
+                return purity_is_pure(root->children[0]->entry)
+                    && (root->children[1] == NULL || is_invariant(root->children[1], loop));
+            }
+            /* Fall through */
+        case EXPRESSION_LIST:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                if (!is_invariant(root->children[i], loop)) {
+                    return false;
+                }
+            }
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+/* True if the expression contains a call, or a division which can trap */
+    static bool
+is_guarded ( node_t *root )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (expression_is_call(root)) {
+        return true;
+    }
+    if (root->type.index == EXPRESSION && root->n_children == 2 && strcmp(root->data, "/") == 0) {
+        node_t *divisor = root->children[1];
+        if (divisor->type.index != INTEGER || *(int32_t *) divisor->data == 0 || *(int32_t *) divisor->data == -1) {
+            return true;
+        }
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (is_guarded(root->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* Rewriting */
+
+
+/*
+ * Move the invariant parts of an expression in front of the loops it is
+ * in. Only the innermost 'limit' open loops enclose it, and 'first' is
+ * the open loop it is evaluated first thing in, or -1.
+ */
+    static node_t *
+hoist ( node_t *root, uint32_t limit, int32_t first, int32_t *changes )
+{
+    int32_t level = -1;
+
+    if (root == NULL) {
+        return NULL;
+    }
+
+    if (root->type.index == EXPRESSION) {
+        if (is_guarded(root)) {
+            if (first >= 0 && (uint32_t) first < limit && is_invariant(root, open_loops[first].loop)) {
+                level = first;
+            }
+        } else {
+            for (uint32_t l = 0; l < limit && level < 0; l++) {
+                if (is_invariant(root, open_loops[l].loop)) {
+                    level = l;
+                }
+            }
+        }
+    }
+
+    if (level >= 0) {
+        open_loop_t *target = &open_loops[level];
+        symbol_t *temporary = temporary_new("licm");
+
+        /* What is left can still leave the loops further out */
+        for (uint32_t i = 0; i < root->n_children; i++) {
+            root->children[i] = hoist(root->children[i], level, -1, changes);
+        }
+        target->prefix = array_grow(target->prefix, target->n_prefix, &target->capacity, sizeof(*target->prefix));
+        target->prefix[target->n_prefix++] = temporary_assign(temporary, root);
+        (*changes)++;
+        return temporary_read(temporary);
+    }
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = hoist(root->children[i], limit, first, changes);
+    }
+    return root;
+}
+
+
+    static bool
+loop_open ( node_t *root )
+{
+    loop_t *loop = loop_find(root);
+
+    if (loop == NULL) {
+        return false;
+    }
+    open_loops = array_grow(open_loops, n_open, &open_capacity, sizeof(*open_loops));
+    open_loops[n_open++] = (open_loop_t) { loop, NULL, 0, 0 };
+    return true;
+}
+
+
+/* Close the innermost loop, with what was moved out of it in front */
+    static node_t *
+loop_close ( node_t *root )
+{
+    open_loop_t *closed = &open_loops[--n_open];
+    node_t *list;
+
+    if (closed->n_prefix == 0) {
+        return root;
+    }
+    list = node_list_new(statement_list_n, closed->n_prefix + 1);
+    memcpy(list->children, closed->prefix, sizeof(node_t *) * closed->n_prefix);
+    list->children[closed->n_prefix] = root;
+    free(closed->prefix);
+    return list;
+}
+
+
+    static node_t *
+rewrite_statement ( node_t *root, int32_t *changes )
+{
+    int32_t first;
+
+    if (root == NULL) {
+        return NULL;
+    }
+    switch (root->type.index) {
+        case WHILE_STATEMENT:
+            if (!loop_open(root)) {
+                break;
+            }
+            first = purity_expression_is_pure(root->children[0]) ? (int32_t) n_open - 1 : -1;
+            root->children[0] = hoist(root->children[0], n_open, first, changes);
+            root->children[1] = rewrite_statement(root->children[1], changes);
+            return loop_close(root);
+
+        case FOR_STATEMENT:
+            /* The start value is computed before the loop */
+            root->children[0]->children[1] = hoist(root->children[0]->children[1], n_open, -1, changes);
+            if (!loop_open(root)) {
+                break;
+            }
+            first = (purity_expression_is_pure(root->children[1]) && !expression_has_call(root->children[0]))
+                ? (int32_t) n_open - 1 : -1;
+            root->children[1] = hoist(root->children[1], n_open, first, changes);
+            root->children[2] = rewrite_statement(root->children[2], changes);
+            return loop_close(root);
+
+        case ASSIGNMENT_STATEMENT:
+            root->children[1] = hoist(root->children[1], n_open, -1, changes);
+            return root;
+
+        case RETURN_STATEMENT: case PRINT_LIST:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                root->children[i] = hoist(root->children[i], n_open, -1, changes);
+            }
+            return root;
+
+        case IF_STATEMENT:
+            root->children[0] = hoist(root->children[0], n_open, -1, changes);
+            for (uint32_t i = 1; i < root->n_children; i++) {
+                root->children[i] = rewrite_statement(root->children[i], changes);
+            }
+            return root;
+
+        case STATEMENT_LIST: {
+            uint32_t n = 0, capacity = 0;
+            node_t **statements = NULL;
+
+            /* Lists made for the moved assignments are spliced into this one */
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                node_t *statement = rewrite_statement(root->children[i], changes);
+                if (statement->type.index != STATEMENT_LIST) {
+                    statements = array_grow(statements, n, &capacity, sizeof(*statements));
+                    statements[n++] = statement;
+                    continue;
+                }
+                for (uint32_t k = 0; k < statement->n_children; k++) {
+                    statements = array_grow(statements, n, &capacity, sizeof(*statements));
+                    statements[n++] = statement->children[k];
+                }
+                statement->n_children = 0;
+                node_finalize(statement);
+            }
+            free(root->children);
+            root->children = statements;
+            root->n_children = n;
+            return root;
+        }
+
+        default:
+            break;
+    }
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = rewrite_statement(root->children[i], changes);
+    }
+    return root;
+}
+
+
+    int32_t
+move_loop_invariants ( node_t *root )
+{
+    node_t *functions = root->children[0];
+    ir_program_t *program = ir_build(root);
+    int32_t changes = 0;
+
+    n_loops = n_reads = 0;
+    for (uint32_t f = 0; f < program->n_functions; f++) {
+        find_loops(&program->functions[f]);
+    }
+    qsort(loops, n_loops, sizeof(*loops), node_compare);
+    qsort(reads, n_reads, sizeof(*reads), node_compare);
+    purity_analyse(root);
+
+    for (uint32_t f = 0; f < functions->n_children; f++) {
+        node_t *function = functions->children[f], *body = function->children[function->n_children - 1];
+        if (temporaries_open(function)) {
+            body->children[1] = rewrite_statement(body->children[1], &changes);
+            temporaries_close();
+        }
+    }
+
+    for (uint32_t l = 0; l < n_loops; l++) {
+        free(loops[l].in_loop);
+    }
+    ir_finalize(program);
+    purity_finalize();
+    free(loops);
+    free(reads);
+    free(open_loops);
+    loops = NULL;
+    reads = NULL;
+    open_loops = NULL;
+    loops_capacity = reads_capacity = open_capacity = 0;
+    return changes;
+}
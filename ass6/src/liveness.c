@@ -0,0 +1,600 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+#include "liveness.h"
+
+/*
+ * Liveness analysis, and the passes built on it. Live sets are found by
+ * the usual backward dataflow over the reachable blocks, visited in
+ * postorder until nothing changes.
+ *
+ * Dead stores are assignments whose value is not live after them. Values
+ * only count as used by instructions which are needed themselves: those
+ * which print, return, branch or call, and everything they use in turn.
+ * A store which only feeds another dead store, or itself around a loop,
+ * is dead too. The zeros of a declaration are dead stores of the same
+ * kind when every read sees an assignment instead.
+ */
+
+/* The function being analysed */
+static ir_function_t *function;
+static bool *needed;
+static ir_instruction_t **worklist;
+static uint32_t n_worklist, worklist_capacity;
+
+/* Sorted nodes of the whole program */
+static node_t **removable, **dead, **uncleared;
+static uint32_t n_removable, removable_capacity, n_dead, dead_capacity, n_uncleared, uncleared_capacity;
+
+
+/* Sets */
+
+
+    static bool
+set_has ( uint32_t *set, int32_t id )
+{
+    return (set[id / 32] >> (id % 32)) & 1;
+}
+
+
+    static void
+set_add ( uint32_t *set, int32_t id )
+{
+    set[id / 32] |= 1u << (id % 32);
+}
+
+
+    static void
+set_remove ( uint32_t *set, int32_t id )
+{
+    set[id / 32] &= ~(1u << (id % 32));
+}
+
+
+/* Analysis */
+
+
+    static bool
+counts ( bool *counted, ir_instruction_t *i )
+{
+    return counted == NULL || counted[i->id];
+}
+
+
+/* What is live when a block is entered, given what is live when it is left */
+    static void
+transfer ( liveness_t *liveness, ir_block_t *block, bool *counted, uint32_t *live )
+{
+    memcpy(live, liveness->live_out[block->id], sizeof(*live) * liveness->n_words);
+    for (ir_instruction_t *i = block->last; i != NULL; i = i->previous) {
+        set_remove(live, i->id);
+        if (i->opcode != IR_PHI && counts(counted, i)) {
+            for (uint32_t k = 0; k < i->n_operands; k++) {
+                set_add(live, i->operands[k]->id);
+            }
+        }
+    }
+}
+
+
+    liveness_t *
+liveness_analyse ( ir_function_t *analysed, bool *counted )
+{
+    liveness_t *liveness = allocate_zeroed(sizeof(*liveness));
+    uint32_t n_reachable = 0, *live;
+    bool changed = true;
+
+    liveness->function = analysed;
+    liveness->n_words = (analysed->n_values + 31) / 32 + 1;
+    liveness->live_in = allocate_zeroed(sizeof(*liveness->live_in) * (analysed->n_blocks + 1));
+    liveness->live_out = allocate_zeroed(sizeof(*liveness->live_out) * (analysed->n_blocks + 1));
+    for (uint32_t b = 0; b < analysed->n_blocks; b++) {
+        liveness->live_in[b] = allocate_zeroed(sizeof(**liveness->live_in) * liveness->n_words);
+        liveness->live_out[b] = allocate_zeroed(sizeof(**liveness->live_out) * liveness->n_words);
+        if (analysed->blocks[b]->order >= 0) {
+            n_reachable++;
+        }
+    }
+    live = allocate_zeroed(sizeof(*live) * liveness->n_words);
+
+    while (changed) {
+        changed = false;
+        for (uint32_t b = n_reachable; b > 0; b--) {
+            ir_block_t *block = analysed->blocks[b - 1];
+            uint32_t *out = liveness->live_out[block->id];
+
+            for (uint32_t s = 0; s < block->n_successors; s++) {
+                ir_block_t *successor = block->successors[s];
+                for (uint32_t w = 0; w < liveness->n_words; w++) {
+                    out[w] |= liveness->live_in[successor->id][w];
+                }
+                /* Operands of phis which come along this edge */
+                for (ir_instruction_t *i = successor->first; i != NULL && i->opcode == IR_PHI; i = i->next) {
+                    if (!counts(counted, i)) {
+                        continue;
+                    }
+                    for (uint32_t p = 0; p < successor->n_predecessors; p++) {
+                        if (successor->predecessors[p] == block) {
+                            set_add(out, i->operands[p]->id);
+                        }
+                    }
+                }
+            }
+
+            transfer(liveness, block, counted, live);
+            if (memcmp(live, liveness->live_in[block->id], sizeof(*live) * liveness->n_words) != 0) {
+                memcpy(liveness->live_in[block->id], live, sizeof(*live) * liveness->n_words);
+                changed = true;
+            }
+        }
+    }
+
+    free(live);
+    return liveness;
+}
+
+
+    void
+liveness_finalize ( liveness_t *liveness )
+{
+    for (uint32_t b = 0; b < liveness->function->n_blocks; b++) {
+        free(liveness->live_in[b]);
+        free(liveness->live_out[b]);
+    }
+    free(liveness->live_in);
+    free(liveness->live_out);
+    free(liveness);
+}
+
+
+    bool
+liveness_live_in ( liveness_t *liveness, ir_block_t *block, ir_instruction_t *value )
+{
+    return set_has(liveness->live_in[block->id], value->id);
+}
+
+
+    bool
+liveness_live_out ( liveness_t *liveness, ir_block_t *block, ir_instruction_t *value )
+{
+    return set_has(liveness->live_out[block->id], value->id);
+}
+
+
+/* Dead stores */
+
+
+    static bool
+node_find ( node_t **nodes, uint32_t n_nodes, node_t *node )
+{
+    return bsearch(&node, nodes, n_nodes, sizeof(*nodes), node_compare) != NULL;
+}
+
+
+    static node_t **
+node_add ( node_t **nodes, uint32_t *n_nodes, uint32_t *capacity, node_t *node )
+{
+    nodes = array_grow(nodes, *n_nodes, capacity, sizeof(*nodes));
+    nodes[(*n_nodes)++] = node;
+    return nodes;
+}
+
+
+/* True if evaluating the expression can stop the program */
+    static bool
+may_trap ( node_t *root )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (root->type.index == EXPRESSION && root->n_children == 2 && strcmp(root->data, "/") == 0) {
+        node_t *divisor = root->children[1];
+        if (divisor->type.index != INTEGER || *(int32_t *) divisor->data == 0
+            || *(int32_t *) divisor->data == -1) {
+            return true;
+        }
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (may_trap(root->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* Assignments which can go without changing what else happens */
+    static void
+find_removable ( node_t *root )
+{
+    if (root == NULL) {
+        return;
+    }
+    switch (root->type.index) {
+        case ASSIGNMENT_STATEMENT:
+            if (!expression_has_call(root->children[1]) && !may_trap(root->children[1])) {
+                removable = node_add(removable, &n_removable, &removable_capacity, root);
+            }
+            return;
+        case FOR_STATEMENT:
+            /* The loop needs its first assignment */
+            find_removable(root->children[2]);
+            return;
+        case EXPRESSION:
+            return;
+        default:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                find_removable(root->children[i]);
+            }
+            return;
+    }
+}
+
+
+    static void
+need ( ir_instruction_t *i )
+{
+    if (needed[i->id]) {
+        return;
+    }
+    needed[i->id] = true;
+    worklist = array_grow(worklist, n_worklist, &worklist_capacity, sizeof(*worklist));
+    worklist[n_worklist++] = i;
+}
+
+
+    static bool
+is_root ( ir_instruction_t *i )
+{
+    switch (i->opcode) {
+        case IR_CALL: case IR_PRINT: case IR_JUMP: case IR_BRANCH: case IR_RETURN:
+            return true;
+        case IR_COPY:
+            return !node_find(removable, n_removable, i->node);
+        default:
+            return false;
+    }
+}
+
+
+    static void
+analyse ( ir_function_t *analysed )
+{
+    liveness_t *liveness;
+    uint32_t *live;
+
+    function = analysed;
+    needed = allocate_zeroed(sizeof(*needed) * (function->n_values + 1));
+    n_worklist = 0;
+
+    for (uint32_t b = 0; b < function->n_blocks && function->blocks[b]->order >= 0; b++) {
+        for (ir_instruction_t *i = function->blocks[b]->first; i != NULL; i = i->next) {
+            if (is_root(i)) {
+                need(i);
+            }
+        }
+    }
+    while (n_worklist > 0) {
+        ir_instruction_t *i = worklist[--n_worklist];
+        for (uint32_t k = 0; k < i->n_operands; k++) {
+            need(i->operands[k]);
+        }
+    }
+
+    /* Stores whose value is not live right after them */
+    liveness = liveness_analyse(function, needed);
+    live = allocate_zeroed(sizeof(*live) * liveness->n_words);
+    for (uint32_t b = 0; b < function->n_blocks && function->blocks[b]->order >= 0; b++) {
+        ir_block_t *block = function->blocks[b];
+        memcpy(live, liveness->live_out[block->id], sizeof(*live) * liveness->n_words);
+        for (ir_instruction_t *i = block->last; i != NULL; i = i->previous) {
+            if (!set_has(live, i->id)) {
+                if (i->opcode == IR_COPY && node_find(removable, n_removable, i->node)) {
+                    dead = node_add(dead, &n_dead, &dead_capacity, i->node);
+                } else if (i->opcode == IR_CONSTANT && i->node->type.index == VARIABLE) {
+                    uncleared = node_add(uncleared, &n_uncleared, &uncleared_capacity, i->node);
+                }
+            }
+            set_remove(live, i->id);
+            if (i->opcode != IR_PHI && needed[i->id]) {
+                for (uint32_t k = 0; k < i->n_operands; k++) {
+                    set_add(live, i->operands[k]->id);
+                }
+            }
+        }
+    }
+
+    free(live);
+    liveness_finalize(liveness);
+    free(needed);
+}
+
+
+/* Split declarations into runs of variables which are cleared or not */
+    static void
+mark_declarations ( node_t *list, int32_t *changes )
+{
+    node_t **declarations = NULL;
+    uint32_t n_declarations = 0, capacity = 0;
+
+    for (uint32_t d = 0; d < list->n_children; d++) {
+        node_t *declaration = list->children[d], *variables = declaration->children[0];
+        uint32_t start = 0;
+
+        for (uint32_t v = 1; v <= variables->n_children; v++) {
+            bool cleared = !node_find(uncleared, n_uncleared, variables->children[start]);
+            if (v < variables->n_children
+                && cleared == !node_find(uncleared, n_uncleared, variables->children[v])) {
+                continue;
+            }
+
+            /* Variables start .. v-1 are all the same */
+            node_t *run = malloc(sizeof(*run)), *run_variables = node_list_new(variable_list_n, v - start);
+            memcpy(run_variables->children, &variables->children[start], sizeof(node_t *) * (v - start));
+            node_init(run, declaration_n, cleared ? NULL : STRDUP(DECLARATION_UNCLEARED), 1, run_variables);
+            if (!cleared) {
+                *changes += v - start;
+            }
+            declarations = array_grow(declarations, n_declarations, &capacity, sizeof(*declarations));
+            declarations[n_declarations++] = run;
+            start = v;
+        }
+
+        variables->n_children = 0;
+        node_finalize(variables);
+        node_finalize(declaration);
+    }
+
+    free(list->children);
+    list->children = declarations;
+    list->n_children = n_declarations;
+}
+
+
+    static node_t *
+remove_dead ( node_t *root, int32_t *changes )
+{
+    if (root == NULL) {
+        return NULL;
+    }
+
+    if (root->type.index == ASSIGNMENT_STATEMENT && node_find(dead, n_dead, root)) {
+        (*changes)++;
+        destroy_subtree(root->children[0]);
+        destroy_subtree(root->children[1]);
+        free(root->children);
+        free(root->data);
+        return node_init(root, null_statement_n, NULL, 0);
+    }
+    if (root->type.index == DECLARATION_LIST) {
+        mark_declarations(root, changes);
+        return root;
+    }
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = remove_dead(root->children[i], changes);
+    }
+
+    /* Dead statements leave nothing behind in a list */
+    if (root->type.index == STATEMENT_LIST) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < root->n_children; i++) {
+            if (root->children[i]->type.index == NULL_STATEMENT) {
+                destroy_subtree(root->children[i]);
+            } else {
+                root->children[n++] = root->children[i];
+            }
+        }
+        /* Statement lists are never empty */
+        if (n == 0) {
+            root->children[n++] = node_init(malloc(sizeof(node_t)), null_statement_n, NULL, 0);
+        }
+        root->n_children = n;
+    }
+    return root;
+}
+
+
+    int32_t
+remove_dead_stores ( node_t *root )
+{
+    ir_program_t *program;
+    int32_t changes = 0;
+
+    n_removable = n_dead = n_uncleared = 0;
+    find_removable(root);
+    qsort(removable, n_removable, sizeof(*removable), node_compare);
+
+    program = ir_build(root);
+    for (uint32_t f = 0; f < program->n_functions; f++) {
+        analyse(&program->functions[f]);
+    }
+    ir_finalize(program);
+
+    qsort(dead, n_dead, sizeof(*dead), node_compare);
+    qsort(uncleared, n_uncleared, sizeof(*uncleared), node_compare);
+    remove_dead(root, &changes);
+
+    free(removable);
+    free(dead);
+    free(uncleared);
+    free(worklist);
+    removable = dead = uncleared = NULL;
+    worklist = NULL;
+    removable_capacity = dead_capacity = uncleared_capacity = worklist_capacity = 0;
+    return changes;
+}
+
+
+/*
+ * Warnings about variables and parameters which are never read. Names
+ * are found the way bind_names numbered them: parameters by their offset
+ * above the frame, and locals by their depth and offset in the blocks
+ * which are open where they are read.
+ */
+
+typedef struct {
+    node_t *node;
+    bool read, assigned;
+} usage_t;
+
+static usage_t **scopes;
+static uint32_t *n_scope, scopes_capacity;
+static int32_t scope_depth;
+
+
+    static void
+scope_open ( uint32_t n_variables )
+{
+    scope_depth++;
+    if ((uint32_t) scope_depth >= scopes_capacity) {
+        uint32_t capacity = scopes_capacity;
+        scopes = array_grow(scopes, scope_depth, &scopes_capacity, sizeof(*scopes));
+        n_scope = realloc(n_scope, sizeof(*n_scope) * scopes_capacity);
+        if (n_scope == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for liveness.\n");
+            abort();
+        }
+        memset(&scopes[capacity], 0, sizeof(*scopes) * (scopes_capacity - capacity));
+    }
+    n_scope[scope_depth] = 0;
+    scopes[scope_depth] = allocate_zeroed(sizeof(**scopes) * (n_variables + 1));
+}
+
+
+    static void
+scope_add_variable ( node_t *variable )
+{
+    scopes[scope_depth][n_scope[scope_depth]++] = (usage_t) { variable, false, false };
+}
+
+
+/* Usage of the variable a VARIABLE node refers to */
+    static usage_t *
+usage ( node_t *variable )
+{
+    symbol_t *entry = variable->entry;
+
+    if (entry == NULL || entry->stack_offset == 0) {
+        return NULL;
+    }
+    if (entry->stack_offset > 0) {
+        /* Parameters are in the scope of the function, at depth 2 */
+        return &scopes[2][n_scope[2] - entry->stack_offset / 4 + 1];
+    }
+    return &scopes[entry->depth][-entry->stack_offset / 4 - 1];
+}
+
+
+    static int32_t
+scope_close ( char *function_name, bool parameters )
+{
+    int32_t warnings = 0;
+
+    for (uint32_t v = 0; v < n_scope[scope_depth]; v++) {
+        usage_t *u = &scopes[scope_depth][v];
+        if (u->read) {
+            continue;
+        }
+        warnings++;
+        if (parameters) {
+            fprintf(stderr, "Warning: parameter '%s' of '%s' is never used\n", (char *) u->node->data, function_name);
+        } else {
+            fprintf(stderr, "Warning: variable '%s' in '%s' is %s\n", (char *) u->node->data, function_name,
+                u->assigned ? "assigned but never used" : "never used");
+        }
+    }
+    free(scopes[scope_depth]);
+    scope_depth--;
+    return warnings;
+}
+
+
+    static int32_t
+find_unused ( node_t *root, char *function_name )
+{
+    int32_t warnings = 0;
+    usage_t *u;
+
+    if (root == NULL) {
+        return 0;
+    }
+    switch (root->type.index) {
+        case FUNCTION: {
+            node_t *parameters = root->children[1];
+            function_name = root->children[0]->data;
+            scope_open((parameters != NULL) ? parameters->n_children : 0);
+            for (uint32_t p = 0; parameters != NULL && p < parameters->n_children; p++) {
+                scope_add_variable(parameters->children[p]);
+            }
+            warnings += find_unused(root->children[root->n_children - 1], function_name);
+            return warnings + scope_close(function_name, true);
+        }
+
+        case BLOCK: {
+            node_t *declarations = root->children[0];
+            uint32_t n_variables = 0;
+            for (uint32_t d = 0; declarations != NULL && d < declarations->n_children; d++) {
+                n_variables += declarations->children[d]->children[0]->n_children;
+            }
+            scope_open(n_variables);
+            for (uint32_t d = 0; declarations != NULL && d < declarations->n_children; d++) {
+                node_t *variables = declarations->children[d]->children[0];
+                for (uint32_t v = 0; v < variables->n_children; v++) {
+                    scope_add_variable(variables->children[v]);
+                }
+            }
+            warnings += find_unused(root->children[1], function_name);
+            return warnings + scope_close(function_name, false);
+        }
+
+        case ASSIGNMENT_STATEMENT:
+            u = usage(root->children[0]);
+            if (u != NULL) {
+                u->assigned = true;
+            }
+            return find_unused(root->children[1], function_name);
+
+        case FOR_STATEMENT:
+            /* The loop itself reads its variable */
+            u = usage(root->children[0]->children[0]);
+            if (u != NULL) {
+                u->read = true;
+            }
+            break;
+
+        case VARIABLE:
+            u = usage(root);
+            if (u != NULL) {
+                u->read = true;
+            }
+            return 0;
+
+        default:
+            break;
+    }
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        warnings += find_unused(root->children[i], function_name);
+    }
+    return warnings;
+}
+
+
+    int32_t
+warn_unused ( node_t *root )
+{
+    int32_t warnings;
+
+    /* The function list is at depth 1, as in the generator */
+    scope_depth = 1;
+    warnings = find_unused(root, NULL);
+
+    free(scopes);
+    free(n_scope);
+    scopes = NULL;
+    n_scope = NULL;
+    scopes_capacity = 0;
+    return warnings;
+}
@@ -0,0 +1,63 @@
+#include <stdlib.h>
+
+#include "passes.h"
+
+/*
+ * Memoization, only with -e memoize: calls to pure functions which are
+ * recursive, directly or through others, look up their arguments in a
+ * cache of the results of earlier calls, and return what they found
+ * without running the body. The cache is direct mapped, 1 << MEMO_BITS
+ * entries indexed by a hash of the arguments, which are compared in full
+ * before an entry is used, so a collision only costs the call. Results
+ * are stored when the body returns, under the arguments the call was
+ * made with, not what the body assigned to its parameters since. Calls
+ * which trap or never return store nothing. Each backend builds the cache
+ * its own way: the generator in the data of the program, the bytecode VM
+ * in its runtime, and the C backend as a static array.
+ */
+
+
+/* Find out which functions are pure, the backends call this before they start */
+    void
+memoize_analyse ( node_t *root )
+{
+    if (pass_enabled(PASS_MEMOIZE)) {
+        purity_analyse(root);
+    }
+}
+
+
+/* True if calls to a function definition are looked up in a cache */
+    bool
+memoize_function ( node_t *function )
+{
+    symbol_t *entry = function->children[0]->entry;
+    int32_t n_parameters = (function->children[1] == NULL) ? 0 : function->children[1]->n_children;
+
+    return pass_enabled(PASS_MEMOIZE) && n_parameters > 0 && n_parameters <= MEMO_KEYS
+        && purity_is_pure(entry) && purity_is_recursive(entry);
+}
+
+
+/*
+ * Index of the cache entry for a list of arguments: the arguments are
+ * combined like a polynomial in 31, which the generator computes with an
+ * imul and an add for each
+ */
+    uint32_t
+memoize_hash ( uint32_t seed, int32_t *arguments, uint32_t n_arguments )
+{
+    uint32_t hash = seed;
+
+    for (uint32_t a = 0; a < n_arguments; a++) {
+        hash = hash * 31 + (uint32_t) arguments[a];
+    }
+    return hash & ((1 << MEMO_BITS) - 1);
+}
+
+
+    void
+memoize_finalize ( void )
+{
+    purity_finalize();
+}
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "passes.h"
+
+/*
+ * Pass manager: the registry of optimization passes, which of them run
+ * at the selected -O level, and what each of them did. -O0 runs none,
+ * -O1 the ones which only ever make code smaller and faster, -O2 the
+ * rest. The default is -O1. Passes at -O3 trade memory for speed in a
+ * way which only pays for some programs, and only run when -e selects
+ * them.
+ */
+
+int32_t optimization_level = 1;
+bool pass_report = false;
+
+static pass_t passes[N_PASSES] = {
+    [PASS_UNUSED] = { "unused",
+        "Warn about variables and parameters which are never used",
+        PASS_TREE, 0, warn_unused, NULL, 0, 0, 0.0 },
+    [PASS_INLINE] = { "inline",
+        "Replace calls to small functions with a copy of their body",
+        PASS_TREE, 2, inline_functions, NULL, 0, 0, 0.0 },
+    [PASS_FOLD] = { "fold",
+        "Fold constant expressions and algebraic identities",
+        PASS_TREE, 1, fold_constants, NULL, 0, 0, 0.0 },
+    [PASS_SCCP] = { "sccp",
+        "Propagate constants through variables and prune constant branches",
+        PASS_TREE, 1, propagate_constants, NULL, 0, 0, 0.0 },
+    [PASS_EVALUATE] = { "evaluate",
+        "Evaluate calls to pure functions with constant arguments at compile time",
+        PASS_TREE, 1, evaluate_calls, NULL, 0, 0, 0.0 },
+    [PASS_SPECIALIZE] = { "specialize",
+        "Clone functions for calls which pass them constant arguments",
+        PASS_TREE, 2, specialize_functions, NULL, 0, 0, 0.0 },
+    [PASS_UNREACHABLE] = { "unreachable",
+        "Remove statements after a return",
+        PASS_TREE, 1, remove_unreachable, NULL, 0, 0, 0.0 },
+    [PASS_UNROLL] = { "unroll",
+        "Unroll FOR loops with constant bounds, fully or by a factor",
+        PASS_TREE, 2, unroll_loops, NULL, 0, 0, 0.0 },
+    [PASS_CSE] = { "cse",
+        "Compute repeated expressions once, in blocks and across dominators",
+        PASS_TREE, 2, eliminate_common_subexpressions, NULL, 0, 0, 0.0 },
+    [PASS_LICM] = { "licm",
+        "Compute loop invariant expressions and pure calls before the loop",
+        PASS_TREE, 2, move_loop_invariants, NULL, 0, 0, 0.0 },
+    [PASS_INDUCTION] = { "induction",
+        "Turn multiples of loop counters into locals which are added to",
+        PASS_TREE, 2, reduce_induction_variables, NULL, 0, 0, 0.0 },
+    [PASS_DEAD_STORES] = { "dead-stores",
+        "Remove assignments and zeros nothing reads",
+        PASS_TREE, 1, remove_dead_stores, NULL, 0, 0, 0.0 },
+    [PASS_TAIL_CALLS] = { "tail-calls",
+        "Turn calls in return statements into jumps",
+        PASS_CODEGEN, 1, NULL, NULL, 0, 0, 0.0 },
+    [PASS_STRENGTH_REDUCTION] = { "strength-reduction",
+        "Multiply and divide by constants with shifts and adds",
+        PASS_CODEGEN, 1, NULL, NULL, 0, 0, 0.0 },
+    [PASS_LOOP_ROTATION] = { "loop-rotation",
+        "Test loop conditions at the bottom, count FOR loops down in a register",
+        PASS_CODEGEN, 1, NULL, NULL, 0, 0, 0.0 },
+    [PASS_IF_CONVERSION] = { "if-conversion",
+        "Assign one of two values with a conditional move instead of branching",
+        PASS_CODEGEN, 1, NULL, NULL, 0, 0, 0.0 },
+    [PASS_SWITCH] = { "switch",
+        "Dispatch chains of comparisons with constants through a table or a binary search",
+        PASS_CODEGEN, 2, NULL, NULL, 0, 0, 0.0 },
+    [PASS_MEMOIZE] = { "memoize",
+        "Cache the results of pure recursive functions",
+        PASS_CODEGEN, 3, NULL, NULL, 0, 0, 0.0 },
+    [PASS_PEEPHOLE] = { "peephole",
+        "Remove redundant moves, stack traffic and jumps",
+        PASS_INSTRUCTIONS, 2, NULL, peephole_optimize, 0, 0, 0.0 },
+};
+
+
+/* Enable or disable a pass by name, whatever the level says */
+    void
+pass_select ( char *name, bool enabled )
+{
+    for (int32_t p = 0; p < N_PASSES; p++) {
+        if (strcmp(passes[p].name, name) == 0) {
+            passes[p].selected = enabled ? 1 : -1;
+            return;
+        }
+    }
+
+    fprintf(stderr, "Unknown pass '%s', the passes are:\n", name);
+    for (int32_t p = 0; p < N_PASSES; p++) {
+        fprintf(stderr, "  %-20s -O%d  %s\n", passes[p].name, passes[p].level, passes[p].description);
+    }
+    exit(EXIT_FAILURE);
+}
+
+
+    bool
+pass_enabled ( pass_id_t pass )
+{
+    if (passes[pass].selected != 0) {
+        return passes[pass].selected > 0;
+    }
+    return optimization_level >= passes[pass].level;
+}
+
+
+/* Record changes made by a code generation pass */
+    void
+pass_count ( pass_id_t pass, int32_t changes )
+{
+    passes[pass].changes += changes;
+}
+
+
+/* Run one pass and account for it */
+    static void
+pass_run ( pass_t *pass, node_t *root, instruction_t **start )
+{
+    clock_t begin = clock();
+
+    if (pass->kind == PASS_TREE) {
+        pass->changes += pass->run_tree(root);
+    } else {
+        pass->changes += pass->run_instructions(start);
+    }
+    pass->seconds += (double) (clock() - begin) / CLOCKS_PER_SEC;
+}
+
+
+    void
+passes_run_tree ( node_t *root )
+{
+    for (int32_t p = 0; p < N_PASSES; p++) {
+        if (passes[p].kind == PASS_TREE && pass_enabled(p)) {
+            pass_run(&passes[p], root, NULL);
+        }
+    }
+}
+
+
+    void
+passes_run_instructions ( instruction_t **start )
+{
+    for (int32_t p = 0; p < N_PASSES; p++) {
+        if (passes[p].kind == PASS_INSTRUCTIONS && pass_enabled(p)) {
+            pass_run(&passes[p], NULL, start);
+        }
+    }
+}
+
+
+/* Print what every pass did, and how long it took */
+    void
+passes_report ( FILE *stream )
+{
+    double total = 0.0;
+
+    fprintf(stream, "%-20s %5s %5s %8s %10s\n", "pass", "level", "state", "changes", "time (ms)");
+    for (int32_t p = 0; p < N_PASSES; p++) {
+        pass_t *pass = &passes[p];
+        fprintf(stream, "%-20s   -O%d %5s %8d ", pass->name, pass->level,
+            pass_enabled(p) ? "on" : "off", pass->changes);
+        if (pass->kind == PASS_CODEGEN) {
+            fprintf(stream, "%10s\n", "-");
+        } else {
+            fprintf(stream, "%10.3f\n", pass->seconds * 1000.0);
+            total += pass->seconds;
+        }
+    }
+    fprintf(stream, "%-20s %5s %5s %8s %10.3f\n", "total", "", "", "", total * 1000.0);
+}
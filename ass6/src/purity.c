@@ -0,0 +1,471 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+/*
+ * Purity of functions. A function is pure if it prints nothing and only
+ * calls pure functions. The functions are the symbols bind_names made
+ * for the function list, and the call graph between them is built once:
+ * those which print, or call something which is not one of them, are
+ * impure, and so is every caller of an impure function, found by
+ * following the callers from each one that is. VSL has no globals, so a
+ * call to a pure function with the same arguments always gives the same
+ * result, and has no effect other than that. It can still trap, or
+ * never return, so passes must not make calls which would not have been
+ * made.
+ *
+ * Calls to pure functions can also be evaluated here, by walking the
+ * tree of the callee the way the backends would run it. The evaluation
+ * gives up, and the call is left for run time, if it traps, runs more
+ * than EVALUATE_STEPS nodes, nests calls deeper than EVALUATE_CALLS or
+ * blocks deeper than EVALUATE_BLOCKS, or falls off the end of a function.
+ */
+
+enum { EVALUATE_STEPS = 1 << 20, EVALUATE_CALLS = 256, EVALUATE_BLOCKS = 32 };
+
+typedef struct {
+    symbol_t *entry;
+    node_t *function;
+    bool pure;
+    uint32_t *callers, n_callers, capacity;     /* Indices of the functions calling this one */
+} purity_t;
+
+/* A call being evaluated, its variables are on the value stack from bottom */
+typedef struct {
+    uint32_t bottom;
+    int32_t n_parameters, depth;
+    uint32_t base[EVALUATE_BLOCKS];             /* Locals declared outside each open block */
+    uint32_t n_locals;
+    int32_t result;
+} frame_t;
+
+typedef enum { EVALUATE_NEXT, EVALUATE_RETURN, EVALUATE_FAIL } evaluation_t;
+
+static purity_t *functions;
+static uint32_t n_functions;
+
+static int32_t *stack;
+static uint32_t stack_top, stack_capacity;
+static int32_t steps, calls;
+
+static evaluation_t evaluate_statement ( frame_t *frame, node_t *root );
+
+
+    static int
+purity_compare ( const void *a, const void *b )
+{
+    uintptr_t x = (uintptr_t) ((const purity_t *) a)->entry, y = (uintptr_t) ((const purity_t *) b)->entry;
+    return (x > y) - (x < y);
+}
+
+
+    static purity_t *
+purity_find ( symbol_t *entry )
+{
+    purity_t key = { entry, NULL, false, NULL, 0, 0 };
+    return bsearch(&key, functions, n_functions, sizeof(*functions), purity_compare);
+}
+
+
+/* True if the statement prints, or calls a function not known to be pure */
+    static bool
+has_effects ( node_t *root )
+{
+    if (root == NULL) {
+        return false;
+    }
+    if (root->type.index == PRINT_LIST || root->type.index == PRINT_STATEMENT) {
+        return true;
+    }
+    if (expression_is_call(root)) {
+        purity_t *callee = purity_find(root->children[0]->entry);
+        if (callee == NULL || !callee->pure) {
+            return true;
+        }
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (has_effects(root->children[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* Record the calls of a function, false if it prints or calls something unknown */
+    static bool
+find_calls ( node_t *root, uint32_t caller )
+{
+    bool pure = true;
+
+    if (root == NULL) {
+        return true;
+    }
+    if (root->type.index == PRINT_LIST || root->type.index == PRINT_STATEMENT) {
+        return false;
+    }
+    if (expression_is_call(root)) {
+        purity_t *callee = purity_find(root->children[0]->entry);
+        if (callee == NULL) {
+            return false;
+        }
+        if (callee->n_callers == callee->capacity) {
+            callee->capacity = 2 * callee->capacity + 4;
+            callee->callers = realloc(callee->callers, sizeof(*callee->callers) * callee->capacity);
+            if (callee->callers == NULL) {
+                fprintf(stderr, "Failed to reallocate heap for purity.\n");
+                abort();
+            }
+        }
+        callee->callers[callee->n_callers++] = caller;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        pure = find_calls(root->children[i], caller) && pure;
+    }
+    return pure;
+}
+
+
+    void
+purity_analyse ( node_t *root )
+{
+    node_t *list = root->children[0];
+    uint32_t *impure, n_impure = 0;
+
+    purity_finalize();
+    n_functions = list->n_children;
+    functions = malloc(sizeof(*functions) * (n_functions + 1));
+    impure = malloc(sizeof(*impure) * (n_functions + 1));
+    if (functions == NULL || impure == NULL) {
+        fprintf(stderr, "Failed to allocate heap for purity.\n");
+        abort();
+    }
+    for (uint32_t f = 0; f < n_functions; f++) {
+        functions[f] = (purity_t) { list->children[f]->children[0]->entry, list->children[f], true, NULL, 0, 0 };
+    }
+    qsort(functions, n_functions, sizeof(*functions), purity_compare);
+
+    for (uint32_t f = 0; f < n_functions; f++) {
+        node_t *function = functions[f].function;
+        if (!find_calls(function->children[function->n_children - 1], f)) {
+            functions[f].pure = false;
+            impure[n_impure++] = f;
+        }
+    }
+
+    /* Every function which calls an impure one is impure */
+    while (n_impure > 0) {
+        purity_t *callee = &functions[impure[--n_impure]];
+        for (uint32_t c = 0; c < callee->n_callers; c++) {
+            if (functions[callee->callers[c]].pure) {
+                functions[callee->callers[c]].pure = false;
+                impure[n_impure++] = callee->callers[c];
+            }
+        }
+    }
+    free(impure);
+}
+
+
+    bool
+purity_is_pure ( symbol_t *function )
+{
+    purity_t *found = purity_find(function);
+    return found != NULL && found->pure;
+}
+
+
+/* True if the function can call itself, directly or through other functions */
+    bool
+purity_is_recursive ( symbol_t *function )
+{
+    purity_t *found = purity_find(function);
+    uint32_t self, *worklist, n_worklist = 0;
+    bool *seen, recursive = false;
+
+    if (found == NULL) {
+        return false;
+    }
+    self = found - functions;
+    worklist = malloc(sizeof(*worklist) * (n_functions + 1));
+    seen = calloc(n_functions + 1, sizeof(*seen));
+    if (worklist == NULL || seen == NULL) {
+        fprintf(stderr, "Failed to allocate heap for purity.\n");
+        abort();
+    }
+
+    /* Follow the callers back from the function, it is recursive if it turns up among them */
+    worklist[n_worklist++] = self;
+    while (n_worklist > 0 && !recursive) {
+        purity_t *callee = &functions[worklist[--n_worklist]];
+        for (uint32_t c = 0; c < callee->n_callers; c++) {
+            uint32_t caller = callee->callers[c];
+            recursive = recursive || caller == self;
+            if (!seen[caller]) {
+                seen[caller] = true;
+                worklist[n_worklist++] = caller;
+            }
+        }
+    }
+    free(worklist);
+    free(seen);
+    return recursive;
+}
+
+
+/* True if evaluating the expression has no effect but its value, or a trap */
+    bool
+purity_expression_is_pure ( node_t *root )
+{
+    return !has_effects(root);
+}
+
+
+/* Evaluation */
+
+
+    static void
+push ( int32_t value )
+{
+    if (stack_top == stack_capacity) {
+        stack_capacity = 2 * stack_capacity + 64;
+        stack = realloc(stack, sizeof(*stack) * stack_capacity);
+        if (stack == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for evaluation.\n");
+            abort();
+        }
+    }
+    stack[stack_top++] = value;
+}
+
+
+/* Where a variable of the call is, numbered like variable_slot in the IR, NULL if it is not one */
+    static int32_t *
+slot ( frame_t *frame, symbol_t *entry )
+{
+    if (frame == NULL || entry == NULL) {
+        return NULL;
+    }
+    if (entry->stack_offset > 0) {
+        int32_t index = frame->n_parameters - entry->stack_offset / 4 + 1;
+        return (index >= 0) ? &stack[frame->bottom + index] : NULL;
+    }
+    if (entry->depth < 3 || entry->depth > frame->depth) {
+        return NULL;
+    }
+    return &stack[frame->bottom + frame->n_parameters + frame->base[entry->depth] - entry->stack_offset / 4 - 1];
+}
+
+
+/* Run a pure function on the arguments on top of the stack */
+    static bool
+evaluate_call ( purity_t *callee, uint32_t n_arguments, int32_t *value )
+{
+    node_t *parameters = callee->function->children[1];
+    frame_t frame = { stack_top - n_arguments, n_arguments, 2, { 0 }, 0, 0 };
+    evaluation_t result;
+
+    if (!callee->pure || (parameters == NULL ? 0 : parameters->n_children) != n_arguments
+        || calls == EVALUATE_CALLS) {
+        return false;
+    }
+    calls++;
+    result = evaluate_statement(&frame, callee->function->children[callee->function->n_children - 1]);
+    calls--;
+    stack_top = frame.bottom;
+    *value = frame.result;
+    return result == EVALUATE_RETURN;
+}
+
+
+    static bool
+evaluate ( frame_t *frame, node_t *root, int32_t *value )
+{
+    node_t *arguments;
+    int32_t left, right, *variable;
+    uint32_t n_arguments = 0;
+
+    if (steps-- <= 0) {
+        return false;
+    }
+
+    switch (root->type.index) {
+        case INTEGER:
+            *value = *(int32_t *) root->data;
+            return true;
+
+        case VARIABLE:
+            variable = slot(frame, root->entry);
+            if (variable == NULL) {
+                return false;
+            }
+            *value = *variable;
+            return true;
+
+        case EXPRESSION:
+            if (root->data == NULL) {
+                return evaluate(frame, root->children[0], value);
+            }
+            if (expression_is_call(root)) {
+                /* The whole evaluation is given up when a part of it fails */
+                purity_t *callee = purity_find(root->children[0]->entry);
+                arguments = root->children[1];
+                for (uint32_t a = 0; arguments != NULL && a < arguments->n_children; a++, n_arguments++) {
+                    if (!evaluate(frame, arguments->children[a], &left)) {
+                        return false;
+                    }
+                    push(left);
+                }
+                return callee != NULL && evaluate_call(callee, n_arguments, value);
+            }
+            if (!evaluate(frame, root->children[0], &left)) {
+                return false;
+            }
+            if (root->n_children == 1) {
+                *value = (int32_t) -(uint32_t) left;
+                return true;
+            }
+            return evaluate(frame, root->children[1], &right) && fold_binary(root->data, left, right, value);
+
+        default:
+            return false;
+    }
+}
+
+
+    static evaluation_t
+evaluate_statement ( frame_t *frame, node_t *root )
+{
+    node_t *declarations;
+    evaluation_t result = EVALUATE_NEXT;
+    int32_t value, end, *variable;
+
+    if (root == NULL) {
+        return EVALUATE_NEXT;
+    }
+    if (steps-- <= 0) {
+        return EVALUATE_FAIL;
+    }
+
+    switch (root->type.index) {
+        case STATEMENT_LIST:
+            for (uint32_t i = 0; i < root->n_children && result == EVALUATE_NEXT; i++) {
+                result = evaluate_statement(frame, root->children[i]);
+            }
+            return result;
+
+        case BLOCK:
+            /* Declared variables start out as 0 */
+            if (frame->depth + 1 == EVALUATE_BLOCKS) {
+                return EVALUATE_FAIL;
+            }
+            frame->base[++frame->depth] = frame->n_locals;
+            declarations = root->children[0];
+            for (uint32_t d = 0; declarations != NULL && d < declarations->n_children; d++) {
+                for (uint32_t v = 0; v < declarations->children[d]->children[0]->n_children; v++) {
+                    push(0);
+                    frame->n_locals++;
+                }
+            }
+            result = evaluate_statement(frame, root->children[1]);
+            frame->n_locals = frame->base[frame->depth--];
+            stack_top = frame->bottom + frame->n_parameters + frame->n_locals;
+            return result;
+
+        case ASSIGNMENT_STATEMENT:
+            variable = slot(frame, root->children[0]->entry);
+            if (variable == NULL || !evaluate(frame, root->children[1], &value)) {
+                return EVALUATE_FAIL;
+            }
+            /* The stack may have moved while evaluating */
+            *slot(frame, root->children[0]->entry) = value;
+            return EVALUATE_NEXT;
+
+        case RETURN_STATEMENT:
+            if (!evaluate(frame, root->children[0], &frame->result)) {
+                return EVALUATE_FAIL;
+            }
+            return EVALUATE_RETURN;
+
+        case NULL_STATEMENT:
+            return EVALUATE_NEXT;
+
+        case IF_STATEMENT:
+            if (!evaluate(frame, root->children[0], &value)) {
+                return EVALUATE_FAIL;
+            }
+            if (value != 0) {
+                return evaluate_statement(frame, root->children[1]);
+            }
+            return (root->n_children == 3) ? evaluate_statement(frame, root->children[2]) : EVALUATE_NEXT;
+
+        case WHILE_STATEMENT:
+            while (result == EVALUATE_NEXT) {
+                if (!evaluate(frame, root->children[0], &value)) {
+                    return EVALUATE_FAIL;
+                }
+                if (value == 0) {
+                    break;
+                }
+                result = evaluate_statement(frame, root->children[1]);
+            }
+            return result;
+
+        case FOR_STATEMENT:
+            /* The end value is evaluated before every iteration, the variable counts up to it */
+            result = evaluate_statement(frame, root->children[0]);
+            while (result == EVALUATE_NEXT) {
+                if (!evaluate(frame, root->children[1], &end)) {
+                    return EVALUATE_FAIL;
+                }
+                variable = slot(frame, root->children[0]->children[0]->entry);
+                if (*variable == end) {
+                    break;
+                }
+                result = evaluate_statement(frame, root->children[2]);
+                if (result == EVALUATE_NEXT) {
+                    variable = slot(frame, root->children[0]->children[0]->entry);
+                    *variable = (int32_t) ((uint32_t) *variable + 1);
+                }
+            }
+            return result;
+
+        default:
+            return EVALUATE_FAIL;
+    }
+}
+
+
+/*
+ * The value of a call to a pure function, evaluated now. False if it
+ * cannot be, and the call has to be left for run time. Arguments are
+ * evaluated too, but can only be constants and calls.
+ */
+    bool
+purity_evaluate ( node_t *call, int32_t *value )
+{
+    bool evaluated;
+
+    steps = EVALUATE_STEPS;
+    calls = 0;
+    stack_top = 0;
+    evaluated = evaluate(NULL, call, value);
+    stack_top = 0;
+    return evaluated;
+}
+
+
+    void
+purity_finalize ( void )
+{
+    for (uint32_t f = 0; f < n_functions; f++) {
+        free(functions[f].callers);
+    }
+    free(functions);
+    free(stack);
+    stack = NULL;
+    stack_capacity = 0;
+    functions = NULL;
+    n_functions = 0;
+}
@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+#include "ir.h"
+
+/*
+ * Sparse conditional constant propagation (Wegman and Zadeck) on the
+ * SSA form of every function. Values start out unknown and are only
+ * lowered, to a constant and then to varying, and only blocks reached
+ * along edges that can be taken are evaluated, so constants flow through
+ * variables, phis and branches that are decided by them. The tree is
+ * then rewritten: reads and expressions with a constant value become
+ * integers, and IF, WHILE and FOR statements with a branch that is never
+ * taken lose it.
+ */
+
+typedef enum { UNKNOWN, CONSTANT, VARYING } lattice_t;
+
+/* What happens to a tree node */
+typedef enum { REWRITE_INTEGER, REWRITE_TAKEN, REWRITE_NOT_TAKEN } rewrite_t;
+
+typedef struct {
+    node_t *node;
+    rewrite_t rewrite;
+    int32_t value;
+} decision_t;
+
+/* The function being analysed */
+static ir_function_t *function;
+static lattice_t *lattice;
+static int32_t *values;
+static bool *executable, (*edges)[2];
+static ir_instruction_t ***users;
+static uint32_t *n_users;
+
+/* Worklists */
+static ir_instruction_t **instructions;
+static uint32_t n_instructions, instructions_capacity;
+static ir_block_t **flow;
+static int32_t *flow_successor;
+static uint32_t n_flow, flow_capacity;
+
+/* Decisions for the whole program, sorted by node when rewriting */
+static decision_t *decisions;
+static uint32_t n_decisions, decisions_capacity;
+
+
+/* The edge from a block to its successor number 'successor' can be taken */
+    static void
+add_edge ( ir_block_t *block, int32_t successor )
+{
+    if (edges[block->id][successor]) {
+        return;
+    }
+    flow = array_grow(flow, n_flow, &flow_capacity, sizeof(*flow));
+    flow_successor = realloc(flow_successor, sizeof(*flow_successor) * flow_capacity);
+    if (flow_successor == NULL) {
+        fprintf(stderr, "Failed to reallocate heap for constant propagation.\n");
+        abort();
+    }
+    flow[n_flow] = block;
+    flow_successor[n_flow++] = successor;
+}
+
+
+/* Lower the value of an instruction, and look at its users again */
+    static void
+lower ( ir_instruction_t *instruction, lattice_t level, int32_t value )
+{
+    if (level <= lattice[instruction->id]) {
+        return;
+    }
+    lattice[instruction->id] = level;
+    values[instruction->id] = value;
+    for (uint32_t u = 0; u < n_users[instruction->id]; u++) {
+        instructions = array_grow(instructions, n_instructions, &instructions_capacity, sizeof(*instructions));
+        instructions[n_instructions++] = users[instruction->id][u];
+    }
+}
+
+
+/* True if the edge from the predecessor number 'p' of a block can be taken */
+    static bool
+incoming ( ir_block_t *block, uint32_t p )
+{
+    ir_block_t *predecessor = block->predecessors[p];
+    for (uint32_t s = 0; s < predecessor->n_successors; s++) {
+        if (predecessor->successors[s] == block && edges[predecessor->id][s]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+    static void
+visit ( ir_instruction_t *i )
+{
+    lattice_t level = CONSTANT;
+    int32_t value = 0;
+
+    switch (i->opcode) {
+        case IR_CONSTANT:
+            lower(i, CONSTANT, i->value);
+            break;
+
+        case IR_PARAMETER: case IR_UNDEFINED: case IR_CALL:
+            lower(i, VARYING, 0);
+            break;
+
+        case IR_COPY:
+            lower(i, lattice[i->operands[0]->id], values[i->operands[0]->id]);
+            break;
+
+        case IR_PHI:
+            level = UNKNOWN;
+            for (uint32_t k = 0; k < i->n_operands && level != VARYING; k++) {
+                ir_instruction_t *operand = i->operands[k];
+                if (!incoming(i->block, k) || lattice[operand->id] == UNKNOWN) {
+                    continue;
+                }
+                if (lattice[operand->id] == VARYING
+                    || (level == CONSTANT && values[operand->id] != value)) {
+                    level = VARYING;
+                } else {
+                    level = CONSTANT;
+                    value = values[operand->id];
+                }
+            }
+            lower(i, level, value);
+            break;
+
+        case IR_NEGATE: case IR_BINARY:
+            for (uint32_t k = 0; k < i->n_operands; k++) {
+                lattice_t operand = lattice[i->operands[k]->id];
+                if (operand == VARYING || (operand == UNKNOWN && level != VARYING)) {
+                    level = operand;
+                }
+            }
+            if (level == CONSTANT) {
+                int32_t left = values[i->operands[0]->id];
+                if (i->opcode == IR_NEGATE) {
+                    value = (int32_t) -(uint32_t) left;
+                } else if (!fold_binary(i->op, left, values[i->operands[1]->id], &value)) {
+                    level = VARYING;
+                }
+            }
+            if (level != UNKNOWN) {
+                lower(i, level, value);
+            }
+            break;
+
+        case IR_JUMP:
+            add_edge(i->block, 0);
+            break;
+
+        case IR_BRANCH:
+            level = lattice[i->operands[0]->id];
+            if (level == VARYING || (level == CONSTANT && values[i->operands[0]->id] != 0)) {
+                add_edge(i->block, 0);
+            }
+            if (level == VARYING || (level == CONSTANT && values[i->operands[0]->id] == 0)) {
+                add_edge(i->block, 1);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+/* Users of every value, for the SSA worklist */
+    static void
+find_users ( void )
+{
+    uint32_t *capacity = allocate_zeroed(sizeof(*capacity) * (function->n_values + 1));
+
+    users = allocate_zeroed(sizeof(*users) * (function->n_values + 1));
+    n_users = allocate_zeroed(sizeof(*n_users) * (function->n_values + 1));
+    for (uint32_t b = 0; b < function->n_blocks; b++) {
+        for (ir_instruction_t *i = function->blocks[b]->first; i != NULL; i = i->next) {
+            for (uint32_t k = 0; k < i->n_operands; k++) {
+                int32_t id = i->operands[k]->id;
+                users[id] = array_grow(users[id], n_users[id], &capacity[id], sizeof(**users));
+                users[id][n_users[id]++] = i;
+            }
+        }
+    }
+    free(capacity);
+}
+
+
+    static void
+decide ( node_t *node, rewrite_t rewrite, int32_t value )
+{
+    decisions = array_grow(decisions, n_decisions, &decisions_capacity, sizeof(*decisions));
+    decisions[n_decisions++] = (decision_t) { node, rewrite, value };
+}
+
+
+    static void
+analyse ( ir_function_t *analysed )
+{
+    function = analysed;
+    lattice = allocate_zeroed(sizeof(*lattice) * (function->n_values + 1));
+    values = allocate_zeroed(sizeof(*values) * (function->n_values + 1));
+    executable = allocate_zeroed(sizeof(*executable) * (function->n_blocks + 1));
+    edges = allocate_zeroed(sizeof(*edges) * (function->n_blocks + 1));
+    find_users();
+    n_instructions = n_flow = 0;
+
+    executable[0] = true;
+    for (ir_instruction_t *i = function->blocks[0]->first; i != NULL; i = i->next) {
+        visit(i);
+    }
+
+    while (n_flow > 0 || n_instructions > 0) {
+        if (n_flow > 0) {
+            ir_block_t *from = flow[--n_flow];
+            int32_t successor = flow_successor[n_flow];
+            ir_block_t *to = from->successors[successor];
+            bool first = !executable[to->id];
+
+            if (edges[from->id][successor]) {
+                continue;
+            }
+            edges[from->id][successor] = true;
+            executable[to->id] = true;
+
+            /* Phis see one more edge, everything else only runs once */
+            for (ir_instruction_t *i = to->first; i != NULL; i = i->next) {
+                if (first || i->opcode == IR_PHI) {
+                    visit(i);
+                }
+            }
+        } else {
+            ir_instruction_t *i = instructions[--n_instructions];
+            if (executable[i->block->id]) {
+                visit(i);
+            }
+        }
+    }
+
+    /* Constant values of reads and of expressions */
+    for (uint32_t u = 0; u < function->n_uses; u++) {
+        ir_instruction_t *value = function->uses[u].value;
+        if (lattice[value->id] == CONSTANT) {
+            decide(function->uses[u].node, REWRITE_INTEGER, values[value->id]);
+        }
+    }
+    for (uint32_t b = 0; b < function->n_blocks; b++) {
+        if (!executable[b]) {
+            continue;
+        }
+        for (ir_instruction_t *i = function->blocks[b]->first; i != NULL; i = i->next) {
+            if ((i->opcode == IR_BINARY || i->opcode == IR_NEGATE) && lattice[i->id] == CONSTANT
+                && i->node->type.index == EXPRESSION) {
+                decide(i->node, REWRITE_INTEGER, values[i->id]);
+            }
+            /* Branches which only go one way */
+            if (i->opcode == IR_BRANCH && edges[b][0] != edges[b][1]) {
+                decide(i->node, edges[b][0] ? REWRITE_TAKEN : REWRITE_NOT_TAKEN, 0);
+            }
+        }
+    }
+
+    for (int32_t v = 0; v < function->n_values; v++) {
+        free(users[v]);
+    }
+    free(users);
+    free(n_users);
+    free(lattice);
+    free(values);
+    free(executable);
+    free(edges);
+}
+
+
+    static int
+decision_compare ( const void *a, const void *b )
+{
+    uintptr_t x = (uintptr_t) ((const decision_t *) a)->node, y = (uintptr_t) ((const decision_t *) b)->node;
+    return (x > y) - (x < y);
+}
+
+
+    static decision_t *
+decision_find ( node_t *node )
+{
+    decision_t key = { node, REWRITE_INTEGER, 0 };
+    return bsearch(&key, decisions, n_decisions, sizeof(*decisions), decision_compare);
+}
+
+
+/* Replace a statement with nothing, in place */
+    static node_t *
+make_null_statement ( node_t *root )
+{
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        destroy_subtree(root->children[i]);
+    }
+    free(root->children);
+    free(root->data);
+    node_init(root, null_statement_n, NULL, 0);
+    return root;
+}
+
+
+/* Replace a statement with one of its children */
+    static node_t *
+keep_statement ( node_t *root, uint32_t index )
+{
+    node_t *child = root->children[index];
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (i != index) {
+            destroy_subtree(root->children[i]);
+        }
+    }
+    node_finalize(root);
+    return child;
+}
+
+
+    static node_t *
+rewrite ( node_t *root, int32_t *changes )
+{
+    decision_t *decision;
+
+    if (root == NULL) {
+        return NULL;
+    }
+
+    decision = decision_find(root);
+    if (decision != NULL) {
+        switch (decision->rewrite) {
+            case REWRITE_INTEGER:
+                /* Calls are still made for what they do */
+                if (root->type.index == VARIABLE || !expression_has_call(root)) {
+                    (*changes)++;
+                    return node_make_integer(root, decision->value);
+                }
+                break;
+
+            case REWRITE_TAKEN:
+                /* A WHILE which never ends stays as it is */
+                if (root->type.index == IF_STATEMENT) {
+                    (*changes)++;
+                    return rewrite(keep_statement(root, 1), changes);
+                }
+                break;
+
+            case REWRITE_NOT_TAKEN:
+                (*changes)++;
+                if (root->type.index == IF_STATEMENT && root->n_children == 3) {
+                    return rewrite(keep_statement(root, 2), changes);
+                }
+                if (root->type.index == FOR_STATEMENT) {
+                    /* The variable is still assigned */
+                    return rewrite(keep_statement(root, 0), changes);
+                }
+                return make_null_statement(root);
+        }
+    }
+
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = rewrite(root->children[i], changes);
+    }
+    return root;
+}
+
+
+    int32_t
+propagate_constants ( node_t *root )
+{
+    ir_program_t *program = ir_build(root);
+    int32_t changes = 0;
+
+    n_decisions = 0;
+    for (uint32_t f = 0; f < program->n_functions; f++) {
+        analyse(&program->functions[f]);
+    }
+    qsort(decisions, n_decisions, sizeof(*decisions), decision_compare);
+    rewrite(root, &changes);
+
+    ir_finalize(program);
+    free(decisions);
+    free(instructions);
+    free(flow);
+    free(flow_successor);
+    decisions = NULL;
+    instructions = NULL;
+    flow = NULL;
+    flow_successor = NULL;
+    decisions_capacity = instructions_capacity = flow_capacity = 0;
+    return changes;
+}
+
+
+/*
+ * Removal of unreachable statements: everything after a statement which
+ * always returns, in the same list. A statement always returns if it is
+ * a RETURN, a block with one in its list, or an IF with two arms which
+ * both do.
+ */
+    static bool
+always_returns ( node_t *root )
+{
+    if (root == NULL) {
+        return false;
+    }
+    switch (root->type.index) {
+        case RETURN_STATEMENT:
+            return true;
+        case BLOCK:
+            return always_returns(root->children[1]);
+        case STATEMENT_LIST:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                if (always_returns(root->children[i])) {
+                    return true;
+                }
+            }
+            return false;
+        case IF_STATEMENT:
+            return root->n_children == 3 && always_returns(root->children[1]) && always_returns(root->children[2]);
+        default:
+            return false;
+    }
+}
+
+
+    static void
+prune ( node_t *root, int32_t *changes )
+{
+    if (root == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        prune(root->children[i], changes);
+    }
+    if (root->type.index != STATEMENT_LIST) {
+        return;
+    }
+    for (uint32_t i = 0; i + 1 < root->n_children; i++) {
+        if (always_returns(root->children[i])) {
+            for (uint32_t k = i + 1; k < root->n_children; k++) {
+                destroy_subtree(root->children[k]);
+                (*changes)++;
+            }
+            root->n_children = i + 1;
+            break;
+        }
+    }
+}
+
+
+    int32_t
+remove_unreachable ( node_t *root )
+{
+    int32_t changes = 0;
+    prune(root, &changes);
+    return changes;
+}
@@ -0,0 +1,441 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+/*
+ * Specialization of functions for constant arguments. Calls which pass
+ * integer literals for some parameters of a function, like improve(n, 1),
+ * go to a clone of it without those parameters, named after it with a
+ * number, in which they are the constants. Reads of a parameter the body
+ * never assigns become the literal, one it does assign becomes a local
+ * which is assigned the literal first. sccp and fold then work the
+ * constants through the clone. The clones follow their originals in the
+ * function list, so the backends emit them next to each other.
+ *
+ * Every function and set of literals passed to it is a variant, and the
+ * variants with the most calls are cloned first, at most VARIANTS for a
+ * function and CLONES in all, and only for functions of at most SIZE
+ * nodes which read one of the constant parameters. Functions with more
+ * than 32 parameters are left alone. Calls in the clones are redirected
+ * too, so a clone can call itself.
+ */
+
+enum { CLONES = 8, VARIANTS = 2, SIZE = 256, MAX_PARAMETERS = 32 };
+
+typedef struct {
+    uint32_t function;              /* Index in the function list */
+    uint32_t mask;                  /* The parameters passed literals, a bit each */
+    int32_t values[MAX_PARAMETERS];
+    uint32_t n_calls, order;
+    node_t *clone;
+} variant_t;
+
+static node_t *list;
+static variant_t *variants;
+static uint32_t n_variants, capacity;
+
+
+/* Index of the function a symbol names, -1 if it is not one */
+    static int32_t
+function_index ( symbol_t *entry )
+{
+    for (uint32_t f = 0; f < list->n_children; f++) {
+        if (list->children[f]->children[0]->entry == entry) {
+            return f;
+        }
+    }
+    return -1;
+}
+
+
+/* The variant of a call, false if it passes no literals to a function of the program */
+    static bool
+call_variant ( node_t *call, variant_t *variant )
+{
+    node_t *arguments = call->children[1];
+    int32_t f = function_index(call->children[0]->entry);
+
+    if (f < 0 || arguments == NULL || arguments->n_children > MAX_PARAMETERS
+        || arguments->n_children != function_parameter_count(list->children[f])) {
+        return false;
+    }
+    memset(variant, 0, sizeof(*variant));
+    variant->function = f;
+    for (uint32_t a = 0; a < arguments->n_children; a++) {
+        if (arguments->children[a]->type.index == INTEGER) {
+            variant->mask |= 1u << a;
+            variant->values[a] = *(int32_t *) arguments->children[a]->data;
+        }
+    }
+    return variant->mask != 0;
+}
+
+
+    static bool
+variant_equal ( variant_t *a, variant_t *b )
+{
+    if (a->function != b->function || a->mask != b->mask) {
+        return false;
+    }
+    for (uint32_t p = 0; p < MAX_PARAMETERS; p++) {
+        if ((a->mask & (1u << p)) && a->values[p] != b->values[p]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Count the calls of every variant */
+    static void
+find_variants ( node_t *root )
+{
+    variant_t found;
+
+    if (root == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        find_variants(root->children[i]);
+    }
+    if (!expression_is_call(root) || !call_variant(root, &found)) {
+        return;
+    }
+
+    for (uint32_t v = 0; v < n_variants; v++) {
+        if (variant_equal(&variants[v], &found)) {
+            variants[v].n_calls++;
+            return;
+        }
+    }
+    if (n_variants == capacity) {
+        capacity = 2 * capacity + 8;
+        variants = realloc(variants, sizeof(*variants) * capacity);
+        if (variants == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for specialization.\n");
+            abort();
+        }
+    }
+    found.n_calls = 1;
+    found.order = n_variants;
+    variants[n_variants++] = found;
+}
+
+
+/* Most calls first, then in the order they were found */
+    static int
+variant_compare ( const void *a, const void *b )
+{
+    const variant_t *x = a, *y = b;
+    if (x->n_calls != y->n_calls) {
+        return (x->n_calls < y->n_calls) - (x->n_calls > y->n_calls);
+    }
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+
+/* Parameters are numbered by bind_names from 4 + 4n for the first down to 8 */
+    static int32_t
+parameter_index ( symbol_t *entry, uint32_t n_parameters )
+{
+    return (int32_t) n_parameters + 1 - entry->stack_offset / 4;
+}
+
+
+/* The parameters in a mask which the subtree reads or assigns, a bit each */
+    static uint32_t
+parameters_used ( node_t *root, uint32_t n_parameters, bool assigned )
+{
+    uint32_t used = 0;
+
+    if (root == NULL) {
+        return 0;
+    }
+    if (root->type.index == VARIABLE && root->entry != NULL && root->entry->stack_offset > 0 && !assigned) {
+        return 1u << parameter_index(root->entry, n_parameters);
+    }
+    if (root->type.index == ASSIGNMENT_STATEMENT && assigned) {
+        used |= parameters_used(root->children[0], n_parameters, false);
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        used |= parameters_used(root->children[i], n_parameters, assigned);
+    }
+    return used;
+}
+
+
+/* A name for a clone which no function has yet */
+    static char *
+clone_name ( char *name )
+{
+    char *clone = malloc(strlen(name) + 16);
+
+    if (clone == NULL) {
+        fprintf(stderr, "Failed to allocate heap for specialization.\n");
+        abort();
+    }
+    for (uint32_t k = 1; ; k++) {
+        bool taken = false;
+        sprintf(clone, "%s_%u", name, k);
+        for (uint32_t f = 0; f < list->n_children && !taken; f++) {
+            taken = strcmp(list->children[f]->children[0]->entry->label, clone) == 0;
+        }
+        for (uint32_t v = 0; v < n_variants && !taken; v++) {
+            taken = variants[v].clone != NULL && strcmp(variants[v].clone->children[0]->data, clone) == 0;
+        }
+        if (!taken) {
+            return clone;
+        }
+    }
+}
+
+
+/*
+ * Give the parameters of the clone which are left symbols numbered for
+ * their new positions, and put the constants in for the others
+ */
+    static void
+rewrite_parameters ( node_t **link, variant_t *variant, symbol_t **parameters, symbol_t **locals,
+    uint32_t n_parameters )
+{
+    node_t *root = *link;
+
+    if (root == NULL) {
+        return;
+    }
+    if (root->type.index == VARIABLE && root->entry != NULL && root->entry->stack_offset > 0) {
+        int32_t p = parameter_index(root->entry, n_parameters);
+        if (locals[p] != NULL) {
+            *link = temporary_read(locals[p]);
+            destroy_subtree(root);
+        } else if (variant->mask & (1u << p)) {
+            node_make_integer(root, variant->values[p]);
+        } else {
+            root->entry = parameters[p];
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        rewrite_parameters(&root->children[i], variant, parameters, locals, n_parameters);
+    }
+}
+
+
+/* Make the clone of a variant, false if it cannot be had or is not worth it */
+    static bool
+clone_variant ( variant_t *variant )
+{
+    node_t *function = list->children[variant->function], *clone, *body, *name, *assigns = NULL;
+    uint32_t n_parameters = function_parameter_count(function), n_left = 0, assigned;
+    symbol_t *parameters[MAX_PARAMETERS] = { NULL }, *locals[MAX_PARAMETERS] = { NULL };
+    symbol_t *entry;
+
+    body = function->children[function->n_children - 1];
+    if (subtree_size(function) > SIZE || !(parameters_used(body, n_parameters, false) & variant->mask)) {
+        return false;
+    }
+    assigned = parameters_used(body, n_parameters, true) & variant->mask;
+    if (assigned != 0 && (body == NULL || body->type.index != BLOCK)) {
+        return false;
+    }
+
+    clone = subtree_copy(function);
+    body = clone->children[clone->n_children - 1];
+
+    /* The clone's own name and symbol */
+    name = clone->children[0];
+    free(name->data);
+    name->data = clone_name(function->children[0]->entry->label);
+    entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        fprintf(stderr, "Failed to allocate heap for specialization.\n");
+        abort();
+    }
+    *entry = *function->children[0]->entry;
+    entry->label = name->data;
+    symbol_keep(entry);
+    name->entry = entry;
+
+    /* Symbols of the parameters left, and locals for the constants the body assigns */
+    for (uint32_t p = 0; p < n_parameters; p++) {
+        if (!(variant->mask & (1u << p))) {
+            n_left++;
+        }
+    }
+    temporaries_open(clone);
+    for (uint32_t p = 0, left = 0; p < n_parameters; p++) {
+        if (variant->mask & (1u << p)) {
+            if (assigned & (1u << p)) {
+                node_t *value = malloc(sizeof(*value));
+                node_t *assignment;
+                locals[p] = temporary_new("sp");
+                node_init(value, integer_n, NULL, 0);
+                node_make_integer(value, variant->values[p]);
+                assignment = temporary_assign(locals[p], value);
+                if (assigns == NULL) {
+                    assigns = malloc(sizeof(*assigns));
+                    node_init(assigns, statement_list_n, NULL, 1, assignment);
+                } else {
+                    assigns->children = realloc(assigns->children, sizeof(node_t *) * (assigns->n_children + 2));
+                    if (assigns->children == NULL) {
+                        fprintf(stderr, "Failed to reallocate heap for specialization.\n");
+                        abort();
+                    }
+                    assigns->children[assigns->n_children++] = assignment;
+                }
+            }
+            continue;
+        }
+        parameters[p] = malloc(sizeof(*parameters[p]));
+        if (parameters[p] == NULL) {
+            fprintf(stderr, "Failed to allocate heap for specialization.\n");
+            abort();
+        }
+        parameters[p]->stack_offset = 4 + 4 * n_left - 4 * left++;
+        parameters[p]->depth = 2;
+        parameters[p]->label = NULL;
+        symbol_keep(parameters[p]);
+    }
+    rewrite_parameters(&body, variant, parameters, locals, n_parameters);
+    clone->children[clone->n_children - 1] = body;
+
+    /* The constants the body assigns are set first */
+    if (assigns != NULL) {
+        node_t *statements = body->children[1];
+        if (statements != NULL) {
+            assigns->children = realloc(assigns->children, sizeof(node_t *) * (assigns->n_children + 2));
+            if (assigns->children == NULL) {
+                fprintf(stderr, "Failed to reallocate heap for specialization.\n");
+                abort();
+            }
+            assigns->children[assigns->n_children++] = statements;
+        }
+        body->children[1] = assigns;
+    }
+    temporaries_close();
+
+    /* Drop the constant parameters from the list */
+    for (uint32_t p = 0, kept = 0; p < n_parameters; p++) {
+        node_t *parameter = clone->children[1]->children[p];
+        if (variant->mask & (1u << p)) {
+            destroy_subtree(parameter);
+        } else {
+            clone->children[1]->children[kept++] = parameter;
+        }
+    }
+    clone->children[1]->n_children = n_left;
+    if (n_left == 0) {
+        destroy_subtree(clone->children[1]);
+        clone->children[1] = NULL;
+    }
+
+    variant->clone = clone;
+    return true;
+}
+
+
+/* Send the calls of the cloned variants to the clones, counting them */
+    static void
+redirect_calls ( node_t *root, int32_t *changes )
+{
+    variant_t found;
+
+    if (root == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        redirect_calls(root->children[i], changes);
+    }
+    if (!expression_is_call(root) || !call_variant(root, &found)) {
+        return;
+    }
+
+    for (uint32_t v = 0; v < n_variants; v++) {
+        node_t *arguments = root->children[1], *callee = root->children[0];
+        uint32_t kept = 0;
+
+        if (variants[v].clone == NULL || !variant_equal(&variants[v], &found)) {
+            continue;
+        }
+        free(callee->data);
+        callee->data = STRDUP(variants[v].clone->children[0]->data);
+        callee->entry = variants[v].clone->children[0]->entry;
+        for (uint32_t a = 0; a < arguments->n_children; a++) {
+            if (found.mask & (1u << a)) {
+                destroy_subtree(arguments->children[a]);
+            } else {
+                arguments->children[kept++] = arguments->children[a];
+            }
+        }
+        arguments->n_children = kept;
+        if (kept == 0) {
+            destroy_subtree(arguments);
+            root->children[1] = NULL;
+        }
+        (*changes)++;
+        return;
+    }
+}
+
+
+    int32_t
+specialize_functions ( node_t *root )
+{
+    uint32_t n_functions, n_clones = 0, *per_function;
+    int32_t changes = 0;
+    node_t **functions;
+
+    list = root->children[0];
+    n_functions = list->n_children;
+    n_variants = 0;
+    find_variants(list);
+    qsort(variants, n_variants, sizeof(*variants), variant_compare);
+
+    per_function = calloc(n_functions + 1, sizeof(*per_function));
+    if (per_function == NULL) {
+        fprintf(stderr, "Failed to allocate heap for specialization.\n");
+        abort();
+    }
+    for (uint32_t v = 0; v < n_variants && n_clones < CLONES; v++) {
+        if (per_function[variants[v].function] < VARIANTS && clone_variant(&variants[v])) {
+            per_function[variants[v].function]++;
+            n_clones++;
+        }
+    }
+    free(per_function);
+
+    if (n_clones > 0) {
+        /* Calls in the clones go to clones too, they are redirected before they join the list */
+        for (uint32_t v = 0; v < n_variants; v++) {
+            redirect_calls(variants[v].clone, &changes);
+        }
+        redirect_calls(list, &changes);
+
+        /* Every clone follows its original */
+        functions = malloc(sizeof(*functions) * (n_functions + n_clones + 1));
+        if (functions == NULL) {
+            fprintf(stderr, "Failed to allocate heap for specialization.\n");
+            abort();
+        }
+        list->n_children = 0;
+        for (uint32_t f = 0; f < n_functions; f++) {
+            functions[list->n_children++] = list->children[f];
+            for (uint32_t v = 0; v < n_variants; v++) {
+                if (variants[v].clone != NULL && variants[v].function == f) {
+                    functions[list->n_children++] = variants[v].clone;
+                }
+            }
+        }
+        free(list->children);
+        list->children = functions;
+
+        propagate_constants(root);
+        fold_constants(root);
+    }
+
+    free(variants);
+    variants = NULL;
+    n_variants = capacity = 0;
+    return changes;
+}
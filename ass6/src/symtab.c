@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symtab.h"
+
+// static does not mean the same as in Java.
+// For global variables, it means they are only visible in this file.
+
+// Pointer to stack of hash tables 
+static hash_t **scopes;
+
+// Pointer to array of values, to make it easier to free them
+static symbol_t **values;
+
+// Pointer to array of strings, should be able to dynamically expand as new strings
+// are added.
+static char **strings;
+
+// Helper variables for manageing the stacks/arrays
+static int32_t scopes_size = 16, scopes_index = -1;
+static int32_t values_size = 16, values_index = -1;
+static int32_t strings_size = 16, strings_index = -1;
+
+
+void symtab_init(void) {
+    scopes = malloc(sizeof(*scopes) * scopes_size);
+    values = malloc(sizeof(*values) * values_size);
+    strings = malloc(sizeof(*strings) * strings_size);
+}
+
+
+void symtab_finalize(void) {
+    for (int i = 0; i <= scopes_index; i++) {
+        /*
+         * We shouldn't have to remove scopes, but this is here just in case
+         * something wrong happens and we want to clean up.
+         */
+        scope_remove();
+    }
+
+    for (int i = 0; i <= values_index; i++) {
+        free(values[i]);
+    }
+
+    for (int i = 0; i <= strings_index; i++) {
+        free(strings[i]);
+    }
+
+    free(scopes);
+    free(values);
+    free(strings);
+}
+
+
+int32_t strings_add(char *str) {
+    /*
+     * Every backend prints strings with printf, so a '%' is doubled to come
+     * out as it is written.
+     */
+    int32_t percents = 0;
+    for (char *c = str; *c != '\0'; c++) {
+        percents += (*c == '%');
+    }
+    if (percents > 0) {
+        char *doubled = malloc(strlen(str) + percents + 1), *d = doubled;
+        if (doubled == NULL) {
+            fprintf(stderr, "Failed to allocate heap for a string.\n");
+            abort();
+        }
+        for (char *c = str; *c != '\0'; c++) {
+            if (*c == '%') {
+                *d++ = '%';
+            }
+            *d++ = *c;
+        }
+        *d = '\0';
+        free(str);
+        str = doubled;
+    }
+
+    strings_index++;
+
+    if (strings_index == strings_size) {
+        /*
+         * I double the size of this array every time, it should work decently
+         * most of the time. If there are many strings we will probably have to
+         * spend less time reallocing.
+         */
+        strings_size = strings_size << 1;
+        strings = realloc(strings, sizeof(*strings) * strings_size);
+
+        if (strings == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for strings array.\n");
+            abort();
+        }
+    }
+
+    strings[strings_index] = str;
+
+    return strings_index;
+}
+
+
+int32_t strings_count(void) {
+    return strings_index + 1;
+}
+
+
+/* The string literal as it appears in the source, quotes included and '%' doubled */
+char *strings_get(int32_t index) {
+    return strings[index];
+}
+
+
+/*
+ * The bytes of a string literal, with the escapes interpreted the way the
+ * '.string' directive does. The copy is on the heap and NUL terminated, its
+ * length does not count the terminator.
+ */
+char *strings_value(int32_t index, uint32_t *length) {
+    char *literal = strings[index];
+    char *value = malloc(strlen(literal) + 1);
+    uint32_t n = 0;
+
+    for (char *c = literal + 1; *c != '\0' && *c != '"'; c++) {
+        char byte = *c;
+        if (*c == '\\') {
+            c++;
+            switch (*c) {
+                case 'n': byte = '\n'; break;
+                case 't': byte = '\t'; break;
+                case 'r': byte = '\r'; break;
+                case 'b': byte = '\b'; break;
+                case 'f': byte = '\f'; break;
+                case 'x':
+                    byte = strtol(c + 1, &c, 16);
+                    c--;
+                    break;
+                default:
+                    if (*c >= '0' && *c <= '7') {
+                        byte = 0;
+                        for (int i = 0; i < 3 && *c >= '0' && *c <= '7'; i++, c++) {
+                            byte = 8 * byte + (*c - '0');
+                        }
+                        c--;
+                    } else {
+                        byte = *c;
+                    }
+                    break;
+            }
+        }
+        value[n++] = byte;
+    }
+    value[n] = '\0';
+
+    *length = n;
+    return value;
+}
+
+
+void strings_output(FILE *stream) {
+    fprintf(stream, ".data\n.INTEGER: .string \"%%d \"\n");
+
+    for (int i = 0; i <= strings_index; i++) {
+        fprintf(stream, ".STRING%d: .string %s\n", i, strings[i]);
+    }
+
+    fprintf(stream, ".globl main\n");
+}
+
+
+void scope_add(void) {
+    scopes_index++;
+
+    if (scopes_index == scopes_size) {
+        /* See comment in strings_add */
+        scopes_size = scopes_size << 1;
+        scopes = realloc(scopes, sizeof(*scopes) * scopes_size);
+
+        if (scopes == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for the scope stack.\n");
+        }
+    }
+
+    scopes[scopes_index] = ght_create(HASH_BUCKETS);
+}
+
+
+void scope_remove(void) {
+    ght_finalize(scopes[scopes_index]);
+    scopes_index--;
+}
+
+
+/*
+ * Keep a symbol so that symtab_finalize frees it. symbol_insert does this
+ * for everything bind_names finds, passes which make variables of their
+ * own after that use it directly.
+ */
+void symbol_keep(symbol_t *value) {
+    values_index++;
+
+    if (values_index == values_size) {
+        /* See comment in strings_add */
+        values_size = values_size << 1;
+        values = realloc(values, sizeof(*values) * values_size);
+
+        if (values == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for the value array.\n");
+        }
+    }
+
+    values[values_index] = value;
+}
+
+
+void symbol_insert(char *key, symbol_t *value) {
+    symbol_keep(value);
+    /*
+     * Set this entries' depth, counting from 1 for the functions, so the
+     * parameters are at depth 2 and the locals of a function body at 3.
+     */
+    value->depth = scopes_index + 1;
+    ght_insert(scopes[scopes_index], value, strlen(key), key);
+
+// Keep this for debugging/testing
+#ifdef DUMP_SYMTAB
+fprintf ( stderr, "Inserting (%s,%d)\n", key, value->stack_offset );
+#endif
+}
+
+
+symbol_t * symbol_get(char *key) {
+    int32_t search_index = scopes_index;
+    symbol_t* result = NULL;
+
+    /*
+     * Iterate until we find the symbol or we have reached the bottom of the
+     * stack.
+     */
+    while (result == NULL && search_index >= 0) {
+        result = ght_get(scopes[search_index], strlen(key), key);
+        search_index--;
+    }
+
+    /*
+     * Here would be a good place to print error messages if we failed to find
+     * a symbol.
+     */
+// Keep this for debugging/testing
+#ifdef DUMP_SYMTAB
+    if ( result != NULL )
+        fprintf ( stderr, "Retrieving (%s,%d)\n", key, result->stack_offset );
+#endif
+
+    return result;
+}
@@ -0,0 +1,139 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+/*
+ * Locals made by tree passes to keep values in. They are declared after
+ * the locals of the block which is the body of their function, so they
+ * are in scope everywhere in it, and numbered the way bind_names numbers
+ * that block: 4 bytes each below the ones before them, at depth 3 (the
+ * function list is at depth 1, as in the generator). Their names cannot
+ * be confused with the ones in the program, and keep the C backend happy.
+ */
+
+static node_t *body;
+static int32_t body_locals;
+static symbol_t **symbols;
+static char **names;
+static uint32_t n_temporaries, capacity;
+
+
+/* Start making locals for a function, false if it has no block to put them in */
+    bool
+temporaries_open ( node_t *function )
+{
+    node_t *declarations;
+
+    body = function->children[function->n_children - 1];
+    if (body == NULL || body->type.index != BLOCK) {
+        body = NULL;
+        return false;
+    }
+
+    body_locals = 0;
+    n_temporaries = 0;
+    declarations = body->children[0];
+    for (uint32_t i = 0; declarations != NULL && i < declarations->n_children; i++) {
+        body_locals += declarations->children[i]->children[0]->n_children;
+    }
+    return true;
+}
+
+
+    symbol_t *
+temporary_new ( char *prefix )
+{
+    symbol_t *temporary = malloc(sizeof(*temporary));
+    char *name = malloc(strlen(prefix) + 16);
+
+    if (temporary == NULL || name == NULL) {
+        fprintf(stderr, "Failed to allocate heap for a temporary.\n");
+        abort();
+    }
+    if (n_temporaries == capacity) {
+        capacity = 2 * capacity + 8;
+        symbols = realloc(symbols, sizeof(*symbols) * capacity);
+        names = realloc(names, sizeof(*names) * capacity);
+        if (symbols == NULL || names == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for temporaries.\n");
+            abort();
+        }
+    }
+
+    sprintf(name, "_%s%u", prefix, n_temporaries + 1);
+    symbols[n_temporaries] = temporary;
+    names[n_temporaries++] = name;
+    temporary->stack_offset = -4 * (body_locals + (int32_t) n_temporaries);
+    temporary->depth = 3;
+    temporary->label = NULL;
+    symbol_keep(temporary);
+    return temporary;
+}
+
+
+/* A VARIABLE node which refers to a temporary */
+    node_t *
+temporary_read ( symbol_t *temporary )
+{
+    node_t *read = malloc(sizeof(*read));
+    uint32_t t = 0;
+
+    while (symbols[t] != temporary) {
+        t++;
+    }
+    node_init(read, variable_n, STRDUP(names[t]), 0);
+    read->entry = temporary;
+    return read;
+}
+
+
+/* An assignment of a value to a temporary */
+    node_t *
+temporary_assign ( symbol_t *temporary, node_t *value )
+{
+    node_t *assignment = malloc(sizeof(*assignment));
+    return node_init(assignment, assignment_statement_n, NULL, 2, temporary_read(temporary), value);
+}
+
+
+/* Declare the locals made for the function, returning how many there were */
+    int32_t
+temporaries_close ( void )
+{
+    node_t *variables, *declaration, **list;
+    int32_t made = n_temporaries;
+
+    if (body != NULL && n_temporaries > 0) {
+        variables = node_list_new(variable_list_n, n_temporaries);
+        for (uint32_t t = 0; t < n_temporaries; t++) {
+            variables->children[t] = malloc(sizeof(node_t));
+            node_init(variables->children[t], variable_n, STRDUP(names[t]), 0);
+        }
+        declaration = malloc(sizeof(*declaration));
+        node_init(declaration, declaration_n, NULL, 1, variables);
+
+        list = &body->children[0];
+        if (*list == NULL) {
+            *list = malloc(sizeof(**list));
+            node_init(*list, declaration_list_n, NULL, 0);
+        }
+        (*list)->children = realloc((*list)->children, sizeof(node_t *) * ((*list)->n_children + 1));
+        if ((*list)->children == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for declarations.\n");
+            abort();
+        }
+        (*list)->children[(*list)->n_children++] = declaration;
+    }
+
+    for (uint32_t t = 0; t < n_temporaries; t++) {
+        free(names[t]);
+    }
+    free(symbols);
+    free(names);
+    symbols = NULL;
+    names = NULL;
+    body = NULL;
+    n_temporaries = capacity = 0;
+    return made;
+}
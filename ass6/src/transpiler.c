@@ -0,0 +1,542 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "transpiler.h"
+#include "passes.h"
+
+/*
+ * C backend: writes the bound tree as a C program, so a C compiler can
+ * optimize it. VSL functions become static C functions (prefix vsl_),
+ * variables become C variables (prefix v_) declared in the same blocks,
+ * so C scoping gives the shadowing that bind_names does. Arithmetic wraps
+ * and division traps like the native code. The operands of C operators
+ * and arguments are unsequenced, so calls are assigned to temporaries in
+ * the native evaluation order when an expression has more than one.
+ * A memoized function becomes a static function (prefix memoized_) for
+ * the body, called by vsl_ when its cache has nothing for the arguments.
+ */
+
+
+/* Growable string for building expressions */
+typedef struct {
+    char *text;
+    size_t length, capacity;
+} text_t;
+
+static FILE *source;
+static int32_t indent, temporaries;
+static node_t *function_list;
+
+static void text_printf ( text_t *text, const char *format, ... );
+static void line ( const char *format, ... );
+static void expression ( text_t *text, node_t *root, bool hoist );
+static void statement ( node_t *root );
+
+/* Helpers at the top of every translated program */
+static const char *prelude =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <stdint.h>\n"
+    "#include <signal.h>\n"
+    "\n"
+    "/* 32 bit arithmetic wraps around, and division traps like idivl */\n"
+    "static inline int32_t vsl_add(int32_t a, int32_t b) { return (int32_t) ((uint32_t) a + (uint32_t) b); }\n"
+    "static inline int32_t vsl_sub(int32_t a, int32_t b) { return (int32_t) ((uint32_t) a - (uint32_t) b); }\n"
+    "static inline int32_t vsl_mul(int32_t a, int32_t b) { return (int32_t) ((uint32_t) a * (uint32_t) b); }\n"
+    "static inline int32_t vsl_neg(int32_t a) { return (int32_t) -(uint32_t) a; }\n"
+    "static inline int32_t vsl_div(int32_t a, int32_t b)\n"
+    "{\n"
+    "    if (b == 0 || (a == INT32_MIN && b == -1)) {\n"
+    "        raise(SIGFPE);\n"
+    "        exit(EXIT_FAILURE);\n"
+    "    }\n"
+    "    return a / b;\n"
+    "}\n";
+
+
+    static void
+text_printf ( text_t *text, const char *format, ... )
+{
+    va_list arguments;
+    int length;
+
+    va_start(arguments, format);
+    length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+
+    if (text->length + length + 1 > text->capacity) {
+        text->capacity = 2 * (text->length + length + 1);
+        text->text = realloc(text->text, text->capacity);
+        if (text->text == NULL) {
+            fprintf(stderr, "Failed to reallocate heap for C text.\n");
+            abort();
+        }
+    }
+
+    va_start(arguments, format);
+    vsnprintf(text->text + text->length, length + 1, format, arguments);
+    va_end(arguments);
+    text->length += length;
+}
+
+
+/* One line of output at the current indentation */
+    static void
+line ( const char *format, ... )
+{
+    va_list arguments;
+
+    fprintf(source, "%*s", 4 * indent, "");
+    va_start(arguments, format);
+    vfprintf(source, format, arguments);
+    va_end(arguments);
+    fputc('\n', source);
+}
+
+
+    static int32_t
+count_calls ( node_t *root )
+{
+    int32_t calls = (root != NULL && expression_is_call(root)) ? 1 : 0;
+    if (root != NULL) {
+        for (uint32_t i = 0; i < root->n_children; i++) {
+            calls += count_calls(root->children[i]);
+        }
+    }
+    return calls;
+}
+
+
+/* A string literal's bytes as a C string, without the quotes */
+    static void
+string_literal ( text_t *text, int32_t index )
+{
+    uint32_t length;
+    char *value = strings_value(index, &length);
+
+    for (uint32_t i = 0; i < length; i++) {
+        unsigned char c = value[i];
+        if (c == '"' || c == '\\' || c == '?') {
+            text_printf(text, "\\%c", c);
+        } else if (c == '\n') {
+            text_printf(text, "\\n");
+        } else if (c < ' ' || c > '~') {
+            text_printf(text, "\\%03o", c);
+        } else {
+            text_printf(text, "%c", c);
+        }
+    }
+    free(value);
+}
+
+
+/* Expressions */
+
+
+    static void
+call ( text_t *text, node_t *root, bool hoist )
+{
+    node_t *arguments = root->children[1];
+    text_t c = { NULL, 0, 0 };
+
+    text_printf(&c, "vsl_%s(", (char *) root->children[0]->data);
+    for (uint32_t i = 0; arguments != NULL && i < arguments->n_children; i++) {
+        if (i > 0) {
+            text_printf(&c, ", ");
+        }
+        expression(&c, arguments->children[i], hoist);
+    }
+    text_printf(&c, ")");
+
+    if (hoist) {
+        int32_t temporary = temporaries++;
+        line("int32_t t%d = %s;", temporary, c.text);
+        text_printf(text, "t%d", temporary);
+    } else {
+        text_printf(text, "%s", c.text);
+    }
+    free(c.text);
+}
+
+
+/*
+ * Append the C for an expression. With hoist set, calls are assigned to
+ * temporaries on lines of their own, arguments before calls and left
+ * operands before right ones, the order the generator evaluates them in.
+ */
+    static void
+expression ( text_t *text, node_t *root, bool hoist )
+{
+    char *op = (char *) root->data;
+
+    if (root->type.index == INTEGER) {
+        int32_t value = *(int32_t *) root->data;
+        if (value == INT32_MIN) {
+            text_printf(text, "INT32_MIN");
+        } else {
+            text_printf(text, "%d", value);
+        }
+    } else if (root->type.index == VARIABLE) {
+        text_printf(text, "v_%s", (char *) root->data);
+    } else if (root->type.index != EXPRESSION || op == NULL) {
+        expression(text, root->children[0], hoist);
+    } else if (root->n_children == 1) {
+        text_printf(text, "vsl_neg(");
+        expression(text, root->children[0], hoist);
+        text_printf(text, ")");
+    } else if (expression_is_call(root)) {
+        call(text, root, hoist);
+    } else if (strchr("+-*/", *op) != NULL && op[1] == '\0') {
+        char *helper = (*op == '+') ? "add" : (*op == '-') ? "sub" : (*op == '*') ? "mul" : "div";
+        text_printf(text, "vsl_%s(", helper);
+        expression(text, root->children[0], hoist);
+        text_printf(text, ", ");
+        expression(text, root->children[1], hoist);
+        text_printf(text, ")");
+    } else {
+        /* Relations are 1 or 0 in C as well */
+        text_printf(text, "(");
+        expression(text, root->children[0], hoist);
+        text_printf(text, " %s ", op);
+        expression(text, root->children[1], hoist);
+        text_printf(text, ")");
+    }
+}
+
+
+/* The C for an expression, with calls hoisted if their order could change */
+    static char *
+value ( node_t *root )
+{
+    text_t text = { NULL, 0, 0 };
+    expression(&text, root, count_calls(root) > 1);
+    return text.text;
+}
+
+
+/* Statements */
+
+
+/* Relations are parenthesized already, so they can be a condition as they are */
+    static void
+conditional ( char *keyword, char *condition )
+{
+    if (*condition == '(') {
+        line("%s %s", keyword, condition);
+    } else {
+        line("%s (%s)", keyword, condition);
+    }
+}
+
+
+/* Print lists become one printf, split where an item calls a function */
+    static void
+print_list ( node_t *root )
+{
+    text_t format = { NULL, 0, 0 }, arguments = { NULL, 0, 0 };
+
+    text_printf(&format, "%s", "");
+    text_printf(&arguments, "%s", "");
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        node_t *item = root->children[i]->children[0];
+        if (item->type.index == TEXT) {
+            string_literal(&format, *(int32_t *) item->data);
+            continue;
+        }
+
+        /* Calls may print, so what comes before them is printed first */
+        if (count_calls(item) > 0 && format.length > 0) {
+            line("printf(\"%s\"%s);", format.text, arguments.text);
+            format.length = arguments.length = 0;
+            format.text[0] = arguments.text[0] = '\0';
+        }
+        text_printf(&format, "%%d ");
+        text_printf(&arguments, ", ");
+        expression(&arguments, item, count_calls(item) > 0);
+    }
+    text_printf(&format, "\\n");
+    line("printf(\"%s\"%s);", format.text, arguments.text);
+
+    free(format.text);
+    free(arguments.text);
+}
+
+
+    static void
+block ( node_t *root )
+{
+    line("{");
+    indent++;
+    if (root->children[0] != NULL) {
+        for (uint32_t i = 0; i < root->children[0]->n_children; i++) {
+            node_t *variables = root->children[0]->children[i]->children[0];
+            text_t declaration = { NULL, 0, 0 };
+            /* Declarations with data are not cleared, see DECLARATION_CLEARED in passes.h */
+            bool cleared = root->children[0]->children[i]->data == NULL;
+            text_printf(&declaration, "int32_t ");
+            for (uint32_t v = 0; v < variables->n_children; v++) {
+                text_printf(&declaration, "%sv_%s%s", (v > 0) ? ", " : "", (char *) variables->children[v]->data,
+                    cleared ? " = 0" : "");
+            }
+            line("%s;", declaration.text);
+            free(declaration.text);
+        }
+    }
+    statement(root->children[1]);
+    indent--;
+    line("}");
+}
+
+
+/* Statements in a C block of their own, for the bodies of if and loops */
+    static void
+body ( node_t *root )
+{
+    if (root->type.index == BLOCK) {
+        block(root);
+    } else {
+        line("{");
+        indent++;
+        statement(root);
+        indent--;
+        line("}");
+    }
+}
+
+
+    static void
+statement ( node_t *root )
+{
+    char *c, *end;
+
+    if (root == NULL) {
+        return;
+    }
+
+    switch (root->type.index) {
+        case BLOCK:
+            block(root);
+            break;
+
+        case ASSIGNMENT_STATEMENT:
+            c = value(root->children[1]);
+            line("v_%s = %s;", (char *) root->children[0]->data, c);
+            free(c);
+            break;
+
+        case RETURN_STATEMENT:
+            c = value(root->children[0]);
+            line("return %s;", c);
+            free(c);
+            break;
+
+        case PRINT_LIST:
+            print_list(root);
+            break;
+
+        case IF_STATEMENT:
+            c = value(root->children[0]);
+            conditional("if", c);
+            body(root->children[1]);
+            if (root->n_children == 3) {
+                line("else");
+                body(root->children[2]);
+            }
+            free(c);
+            break;
+
+        case WHILE_STATEMENT:
+            /* Hoisted calls in the condition are made on every iteration */
+            if (count_calls(root->children[0]) > 1) {
+                line("for (;;) {");
+                indent++;
+                c = value(root->children[0]);
+                line("if (!%s)", c);
+                line("    break;");
+                body(root->children[1]);
+                indent--;
+                line("}");
+            } else {
+                c = value(root->children[0]);
+                conditional("while", c);
+                body(root->children[1]);
+            }
+            free(c);
+            break;
+
+        case FOR_STATEMENT: {
+            /* The end value is evaluated on every iteration, as in the generator */
+            char *counter = (char *) root->children[0]->children[0]->data;
+            statement(root->children[0]);
+            if (count_calls(root->children[1]) > 1) {
+                line("for (;; v_%s = vsl_add(v_%s, 1)) {", counter, counter);
+                indent++;
+                end = value(root->children[1]);
+                line("if (v_%s == %s)", counter, end);
+                line("    break;");
+                body(root->children[2]);
+                indent--;
+                line("}");
+            } else {
+                end = value(root->children[1]);
+                line("for (; v_%s != %s; v_%s = vsl_add(v_%s, 1))", counter, end, counter, counter);
+                body(root->children[2]);
+            }
+            free(end);
+            break;
+        }
+
+        case NULL_STATEMENT:
+            break;
+
+        default:
+            for (uint32_t i = 0; i < root->n_children; i++) {
+                statement(root->children[i]);
+            }
+            break;
+    }
+}
+
+
+/* Functions */
+
+
+    static void
+prototype ( node_t *function, char *prefix, char *terminator )
+{
+    node_t *parameters = function->children[1];
+    text_t c = { NULL, 0, 0 };
+
+    text_printf(&c, "static int32_t %s%s(", prefix, (char *) function->children[0]->data);
+    if (parameters == NULL || parameters->n_children == 0) {
+        text_printf(&c, "void");
+    }
+    for (uint32_t i = 0; parameters != NULL && i < parameters->n_children; i++) {
+        text_printf(&c, "%sint32_t v_%s", (i > 0) ? ", " : "", (char *) parameters->children[i]->data);
+    }
+    line("%s)%s", c.text, terminator);
+    free(c.text);
+}
+
+
+/*
+ * The cache of a memoized function, a static array in the function which
+ * looks the arguments up in it, and calls the body if they are not there
+ */
+    static void
+memoized ( node_t *root )
+{
+    node_t *parameters = root->children[1];
+    char *name = (char *) root->children[0]->data;
+    text_t match = { NULL, 0, 0 }, arguments = { NULL, 0, 0 };
+
+    for (uint32_t i = 0; i < parameters->n_children; i++) {
+        char *parameter = (char *) parameters->children[i]->data;
+        text_printf(&match, " && entry->keys[%u] == v_%s", i, parameter);
+        text_printf(&arguments, "%sv_%s", (i > 0) ? ", " : "", parameter);
+    }
+
+    prototype(root, "vsl_", "");
+    line("{");
+    indent++;
+    line("static struct memo { int32_t used, value, keys[%u]; } cache[%d];", parameters->n_children, 1 << MEMO_BITS);
+    line("uint32_t hash = (uint32_t) v_%s;", (char *) parameters->children[0]->data);
+    for (uint32_t i = 1; i < parameters->n_children; i++) {
+        line("hash = hash * 31 + (uint32_t) v_%s;", (char *) parameters->children[i]->data);
+    }
+    line("struct memo *entry = &cache[hash & %d];", (1 << MEMO_BITS) - 1);
+    line("if (entry->used%s)", match.text);
+    line("    return entry->value;");
+    line("int32_t value = memoized_%s(%s);", name, arguments.text);
+    line("entry->used = 1;");
+    line("entry->value = value;");
+    for (uint32_t i = 0; i < parameters->n_children; i++) {
+        line("entry->keys[%u] = v_%s;", i, (char *) parameters->children[i]->data);
+    }
+    line("return value;");
+    indent--;
+    line("}");
+    line("");
+    free(match.text);
+    free(arguments.text);
+    pass_count(PASS_MEMOIZE, 1);
+}
+
+
+    static void
+function ( node_t *root )
+{
+    bool memoize = memoize_function(root);
+
+    prototype(root, memoize ? "memoized_" : "vsl_", "");
+    line("{");
+    indent++;
+    temporaries = 0;
+    statement(root->children[root->n_children - 1]);
+
+    /* Falling off the end returns 0 */
+    line("return 0;");
+    indent--;
+    line("}");
+    line("");
+    if (memoize) {
+        memoized(root);
+    }
+}
+
+
+/*
+ * Like TEXT_HEAD: the command line arguments are converted with strtol
+ * and passed to the first function, the last ones if there are more than
+ * it takes, and what it returns goes to exit
+ */
+    static void
+entry ( node_t *first )
+{
+    node_t *parameters = first->children[1];
+    uint32_t n_parameters = (parameters == NULL) ? 0 : parameters->n_children;
+    text_t arguments = { NULL, 0, 0 };
+
+    text_printf(&arguments, "%s", "");
+    line("int main(int argc, char **argv)");
+    line("{");
+    indent++;
+    if (n_parameters > 0) {
+        line("int32_t arguments[%u];", n_parameters);
+        line("for (int i = 0, a = argc - %u; i < %u; i++, a++)", n_parameters, n_parameters);
+        line("    arguments[i] = (a >= 1) ? (int32_t) strtol(argv[a], NULL, 10) : 0;");
+    } else {
+        line("(void) argc;");
+        line("(void) argv;");
+    }
+    for (uint32_t i = 0; i < n_parameters; i++) {
+        text_printf(&arguments, "%sarguments[%u]", (i > 0) ? ", " : "", i);
+    }
+    line("exit(vsl_%s(%s));", (char *) first->children[0]->data, arguments.text);
+    indent--;
+    line("}");
+    free(arguments.text);
+}
+
+
+    void
+transpile ( FILE *stream, node_t *root )
+{
+    source = stream;
+    indent = 0;
+    function_list = root->children[0];
+
+    fputs(prelude, source);
+    line("");
+    for (uint32_t i = 0; i < function_list->n_children; i++) {
+        prototype(function_list->children[i], "vsl_", ";");
+    }
+    line("");
+    memoize_analyse(root);
+    for (uint32_t i = 0; i < function_list->n_children; i++) {
+        function(function_list->children[i]);
+    }
+    memoize_finalize();
+    entry(function_list->children[0]);
+}
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree.h"
+#include "symtab.h"
+#include "passes.h"
+
+
+#ifdef DUMP_TREES
+void
+node_print ( FILE *output, node_t *root, uint32_t nesting )
+{
+    if ( root != NULL )
+    {
+        fprintf ( output, "%*c%s", nesting, ' ', root->type.text );
+        if ( root->type.index == INTEGER )
+            fprintf ( output, "(%d)", *((int32_t *)root->data) );
+        if ( root->type.index == VARIABLE || root->type.index == EXPRESSION )
+        {
+            if ( root->data != NULL )
+                fprintf ( output, "(\"%s\")", (char *)root->data );
+            else
+                fprintf ( output, "%p", root->data );
+        }
+        fputc ( '\n', output );
+        for ( int32_t i=0; i<root->n_children; i++ )
+            node_print ( output, root->children[i], nesting+1 );
+    }
+    else
+        fprintf ( output, "%*c%p\n", nesting, ' ', root );
+}
+#endif
+
+
+node_t *
+node_init ( node_t *nd, nodetype_t type, void *data, uint32_t n_children, ... )
+{
+    va_list child_list;
+    *nd = (node_t) { type, data, NULL, n_children,
+        (node_t **) malloc ( n_children * sizeof(node_t *) )
+    };
+    va_start ( child_list, n_children );
+    for ( uint32_t i=0; i<n_children; i++ )
+        nd->children[i] = va_arg ( child_list, node_t * );
+    va_end ( child_list );
+    return nd;
+}
+
+
+void
+node_finalize ( node_t *discard )
+{
+    if ( discard != NULL )
+    {
+        free ( discard->data );
+        free ( discard->children );
+        free ( discard );
+    }
+}
+
+
+void
+destroy_subtree ( node_t *discard )
+{
+    if ( discard != NULL )
+    {
+        for ( uint32_t i=0; i<discard->n_children; i++ )
+            destroy_subtree ( discard->children[i] );
+        node_finalize ( discard );
+    }
+}
+
+
+/*
+ * Macro for dereferencing data in a node_t that contain an integer.
+ */
+#define INTVAL(n) *((int*)n->data)
+
+
+/*
+ * A function to change a node with it's first child. To do this we store a copy
+ * of the parent node and move the child node into the parent's position.
+ * Then we free the space previously used by the child, but only after changing
+ * the data- and children-fields at that position with those of the parents so
+ * we don't lose any data.
+ */
+static void collapse_node(node_t* node) {
+    node_t parent = *node;
+
+    *node = *parent.children[0];
+    parent.children[0]->data = parent.data;
+    parent.children[0]->children = parent.children;
+
+    node_finalize(parent.children[0]);
+}
+
+/*
+ * A function to make the various list-types flat. It works by increasing the
+ * size of the left child's array of children by one, and then adding the right
+ * child to the end of that array. Then we collapse the current node, bringing
+ * the left child up as the current node.
+ */
+static void collapse_list(node_t* node) {
+    node->children[0]->n_children++;
+    node->children[0]->children = realloc(node->children[0]->children, sizeof(*node->children) * node->children[0]->n_children);
+
+    if (node->children[0]->children == NULL) {
+        fputs("Failed to reallocate space to make flat lists\n", stderr);
+        abort();
+    }
+
+    node->children[0]->children[node->children[0]->n_children - 1] = node->children[1];
+
+    collapse_node(node);
+}
+
+node_t* simplify_tree ( node_t* node ){
+    if ( node != NULL ){
+        // Recursively simplify the children of the current node
+        for ( uint32_t i=0; i<node->n_children; i++ ){
+            node->children[i] = simplify_tree ( node->children[i] );
+        }
+
+        // After the children have been simplified, we look at the current node
+        // What we do depend upon the type of node
+        switch ( node->type.index ) {
+            // These are lists which needs to be flattened. Their structure
+            // is the same, so they can be treated the same way.
+            case FUNCTION_LIST: case STATEMENT_LIST: case PRINT_LIST:
+            case EXPRESSION_LIST: case VARIABLE_LIST:
+                if (node->children[0]->type.index == node->type.index) {
+                    collapse_list(node);
+                }
+                break;
+
+            // Declaration lists should also be flattened, but their stucture is sligthly
+            // different, so they need their own case
+            case DECLARATION_LIST:
+                if (node->children[0] == NULL) {
+                    /*
+                     * node's left-most child is NULL, so we must shift all the
+                     * elements in the array one position to the left.
+                     * Afterwards we can shrink the children array by one.
+                     */
+                    node->n_children--;
+                    memmove(node->children, &node->children[1], sizeof(*node->children) * node->n_children);
+
+                    node->children = realloc(node->children, sizeof(*node->children) * node->n_children);
+
+                    if (node->children == NULL) {
+                        fputs("Failed to reallocate space to make flat lists\n", stderr);
+                        abort();
+                    }
+                } else if (node->children[0]->type.index == node->type.index) {
+                    collapse_list(node);
+                }
+                break;
+
+            // These have only one child, so they are not needed
+            case STATEMENT: case PARAMETER_LIST: case ARGUMENT_LIST:
+                collapse_node(node);
+                break;
+
+            // Expressions where both children are integers can be evaluated (and replaced with
+            // integer nodes). Expressions whith just one child can be removed (like statements etc above)
+            case EXPRESSION:
+                if (node->n_children == 1 && node->data == NULL) {
+                    collapse_node(node);
+                } else if (node->n_children == 1 && node->children[0]->type.index == INTEGER && strcmp(node->data, "-") == 0) {
+                    /*
+                     * Unary minus, multiply the value stored in the only child
+                     * node with -1 and collapse this node.
+                     */
+                    INTVAL(node->children[0]) = (int32_t) -(uint32_t) INTVAL(node->children[0]);
+                    collapse_node(node);
+                } else if (node->n_children == 2 && node->children[0]->type.index == INTEGER && node->children[1]->type.index == INTEGER) {
+                    /*
+                     * Fold like fold_binary does, wrapping around and
+                     * leaving divisions which trap for the program to do.
+                     */
+                    int32_t value;
+                    if (!fold_binary(node->data, INTVAL(node->children[0]), INTVAL(node->children[1]), &value)) {
+                        break;
+                    }
+                    INTVAL(node->children[0]) = value;
+
+                    /*
+                     * Free the current node data, copy the result to the
+                     * current node and remove the pointer to the result from
+                     * the first child, before free-ing up the space used by
+                     * the children.
+                     */
+                    free(node->data);
+                    node->data = node->children[0]->data;
+                    node->children[0]->data = NULL;
+
+                    node_finalize(node->children[0]);
+                    node_finalize(node->children[1]);
+                    free(node->children);
+
+                    /* Write new data over current node */
+                    node_init(node, integer_n, node->data, 0);
+                }
+                break;
+        }
+    }
+    return node;
+}
+
+
+void bind_names(node_t *root) {
+    /* Temporary pointer used when making new symbols. */
+    symbol_t *tmp;
+    /*
+     * Temporary variable used when setting the offset for symtab entries or
+     * the index for strings.
+     */
+    int tmp_offset;
+
+    /* "NULL-guard" */
+    if (root == NULL) {
+        return;
+    }
+
+    /* First we check whether we should add a new scope to the stack */
+    if (root->type.index == FUNCTION_LIST || root->type.index == FUNCTION|| root->type.index == BLOCK) {
+        scope_add();
+    }
+
+    /*
+     * Now begins the ugliest part of this code, where all the magic for the
+     * symbol table happens. Basically it is a list of several special cases
+     * where something should happen, and just a simple recursion of the tree
+     * otherwise.
+     */
+    if (root->type.index == FUNCTION_LIST) {
+        /* First we need to add all the functions to the symbol table. */
+        for (int i = 0; i < root->n_children; i++) {
+            tmp = malloc(sizeof(*tmp));
+            if (tmp == NULL) {
+                fprintf(stderr, "Failed to allocate heap for symbol.\n");
+                abort();
+            }
+
+            /*
+             * root->children[i]->children[0] is the node containing the name of
+             * the function.
+             */
+            tmp->stack_offset = 0;
+            tmp->label = root->children[i]->children[0]->data;
+            symbol_insert(root->children[i]->children[0]->data, tmp);
+        }
+
+        /*
+         * Now that all the function names are added, we want to search for the
+         * remaining symbols.
+         */
+        for (int i = 0; i < root->n_children; i++) {
+            bind_names(root->children[i]);
+        }
+    } else if (root->type.index == FUNCTION) {
+        /*
+         * The name refers to the symbol of the function itself, which the
+         * code generator takes its label from. It is looked up before the
+         * parameters, which may have the same name.
+         */
+        root->children[0]->entry = symbol_get(root->children[0]->data);
+
+        /*
+         * Then we need to check whether the function has any parameters, and
+         * in that case add them all.
+         */
+        if (root->children[1] != NULL) {
+            /*
+             * The parameters are all children of the current node's second
+             * child. This code is not very maintainable, luckily, that's not a
+             * requirement, even though I should try to make the code as
+             * maintainable as possible.
+             */
+            tmp_offset = 4 + 4 * root->children[1]->n_children;
+
+            for (int i = 0; i < root->children[1]->n_children; i++, tmp_offset -= 4) {
+                tmp = malloc(sizeof(*tmp));
+                if (tmp == NULL) {
+                    fprintf(stderr, "Failed to allocate heap for symbol.\n");
+                    abort();
+                }
+
+                /*
+                 * We don't need to set the depth as symbol_insert handles that
+                 * automatically.
+                 */
+                tmp->stack_offset = tmp_offset;
+                symbol_insert(root->children[1]->children[i]->data, tmp);
+            }
+        }
+
+        /*
+         * The current node's third child contains the function body, whick is
+         * where we will have to look for more symbol references.
+         */
+        bind_names(root->children[2]);
+    } else if (root->type.index == BLOCK) {
+        /*
+         * We need to check whether the current block has any variables we
+         * should add to the stack, and add them if that's the case.
+         */
+        if (root->children[0] != NULL) {
+            tmp_offset = -4;
+
+            /*
+             * We need to iterate over all the declaration nodes in the
+             * declaration list. Every declaration has a variable list with
+             * potentially several variables which we also need to iterate over.
+             */
+            for (int i = 0; i < root->children[0]->n_children; i++) {
+                for (int n = 0; n < root->children[0]->children[i]->children[0]->n_children; n++, tmp_offset -= 4) {
+                    tmp = malloc(sizeof(*tmp));
+                    if (tmp == NULL) {
+                        fprintf(stderr, "Failed to allocate heap for symbol.\n");
+                        abort();
+                    }
+
+                    tmp->stack_offset = tmp_offset;
+                    symbol_insert(root->children[0]->children[i]->children[0]->children[n]->data, tmp);
+                }
+            }
+        }
+
+        /* Now we need to recurse through the statement list. */
+        bind_names(root->children[1]);
+    } else if (root->type.index == VARIABLE) {
+        /*
+         * We have reached a reference to a variable and insert the pointer to
+         * the symtab entry.
+         */
+        root->entry = symbol_get(root->data);
+    } else if (root->type.index == TEXT) {
+        /*
+         * We have reached a text node and have to add it to the string list.
+         * As we don't want to store the string two places, we exchange the text
+         * node's data pointer with a pointer to a variable with the index of
+         * this string in the string array.
+         */
+        tmp_offset = strings_add(root->data);
+        root->data = malloc(sizeof(tmp_offset));
+        *((int*) root->data) = tmp_offset;
+    } else {
+        for (int i = 0; i < root->n_children; i++) {
+            bind_names(root->children[i]);
+        }
+    }
+
+    if (root->type.index == FUNCTION_LIST || root->type.index == FUNCTION|| root->type.index == BLOCK) {
+        scope_remove();
+    }
+}
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "passes.h"
+
+/*
+ * Unrolling of FOR loops which run a number of times known at compile
+ * time, from a constant start value to a constant end value, with a body
+ * which does not assign the variable. A loop with few iterations and a
+ * small body is replaced by a copy of the body for every iteration, where
+ * the variable is the constant it would have been, and folded. A larger
+ * loop with a small body runs a multiple of the factor iterations with
+ * that many copies of the body in each, the variable counted up between
+ * them, followed by a loop for what remains. It runs after sccp, so end
+ * values which are constant through variables are literals by then, and
+ * loops inside others are unrolled first, so the size of their copies
+ * counts against the loops around them.
+ */
+
+/*
+ * Limits, set from the command line with -u name=value to a value from 1
+ * to the cap, which keeps the copies of a loop within reason
+ */
+typedef struct {
+    char *name;
+    int32_t value, cap;
+} unroll_limit_t;
+
+enum { FULL_TRIPS, FULL_SIZE, FACTOR, BODY_SIZE, N_LIMITS };
+
+static unroll_limit_t limits[N_LIMITS] = {
+    [FULL_TRIPS] = { "full-trips", 16, 1024 },  /* Most iterations to unroll fully */
+    [FULL_SIZE] = { "full-size", 256, 65536 },  /* Most nodes in a fully unrolled loop */
+    [FACTOR] = { "factor", 4, 64 },             /* Copies of the body when partially unrolled */
+    [BODY_SIZE] = { "body-size", 48, 4096 },    /* Most nodes in a body to unroll partially */
+};
+
+
+/*
+ * Set a limit from a name=value setting, false if there is no such limit,
+ * or the value is not a number from 1 to its cap
+ */
+    bool
+unroll_set ( char *setting )
+{
+    char *value = strchr(setting, '='), *end;
+    long number;
+
+    if (value == NULL) {
+        return false;
+    }
+    for (int32_t l = 0; l < N_LIMITS; l++) {
+        if (strlen(limits[l].name) == (size_t) (value - setting)
+            && strncmp(limits[l].name, setting, value - setting) == 0) {
+            errno = 0;
+            number = strtol(value + 1, &end, 10);
+            if (errno != 0 || end == value + 1 || *end != '\0'
+                || number < 1 || number > limits[l].cap) {
+                return false;
+            }
+            limits[l].value = number;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* The limits -u can set, their values and caps, a line each */
+    void
+unroll_limits ( FILE *stream )
+{
+    for (int32_t l = 0; l < N_LIMITS; l++) {
+        fprintf(stream, "  %-10s %5d, from 1 to %d\n", limits[l].name, limits[l].value, limits[l].cap);
+    }
+}
+
+
+/* Replace reads of the variable with a constant */
+    static void
+substitute ( node_t *root, symbol_t *entry, int32_t value )
+{
+    if (root->type.index == VARIABLE && root->entry == entry) {
+        node_make_integer(root, value);
+        return;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        if (root->children[i] != NULL) {
+            substitute(root->children[i], entry, value);
+        }
+    }
+}
+
+
+/* Replace assignments of variables to themselves, left by folding, with nothing */
+    static void
+remove_self_assignments ( node_t *root )
+{
+    if (root == NULL) {
+        return;
+    }
+    if (root->type.index == ASSIGNMENT_STATEMENT && root->children[1]->type.index == VARIABLE
+        && root->children[1]->entry == root->children[0]->entry) {
+        destroy_subtree(root->children[0]);
+        destroy_subtree(root->children[1]);
+        free(root->children);
+        node_init(root, null_statement_n, NULL, 0);
+        return;
+    }
+    /* The start of a FOR loop has to stay an assignment */
+    for (uint32_t i = (root->type.index == FOR_STATEMENT) ? 1 : 0; i < root->n_children; i++) {
+        remove_self_assignments(root->children[i]);
+    }
+}
+
+
+/* An assignment of a constant, or of one more than its value, to a variable */
+    static node_t *
+assignment_new ( node_t *variable, bool increment, int32_t value )
+{
+    node_t *assignment = malloc(sizeof(*assignment)), *rhs = malloc(sizeof(*rhs));
+
+    if (increment) {
+        node_init(rhs, expression_n, STRDUP("+"), 2,
+            subtree_copy(variable), node_make_integer(subtree_copy(variable), 1));
+    } else {
+        node_make_integer(node_init(rhs, integer_n, NULL, 0), value);
+    }
+    return node_init(assignment, assignment_statement_n, NULL, 2, subtree_copy(variable), rhs);
+}
+
+
+/* One statement for every iteration, and the last value of the variable */
+    static node_t *
+unroll_fully ( node_t *root, uint32_t trips, int32_t *changes )
+{
+    node_t *variable = root->children[0]->children[0], *body = root->children[2];
+    int32_t start = *(int32_t *) root->children[0]->children[1]->data;
+    node_t *list = statement_list_new(trips + 1);
+
+    for (uint32_t t = 0; t < trips; t++) {
+        node_t *copy = subtree_copy(body);
+        substitute(copy, variable->entry, (int32_t) ((uint32_t) start + t));
+        fold_constants(copy);
+        remove_self_assignments(copy);
+        list->children[list->n_children++] = copy;
+    }
+    list->children[list->n_children++] = assignment_new(variable, false, (int32_t) ((uint32_t) start + trips));
+    destroy_subtree(root);
+    (*changes)++;
+    return list;
+}
+
+
+/* The loop with factor copies of its body, and the loop for the rest */
+    static node_t *
+unroll_partially ( node_t *root, uint32_t trips, int32_t *changes )
+{
+    node_t *variable = root->children[0]->children[0], *body = root->children[2];
+    int32_t start = *(int32_t *) root->children[0]->children[1]->data;
+    uint32_t factor = limits[FACTOR].value, rest = trips % factor;
+    int32_t middle = (int32_t) ((uint32_t) start + (trips - rest));
+    node_t *copies = statement_list_new(2 * factor), *list, *remainder;
+
+    /* The loop itself counts up the variable after the last copy */
+    for (uint32_t c = 0; c < factor; c++) {
+        if (c > 0) {
+            copies->children[copies->n_children++] = assignment_new(variable, true, 0);
+        }
+        copies->children[copies->n_children++] = (c == 0) ? body : subtree_copy(body);
+    }
+    if (rest == 0) {
+        root->children[2] = copies;
+        (*changes)++;
+        return root;
+    }
+
+    remainder = malloc(sizeof(*remainder));
+    node_init(remainder, for_statement_n, NULL, 3,
+        assignment_new(variable, false, middle), root->children[1], subtree_copy(body));
+    root->children[1] = node_make_integer(node_init(malloc(sizeof(node_t)), integer_n, NULL, 0), middle);
+    root->children[2] = copies;
+
+    list = statement_list_new(2);
+    list->children[list->n_children++] = root;
+    list->children[list->n_children++] = remainder;
+    (*changes)++;
+    return list;
+}
+
+
+    static node_t *
+unroll ( node_t *root, int32_t *changes )
+{
+    node_t *init, *end;
+    uint32_t trips, body;
+
+    if (root == NULL) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < root->n_children; i++) {
+        root->children[i] = unroll(root->children[i], changes);
+    }
+    if (root->type.index != FOR_STATEMENT) {
+        return root;
+    }
+
+    init = root->children[0];
+    end = root->children[1];
+    if (init->children[1]->type.index != INTEGER || end->type.index != INTEGER
+        || subtree_assigns(root->children[2], init->children[0]->entry)) {
+        return root;
+    }
+
+    /* The variable wraps around if it starts above the end value */
+    trips = (uint32_t) *(int32_t *) end->data - (uint32_t) *(int32_t *) init->children[1]->data;
+    body = subtree_size(root->children[2]);
+    if (trips <= (uint32_t) limits[FULL_TRIPS].value
+        && (uint64_t) trips * body <= (uint64_t) limits[FULL_SIZE].value) {
+        return unroll_fully(root, trips, changes);
+    }
+    if (limits[FACTOR].value > 1 && body <= (uint32_t) limits[BODY_SIZE].value
+        && trips >= (uint32_t) limits[FACTOR].value) {
+        return unroll_partially(root, trips, changes);
+    }
+    return root;
+}
+
+
+    int32_t
+unroll_loops ( node_t *root )
+{
+    int32_t changes = 0;
+    unroll(root, &changes);
+    return changes;
+}
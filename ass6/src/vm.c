@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include "bytecode.h"
+#include "passes.h"
+
+/*
+ * Interpreter for register bytecode. Dispatch is threaded with computed
+ * gotos (a GNU C extension): every instruction ends by jumping straight to
+ * the code for the next opcode, instead of going back to a switch.
+ * Images are checked when they are loaded, so operands are trusted here.
+ */
+
+/* Size of the register stack, and of the stack of calls in progress */
+#define VM_REGISTERS (1 << 22)
+#define VM_FRAMES (1 << 20)
+
+typedef struct {
+    bytecode_instruction_t *pc;     /* Where to continue */
+    int32_t *registers;             /* Window of the caller */
+    uint16_t destination;           /* Register for the returned value */
+} frame_t;
+
+/*
+ * An entry of the cache of memoized functions, which they all share: it
+ * is direct mapped on the hash of the function and the arguments
+ */
+typedef struct {
+    uint32_t function;              /* Index + 1, 0 if the entry is unused */
+    int32_t value;
+    int32_t keys[MEMO_KEYS];
+} memo_t;
+
+
+/* Integer division traps like idivl does in native code */
+    static int32_t
+divide ( int32_t dividend, int32_t divisor )
+{
+    if (divisor == 0 || (dividend == INT32_MIN && divisor == -1)) {
+        raise(SIGFPE);
+        exit(EXIT_FAILURE);
+    }
+    return dividend / divisor;
+}
+
+
+    static void
+stack_overflow ( void )
+{
+    fprintf(stderr, "Stack overflow\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/* The entry of the cache for a call, the cache is allocated when it is first used */
+    static memo_t *
+memo_find ( memo_t **memo, uint32_t function, int32_t *arguments, uint32_t n_arguments )
+{
+    if (*memo == NULL) {
+        *memo = calloc(1 << MEMO_BITS, sizeof(**memo));
+        if (*memo == NULL) {
+            fprintf(stderr, "Failed to allocate heap for the VM cache.\n");
+            abort();
+        }
+    }
+    return &(*memo)[memoize_hash(function, arguments, n_arguments)];
+}
+
+
+/*
+ * Run a program: the entry function gets the command line arguments
+ * converted with strtol, the way TEXT_HEAD passes them to the first
+ * function, the last ones if there are more than it takes. Returns what
+ * it returns, which TEXT_TAIL passes to exit.
+ */
+    int32_t
+bytecode_run ( bytecode_t *program, int32_t argc, char **argv )
+{
+    static void *dispatch[N_BYTECODES] = {
+        [BC_LOADK] = &&loadk, [BC_MOVE] = &&move, [BC_CLEAR] = &&clear,
+        [BC_ADD] = &&add, [BC_SUB] = &&sub, [BC_MUL] = &&mul, [BC_DIV] = &&div,
+        [BC_ADDI] = &&addi, [BC_NEG] = &&neg,
+        [BC_LT] = &&lt, [BC_GT] = &&gt, [BC_LE] = &&le, [BC_GE] = &&ge, [BC_EQ] = &&eq, [BC_NE] = &&ne,
+        [BC_JUMP] = &&jump, [BC_JUMPZERO] = &&jumpzero,
+        [BC_JUMPLT] = &&jumplt, [BC_JUMPGT] = &&jumpgt, [BC_JUMPLE] = &&jumple,
+        [BC_JUMPGE] = &&jumpge, [BC_JUMPEQ] = &&jumpeq, [BC_JUMPNE] = &&jumpne,
+        [BC_CALL] = &&call, [BC_TAILCALL] = &&tailcall, [BC_RETURN] = &&ret,
+        [BC_PRINTS] = &&prints, [BC_PRINTI] = &&printi, [BC_NEWLINE] = &&newline,
+        [BC_MEMOLOOKUP] = &&memolookup, [BC_MEMORETURN] = &&memoreturn
+    };
+
+    bytecode_function_t *functions = program->functions, *entry = &functions[program->header->entry];
+    bytecode_instruction_t *code = program->code, *pc, *i;
+    int32_t *constants = program->constants;
+    int32_t *stack = calloc(VM_REGISTERS, sizeof(*stack)), *end = stack + VM_REGISTERS, *r = stack;
+    frame_t *frames = malloc(sizeof(*frames) * VM_FRAMES), *frame = frames;
+    memo_t *memo = NULL, *cached;
+    int32_t result;
+
+    if (stack == NULL || frames == NULL) {
+        fprintf(stderr, "Failed to allocate heap for the VM stack.\n");
+        abort();
+    }
+    for (int32_t p = 0, a = argc - entry->n_parameters; p < entry->n_parameters; p++, a++) {
+        if (a >= 1) {
+            r[p] = strtol(argv[a], NULL, 10);
+        }
+    }
+    pc = code + entry->entry;
+
+#define NEXT() do { i = pc++; goto *dispatch[i->opcode]; } while ( false )
+#define JUMP() pc += (int16_t) i->c
+#define ARITHMETIC(op) r[i->a] = (int32_t) ((uint32_t) r[i->b] op (uint32_t) r[i->c]); NEXT()
+#define RELATION(op) r[i->a] = (r[i->b] op r[i->c]); NEXT()
+#define BRANCH(op) if (r[i->a] op r[i->b]) JUMP(); NEXT()
+
+    NEXT();
+
+loadk:      r[i->a] = constants[i->b]; NEXT();
+move:       r[i->a] = r[i->b]; NEXT();
+clear:      memset(r + i->a, 0, sizeof(*r) * i->b); NEXT();
+add:        ARITHMETIC(+);
+sub:        ARITHMETIC(-);
+mul:        ARITHMETIC(*);
+div:        r[i->a] = divide(r[i->b], r[i->c]); NEXT();
+addi:       r[i->a] = (int32_t) ((uint32_t) r[i->b] + (uint32_t) (int16_t) i->c); NEXT();
+neg:        r[i->a] = (int32_t) -(uint32_t) r[i->b]; NEXT();
+lt:         RELATION(<);
+gt:         RELATION(>);
+le:         RELATION(<=);
+ge:         RELATION(>=);
+eq:         RELATION(==);
+ne:         RELATION(!=);
+jump:       JUMP(); NEXT();
+jumpzero:   if (r[i->a] == 0) JUMP(); NEXT();
+jumplt:     BRANCH(<);
+jumpgt:     BRANCH(>);
+jumple:     BRANCH(<=);
+jumpge:     BRANCH(>=);
+jumpeq:     BRANCH(==);
+jumpne:     BRANCH(!=);
+
+call:
+    /* The callee's window starts at the arguments */
+    if (frame == frames + VM_FRAMES - 1 || end - (r + i->c) < functions[i->b].n_registers) {
+        stack_overflow();
+    }
+    *++frame = (frame_t) { pc, r, i->a };
+    r += i->c;
+    pc = code + functions[i->b].entry;
+    NEXT();
+
+tailcall:
+    if (end - r < functions[i->b].n_registers) {
+        stack_overflow();
+    }
+    memmove(r, r + i->c, sizeof(*r) * functions[i->b].n_parameters);
+    pc = code + functions[i->b].entry;
+    NEXT();
+
+ret:
+    result = r[i->a];
+returned:
+    if (frame == frames) {
+        free(stack);
+        free(frames);
+        free(memo);
+        return result;
+    }
+    pc = frame->pc;
+    r = frame->registers;
+    r[frame->destination] = result;
+    frame--;
+    NEXT();
+
+memolookup:
+    cached = memo_find(&memo, i->b, r, functions[i->b].n_parameters);
+    if (cached->function == i->b + 1u
+        && memcmp(cached->keys, r, sizeof(*r) * functions[i->b].n_parameters) == 0) {
+        result = cached->value;
+        goto returned;
+    }
+    memcpy(r + i->a, r, sizeof(*r) * functions[i->b].n_parameters);
+    NEXT();
+
+memoreturn:
+    cached = memo_find(&memo, i->b, r + i->c, functions[i->b].n_parameters);
+    cached->function = i->b + 1;
+    cached->value = r[i->a];
+    memcpy(cached->keys, r + i->c, sizeof(*r) * functions[i->b].n_parameters);
+    goto ret;
+
+prints:     printf(program->pool + program->strings[i->a]); NEXT();
+printi:     printf("%d ", r[i->a]); NEXT();
+newline:    putchar('\n'); NEXT();
+
+#undef NEXT
+#undef JUMP
+#undef ARITHMETIC
+#undef RELATION
+#undef BRANCH
+}
@@ -0,0 +1,211 @@
+#include "vslc.h"
+
+static char *outfile = NULL;
+static char *infile = "vsl";
+static char *bytecode_file = NULL;
+
+
+static void
+usage ( char *program )
+{
+    fprintf ( stderr,
+        "Usage: %s [-p] [-O 0|1|2] [-e pass] [-d pass] [-T] [-u limit=n]\n"
+        "          [-m 32|64] [-c|-b|-C|-I] [-f infile] [-o] outfile\n"
+        "       %s [-O 0|1|2] [-r] [-f infile] [--] [arguments]\n"
+        "       %s -x bytecode [--] [arguments]\n",
+        program, program, program
+    );
+    exit ( EXIT_FAILURE );
+}
+
+
+static void
+options ( int argc, char **argv )
+{
+    int32_t opt = 0;
+    while ( opt != -1 )
+    {
+        opt = getopt ( argc, argv, "+f:o:pm:crbx:CIO:e:d:Tu:" );
+        switch ( opt )
+        {
+            case -1:    /* No more options */
+                break;
+
+
+            case 'f':   /* Redirect input stream from file */{
+                infile = optarg;
+                if ( freopen ( optarg, "r", stdin ) == NULL )
+                {
+                    fprintf (
+                        stderr, "Could not open input file '%s'\n", optarg
+                    );
+                    exit ( EXIT_FAILURE );
+                }
+                                                             }
+                break;
+
+            case 'o':   /* Save filename, redirect stdout when src is ok */{
+                outfile = ( STRDUP ( optarg ));
+                                                                           }
+                break;
+
+            case 'm':   /* Select the target instruction set */
+                if ( strcmp ( optarg, "32" ) == 0 )
+                    target = TARGET_X86;
+                else if ( strcmp ( optarg, "64" ) == 0 )
+                    target = TARGET_X86_64;
+                else
+                {
+                    fprintf ( stderr, "Unknown target '-m%s'\n", optarg );
+                    exit ( EXIT_FAILURE );
+                }
+                break;
+
+            case 'c':   /* Write an ELF object instead of assembly */
+                output = OUTPUT_OBJECT;
+                break;
+
+            case 'r':   /* Run the program in memory, on this machine */
+                output = OUTPUT_RUN;
+                break;
+
+            case 'b':   /* Write a bytecode image instead of assembly */
+                output = OUTPUT_BYTECODE;
+                break;
+
+            case 'C':   /* Write the program as C */
+                output = OUTPUT_C;
+                break;
+
+            case 'I':   /* Write the mid-level IR of the program */
+                output = OUTPUT_IR;
+                break;
+
+            case 'x':   /* Run a bytecode image, without compiling anything */
+                bytecode_file = optarg;
+                break;
+
+            case 'p':   /* Peephole optimization, at any level */
+                pass_select ( "peephole", true );
+                break;
+
+            case 'O':   /* Optimization level, selects the passes to run */
+                if ( strcmp ( optarg, "0" ) == 0 || strcmp ( optarg, "1" ) == 0
+                    || strcmp ( optarg, "2" ) == 0 )
+                    optimization_level = *optarg - '0';
+                else
+                {
+                    fprintf ( stderr, "Unknown optimization level '-O%s'\n", optarg );
+                    exit ( EXIT_FAILURE );
+                }
+                break;
+
+            case 'e':   /* Enable a pass whatever the level */
+                pass_select ( optarg, true );
+                break;
+
+            case 'd':   /* Disable a pass whatever the level */
+                pass_select ( optarg, false );
+                break;
+
+            case 'T':   /* Report what the passes did to stderr */
+                pass_report = true;
+                break;
+
+            case 'u':   /* Size limits of loop unrolling, name=value */
+                if ( !unroll_set ( optarg ) )
+                {
+                    fprintf ( stderr, "Bad unrolling limit '-u %s', the limits are:\n", optarg );
+                    unroll_limits ( stderr );
+                    usage ( argv[0] );
+                }
+                break;
+
+            default:    /* Got some option we don't recognize */
+                usage ( argv[0] );
+        }
+
+    }
+
+    /* What remains of the command line is for the program when it runs */
+    if ( bytecode_file != NULL )
+    {
+        bytecode_t *program = bytecode_load ( bytecode_file );
+        argv[optind - 1] = bytecode_file;
+        exit ( bytecode_run ( program, argc - optind + 1, argv + optind - 1 ) );
+    }
+    if ( output == OUTPUT_RUN )
+    {
+        jit_argc = argc - optind + 1;
+        jit_argv = argv + optind - 1;
+        jit_argv[0] = infile;
+#if defined(__x86_64__)
+        target = TARGET_X86_64;
+#else
+        target = TARGET_X86;
+#endif
+    }
+}
+
+
+int
+main ( int argc, char **argv )
+{
+    options ( argc, argv );
+
+    symtab_init ();
+    yyparse();
+
+#ifdef DUMP_TREES
+    if ( (DUMP_TREES & 1) != 0 )
+        node_print ( stderr, root, 0 );
+#endif
+
+    simplify_tree ( root );
+
+#ifdef DUMP_TREES
+    if ( (DUMP_TREES & 2) != 0 )
+        node_print ( stderr, root, 0 );
+#endif
+
+    bind_names ( root );
+    passes_run_tree ( root );
+
+    /* Parsing and semantics are ok, redirect stdout to file (if requested) */
+    if ( outfile != NULL )
+    {
+        if ( freopen ( outfile, "w", stdout ) == NULL )
+        {
+            fprintf ( stderr, "Could not open output file '%s'\n", outfile );
+            exit ( EXIT_FAILURE );
+        }
+        free ( outfile );
+    }
+
+    if ( output == OUTPUT_BYTECODE )
+    {
+        bytecode_t *program = bytecode_compile ( root );
+        bytecode_write ( stdout, program );
+        bytecode_finalize ( program );
+    }
+    else if ( output == OUTPUT_C )
+        transpile ( stdout, root );
+    else if ( output == OUTPUT_IR )
+    {
+        ir_program_t *program = ir_build ( root );
+        ir_print ( stdout, program );
+        if ( !ir_verify ( stderr, program ) )
+            exit ( EXIT_FAILURE );
+        ir_finalize ( program );
+    }
+    else
+        generate ( stdout, root );
+
+    if ( pass_report )
+        passes_report ( stderr );
+
+    destroy_subtree ( root );
+    symtab_finalize();
+
+    exit ( EXIT_SUCCESS );
+}
@@ -0,0 +1,109 @@
+#!/bin/bash
+#
+# Compile every program in ../ass4/vsl_programs and vsl_programs with every
+# backend at every optimization level, and with the settings of passes
+# below, run it, and compare what it prints with what the x86 assembly at
+# -O0 prints. CC links the programs, and has to be able to build 32 bit
+# executables with -m32.
+#
+CC=${CC:-cc}
+VSLC=./bin/vslc
+PROGRAMS="../ass4/vsl_programs/*.vsl vsl_programs/*.vsl"
+
+# Command line arguments for the programs which take some. An extra one
+# goes first, the first function gets the last ones like TEXT_HEAD does.
+arguments () {
+    echo -n "1 "
+    case $1 in
+        conditional)            echo 25 ;;
+        euclid)                 echo 1071 462 ;;
+        even)                   echo 3 17 ;;
+        fibonacci_iterative)    echo 30 ;;
+        fibonacci_recursive)    echo 20 ;;
+        memoize)                echo 16 ;;
+        newton)                 echo 1000000 ;;
+        specialize)             echo 25 ;;
+        switch)                 echo 25 ;;
+        unroll)                 echo 25 ;;
+    esac
+}
+
+# What a program prints, the exit status differs between backends for
+# programs which end without a RETURN
+run () {
+    timeout 10 "$@" 2> /dev/null
+}
+
+compare () {
+    if diff testOutput/$inputFileBase.correct testOutput/$1.out > testOutput/$1.diff; then
+        rm -f testOutput/$1 testOutput/$1.*
+    else
+        echo -e "\e[00;31mERROR\e[00m $2"
+        errors=1
+    fi
+}
+
+# Compile and run the program with every backend, with the options in $2
+backends () {
+    test=$inputFileBase.$1
+    out=testOutput/$test
+
+    $VSLC $2 -f $inputFile -o $out.x86.s 2> /dev/null \
+        && $CC -m32 -o $out.x86 $out.x86.s && run $out.x86 $args > $out.x86.out
+    compare $test.x86 "x86 $2"
+
+    $VSLC $2 -m64 -f $inputFile -o $out.x86_64.s 2> /dev/null \
+        && $CC -o $out.x86_64 $out.x86_64.s && run $out.x86_64 $args > $out.x86_64.out
+    compare $test.x86_64 "x86-64 $2"
+
+    $VSLC $2 -c -f $inputFile -o $out.object.o 2> /dev/null \
+        && $CC -m32 -o $out.object $out.object.o && run $out.object $args > $out.object.out
+    compare $test.object "x86 object -c $2"
+
+    $VSLC $2 -m64 -c -f $inputFile -o $out.object64.o 2> /dev/null \
+        && $CC -o $out.object64 $out.object64.o && run $out.object64 $args > $out.object64.out
+    compare $test.object64 "x86-64 object -c $2"
+
+    run $VSLC $2 -r -f $inputFile -- $args > $out.jit.out
+    compare $test.jit "JIT -r $2"
+
+    $VSLC $2 -b -f $inputFile -o $out.vm.vslb 2> /dev/null \
+        && run $VSLC -x $out.vm.vslb -- $args > $out.vm.out
+    compare $test.vm "bytecode -b/-x $2"
+
+    $VSLC $2 -C -f $inputFile -o $out.c.c 2> /dev/null \
+        && $CC -w -o $out.c $out.c.c && run $out.c $args > $out.c.out
+    compare $test.c "C -C $2"
+}
+
+rm -rf testOutput
+mkdir testOutput
+failed=0
+for inputFile in $PROGRAMS; do
+    echo "Testing $inputFile ..."
+    inputFileBase=`basename $inputFile .vsl`
+    args=`arguments $inputFileBase`
+    base=testOutput/$inputFileBase
+    errors=0
+
+    $VSLC -O0 -f $inputFile -o $base.s 2> /dev/null \
+        && $CC -m32 -o $base $base.s && run $base $args > $base.correct
+
+    for level in 0 1 2; do
+        backends O$level -O$level
+    done
+    # No unrolling, and unrolling more than by default
+    backends unroll-off "-O2 -u factor=1 -u full-trips=1"
+    backends unroll-more "-O2 -u factor=7 -u full-trips=64 -u full-size=4096 -u body-size=400"
+    # Memoization, which no level selects
+    backends memoize "-O2 -e memoize"
+
+    if [ $errors == 0 ]; then
+        echo -e "\e[00;32mCorrect\e[00m"
+        rm -f $base $base.*
+    else
+        failed=1
+    fi
+    echo
+done
+exit $failed